@@ -1,5 +1,5 @@
 function(NANOPBJSON_GENERATE_CPP)
-  cmake_parse_arguments(NANOPBJSON_GENERATE_CPP "" "RELPATH;TARGET" "" ${ARGN})
+  cmake_parse_arguments(NANOPBJSON_GENERATE_CPP "" "RELPATH;TARGET" "OPTIONS" ${ARGN})
 
   if(NOT NANOPBJSON_GENERATE_CPP_UNPARSED_ARGUMENTS)
     return()
@@ -50,9 +50,10 @@ function(NANOPBJSON_GENERATE_CPP)
     OUTPUT ${SRCS} ${HDRS}
     COMMAND ${CMAKE_COMMAND} -E echo "Generating nanopb json files"
     COMMAND ${CMAKE_COMMAND} -E make_directory ${NANOPB_JSON_GENERATED_DIR}
-    COMMAND python ${NANOPB_JSON_GENERATOR_EXECUTABLE} ${_nanopb_include_path} --output-dir=${NANOPB_JSON_GENERATED_DIR} ${_proto_srcs}
+    COMMAND python ${NANOPB_JSON_GENERATOR_EXECUTABLE} ${_nanopb_include_path} --output-dir=${NANOPB_JSON_GENERATED_DIR} ${NANOPBJSON_GENERATE_CPP_OPTIONS} ${_proto_srcs}
     DEPENDS ${NANOPB_JSON_GENERATOR_EXECUTABLE} ${_proto_srcs}
     COMMENT "Running nanopb json generator"
+    VERBATIM
   )
 
   
@@ -95,7 +96,14 @@ mark_as_advanced(NANOPB_JSON_INCLUDE_DIRS)
 set(NANOPB_JSON_SRCS)
 set(NANOPB_JSON_HDRS)
 list(APPEND _nanopb_json_srcs pbjson_decode.c pbjson_encode.c)
-list(APPEND _nanopb_json_hdrs json.h)
+list(APPEND _nanopb_json_hdrs json.h json.hpp)
+
+# pbjson_parallel_decode() needs POSIX threads, so it is opt-in.
+option(NANOPB_JSON_PARALLEL "Build nanopb_json with the multi-threaded batch decoder" OFF)
+if(NANOPB_JSON_PARALLEL)
+  list(APPEND _nanopb_json_srcs pbjson_parallel.c)
+  list(APPEND _nanopb_json_hdrs json_parallel.h)
+endif()
 
 foreach(FIL ${_nanopb_json_srcs})
   find_file(${FIL}__nano_pb_file NAMES ${FIL} PATHS ${NANOPB_JSON_SRC_ROOT_FOLDER}/src ${NANOPB_JSON_INCLUDE_DIRS} NO_CMAKE_FIND_ROOT_PATH)
@@ -117,6 +125,42 @@ add_library(nanopb_json STATIC EXCLUDE_FROM_ALL ${NANOPB_JSON_SRCS})
 target_compile_features(nanopb_json PUBLIC c_std_11)
 target_include_directories(nanopb_json PUBLIC ${NANOPB_JSON_INCLUDE_DIRS})
 
+# The decoder uses SSE2/AVX2/NEON when the compiler targets them,
+# turn this on to always use the portable byte loops.
+option(NANOPB_JSON_NO_SIMD "Build nanopb_json without SIMD scanning" OFF)
+if(NANOPB_JSON_NO_SIMD)
+  target_compile_definitions(nanopb_json PRIVATE PBJSON_NO_SIMD)
+endif()
+
+# Reject strings that are not well-formed UTF-8 when decoding and encoding.
+option(NANOPB_JSON_VALIDATE_UTF8 "Build nanopb_json with UTF-8 validation of strings" OFF)
+if(NANOPB_JSON_VALIDATE_UTF8)
+  target_compile_definitions(nanopb_json PRIVATE PBJSON_VALIDATE_UTF8)
+endif()
+
+# Per-thread counters behind pbjson_stats_get(), optionally with phase timers.
+option(NANOPB_JSON_STATS "Build nanopb_json with instrumentation counters" OFF)
+option(NANOPB_JSON_STATS_TIMERS "Also time decode and encode phases (needs NANOPB_JSON_STATS)" OFF)
+if(NANOPB_JSON_STATS)
+  target_compile_definitions(nanopb_json PUBLIC PBJSON_STATS)
+  if(NANOPB_JSON_STATS_TIMERS)
+    target_compile_definitions(nanopb_json PUBLIC PBJSON_STATS_TIMERS)
+  endif()
+endif()
+
+# 24-byte field descriptors instead of 56 on 64-bit targets. PUBLIC because the
+# generated tables must be compiled with the same layout as the library.
+option(NANOPB_JSON_COMPACT_DESCRIPTORS "Build nanopb_json with the compact field descriptor layout" OFF)
+if(NANOPB_JSON_COMPACT_DESCRIPTORS)
+  target_compile_definitions(nanopb_json PUBLIC PBJSON_COMPACT_DESCRIPTORS)
+endif()
+
+if(NANOPB_JSON_PARALLEL)
+  find_package(Threads REQUIRED)
+  target_link_libraries(nanopb_json PUBLIC Threads::Threads)
+  target_compile_definitions(nanopb_json PUBLIC PBJSON_PARALLEL)
+endif()
+
 
 
 
@@ -4,13 +4,379 @@
 #include "json_macro.h"
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
+/**
+ * @brief Maximum nesting depth of objects and arrays accepted by the decoder.
+ *
+ * Define it before including this header (or on the compiler command line)
+ * to change the limit. Deeper input is rejected with an error.
+ */
+#ifndef PBJSON_MAX_DEPTH
+#define PBJSON_MAX_DEPTH 64
+#endif
+
+/**
+ * @brief Size of the buffer pbjson_decoder_t uses for keys and numbers split across chunks.
+ *
+ * Longer keys are treated as unknown, longer numbers and enum names are rejected.
+ */
+#ifndef PBJSON_DECODER_TOKEN_SIZE
+#define PBJSON_DECODER_TOKEN_SIZE 64
+#endif
+
+/**
+ * @brief Size of the buffer keys with escape sequences are unescaped into before they are looked up.
+ *
+ * Longer keys with escapes are treated as unknown.
+ */
+#ifndef PBJSON_KEY_UNESCAPE_SIZE
+#define PBJSON_KEY_UNESCAPE_SIZE 64
+#endif
+
+/**
+ * @brief Returned by pbjson_decoder_feed() while the top-level object is incomplete.
+ */
+#define PBJSON_DECODE_NEED_MORE 1
+
+/**
+ * @brief Returned by pbjson_ndjson_read() once every line has been read.
+ */
+#define PBJSON_NDJSON_END 1
+
+/**
+ * @brief Returned by the readers of generated decoders at the closing bracket, see pbjson_parse_object().
+ */
+#define PBJSON_PARSE_END (-2)
 
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
+    typedef struct pbjson_ostream_s pbjson_ostream_t;
+    typedef struct pbjson_fieldmask_s pbjson_fieldmask_t;
+    typedef struct pbjson_parser_s pbjson_parser_t;
+
+    /**
+     * @brief Output stream for the JSON encoder.
+     *
+     * Output either goes into one flat buffer (see pbjson_ostream_from_buffer())
+     * or is collected in a small chunk buffer that is handed to a callback
+     * whenever it fills up (see pbjson_ostream_from_callback()). A stream with
+     * neither a buffer nor a callback only counts the bytes written.
+     */
+    struct pbjson_ostream_s
+    {
+        /**
+         * @brief Called with the next bytes of output.
+         *
+         * @param stream The stream being flushed, @c state holds the user pointer.
+         * @param buf Bytes to write.
+         * @param count Number of bytes in @p buf.
+         * @return 0 on success, -1 to abort encoding.
+         */
+        int (*callback)(pbjson_ostream_t *stream, const char *buf, size_t count);
+        void *state;          /**< User pointer for the callback. */
+        char *buf;            /**< Output buffer, or chunk buffer for callback streams. May be NULL. */
+        size_t max_size;      /**< Size of @c buf, or the output limit when @c buf is NULL. */
+        size_t pos;           /**< Number of bytes currently held in @c buf. */
+        size_t bytes_written; /**< Total number of bytes written to the stream. */
+        unsigned flags;       /**< PBJSON_ENCODE_* options, 0 by default. */
+        const pbjson_fieldmask_t *mask; /**< Fields to write, NULL for all. See pbjson_fieldmask_compile(). */
+    };
+
+    /**
+     * @brief Initializer for a stream that only counts the bytes written.
+     */
+#define PBJSON_OSTREAM_SIZING {NULL, NULL, NULL, SIZE_MAX, 0, 0, 0, NULL}
+
+    /**
+     * @brief Stream flag that leaves out fields holding their default value.
+     *
+     * Follows the proto3 JSON mapping: zero numbers and enums, @c false,
+     * empty strings, empty repeated fields and submessages without presence
+     * whose fields are all default are not written. Fields with presence
+     * (@c has_ members and pointers) are still written whenever they are set.
+     * Generated encoders are bypassed while the flag is set, and likewise
+     * while a field mask is set.
+     */
+#define PBJSON_ENCODE_OMIT_DEFAULTS 1u
+
+    /**
+     * @brief Stream flag that writes enum values by name, as the proto3 JSON mapping does.
+     *
+     * Values the enum has no name for are still written as numbers. The
+     * decoder accepts names and numbers whether or not the flag is used.
+     */
+#define PBJSON_ENCODE_ENUM_NAMES 2u
+
+    /**
+     * @brief The JSON text of one value, handed to a decode callback.
+     */
+    typedef struct pbjson_istream_s
+    {
+        const char *s; /**< Start of the value. */
+        size_t len;    /**< Length of the value in bytes. */
+    } pbjson_istream_t;
+
+    /**
+     * @brief Contents of an FT_CALLBACK field.
+     *
+     * Callback fields let values flow through without being stored in the
+     * structure. The decoder calls @c funcs.decode once for a singular field
+     * and once per element of a repeated field, in input order. The encoder
+     * calls @c funcs.encode once after writing the key; it must write the
+     * whole value, so for a repeated field the brackets and the commas
+     * between elements as well. A field whose callback is NULL is skipped
+     * by the decoder and left out by the encoder.
+     */
+    typedef struct pbjson_callback_s
+    {
+        union
+        {
+            /**
+             * @brief Receives one value, which can be read with pbjson_read_value() or pbjson_decode_n().
+             *
+             * @param stream The JSON text of the value.
+             * @param field Descriptor of the field, see PBJSON_ITER_SUBMSG() for the message of message fields.
+             * @param arg Pointer to @c arg of this structure.
+             * @return 0 on success, -1 to abort decoding.
+             */
+            int (*decode)(const pbjson_istream_t *stream, const pbjson_iter_t *field, void **arg);
+
+            /**
+             * @brief Writes the value of the field with pbjson_write_value(), pbjson_encode_stream() or pbjson_write().
+             *
+             * @param stream The output stream.
+             * @param field Descriptor of the field, see PBJSON_ITER_SUBMSG() for the message of message fields.
+             * @param arg Pointer to @c arg of this structure.
+             * @return 0 on success, -1 to abort encoding.
+             */
+            int (*encode)(pbjson_ostream_t *stream, const pbjson_iter_t *field, void *const *arg);
+        } funcs;
+
+        void *arg; /**< User pointer passed to the callbacks. */
+    } pbjson_callback_t;
+
+    /**
+     * @brief A string field that refers to the decoder input instead of holding a copy.
+     *
+     * Generated for string fields with the option
+     * `callback_datatype:pbjson_string_view_t`. The decoder stores the
+     * location of the text between the quotes, so the input must stay alive
+     * while the view is used. The text is not NUL-terminated. Text with
+     * escape sequences is unescaped into the arena when the decoder has one,
+     * otherwise the view keeps the escapes as they appear in the input and
+     * sets @c escaped. The encoder writes escaped views back as they are and
+     * escapes the others. A view with NULL @c data is absent and left out by
+     * the encoder.
+     */
+    typedef struct pbjson_string_view_s
+    {
+        const char *data; /**< First character of the string, NULL if absent. */
+        size_t size;      /**< Length of the string in bytes. */
+        bool escaped;     /**< Set if @c data is JSON text that still holds its escape sequences. */
+    } pbjson_string_view_t;
+
+    /**
+     * @brief Creates a stream that writes into a flat buffer.
+     *
+     * The output is not NUL-terminated.
+     *
+     * @param buf The output buffer.
+     * @param bufsize Size of @p buf in bytes.
+     * @return The stream.
+     */
+    pbjson_ostream_t pbjson_ostream_from_buffer(char *buf, size_t bufsize);
+
+    /**
+     * @brief Creates a stream that passes its output to a callback in chunks.
+     *
+     * Output is collected in @p chunk and handed to @p callback each time the
+     * chunk fills up, and once more by pbjson_ostream_flush() at the end of
+     * pbjson_encode_stream(). With a @p chunk_size of zero every write goes
+     * to the callback directly.
+     *
+     * @param callback Function that consumes the output.
+     * @param state User pointer stored in the stream for the callback.
+     * @param chunk Chunk buffer, may be NULL if @p chunk_size is zero.
+     * @param chunk_size Size of @p chunk in bytes.
+     * @return The stream.
+     */
+    pbjson_ostream_t pbjson_ostream_from_callback(int (*callback)(pbjson_ostream_t *stream, const char *buf, size_t count),
+                                                  void *state, char *chunk, size_t chunk_size);
+
+    /**
+     * @brief Writes raw bytes to a stream.
+     *
+     * @param stream The stream to write to.
+     * @param buf Bytes to write.
+     * @param count Number of bytes in @p buf.
+     * @return 0 on success, -1 if the buffer is full or the callback failed.
+     */
+    int pbjson_write(pbjson_ostream_t *stream, const char *buf, size_t count);
+
+    /**
+     * @brief Writes one scalar or string value as JSON, for use in encode callbacks.
+     *
+     * Enums are written as numbers, pbjson_write_enum() writes their names.
+     *
+     * @param stream The stream to write to.
+     * @param type Type of the value, any type except PBJSON_MESSAGE_TYPE.
+     * @param size Size of the value in bytes, used for enums and, unless 0, to bound bytes.
+     * @param src The value, for strings the NUL-terminated text, for bytes a pb_bytes_array_t.
+     * @return 0 on success, -1 on error.
+     */
+    int pbjson_write_value(pbjson_ostream_t *stream, pbjson_type_t type, size_t size, const void *src);
+
+    /**
+     * @name Typed writers
+     *
+     * Write one JSON value without a type switch. They are the building
+     * blocks of the encoders generated with --json-codegen and can be used
+     * in encode callbacks as well. Each returns 0 on success, -1 on error.
+     * @{
+     */
+    int pbjson_write_int(pbjson_ostream_t *stream, int64_t val);
+    int pbjson_write_uint(pbjson_ostream_t *stream, uint64_t val);
+    int pbjson_write_float(pbjson_ostream_t *stream, float val);
+    int pbjson_write_double(pbjson_ostream_t *stream, double val);
+    int pbjson_write_bool(pbjson_ostream_t *stream, bool val);
+
+    /** @brief Writes @p len bytes of @p s as a quoted string, escaping quotes, backslashes and control characters. */
+    int pbjson_write_string(pbjson_ostream_t *stream, const char *s, size_t len);
+
+    /** @brief Writes @p len bytes of @p data as a base64 string with padding. */
+    int pbjson_write_bytes(pbjson_ostream_t *stream, const uint8_t *data, size_t len);
+
+    /** @brief Writes @p val by its name in @p desc with PBJSON_ENCODE_ENUM_NAMES set, otherwise as a number. */
+    int pbjson_write_enum(pbjson_ostream_t *stream, const pbjson_enumdesc_t *desc, int32_t val);
+    /** @} */
+
+    /**
+     * @brief Encodes a message as a JSON object, without flushing the stream.
+     *
+     * The specialized encoder of the message is used if it has one.
+     *
+     * @param stream The stream to write to.
+     * @param fields The message descriptor for the structure.
+     * @param src_struct The structure to encode.
+     * @return 0 on success, -1 on error.
+     */
+    int pbjson_encode_message(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const void *src_struct);
+
+    /**
+     * @brief Passes the bytes held in the chunk buffer of a callback stream to the callback.
+     *
+     * Does nothing for buffer and sizing streams.
+     *
+     * @param stream The stream to flush.
+     * @return 0 on success, -1 if the callback failed.
+     */
+    int pbjson_ostream_flush(pbjson_ostream_t *stream);
+
+    /**
+     * @brief Encodes a nanopb structure as JSON into an output stream.
+     *
+     * Callback streams are flushed before returning.
+     *
+     * @param stream The stream to write to.
+     * @param fields The message descriptor for the structure.
+     * @param src_struct The structure to encode.
+     * @return 0 on success, -1 on error.
+     */
+    int pbjson_encode_stream(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const void *src_struct);
+
+    /**
+     * @brief Layout of the output of pbjson_encode_batch().
+     */
+    typedef enum pbjson_batch_mode_enum
+    {
+        PBJSON_BATCH_NDJSON, /**< One object per line, each followed by '\n'. */
+        PBJSON_BATCH_ARRAY,  /**< A single JSON array of the objects. */
+    } pbjson_batch_mode_t;
+
+    /**
+     * @brief Encodes an array of structures into one output stream.
+     *
+     * All records share the stream, so a flat buffer, a callback stream or a
+     * sizing stream can take a whole batch in one call. Callback streams are
+     * flushed before returning.
+     *
+     * @param stream The stream to write to.
+     * @param fields The message descriptor of every structure.
+     * @param src_array The first structure.
+     * @param count Number of structures.
+     * @param stride Distance in bytes from one structure to the next, usually its sizeof().
+     * @param mode PBJSON_BATCH_NDJSON or PBJSON_BATCH_ARRAY.
+     * @param offsets If not NULL, receives @p count + 1 entries: where each
+     *                record starts, relative to the first byte written by this
+     *                call, followed by the total length. The '\n' or ',' after
+     *                a record lies between its end and the next offset.
+     * @return 0 on success, -1 on error.
+     */
+    int pbjson_encode_batch(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const void *src_array,
+                            size_t count, size_t stride, pbjson_batch_mode_t mode, size_t *offsets);
+
+    /**
+     * @brief Encodes only the fields that differ between two versions of a structure.
+     *
+     * The output is an object in the style of a JSON merge patch: changed
+     * fields carry their new value, fields that lost their presence are
+     * null, and static submessages present in both versions are written as
+     * a nested patch of their own. Repeated fields are written whole when
+     * any element changed. Runs of static singular fields are compared with
+     * one memcmp() first. Callback fields are written whenever they have an
+     * encode callback, as they cannot be compared. Unchanged structures give
+     * "{}". The @c mask of the stream limits the fields that are compared,
+     * PBJSON_ENCODE_OMIT_DEFAULTS is ignored. pbjson_decode_apply() merges
+     * the result into a copy of @p prev. Callback streams are flushed before
+     * returning.
+     *
+     * @param stream The stream to write to.
+     * @param fields The message descriptor of both structures.
+     * @param prev The version the receiver already has.
+     * @param cur The version to send.
+     * @return 0 on success, -1 on error.
+     */
+    int pbjson_encode_delta(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const void *prev,
+                            const void *cur);
+
+    /**
+     * @brief Computes the exact length of the JSON text for a structure without writing it.
+     *
+     * The result does not include the terminator, so pbjson_encode() needs a
+     * buffer one byte larger. The generated <Msg>_json_max_size is an upper
+     * bound over all values of the message.
+     *
+     * @param fields The message descriptor for the structure.
+     * @param src_struct The structure to measure.
+     * @return Number of bytes on success, -1 on error.
+     */
+    int pbjson_encoded_size(const pbjson_msgdesc_t *fields, const void *src_struct);
+
+    /**
+     * @brief Transcodes a protobuf binary message to JSON without decoding it into a structure.
+     *
+     * The output is the same as pbjson_encode() of the structure the message
+     * decodes into: fields follow the descriptor order, absent fields without
+     * presence are written with zero values and absent repeated fields as
+     * empty arrays. Packed and unpacked repeated fields are both accepted.
+     * When a singular field occurs more than once the last occurrence is
+     * used, the occurrences of a submessage are merged as protobuf merges
+     * them. Unknown fields are skipped.
+     *
+     * @param stream The stream to write to, flushed at the end.
+     * @param fields Descriptor of the message.
+     * @param buf The encoded message.
+     * @param size Size of @p buf in bytes.
+     * @return 0 on success, -1 on malformed input, a wire type that does not
+     *         match the field, or if the stream fails.
+     */
+    int pbjson_transcode_to_json(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const uint8_t *buf,
+                                 size_t size);
+
     /**
      * @brief Encodes a nanopb structure into a JSON string.
      * 
@@ -22,6 +388,88 @@ extern "C"
      */
     int pbjson_encode(char *s, uint32_t len, const pbjson_msgdesc_t *fields, const void *src_struct);
     
+    /**
+     * @brief Bump allocator for the data of pointer fields.
+     *
+     * The decoder takes memory for strings, repeated fields and submessages
+     * declared with FT_POINTER from the arena in order. Nothing is freed
+     * individually: pbjson_arena_reset() releases every allocation at once.
+     */
+    typedef struct pbjson_arena_s
+    {
+        char *buf;   /**< Memory handed out by the arena. */
+        size_t size; /**< Size of @c buf in bytes. */
+        size_t used; /**< Number of bytes of @c buf in use, including alignment padding. */
+    } pbjson_arena_t;
+
+    /**
+     * @brief Alignment of every block returned by pbjson_arena_alloc().
+     */
+#ifndef PBJSON_ARENA_ALIGN
+#define PBJSON_ARENA_ALIGN 8
+#endif
+
+    /**
+     * @brief Prepares an arena on top of a caller-supplied buffer.
+     *
+     * @param arena The arena to initialize.
+     * @param buf Memory for the allocations, it must outlive the decoded messages.
+     * @param size Size of @p buf in bytes.
+     */
+    void pbjson_arena_init(pbjson_arena_t *arena, void *buf, size_t size);
+
+    /**
+     * @brief Allocates zero-filled memory from an arena.
+     *
+     * @param arena The arena.
+     * @param size Number of bytes to allocate.
+     * @return Pointer aligned to PBJSON_ARENA_ALIGN, or NULL if the arena is full.
+     */
+    void *pbjson_arena_alloc(pbjson_arena_t *arena, size_t size);
+
+    /**
+     * @brief Releases every allocation of an arena.
+     *
+     * Pointer fields of messages decoded with this arena dangle afterwards.
+     *
+     * @param arena The arena.
+     */
+    void pbjson_arena_reset(pbjson_arena_t *arena);
+
+    /**
+     * @brief Selection of fields of a message, and of fields of its submessages.
+     *
+     * A field mask limits the encoder to the selected fields through
+     * @c pbjson_ostream_t::mask, and the decoder through
+     * pbjson_decode_masked(). Masks are built with pbjson_fieldmask_compile()
+     * and can be shared between threads once built.
+     */
+    struct pbjson_fieldmask_s
+    {
+        const pbjson_msgdesc_t *fields; /**< Descriptor the mask applies to. */
+        uint32_t count;                 /**< Number of selected fields. */
+        uint32_t *bits;                 /**< One bit per entry of @c fields->iter, set if the field is selected. */
+        pbjson_fieldmask_t **sub;       /**< Per entry, the mask of a selected message field, NULL to select it whole. */
+    };
+
+    /**
+     * @brief Builds a field mask from a list of field paths.
+     *
+     * The paths use the JSON form of google.protobuf.FieldMask: a comma
+     * separated list where each path names a field by its JSON key and
+     * reaches into submessages with dots, for example "id,user.name". A
+     * path into a repeated message field applies to every element. A path to
+     * a message field selects it whole, also when paths below it are given.
+     *
+     * @param fields Descriptor of the message.
+     * @param paths The paths, NUL-terminated.
+     * @param arena Arena the mask is allocated from, it must outlive the mask.
+     * @return The mask, or NULL if a path names an unknown field, goes into a
+     *         field that is not a message, or the arena is full.
+     */
+    pbjson_fieldmask_t *pbjson_fieldmask_compile(const pbjson_msgdesc_t *fields, const char *paths,
+                                                 pbjson_arena_t *arena);
+
     /**
      * @brief Decodes a JSON string into a Protocol Buffers structure.
      *
@@ -36,6 +484,456 @@ extern "C"
      */
     int pbjson_decode(const char *s, const pbjson_msgdesc_t *fields, void *src_struct);
 
+    /**
+     * @brief Decodes a length-delimited JSON buffer into a Protocol Buffers structure.
+     *
+     * Same as pbjson_decode(), but the input does not need to be NUL-terminated:
+     * the decoder never reads past @p len bytes, so it can run directly on
+     * receive buffers or memory-mapped files.
+     *
+     * @param s The JSON buffer to decode.
+     * @param len Number of bytes in @p s.
+     * @param fields The message descriptor that describes the structure of the Protocol Buffers message.
+     * @param src_struct A pointer to the structure where the decoded data will be stored.
+     * @return 0 on success, a negative value on error.
+     */
+    int pbjson_decode_n(const char *s, size_t len, const pbjson_msgdesc_t *fields, void *src_struct);
+
+    /**
+     * @brief Decodes a length-delimited JSON buffer into a structure with pointer fields.
+     *
+     * Same as pbjson_decode_n(), but the data of FT_POINTER fields is allocated
+     * from @p arena, sized to fit the input exactly. pbjson_decode() and
+     * pbjson_decode_n() reject messages that contain pointer fields. The
+     * pointers stored before an error stay valid until the arena is reset.
+     *
+     * @param s The JSON buffer to decode.
+     * @param len Number of bytes in @p s.
+     * @param fields The message descriptor that describes the structure of the Protocol Buffers message.
+     * @param src_struct A pointer to the structure where the decoded data will be stored.
+     * @param arena The arena for pointer fields.
+     * @return 0 on success, a negative value on error or if the arena is full.
+     */
+    int pbjson_decode_arena(const char *s, size_t len, const pbjson_msgdesc_t *fields, void *src_struct,
+                            pbjson_arena_t *arena);
+
+    /**
+     * @brief Decodes only the fields selected by a field mask.
+     *
+     * Same as pbjson_decode_arena(), but keys of fields that are not selected
+     * are skipped like unknown keys, and their members of @p dst are left as
+     * they are. An object stops being decoded once every selected field has
+     * been seen: the rest of a nested object is only skipped, and nothing
+     * after the last selected field of the top-level object is read at all,
+     * so it is not validated either. As a consequence a key that occurs more
+     * than once keeps its first value. Callback fields are passed on whole.
+     *
+     * @param s The JSON buffer to decode.
+     * @param len Number of bytes in @p s.
+     * @param mask The fields to decode, @c mask->fields describes the structure.
+     * @param dst A pointer to the structure where the decoded data will be stored.
+     * @param arena The arena for pointer fields, or NULL as for pbjson_decode_n().
+     * @return 0 on success, a negative value on error.
+     */
+    int pbjson_decode_masked(const char *s, size_t len, const pbjson_fieldmask_t *mask, void *dst,
+                             pbjson_arena_t *arena);
+
+    /**
+     * @brief Merges a patch written by pbjson_encode_delta() into a structure.
+     *
+     * Same as pbjson_decode_arena(), applied to a structure that already
+     * holds data: fields missing from the patch keep their value, null resets
+     * a field to its default and clears its presence, and a nested object
+     * merges into its submessage. Submessages that become present and the
+     * elements of repeated message fields start out zeroed. Pointer fields
+     * take new memory from @p arena. The old memory is not released.
+     *
+     * @param s The patch.
+     * @param len Number of bytes in @p s.
+     * @param fields The message descriptor that describes the structure of the Protocol Buffers message.
+     * @param dst The structure to update.
+     * @param arena The arena for pointer fields, or NULL as for pbjson_decode_n().
+     * @return 0 on success, a negative value on error. @p dst may be partly updated after an error.
+     */
+    int pbjson_decode_apply(const char *s, size_t len, const pbjson_msgdesc_t *fields, void *dst,
+                            pbjson_arena_t *arena);
+
+    /**
+     * @brief Number of message descriptors a decode context remembers.
+     */
+#ifndef PBJSON_CTX_SLOTS
+#define PBJSON_CTX_SLOTS 16
+#endif
+
+    /**
+     * @brief Key order learned for one message descriptor.
+     */
+    typedef struct pbjson_ctx_slot_s
+    {
+        const pbjson_msgdesc_t *fields; /**< Descriptor, NULL for a free slot. */
+        uint16_t *order;                /**< Index of the field expected first, then after each field. */
+    } pbjson_ctx_slot_t;
+
+    /**
+     * @brief State kept between the messages decoded by one worker.
+     *
+     * The decoder tries the field that followed the previous key before it
+     * hashes a key. Without a context that is the next field in declaration
+     * order. A context learns, per descriptor and on first use, the order in
+     * which the input actually lists the keys, so that a stream of messages
+     * from the same producer resolves almost every key with one compare. It
+     * also resets the arena for pointer fields before each message.
+     *
+     * Nothing is allocated: the orders take (fields + 1) * 2 bytes per
+     * descriptor from the buffer given to pbjson_ctx_init(). Descriptors
+     * that do not fit keep the declaration order. A context must not be
+     * used by several threads at once.
+     */
+    typedef struct pbjson_ctx_s
+    {
+        pbjson_arena_t cache;  /**< Memory for the key orders. */
+        pbjson_arena_t *arena; /**< Arena for pointer fields, reset before each message, NULL if there is none. */
+        pbjson_ctx_slot_t slots[PBJSON_CTX_SLOTS];
+    } pbjson_ctx_t;
+
+    /**
+     * @brief Prepares a decode context.
+     *
+     * @param ctx The context to initialize.
+     * @param buf Memory for the key orders, it must outlive the context.
+     * @param size Size of @p buf in bytes.
+     * @param arena Arena for pointer fields, or NULL as for pbjson_decode_n().
+     */
+    void pbjson_ctx_init(pbjson_ctx_t *ctx, void *buf, size_t size, pbjson_arena_t *arena);
+
+    /**
+     * @brief Forgets the learned key orders, for example when the producer changes.
+     *
+     * @param ctx The context.
+     */
+    void pbjson_ctx_clear(pbjson_ctx_t *ctx);
+
+    /**
+     * @brief Decodes a JSON buffer with a decode context.
+     *
+     * Same as pbjson_decode_arena() with the arena of @p ctx, which is reset
+     * first: pointer fields of the previous message decoded with @p ctx
+     * dangle afterwards.
+     *
+     * @param ctx The context.
+     * @param s The JSON buffer to decode.
+     * @param len Number of bytes in @p s.
+     * @param fields The message descriptor that describes the structure of the Protocol Buffers message.
+     * @param dst A pointer to the structure where the decoded data will be stored.
+     * @return 0 on success, a negative value on error.
+     */
+    int pbjson_ctx_decode(pbjson_ctx_t *ctx, const char *s, size_t len, const pbjson_msgdesc_t *fields, void *dst);
+
+    /**
+     * @brief Transcodes JSON to protobuf binary without decoding it into a structure.
+     *
+     * Accepts the same input as pbjson_decode_n() and produces the encoding of
+     * the structure it would decode into. Fields are written in input order,
+     * including zero values. Repeated numeric fields are packed. Static
+     * strings and arrays are checked against the capacity of the structure,
+     * so the output always decodes on a device with the same structure.
+     * Strings are unescaped into UTF-8 and bytes decoded from base64, as for a structure.
+     *
+     * @param s The JSON buffer to transcode.
+     * @param len Number of bytes in @p s.
+     * @param fields Descriptor of the message.
+     * @param buf Output buffer, or NULL to only compute the encoded size.
+     * @param size Size of @p buf in bytes.
+     * @return Number of bytes written, or -1 on error or if @p buf is too small.
+     */
+    int pbjson_transcode_to_pb(const char *s, size_t len, const pbjson_msgdesc_t *fields, uint8_t *buf, size_t size);
+
+    /**
+     * @brief Parses one scalar or string value, for use in decode callbacks.
+     *
+     * Messages are read with pbjson_decode_n() on the same text instead.
+     * Enums are read as numbers only, there are no names to look up.
+     *
+     * @param stream The JSON text of the value.
+     * @param type Type of the value, any type except PBJSON_MESSAGE_TYPE.
+     * @param dst Destination for the value, for bytes a pb_bytes_array_t.
+     * @param size Size of @p dst in bytes, for strings including the terminator,
+     *             for bytes the whole array as declared with PB_BYTES_ARRAY_T().
+     * @return 0 on success, -1 if the text is not a valid value of @p type.
+     */
+    int pbjson_read_value(const pbjson_istream_t *stream, pbjson_type_t type, void *dst, size_t size);
+
+    /**
+     * @name Generated decoder support
+     *
+     * Read one JSON token without a type switch. They are the building
+     * blocks of the decoders generated with --json-codegen and only work on
+     * the parser handed to pbjson_msgdesc_t::decode. A generated decoder
+     * walks the keys of an object like this:
+     *
+     * @code
+     * uint32_t next;
+     * int index = pbjson_parse_object(parser, fields, p_has_msg, &next);
+     *
+     * while (index >= 0)
+     * {
+     *     // Read the value of field index with one of the readers below.
+     *     index = pbjson_parse_member(parser, fields, &next);
+     * }
+     *
+     * return (index == PBJSON_PARSE_END) ? 0 : -1;
+     * @endcode
+     *
+     * Unless noted otherwise each returns 0 on success, -1 on error.
+     * @{
+     */
+
+    /**
+     * @brief Reads the opening brace of an object and its first key.
+     *
+     * Unknown keys are skipped together with their values.
+     *
+     * @param parser The parser state.
+     * @param fields Descriptor of the message, its keys are looked up.
+     * @param p_has_msg Set to false for {} and to true for any other object, may be NULL.
+     * @param p_next Receives the index of the field expected next, pass it on to pbjson_parse_member().
+     * @return Index of the field in @c fields->iter, PBJSON_PARSE_END if no known key follows, -1 on error.
+     */
+    int pbjson_parse_object(pbjson_parser_t *parser, const pbjson_msgdesc_t *fields, bool *p_has_msg,
+                            uint32_t *p_next);
+
+    /** @brief Reads the separator after a value and the next key, as pbjson_parse_object() does the first. */
+    int pbjson_parse_member(pbjson_parser_t *parser, const pbjson_msgdesc_t *fields, uint32_t *p_next);
+
+    /** @brief Reads the opening bracket of an array, returns 0 if an element follows, PBJSON_PARSE_END if not. */
+    int pbjson_parse_array(pbjson_parser_t *parser);
+
+    /** @brief Reads the separator after an element, returns 0 if another follows, PBJSON_PARSE_END if not. */
+    int pbjson_parse_item(pbjson_parser_t *parser);
+
+    int pbjson_parse_int32(pbjson_parser_t *parser, int32_t *dst);
+    int pbjson_parse_int64(pbjson_parser_t *parser, int64_t *dst);
+    int pbjson_parse_uint32(pbjson_parser_t *parser, uint32_t *dst);
+    int pbjson_parse_uint64(pbjson_parser_t *parser, uint64_t *dst);
+    int pbjson_parse_float(pbjson_parser_t *parser, float *dst);
+    int pbjson_parse_double(pbjson_parser_t *parser, double *dst);
+    int pbjson_parse_bool(pbjson_parser_t *parser, bool *dst);
+
+    /** @brief Reads an enum by a name in @p desc or by number into @p size bytes, 1, 2 or 4. */
+    int pbjson_parse_enum(pbjson_parser_t *parser, const pbjson_enumdesc_t *desc, void *dst, size_t size);
+
+    /** @brief Reads an enum like pbjson_parse_enum(), rejecting negative values. */
+    int pbjson_parse_uenum(pbjson_parser_t *parser, const pbjson_enumdesc_t *desc, void *dst, size_t size);
+
+    /** @brief Reads a string into @p dst of @p size bytes, including the terminator. */
+    int pbjson_parse_string(pbjson_parser_t *parser, char *dst, size_t size);
+
+    /** @brief Reads a string as a view into the input. */
+    int pbjson_parse_string_view(pbjson_parser_t *parser, pbjson_string_view_t *dst);
+
+    /** @brief Reads base64 into @p dst, @p size is the whole array as declared with PB_BYTES_ARRAY_T(). */
+    int pbjson_parse_bytes(pbjson_parser_t *parser, pb_bytes_array_t *dst, size_t size);
+
+    /**
+     * @brief Reads a submessage, with its generated decoder if it has one.
+     *
+     * @param parser The parser state.
+     * @param fields Descriptor of the submessage.
+     * @param dst The submessage structure.
+     * @param p_has_msg Set to whether the object had members, NULL for repeated and required fields.
+     * @return 0 on success, -1 on error.
+     */
+    int pbjson_parse_message(pbjson_parser_t *parser, const pbjson_msgdesc_t *fields, void *dst, bool *p_has_msg);
+    /** @} */
+
+    /**
+     * @brief Grammar check of a value that is skipped, internal to the decoders.
+     */
+    typedef struct pbjson_skip_s
+    {
+        uint8_t stack[(PBJSON_MAX_DEPTH + 7) / 8]; /**< One bit per open object or array, set for an object. */
+        uint8_t state;                             /**< What may come next. */
+        unsigned depth;                            /**< Number of open objects and arrays. */
+    } pbjson_skip_t;
+
+    /**
+     * @brief One open object or array of the incremental decoder.
+     */
+    typedef struct pbjson_decoder_frame_s
+    {
+        const pbjson_iter_t *key;       /**< Field holding this object or array, NULL for the top level. */
+        const pbjson_msgdesc_t *fields; /**< Descriptor of the object, NULL for an array. */
+        char *base;                     /**< Structure the object decodes into, or the one holding the array. */
+        uint32_t index;                 /**< Field expected next, or number of array elements so far. */
+    } pbjson_decoder_frame_t;
+
+    /**
+     * @brief State of an incremental decoder.
+     *
+     * Input is pushed in arbitrary pieces with pbjson_decoder_feed() and
+     * decoded into the destination structure as it arrives, so no buffer
+     * for the whole document is needed. Messages with pointer, callback or
+     * string view fields are not supported. All members are internal.
+     */
+    typedef struct pbjson_decoder_s
+    {
+        const pbjson_msgdesc_t *fields;
+        void *dst;
+        pbjson_decoder_frame_t stack[PBJSON_MAX_DEPTH];
+        unsigned depth;
+        const pbjson_iter_t *field;
+        char *value;
+        uint32_t pos;
+        pbjson_skip_t skip;
+        uint8_t state;
+        bool in_string;
+        bool escape;
+        bool overflow;
+        uint32_t token_len;
+        char token[PBJSON_DECODER_TOKEN_SIZE];
+    } pbjson_decoder_t;
+
+    /**
+     * @brief Prepares an incremental decoder.
+     *
+     * @param dec The decoder to initialize.
+     * @param fields The message descriptor that describes the structure of the Protocol Buffers message.
+     * @param dst The structure where the decoded data will be stored, it must stay valid until decoding ends.
+     */
+    void pbjson_decoder_init(pbjson_decoder_t *dec, const pbjson_msgdesc_t *fields, void *dst);
+
+    /**
+     * @brief Pushes the next piece of input into an incremental decoder.
+     *
+     * Pieces may be split anywhere, including inside keys, strings and numbers.
+     * Only whitespace may follow the top-level object. After an error every
+     * further call fails as well.
+     *
+     * @param dec The decoder.
+     * @param chunk The next bytes of the JSON document.
+     * @param len Number of bytes in @p chunk.
+     * @return 0 once the top-level object is complete, PBJSON_DECODE_NEED_MORE
+     *         while it is not, -1 on error.
+     */
+    int pbjson_decoder_feed(pbjson_decoder_t *dec, const char *chunk, size_t len);
+
+    /**
+     * @brief Reader for newline-delimited JSON, one object per line.
+     *
+     * The reader walks a caller-supplied region, for example a memory-mapped
+     * file, and decodes every record in place without copying it. A record
+     * that fails to decode is reported and skipped, the next call continues
+     * with the following line.
+     */
+    typedef struct pbjson_ndjson_reader_s
+    {
+        const char *s;           /**< Start of the next line. */
+        const char *end;         /**< End of the region. */
+        size_t line;             /**< Line number of the last record, starting at 1. */
+        pbjson_istream_t record; /**< Text of the last record, without its newline. */
+        pbjson_ctx_t *ctx;       /**< Context whose key orders the records use, NULL for none. */
+    } pbjson_ndjson_reader_t;
+
+    /**
+     * @brief Prepares an NDJSON reader.
+     *
+     * @param reader The reader to initialize.
+     * @param buf The NDJSON text, it must stay valid while records are read.
+     * @param len Number of bytes in @p buf.
+     */
+    void pbjson_ndjson_init(pbjson_ndjson_reader_t *reader, const char *buf, size_t len);
+
+    /**
+     * @brief Decodes the next record of an NDJSON reader.
+     *
+     * Blank lines are skipped, a "\r" before the newline is allowed. The
+     * structure is not cleared first: reset it between records if fields
+     * can be missing from a record.
+     *
+     * With @c reader->ctx set, the record is decoded with pbjson_ctx_decode() and
+     * @p arena is not used.
+     *
+     * @param reader The reader.
+     * @param fields The message descriptor of the records.
+     * @param dst The structure to decode into.
+     * @param arena Arena for pointer fields, or NULL as for pbjson_decode_n().
+     * @return 0 if a record was decoded, -1 if the record at @c reader->line
+     *         is not valid, PBJSON_NDJSON_END when there are no more records.
+     */
+    int pbjson_ndjson_read(pbjson_ndjson_reader_t *reader, const pbjson_msgdesc_t *fields, void *dst,
+                           pbjson_arena_t *arena);
+
+#ifdef PBJSON_STATS
+    /**
+     * @brief Phases timed with PBJSON_STATS_TIMERS, indexes of pbjson_stats_t::cycles.
+     */
+    typedef enum pbjson_stats_phase_enum
+    {
+        PBJSON_PHASE_DECODE,     /**< Whole pbjson_decode*() calls. */
+        PBJSON_PHASE_KEY_LOOKUP, /**< Matching keys to fields. */
+        PBJSON_PHASE_NUMBER,     /**< Parsing numbers. */
+        PBJSON_PHASE_SKIP,       /**< Skipping values of unknown keys and callback fields without a decoder. */
+        PBJSON_PHASE_ENCODE,     /**< Whole pbjson_encode*() calls. */
+        PBJSON_PHASE_COUNT,
+    } pbjson_stats_phase_t;
+
+    /**
+     * @brief Counters of the calling thread, built with PBJSON_STATS.
+     *
+     * pbjson_decode*() calls are counted, the incremental decoder is not.
+     * Without PBJSON_STATS_TIMERS every entry of @c cycles stays 0.
+     */
+    typedef struct pbjson_stats_s
+    {
+        uint64_t decode_calls;    /**< Top-level decode calls. */
+        uint64_t decode_errors;   /**< Top-level decode calls that failed. */
+        uint64_t decode_bytes;    /**< Input bytes of top-level decode calls. */
+        uint64_t decode_messages; /**< Objects decoded, nested ones included. */
+        uint64_t decode_fields;   /**< Keys that matched a field. */
+        uint64_t unknown_keys;    /**< Keys that matched no field. */
+        uint64_t values_skipped;  /**< Values parsed only to be thrown away. */
+        uint64_t key_compares;    /**< Key compares against field names. */
+        uint64_t numbers;         /**< Numbers parsed. */
+        uint64_t encode_calls;    /**< Top-level encode calls, pbjson_encode_batch() counts once. */
+        uint64_t encode_bytes;    /**< Output bytes of top-level encode calls. */
+        uint64_t encode_messages; /**< Objects encoded, nested ones included. */
+        uint64_t encode_fields;   /**< Keys written. */
+        uint64_t cycles[PBJSON_PHASE_COUNT]; /**< Time spent per phase, in PBJSON_STATS_CLOCK() ticks. */
+    } pbjson_stats_t;
+
+    /**
+     * @brief Called after each object has been decoded or encoded, nested ones included.
+     *
+     * @param fields Descriptor of the object.
+     * @param is_encode true for the encoder, false for the decoder.
+     * @param bytes Length of the JSON text of the object.
+     * @param cycles Time spent on the object including nested objects, 0 without PBJSON_STATS_TIMERS.
+     * @param arg The pointer given to pbjson_stats_set_hook().
+     */
+    typedef void (*pbjson_stats_hook_t)(const pbjson_msgdesc_t *fields, bool is_encode, size_t bytes, uint64_t cycles,
+                                        void *arg);
+
+    /**
+     * @brief Copies the counters of the calling thread.
+     *
+     * @param stats Receives the counters.
+     */
+    void pbjson_stats_get(pbjson_stats_t *stats);
+
+    /**
+     * @brief Clears the counters of the calling thread.
+     */
+    void pbjson_stats_reset(void);
+
+    /**
+     * @brief Installs a per-object hook for the calling thread.
+     *
+     * @param hook The hook, or NULL to remove it.
+     * @param arg User pointer passed to the hook.
+     */
+    void pbjson_stats_set_hook(pbjson_stats_hook_t hook, void *arg);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,199 @@
+#ifndef PB_JSON_HPP
+#define PB_JSON_HPP
+
+#include "json.h"
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+
+/*
+ * Typed C++ front-end for the generated message descriptors.
+ *
+ * Needs C++17 and headers generated with --cpp-descriptors. The descriptor
+ * and the output path are picked at compile time from the message and sink
+ * types, the work itself is done by the C encoder and decoder, including the
+ * generated encoders of --json-codegen.
+ */
+namespace pbjson
+{
+    namespace detail
+    {
+        /* json_max_size is only emitted for messages with a bounded encoding. */
+        template <typename T, typename = void>
+        struct has_json_max_size : std::false_type
+        {
+        };
+
+        template <typename T>
+        struct has_json_max_size<T, std::void_t<decltype(nanopb::MessageDescriptor<T>::json_max_size)>>
+            : std::true_type
+        {
+        };
+
+        /* Containers that encode() appends to. */
+        template <typename Sink>
+        struct is_sink : std::false_type
+        {
+        };
+
+        template <typename Traits, typename Alloc>
+        struct is_sink<std::basic_string<char, Traits, Alloc>> : std::true_type
+        {
+        };
+
+        template <typename Alloc>
+        struct is_sink<std::vector<char, Alloc>> : std::true_type
+        {
+        };
+
+        template <typename Alloc>
+        struct is_sink<std::vector<unsigned char, Alloc>> : std::true_type
+        {
+        };
+
+        template <typename Sink>
+        int append(pbjson_ostream_t *stream, const char *buf, size_t count)
+        {
+            Sink *out = static_cast<Sink *>(stream->state);
+            out->insert(out->end(), buf, buf + count);
+            return 0;
+        }
+    }
+
+    /**
+     * @brief Message descriptor of a generated structure type.
+     */
+    template <typename T>
+    inline const pbjson_msgdesc_t *fields()
+    {
+        return nanopb::MessageDescriptor<T>::fields();
+    }
+
+    /**
+     * @brief Encodes a structure into a flat buffer.
+     *
+     * The output is not NUL-terminated.
+     *
+     * @param buf The output buffer.
+     * @param size Size of @p buf in bytes.
+     * @param msg The structure to encode.
+     * @return Length of the JSON text, -1 on error or if it does not fit.
+     */
+    template <typename T>
+    inline int encode(char *buf, size_t size, const T &msg)
+    {
+        pbjson_ostream_t stream = pbjson_ostream_from_buffer(buf, size);
+
+        if (pbjson_encode_stream(&stream, fields<T>(), &msg))
+            return -1;
+
+        return (int)stream.pos;
+    }
+
+#if __cplusplus >= 202002L
+    /** @brief Encodes a structure into @p buf, see encode(char *, size_t, const T &). */
+    template <typename T>
+    inline int encode(std::span<char> buf, const T &msg)
+    {
+        return encode(buf.data(), buf.size(), msg);
+    }
+#endif
+
+    /**
+     * @brief Appends the JSON text of a structure to a std::string or std::vector.
+     *
+     * Messages with a generated json_max_size are encoded straight into the
+     * container after growing it once, the others through a stream that
+     * appends every write. On error the container is left as it was.
+     *
+     * @param out The container to append to.
+     * @param msg The structure to encode.
+     * @return Number of bytes appended, -1 on error.
+     */
+    template <typename T, typename Sink>
+    inline std::enable_if_t<detail::is_sink<Sink>::value, int> encode(Sink &out, const T &msg)
+    {
+        size_t start = out.size();
+
+        if constexpr (detail::has_json_max_size<T>::value)
+        {
+            out.resize(start + nanopb::MessageDescriptor<T>::json_max_size);
+            int len = encode(reinterpret_cast<char *>(&out[0]) + start, nanopb::MessageDescriptor<T>::json_max_size,
+                             msg);
+            out.resize(start + (len < 0 ? 0 : (size_t)len));
+            return len;
+        }
+        else
+        {
+            pbjson_ostream_t stream = pbjson_ostream_from_callback(detail::append<Sink>, &out, nullptr, 0);
+
+            if (pbjson_encode_stream(&stream, fields<T>(), &msg))
+            {
+                out.resize(start);
+                return -1;
+            }
+
+            return (int)(out.size() - start);
+        }
+    }
+
+    /**
+     * @brief Computes the exact length of the JSON text for a structure.
+     *
+     * @param msg The structure.
+     * @return The length in bytes, -1 on error.
+     */
+    template <typename T>
+    inline int encoded_size(const T &msg)
+    {
+        return pbjson_encoded_size(fields<T>(), &msg);
+    }
+
+    /**
+     * @brief Decodes JSON text into a structure.
+     *
+     * @param s The JSON text, need not be NUL-terminated.
+     * @param msg The structure to fill, initialized by the caller.
+     * @return 0 on success, -1 on error.
+     */
+    template <typename T>
+    inline int decode(std::string_view s, T &msg)
+    {
+        return pbjson_decode_n(s.data(), s.size(), fields<T>(), &msg);
+    }
+
+    /**
+     * @brief Decodes JSON text into a structure with pointer fields.
+     *
+     * @param s The JSON text, need not be NUL-terminated.
+     * @param msg The structure to fill, initialized by the caller.
+     * @param arena Arena for the pointer fields of @p msg.
+     * @return 0 on success, -1 on error.
+     */
+    template <typename T>
+    inline int decode(std::string_view s, T &msg, pbjson_arena_t &arena)
+    {
+        return pbjson_decode_arena(s.data(), s.size(), fields<T>(), &msg, &arena);
+    }
+
+    /**
+     * @brief Decodes JSON text into a structure with a decode context.
+     *
+     * @param ctx The context, see pbjson_ctx_decode().
+     * @param s The JSON text, need not be NUL-terminated.
+     * @param msg The structure to fill, initialized by the caller.
+     * @return 0 on success, -1 on error.
+     */
+    template <typename T>
+    inline int decode(pbjson_ctx_t &ctx, std::string_view s, T &msg)
+    {
+        return pbjson_ctx_decode(&ctx, s.data(), s.size(), fields<T>(), &msg);
+    }
+}
+
+#endif // PB_JSON_HPP
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #define PB_JSON_PROTO_HEADER_VERSION 40
 
@@ -27,60 +28,198 @@
 #endif
 #endif
 
+/* Initializer of the pbjson_ref_t of a pbjson_iter_t, or of an entry
+ * of the generated pbjson_refs[] with PBJSON_COMPACT_DESCRIPTORS: the message
+ * descriptor of a submessage field, the names of an enum field. */
 #define PBJSON_SUBMESSAGE_POINTER(msgname, type, prop) \
-    _PBJSON_SUBMESSAGE_ITER_##type(msgname##_##prop##_MSGTYPE)
-#define _PBJSON_SUBMESSAGE_ITER_MESSAGE(msgname) \
-    _PBJSON_SUBMESSAGE_ITER2(msgname)
+    _PBJSON_SUBMESSAGE_ITER_##type(msgname##_##prop##_MSGTYPE, msgname##_##prop##_ENUMTYPE)
+#define _PBJSON_SUBMESSAGE_ITER_MESSAGE(msgtype, enumtype) \
+    {.submsg = _PBJSON_SUBMESSAGE_ITER2(msgtype)}
 #define _PBJSON_SUBMESSAGE_ITER2(msgname) &msgname##_msg
+#define _PBJSON_SUBMESSAGE_ITER_ENUM(msgtype, enumtype) \
+    {.enumdesc = _PBJSON_ENUMDESC_ITER2(enumtype)}
+#define _PBJSON_SUBMESSAGE_ITER_UENUM(msgtype, enumtype) \
+    {.enumdesc = _PBJSON_ENUMDESC_ITER2(enumtype)}
+#define _PBJSON_ENUMDESC_ITER2(enumname) &enumname##_enum
 
-#define _PBJSON_SUBMESSAGE_ITER_BOOL(msgname) (void *)0
-#define _PBJSON_SUBMESSAGE_ITER_ENUM(msgname) (void *)0
-#define _PBJSON_SUBMESSAGE_ITER_UENUM(msgname) (void *)0
-#define _PBJSON_SUBMESSAGE_ITER_FLOAT(msgname) (void *)0
-#define _PBJSON_SUBMESSAGE_ITER_DOUBLE(msgname) (void *)0
-#define _PBJSON_SUBMESSAGE_ITER_INT32(msgname) (void *)0
-#define _PBJSON_SUBMESSAGE_ITER_SINT32(msgname) (void *)0
-#define _PBJSON_SUBMESSAGE_ITER_SFIXED32(msgname) (void *)0
-#define _PBJSON_SUBMESSAGE_ITER_INT64(msgname) (void *)0
-#define _PBJSON_SUBMESSAGE_ITER_SINT64(msgname) (void *)0
-#define _PBJSON_SUBMESSAGE_ITER_SFIXED64(msgname) (void *)0
-#define _PBJSON_SUBMESSAGE_ITER_UINT32(msgname) (void *)0
-#define _PBJSON_SUBMESSAGE_ITER_FIXED32(msgname) (void *)0
-#define _PBJSON_SUBMESSAGE_ITER_UINT64(msgname) (void *)0
-#define _PBJSON_SUBMESSAGE_ITER_FIXED64(msgname) (void *)0
-#define _PBJSON_SUBMESSAGE_ITER_STRING(msgname) (void *)0
+#define _PBJSON_SUBMESSAGE_ITER_BOOL(msgtype, enumtype) {(void *)0}
+#define _PBJSON_SUBMESSAGE_ITER_FLOAT(msgtype, enumtype) {(void *)0}
+#define _PBJSON_SUBMESSAGE_ITER_DOUBLE(msgtype, enumtype) {(void *)0}
+#define _PBJSON_SUBMESSAGE_ITER_INT32(msgtype, enumtype) {(void *)0}
+#define _PBJSON_SUBMESSAGE_ITER_SINT32(msgtype, enumtype) {(void *)0}
+#define _PBJSON_SUBMESSAGE_ITER_SFIXED32(msgtype, enumtype) {(void *)0}
+#define _PBJSON_SUBMESSAGE_ITER_INT64(msgtype, enumtype) {(void *)0}
+#define _PBJSON_SUBMESSAGE_ITER_SINT64(msgtype, enumtype) {(void *)0}
+#define _PBJSON_SUBMESSAGE_ITER_SFIXED64(msgtype, enumtype) {(void *)0}
+#define _PBJSON_SUBMESSAGE_ITER_UINT32(msgtype, enumtype) {(void *)0}
+#define _PBJSON_SUBMESSAGE_ITER_FIXED32(msgtype, enumtype) {(void *)0}
+#define _PBJSON_SUBMESSAGE_ITER_UINT64(msgtype, enumtype) {(void *)0}
+#define _PBJSON_SUBMESSAGE_ITER_FIXED64(msgtype, enumtype) {(void *)0}
+#define _PBJSON_SUBMESSAGE_ITER_STRING(msgtype, enumtype) {(void *)0}
+#define _PBJSON_SUBMESSAGE_ITER_BYTES(msgtype, enumtype) {(void *)0}
+
+/* Offsets and sizes stored in pbjson_iter_t. With PBJSON_COMPACT_DESCRIPTORS
+ * they are 16 bits wide, and a value that does not fit stops the build. */
+#ifdef PBJSON_COMPACT_DESCRIPTORS
+#define PBJSON_GEN_U16(val) ((uint16_t)((val) + 0 * sizeof(char[((val) <= UINT16_MAX) ? 1 : -1])))
+#define PBJSON_GEN_OFFSET(struct_name, member) PBJSON_GEN_U16(offsetof(struct_name, member))
+#define PBJSON_GEN_SIZE(size) PBJSON_GEN_U16(size)
+#else
+#define PBJSON_GEN_OFFSET(struct_name, member) (uint32_t)offsetof(struct_name, member)
+#define PBJSON_GEN_SIZE(size) (uint32_t)(size)
+#endif
 
 #define PBJSON_GEN_OPTION_REQUIRED(struct_name, prop) 0, PBJSON_OPTION_SINGULAR
 #define PBJSON_GEN_OPTION_SINGULAR(struct_name, prop) 0, PBJSON_OPTION_SINGULAR
 #define PBJSON_GEN_OPTION_REPEATED(struct_name, prop) \
-    (uint32_t)(uintptr_t)(&((struct_name *)0)->prop##_count), PBJSON_OPTION_REPEATED
+    PBJSON_GEN_OFFSET(struct_name, prop##_count), PBJSON_OPTION_REPEATED
 #define PBJSON_GEN_OPTION_OPTIONAL(struct_name, prop) \
-    (uint32_t)(uintptr_t)(&((struct_name *)0)->has_##prop), PBJSON_OPTION_OPTIONAL
+    PBJSON_GEN_OFFSET(struct_name, has_##prop), PBJSON_OPTION_OPTIONAL
+
+/* Pointer fields have no has_ member, NULL means absent. */
+#define PBJSON_GEN_POINTER_OPTION_REQUIRED(struct_name, prop) 0, PBJSON_OPTION_SINGULAR
+#define PBJSON_GEN_POINTER_OPTION_SINGULAR(struct_name, prop) 0, PBJSON_OPTION_SINGULAR
+#define PBJSON_GEN_POINTER_OPTION_REPEATED(struct_name, prop) PBJSON_GEN_OPTION_REPEATED(struct_name, prop)
+#define PBJSON_GEN_POINTER_OPTION_OPTIONAL(struct_name, prop) 0, PBJSON_OPTION_SINGULAR
+
+/* Callback fields have neither a has_ nor a _count member. */
+#define PBJSON_GEN_CALLBACK_OPTION_REQUIRED(struct_name, prop) 0, PBJSON_OPTION_SINGULAR
+#define PBJSON_GEN_CALLBACK_OPTION_SINGULAR(struct_name, prop) 0, PBJSON_OPTION_SINGULAR
+#define PBJSON_GEN_CALLBACK_OPTION_REPEATED(struct_name, prop) 0, PBJSON_OPTION_REPEATED
+#define PBJSON_GEN_CALLBACK_OPTION_OPTIONAL(struct_name, prop) 0, PBJSON_OPTION_SINGULAR
+
+#define PBJSON_GEN_OPTION_STATIC(struct_name, option, prop) PBJSON_GEN_OPTION_##option(struct_name, prop)
+#define PBJSON_GEN_OPTION_POINTER(struct_name, option, prop) PBJSON_GEN_POINTER_OPTION_##option(struct_name, prop)
+#define PBJSON_GEN_OPTION_CALLBACK(struct_name, option, prop) PBJSON_GEN_CALLBACK_OPTION_##option(struct_name, prop)
+#define PBJSON_GEN_OPTION_VIEW(struct_name, option, prop) 0, PBJSON_OPTION_SINGULAR
 
 #define PBJSON_GEN_ITEM_SIZE_REQUIRED(struct_name, prop) sizeof(((struct_name *)0)->prop)
 #define PBJSON_GEN_ITEM_SIZE_SINGULAR(struct_name, prop) sizeof(((struct_name *)0)->prop)
 #define PBJSON_GEN_ITEM_SIZE_REPEATED(struct_name, prop) sizeof(((struct_name *)0)->prop[0])
 #define PBJSON_GEN_ITEM_SIZE_OPTIONAL(struct_name, prop) sizeof(((struct_name *)0)->prop)
 
-#define PBJSON_GEN_ITER(struct_name, p1, option, type, prop, p3) \
-    {                                                            \
-        #prop,                                                   \
-        PBJSON_SUBMESSAGE_POINTER(struct_name, type, prop),      \
-        PBJSON_GEN_ITEM_SIZE_##option(struct_name, prop),        \
-        (uint32_t)(uintptr_t)(&((struct_name *)0)->prop),        \
-        PBJSON_GEN_OPTION_##option(struct_name, prop),           \
-        PBJSON_##type##_TYPE,                                    \
+/* Size of the item a pointer field points to, or of one array element. */
+#define PBJSON_GEN_POINTER_ITEM_SIZE_REQUIRED(struct_name, prop) sizeof(*((struct_name *)0)->prop)
+#define PBJSON_GEN_POINTER_ITEM_SIZE_SINGULAR(struct_name, prop) sizeof(*((struct_name *)0)->prop)
+#define PBJSON_GEN_POINTER_ITEM_SIZE_REPEATED(struct_name, prop) sizeof(((struct_name *)0)->prop[0])
+#define PBJSON_GEN_POINTER_ITEM_SIZE_OPTIONAL(struct_name, prop) sizeof(*((struct_name *)0)->prop)
+
+#define PBJSON_GEN_ITEM_SIZE_STATIC(struct_name, option, prop) PBJSON_GEN_ITEM_SIZE_##option(struct_name, prop)
+#define PBJSON_GEN_ITEM_SIZE_POINTER(struct_name, option, prop) PBJSON_GEN_POINTER_ITEM_SIZE_##option(struct_name, prop)
+#define PBJSON_GEN_ITEM_SIZE_CALLBACK(struct_name, option, prop) sizeof(((struct_name *)0)->prop)
+#define PBJSON_GEN_ITEM_SIZE_VIEW(struct_name, option, prop) sizeof(((struct_name *)0)->prop)
+
+#define PBJSON_GEN_MAX_COUNT_REQUIRED(struct_name, prop) 1
+#define PBJSON_GEN_MAX_COUNT_SINGULAR(struct_name, prop) 1
+#define PBJSON_GEN_MAX_COUNT_REPEATED(struct_name, prop) \
+    (uint32_t)(sizeof(((struct_name *)0)->prop) / sizeof(((struct_name *)0)->prop[0]))
+#define PBJSON_GEN_MAX_COUNT_OPTIONAL(struct_name, prop) 1
+
+/* Pointer arrays are sized by the decoder to fit the input. */
+#define PBJSON_GEN_POINTER_MAX_COUNT_REQUIRED(struct_name, prop) 1
+#define PBJSON_GEN_POINTER_MAX_COUNT_SINGULAR(struct_name, prop) 1
+#define PBJSON_GEN_POINTER_MAX_COUNT_REPEATED(struct_name, prop) UINT32_MAX
+#define PBJSON_GEN_POINTER_MAX_COUNT_OPTIONAL(struct_name, prop) 1
+
+#define PBJSON_GEN_MAX_COUNT_STATIC(struct_name, option, prop) PBJSON_GEN_MAX_COUNT_##option(struct_name, prop)
+#define PBJSON_GEN_MAX_COUNT_POINTER(struct_name, option, prop) PBJSON_GEN_POINTER_MAX_COUNT_##option(struct_name, prop)
+#define PBJSON_GEN_MAX_COUNT_CALLBACK(struct_name, option, prop) PBJSON_GEN_POINTER_MAX_COUNT_##option(struct_name, prop)
+#define PBJSON_GEN_MAX_COUNT_VIEW(struct_name, option, prop) 1
+
+#ifdef PBJSON_COMPACT_DESCRIPTORS
+/* The key and descriptor of a field are located by the _JSONKEY and _JSONREF
+ * defines that the generator emits next to the tables of the file. */
+#define PBJSON_GEN_ITER(struct_name, p1, option, type, prop, p3)                 \
+    {                                                                            \
+        PBJSON_GEN_SIZE(PBJSON_GEN_ITEM_SIZE_##p1(struct_name, option, prop)),   \
+        PBJSON_GEN_OFFSET(struct_name, prop),                                    \
+        PBJSON_GEN_OPTION_##p1(struct_name, option, prop),                       \
+        PBJSON_##type##_TYPE,                                                    \
+        PBJSON_##p1##_ATYPE,                                                     \
+        PBJSON_##type##_WIRE,                                                    \
+        sizeof(#prop) - 1,                                                       \
+        struct_name##_##prop##_JSONKEY,                                          \
+        struct_name##_##prop##_JSONREF,                                          \
+        PBJSON_GEN_MAX_COUNT_##p1(struct_name, option, prop),                    \
+        p3,                                                                      \
     },
+#else
+#define PBJSON_GEN_ITER(struct_name, p1, option, type, prop, p3)                 \
+    {                                                                            \
+        #prop,                                                                   \
+        PBJSON_SUBMESSAGE_POINTER(struct_name, type, prop),                      \
+        ",\"" #prop "\":",                                                       \
+        PBJSON_GEN_SIZE(PBJSON_GEN_ITEM_SIZE_##p1(struct_name, option, prop)),   \
+        PBJSON_GEN_OFFSET(struct_name, prop),                                    \
+        PBJSON_GEN_OPTION_##p1(struct_name, option, prop),                       \
+        PBJSON_##type##_TYPE,                                                    \
+        PBJSON_##p1##_ATYPE,                                                     \
+        PBJSON_##type##_WIRE,                                                    \
+        PBJSON_GEN_MAX_COUNT_##p1(struct_name, option, prop),                    \
+        sizeof(#prop) - 1,                                                       \
+        p3,                                                                      \
+    },
+#endif
+
+/* Protobuf encoding of each field type, see pbjson_wire_enum. */
+#define PBJSON_BOOL_WIRE PBJSON_WIRE_VARINT
+#define PBJSON_ENUM_WIRE PBJSON_WIRE_VARINT
+#define PBJSON_UENUM_WIRE PBJSON_WIRE_VARINT
+#define PBJSON_FLOAT_WIRE PBJSON_WIRE_FIXED32
+#define PBJSON_DOUBLE_WIRE PBJSON_WIRE_FIXED64
+#define PBJSON_INT32_WIRE PBJSON_WIRE_VARINT
+#define PBJSON_SINT32_WIRE PBJSON_WIRE_ZIGZAG
+#define PBJSON_SFIXED32_WIRE PBJSON_WIRE_FIXED32
+#define PBJSON_INT64_WIRE PBJSON_WIRE_VARINT
+#define PBJSON_SINT64_WIRE PBJSON_WIRE_ZIGZAG
+#define PBJSON_SFIXED64_WIRE PBJSON_WIRE_FIXED64
+#define PBJSON_UINT32_WIRE PBJSON_WIRE_VARINT
+#define PBJSON_FIXED32_WIRE PBJSON_WIRE_FIXED32
+#define PBJSON_UINT64_WIRE PBJSON_WIRE_VARINT
+#define PBJSON_FIXED64_WIRE PBJSON_WIRE_FIXED64
+#define PBJSON_STRING_WIRE PBJSON_WIRE_LEN
+#define PBJSON_BYTES_WIRE PBJSON_WIRE_LEN
+#define PBJSON_MESSAGE_WIRE PBJSON_WIRE_LEN
+
+/* Protobuf wire type of a pbjson_wire_t. */
+#define PBJSON_WIRE_TYPE(wire) ((unsigned)(wire) & 7u)
 
 #define PBJSON_COUNT_ITER(struct_name, p1, option, type, prop, p3) +1
 
-#define PBJSON_BIND(msgname, structname, width)                   \
-    const pbjson_iter_t msgname##_field_info[] =                  \
-        {msgname##_FIELDLIST(PBJSON_GEN_ITER, structname)};       \
-    const pbjson_msgdesc_t msgname##_msg =                        \
-        {                                                         \
-            msgname##_field_info,                                 \
-            0 msgname##_FIELDLIST(PBJSON_COUNT_ITER, structname), \
+#define PBJSON_BIND(msgname, structname, width)                                 \
+    const pbjson_iter_t msgname##_field_info[] =                                \
+        {msgname##_FIELDLIST(PBJSON_GEN_ITER, structname)};                     \
+    static const uint16_t msgname##_key_table[] = {msgname##_KEYHASH_TABLE};    \
+    const pbjson_msgdesc_t msgname##_msg =                                      \
+        {                                                                       \
+            msgname##_field_info,                                               \
+            0 msgname##_FIELDLIST(PBJSON_COUNT_ITER, structname),               \
+            msgname##_key_table,                                                \
+            sizeof(msgname##_key_table) / sizeof(msgname##_key_table[0]) - 1,   \
+            msgname##_KEYHASH_SEED,                                             \
+            msgname##_JSON_ENCODE,                                              \
+            msgname##_JSON_DECODE,                                              \
+            PBJSON_BIND_TABLES                                                  \
+    };
+
+/* Key pool and descriptor table of the file, emitted by the generator. */
+#ifdef PBJSON_COMPACT_DESCRIPTORS
+#define PBJSON_BIND_TABLES pbjson_keys, pbjson_refs,
+#else
+#define PBJSON_BIND_TABLES
+#endif
+
+#define PBJSON_ENUM_BIND(enumname, typename)                                              \
+    static const pbjson_enum_value_t enumname##_enum_values[] =                           \
+        {enumname##_ENUM_VALUES};                                                         \
+    static const uint16_t enumname##_enum_key_table[] = {enumname##_KEYHASH_TABLE};       \
+    const pbjson_enumdesc_t typename##_enum =                                             \
+        {                                                                                 \
+            enumname##_enum_values,                                                       \
+            sizeof(enumname##_enum_values) / sizeof(enumname##_enum_values[0]),           \
+            enumname##_enum_key_table,                                                    \
+            sizeof(enumname##_enum_key_table) / sizeof(enumname##_enum_key_table[0]) - 1, \
+            enumname##_KEYHASH_SEED,                                                      \
     };
 
 #ifdef __cplusplus
@@ -112,6 +251,7 @@ extern "C"
 
         PBJSON_STRING_TYPE,
         PBJSON_MESSAGE_TYPE,
+        PBJSON_BYTES_TYPE,
 
     };
 
@@ -122,33 +262,189 @@ extern "C"
         PBJSON_OPTION_OPTIONAL,
     };
 
+    enum pbjson_atype_enum
+    {
+        PBJSON_STATIC_ATYPE,
+        PBJSON_POINTER_ATYPE,
+        PBJSON_CALLBACK_ATYPE,
+        PBJSON_VIEW_ATYPE,
+    };
+
+    /* Encoding of a field in protobuf binary. The values are the protobuf wire
+     * types, except for PBJSON_WIRE_ZIGZAG: sint32 and sint64 are varints of
+     * the zigzag-encoded value. */
+    enum pbjson_wire_enum
+    {
+        PBJSON_WIRE_VARINT = 0,
+        PBJSON_WIRE_FIXED64 = 1,
+        PBJSON_WIRE_LEN = 2,
+        PBJSON_WIRE_FIXED32 = 5,
+        PBJSON_WIRE_ZIGZAG = 8 | PBJSON_WIRE_VARINT,
+    };
+
     typedef enum pbjson_type_enum pbjson_type_t;
     typedef enum pbjson_option_enum pbjson_option_t;
+    typedef enum pbjson_atype_enum pbjson_atype_t;
+    typedef enum pbjson_wire_enum pbjson_wire_t;
 
     typedef struct pbjson_iter_s pbjson_iter_t;
     typedef struct pbjson_msgdesc_s pbjson_msgdesc_t;
+    typedef struct pbjson_enumdesc_s pbjson_enumdesc_t;
+    struct pbjson_ostream_s;
+    struct pbjson_parser_s;
+
+    /* Descriptor reached from a field, the submessage or the enum names. */
+    typedef union pbjson_ref_u
+    {
+        const pbjson_msgdesc_t *submsg;    /* Message fields. */
+        const pbjson_enumdesc_t *enumdesc; /* Enum fields, NULL if the names are not known. */
+    } pbjson_ref_t;
 
+#ifdef PBJSON_COMPACT_DESCRIPTORS
+    /* Compact layout: 16-bit offsets into the key pool and the descriptor
+     * table that all messages of a .proto file share, instead of pointers.
+     * Read the key, name and descriptors with the PBJSON_ITER_ macros. */
+    struct pbjson_iter_s
+    {
+        uint16_t item_size;
+        uint16_t data_offset;
+        uint16_t count_offset;
+        pbjson_option_t option : 8;
+        pbjson_type_t data_type : 8;
+        pbjson_atype_t atype : 8;
+        pbjson_wire_t wire : 8;
+        uint16_t name_len;   /* strlen() of the name, so the JSON key is name_len + 4 bytes. */
+        uint16_t key_offset; /* Offset of ",\"name\":" in the keys of the message descriptor. */
+        uint16_t ref;        /* Index into the refs of the message descriptor, 0 for none. */
+        uint32_t max_count;  /* Capacity of a repeated field, 1 otherwise. */
+        uint32_t tag;        /* Protobuf field number. */
+    };
+#else
+    /* Pointers first and the enums in one word, 56 bytes on 64-bit targets. */
     struct pbjson_iter_s
     {
         const char *name;
-        const pbjson_msgdesc_t *submsg;
+        pbjson_ref_t ref;
+        const char *json_key; /* ",\"name\":", the encoder skips the comma before the first key of an object. */
         uint32_t item_size;
         uint32_t data_offset;
         uint32_t count_offset;
-        pbjson_option_t option;
-        pbjson_type_t data_type;
+        pbjson_option_t option : 8;
+        pbjson_type_t data_type : 8;
+        pbjson_atype_t atype : 8; /* Pointer fields hold the address of their data, allocated from a pbjson_arena_t.
+                                   * Callback fields hold a pbjson_callback_t, view fields a pbjson_string_view_t. */
+        pbjson_wire_t wire : 8;   /* Protobuf encoding, used by the binary transcoder. */
+        uint32_t max_count;       /* Capacity of a repeated field, 1 otherwise. */
+        uint32_t name_len;        /* strlen(name), so json_key is name_len + 4 bytes. */
+        uint32_t tag;             /* Protobuf field number. */
     };
+#endif
+
+/* Members of a field that the compact layout keeps in the tables of its file,
+ * @p fields being the message descriptor that holds @p iter:
+ * PBJSON_ITER_KEY() is ",\"name\":", the encoder skips the comma before the
+ * first key of an object, PBJSON_ITER_NAME() the name_len bytes of the name,
+ * NUL-terminated only in the default layout. */
+#ifdef PBJSON_COMPACT_DESCRIPTORS
+#define PBJSON_ITER_KEY(fields, iter) ((fields)->keys + (iter)->key_offset)
+#define PBJSON_ITER_NAME(fields, iter) (PBJSON_ITER_KEY(fields, iter) + 2)
+#define PBJSON_ITER_SUBMSG(fields, iter) ((fields)->refs[(iter)->ref].submsg)
+#define PBJSON_ITER_ENUMDESC(fields, iter) ((iter)->ref ? (fields)->refs[(iter)->ref].enumdesc : NULL)
+#else
+#define PBJSON_ITER_KEY(fields, iter) ((void)(fields), (iter)->json_key)
+#define PBJSON_ITER_NAME(fields, iter) ((void)(fields), (iter)->name)
+#define PBJSON_ITER_SUBMSG(fields, iter) ((void)(fields), (iter)->ref.submsg)
+#define PBJSON_ITER_ENUMDESC(fields, iter) ((void)(fields), (iter)->ref.enumdesc)
+#endif
 
     struct pbjson_msgdesc_s
     {
         const pbjson_iter_t *iter;
         uint32_t num_field;
+
+        /* Perfect hash of the field names, generated by nanopb_generator.py.
+         * key_table[hash & key_table_mask] is the field index plus one, or 0
+         * for an unused slot. A NULL key_table makes the decoder search iter[]
+         * linearly. */
+        const uint16_t *key_table;
+        uint32_t key_table_mask;
+        uint32_t key_seed;
+
+        /* Straight-line encoder generated with --json-codegen, or NULL to
+         * encode from iter[]. Both produce the same output. */
+        int (*encode)(struct pbjson_ostream_s *stream, const void *src_struct);
+
+        /* Straight-line decoder generated with --json-codegen, or NULL to
+         * decode through iter[]. Not used for field masks and patches. */
+        int (*decode)(struct pbjson_parser_s *parser, void *dst_struct, bool *p_has_msg);
+
+#ifdef PBJSON_COMPACT_DESCRIPTORS
+        const char *keys;         /* JSON keys of the fields of the file, see PBJSON_ITER_KEY(). */
+        const pbjson_ref_t *refs; /* Submessage and enum descriptors, refs[0] is none. */
+#endif
+    };
+
+    /* One name of an enum value. */
+    typedef struct pbjson_enum_value_s
+    {
+        const char *json_name; /* "\"NAME\"", the name in quotes as the encoder writes it. */
+        uint32_t name_len;     /* strlen() of the name, so json_name is name_len + 2 bytes. */
+        int32_t value;
+    } pbjson_enum_value_t;
+
+    struct pbjson_enumdesc_s
+    {
+        /* Every name of the enum, sorted by value. Aliases follow the first
+         * name of their value, which is the one the encoder writes. An enum
+         * whose values have no gaps is indexed by value, others are searched. */
+        const pbjson_enum_value_t *values;
+        uint32_t num_values;
+
+        /* Perfect hash of the names, like the one of pbjson_msgdesc_t:
+         * key_table[hash & key_table_mask] is the index into values[] plus
+         * one, or 0 for an unused slot. NULL makes the decoder search values[]. */
+        const uint16_t *key_table;
+        uint32_t key_table_mask;
+        uint32_t key_seed;
     };
 
     typedef uint32_t pbjson_size_t;
+    typedef uint8_t pb_byte_t;
+
+    /* Storage of a bytes field, as in nanopb. Static fields use
+     * PB_BYTES_ARRAY_T(max_size), whose capacity is the structure size less
+     * the offset of bytes; pointer fields are allocated to fit the value. */
+#define PB_BYTES_ARRAY_T(n) \
+    struct                  \
+    {                       \
+        pbjson_size_t size; \
+        pb_byte_t bytes[n]; \
+    }
+
+    typedef struct pb_bytes_array_s
+    {
+        pbjson_size_t size;
+        pb_byte_t bytes[1];
+    } pb_bytes_array_t;
 
 #ifdef __cplusplus
 }
+
+/* Target of the MessageDescriptor<T> specializations emitted with
+ * --cpp-descriptors, see pb/json.hpp. */
+#ifndef PB_INLINE_CONSTEXPR
+#if __cplusplus >= 201703L
+#define PB_INLINE_CONSTEXPR inline constexpr
+#else
+#define PB_INLINE_CONSTEXPR constexpr
+#endif
+#endif
+
+namespace nanopb
+{
+    template <typename GenMessageT>
+    struct MessageDescriptor;
+}
 #endif
 
 #endif // PB_JSON_MACRO_H
\ No newline at end of file
@@ -0,0 +1,60 @@
+#ifndef PB_JSON_PARALLEL_H
+#define PB_JSON_PARALLEL_H
+
+#include "json.h"
+
+/**
+ * @brief Upper limit for the number of threads of pbjson_parallel_decode().
+ */
+#ifndef PBJSON_PARALLEL_MAX_THREADS
+#define PBJSON_PARALLEL_MAX_THREADS 64
+#endif
+
+/**
+ * @brief Number of records a thread claims at a time.
+ *
+ * Smaller batches balance uneven records better, larger ones touch the
+ * shared counters less often.
+ */
+#ifndef PBJSON_PARALLEL_BATCH
+#define PBJSON_PARALLEL_BATCH 32
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @brief Decodes a batch of JSON records on several threads.
+     *
+     * Records are split into one contiguous range per thread. A thread
+     * decodes its own range in batches of PBJSON_PARALLEL_BATCH records and
+     * then steals batches from the ranges of the other threads, so a few
+     * slow records do not hold up the whole job. Record @c i is always
+     * decoded into slot @c i of @p dst_array and reported in @c results[i].
+     * If a thread cannot be created its range is stolen by the others.
+     *
+     * Only available when the library is built with NANOPB_JSON_PARALLEL.
+     *
+     * @param fields The message descriptor of every record.
+     * @param inputs The JSON text of each record, for example the lines found by pbjson_ndjson_read().
+     * @param count Number of records.
+     * @param dst_array The first destination structure.
+     * @param stride Distance in bytes from one destination structure to the next.
+     * @param results If not NULL, receives 0 or -1 for each record.
+     * @param num_threads Number of threads including the caller, 0 for one per online CPU.
+     * @param arenas NULL, or one arena per thread for pointer fields. The data
+     *               of a record may end up in any of them. Needs an explicit
+     *               @p num_threads, the number of arenas.
+     * @return Number of records that failed to decode, or -1 if the arguments are invalid.
+     */
+    int pbjson_parallel_decode(const pbjson_msgdesc_t *fields, const pbjson_istream_t *inputs, size_t count,
+                               void *dst_array, size_t stride, int *results, unsigned num_threads,
+                               pbjson_arena_t *arenas);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PB_JSON_PARALLEL_H
@@ -138,6 +138,26 @@ datatypes = {
     (FieldD.TYPE_UINT64, nanopb_pb2.IS_64):   ('uint64_t','UINT64', 10,  8),
 }
 
+# Longest value text written by pbjson_encode() for each scalar type, e.g.
+# "-2147483648" or "-2.2250738585072014e-308".
+json_value_sizes = {
+    'BOOL':     5,
+    'ENUM':     11,
+    'UENUM':    10,
+    'FLOAT':    17,
+    'DOUBLE':   25,
+    'INT32':    11,
+    'SINT32':   11,
+    'SFIXED32': 11,
+    'UINT32':   10,
+    'FIXED32':  10,
+    'INT64':    20,
+    'SINT64':   20,
+    'SFIXED64': 20,
+    'UINT64':   20,
+    'FIXED64':  20,
+}
+
 class NamingStyle:
     def enum_name(self, name):
         return "_%s" % (name)
@@ -207,6 +227,7 @@ class Globals:
     separate_options = []
     matched_namemasks = set()
     protoc_insertion_points = False
+    json_codegen = []
     naming_style = NamingStyle()
 
 class Names:
@@ -265,6 +286,87 @@ assert varint_max_size(0) == 1
 assert varint_max_size(127) == 1
 assert varint_max_size(128) == 2
 
+def json_key_hash(key, seed):
+    '''Seeded FNV-1a hash of a JSON key, must match pbjson_key_hash() in pbjson_decode.c.'''
+    h = (2166136261 ^ seed) & 0xFFFFFFFF
+    for b in bytearray(key.encode('utf-8')):
+        h ^= b
+        h = (h * 16777619) & 0xFFFFFFFF
+    return h
+
+def json_key_table(keys, max_seed = 4096):
+    '''Find a collision-free (perfect) hash table for the given keys.
+    Returns (seed, table) where table[hash & (len(table) - 1)] is the key
+    index plus one, and 0 marks an empty slot. Returns None if no seed is found.
+    '''
+    size = 1
+    while size < 2 * len(keys):
+        size *= 2
+
+    for _ in range(8):
+        for seed in range(max_seed):
+            table = [0] * size
+            for index, key in enumerate(keys):
+                slot = json_key_hash(key, seed) & (size - 1)
+                if table[slot]:
+                    break
+                table[slot] = index + 1
+            else:
+                return seed, table
+        size *= 2
+
+    return None
+
+def json_compact_tables(fields):
+    '''Return the key pool and descriptor table that the messages of a file
+    share with PBJSON_COMPACT_DESCRIPTORS, and the _JSONKEY and _JSONREF
+    defines locating each field in them. fields is a list of
+    (struct_name, name, pbtype, target) in FIELDLIST order, target being the
+    type of a message or enum field and None otherwise.
+    '''
+    keys = []
+    key_offsets = {}
+    pool_size = 0
+    refs = ['{(void *)0}']
+    ref_indexes = {}
+    defines = []
+
+    for struct_name, name, pbtype, target in fields:
+        key = ',\\"%s\\":' % name
+        if key not in key_offsets:
+            key_offsets[key] = pool_size
+            keys.append(key)
+            pool_size += len(name) + 4
+
+        ref = 0
+        if target is not None:
+            # ENUM and UENUM fields of one enum share its names.
+            kind = (pbtype == 'MESSAGE', target)
+            if kind not in ref_indexes:
+                ref_indexes[kind] = len(refs)
+                refs.append('PBJSON_SUBMESSAGE_POINTER(%s, %s, %s)' % (struct_name, pbtype, name))
+            ref = ref_indexes[kind]
+
+        defines.append('#define %s_%s_JSONKEY %d\n' % (struct_name, name, key_offsets[key]))
+        defines.append('#define %s_%s_JSONREF %d\n' % (struct_name, name, ref))
+
+    if pool_size > 65535 or len(refs) > 65535:
+        raise Exception("The JSON keys of this file do not fit the 16-bit offsets of PBJSON_COMPACT_DESCRIPTORS")
+
+    result = '#ifdef PBJSON_COMPACT_DESCRIPTORS\n'
+    result += 'static const char pbjson_keys[] =\n'
+    result += ''.join('    "%s"\n' % key for key in keys[:-1])
+    result += '    "%s";\n' % keys[-1]
+    result += 'static const pbjson_ref_t pbjson_refs[] = {\n'
+    result += ''.join('    %s,\n' % ref for ref in refs)
+    result += '};\n'
+    result += ''.join(defines)
+    result += '#endif\n'
+    return result
+
+assert json_key_hash('', 0) == 2166136261
+assert json_key_hash('a', 0) == 0xe40c292c
+
 class EncodedSize:
     '''Class used to represent the encoded size of a field or a message.
     Consists of a combination of symbolic sizes and integer sizes.'''
@@ -413,6 +515,7 @@ class Enum(ProtoElement):
             self.values = [(base_name + x.name, x.number) for x in desc.value]
 
         self.value_longnames = [self.names + x.name for x in desc.value]
+        self.json_names = [x.name for x in desc.value]
         self.packed = enum_options.packed_enum
 
     def has_negative(self):
@@ -424,6 +527,10 @@ class Enum(ProtoElement):
     def encoded_size(self):
         return max([varint_max_size(v) for n,v in self.values])
 
+    def json_name_size(self):
+        '''Longest name written with PBJSON_ENCODE_ENUM_NAMES, in quotes.'''
+        return max(len(x) for x in self.json_names) + 2
+
     def __repr__(self):
         return 'Enum(%s)' % self.names
 
@@ -512,6 +619,8 @@ class Enum(ProtoElement):
             for i, x in enumerate(self.values):
                 result += '#define %s %s\n' % (Globals.naming_style.define_name(self.value_longnames[i]), Globals.naming_style.enum_entry(x[0]))
 
+        result += 'extern const pbjson_enumdesc_t %s_enum;\n' % Globals.naming_style.type_name(self.names)
+
         if self.options.enum_to_string:
             result += 'const char *%s(%s v);\n' % (
                 Globals.naming_style.func_name('%s_name' % self.names),
@@ -524,6 +633,27 @@ class Enum(ProtoElement):
 
         return result
 
+    def json_table_definition(self):
+        '''Return the names of the enum values for the JSON encoder and decoder,
+        sorted by value with aliases after the first name of their value, and
+        the perfect hash table the decoder looks the names up in.'''
+        order = sorted(range(len(self.values)), key = lambda i: (self.values[i][1], i))
+        names = [self.json_names[i] for i in order]
+        define_name = Globals.naming_style.define_name(self.names)
+
+        found = json_key_table(names)
+        if found is None:
+            raise Exception("Could not build JSON name hash table for enum %s" % self.names)
+        seed, table = found
+
+        entries = ['{"\\"%s\\"", %d, %s}' % (self.json_names[i], len(self.json_names[i]),
+                                            Globals.naming_style.enum_entry(self.values[i][0])) for i in order]
+        result = '#define %s_ENUM_VALUES %s\n' % (define_name, ', '.join(entries))
+        result += '#define %s_KEYHASH_SEED 0x%08xu\n' % (define_name, seed)
+        result += '#define %s_KEYHASH_TABLE %s\n' % (define_name, ', '.join(str(x) for x in table))
+        result += 'PBJSON_ENUM_BIND(%s, %s)\n' % (define_name, Globals.naming_style.type_name(self.names))
+        return result
+
     def enum_to_string_definition(self):
         if not self.options.enum_to_string:
             return ""
@@ -606,6 +736,9 @@ class Field(ProtoElement):
         self.ctype = None
         self.fixed_count = False
         self.callback_datatype = field_options.callback_datatype
+        if self.callback_datatype == 'pb_callback_t':
+            # Callback fields use the JSON library's own callback type.
+            self.callback_datatype = 'pbjson_callback_t'
         self.math_include_required = False
         self.sort_by_tag = field_options.sort_by_tag
 
@@ -729,22 +862,16 @@ class Field(ProtoElement):
                 # check the presence of it.
                 self.enc_size = varint_max_size(self.max_size) + self.max_size - 1
         elif desc.type == FieldD.TYPE_BYTES:
+            # The JSON encoder and decoder only know pb_bytes_array_t.
             if field_options.fixed_length:
-                self.pbtype = 'FIXED_LENGTH_BYTES'
-
-                if self.max_size is None:
-                    raise Exception("Field '%s' is defined as fixed length, "
-                                    "but max_size is not given." % self.name)
+                raise Exception("Field '%s' is defined as fixed length, which is not "
+                                "supported, use max_size only." % self.name)
 
+            self.pbtype = 'BYTES'
+            self.ctype = 'pb_bytes_array_t'
+            if self.allocation == 'STATIC':
+                self.ctype = Globals.naming_style.bytes_type(self.struct_name, self.name)
                 self.enc_size = varint_max_size(self.max_size) + self.max_size
-                self.ctype = 'pb_byte_t'
-                self.array_decl += '[%d]' % self.max_size
-            else:
-                self.pbtype = 'BYTES'
-                self.ctype = 'pb_bytes_array_t'
-                if self.allocation == 'STATIC':
-                    self.ctype = Globals.naming_style.bytes_type(self.struct_name, self.name)
-                    self.enc_size = varint_max_size(self.max_size) + self.max_size
         elif desc.type == FieldD.TYPE_MESSAGE:
             self.pbtype = 'MESSAGE'
             self.ctype = self.submsgname = names_from_type_name(desc.type_name)
@@ -754,6 +881,12 @@ class Field(ProtoElement):
         else:
             raise NotImplementedError(desc.type)
 
+        if self.is_string_view():
+            # Zero-copy strings, the decoder stores a view into its input.
+            if self.pbtype != 'STRING' or self.rules == 'REPEATED':
+                raise Exception("Field '%s' uses pbjson_string_view_t, which is only "
+                                "supported for singular string fields." % self.name)
+
         if self.default and self.pbtype in ['FLOAT', 'DOUBLE']:
             if 'inf' in self.default or 'nan' in self.default:
                 self.math_include_required = True
@@ -915,8 +1048,10 @@ class Field(ProtoElement):
         elif self.allocation == 'CALLBACK':
             if self.pbtype == 'EXTENSION':
                 outer_init = 'NULL'
-            elif self.callback_datatype == 'pb_callback_t':
+            elif self.callback_datatype == 'pbjson_callback_t':
                 outer_init = '{{NULL}, NULL}'
+            elif self.is_string_view():
+                outer_init = '{NULL, 0}'
             elif self.initializer is not None:
                 outer_init = inner_init
             elif self.callback_datatype.strip().endswith('*'):
@@ -957,7 +1092,7 @@ class Field(ProtoElement):
 
         return '%s(%s, %-9s %-9s %-9s %-16s %3d)' % (self.macro_x_param,
                                                      self.macro_a_param,
-                                                     self.allocation + ',',
+                                                     self.json_atype() + ',',
                                                      self.rules + ',',
                                                      self.pbtype + ',',
                                                      name + ',',
@@ -1012,6 +1147,65 @@ class Field(ProtoElement):
 
         return size
 
+    def json_encoded_size(self, dependencies):
+        '''Return the maximum size that this field can take in the output of
+        pbjson_encode(), including the key and the separating comma. If the
+        size cannot be determined, returns None.'''
+
+        if self.allocation != 'STATIC':
+            return None
+
+        if self.pbtype == 'MESSAGE':
+            encsize = None
+            if str(self.submsgname) in dependencies:
+                submsg = dependencies[str(self.submsgname)]
+                other_dependencies = dict(x for x in dependencies.items() if x[0] != str(self.struct_name))
+                encsize = submsg.json_encoded_size(other_dependencies)
+
+                my_msg = dependencies.get(str(self.struct_name))
+                external = (not my_msg or submsg.protofile != my_msg.protofile)
+
+                if encsize and encsize.symbols and external:
+                    encsize = None
+                elif encsize is None and not external:
+                    return None
+
+            if encsize is None:
+                # Reference the size #defined in the other file.
+                encsize = EncodedSize(self.submsgname + 'json_max_size')
+
+        elif self.pbtype == 'STRING':
+            # Quotes around the text, max_size includes the terminator.
+            # Every byte can be escaped as \u00XX.
+            encsize = EncodedSize(6 * (self.max_size - 1) + 2)
+
+        elif self.pbtype == 'BYTES':
+            # Base64 with padding in quotes. The array is padded to the 4 byte
+            # alignment of its size member and the decoder fills that too.
+            capacity = (self.max_size + 3) // 4 * 4
+            encsize = EncodedSize((capacity + 2) // 3 * 4 + 2)
+
+        elif self.pbtype in ['ENUM', 'UENUM']:
+            # The number, or with PBJSON_ENCODE_ENUM_NAMES the name.
+            enumtype = dependencies.get(str(self.ctype))
+            if not isinstance(enumtype, Enum):
+                return None
+            encsize = EncodedSize(max(json_value_sizes[self.pbtype], enumtype.json_name_size()))
+
+        elif self.pbtype in json_value_sizes:
+            encsize = EncodedSize(json_value_sizes[self.pbtype])
+
+        else:
+            return None
+
+        if self.rules in ['REPEATED', 'FIXARRAY']:
+            # Brackets and commas between the elements.
+            encsize = encsize * self.max_count + (self.max_count + 1)
+
+        # ,"name":
+        encsize += len(Globals.naming_style.var_name(self.name)) + 4
+        return encsize
+
     def encoded_size(self, dependencies):
         '''Return the maximum size that this field can take when encoded,
         including the field tag. If the size cannot be determined, returns
@@ -1087,10 +1281,20 @@ class Field(ProtoElement):
         return encsize
 
     def has_callbacks(self):
-        return self.allocation == 'CALLBACK'
+        return self.allocation == 'CALLBACK' and not self.is_string_view()
 
     def requires_custom_field_callback(self):
-        return self.allocation == 'CALLBACK' and self.callback_datatype != 'pb_callback_t'
+        return self.has_callbacks() and self.callback_datatype != 'pbjson_callback_t'
+
+    def is_string_view(self):
+        return self.allocation == 'CALLBACK' and self.callback_datatype == 'pbjson_string_view_t'
+
+    def json_atype(self):
+        '''Return the allocation type written to the FIELDLIST macro.
+        String views are stored like callbacks, but decoded by the library.'''
+        if self.is_string_view():
+            return 'VIEW'
+        return self.allocation
 
 class ExtensionRange(Field):
     def __init__(self, struct_name, range_start, field_options):
@@ -1133,6 +1337,10 @@ class ExtensionRange(Field):
         # way the value remains useful if extensions are not used.
         return EncodedSize(0)
 
+    def json_encoded_size(self, dependencies):
+        # Extensions are not written by pbjson_encode().
+        return EncodedSize(0)
+
 class ExtensionField(Field):
     def __init__(self, fullname, desc, field_options):
         self.fullname = fullname
@@ -1289,6 +1497,10 @@ class OneOf(Field):
             required_defs = list(itertools.chain.from_iterable(s.required_defines for k,s in dynamic_sizes.items()))
             return EncodedSize(0, ['sizeof(union %s)' % union_name], [union_def], required_defs)
 
+    def json_encoded_size(self, dependencies):
+        # Oneofs are not described by PBJSON_BIND.
+        return None
+
     def has_callbacks(self):
         return bool([f for f in self.fields if f.has_callbacks()])
 
@@ -1564,6 +1776,10 @@ class Message(ProtoElement):
         if size_define in local_defines:
             result += '    static PB_INLINE_CONSTEXPR const uint32_t size = %s;\n' % (size_define)
 
+        json_size_define = "%s_json_max_size" % (self.name)
+        if json_size_define in local_defines:
+            result += '    static PB_INLINE_CONSTEXPR const uint32_t json_max_size = %s;\n' % (json_size_define)
+
         result += '    static inline const pbjson_msgdesc_t* fields() {\n'
         result += '        return &%s_msg;\n' % (self.name)
         result += '    }\n'
@@ -1582,12 +1798,301 @@ class Message(ProtoElement):
         if width == 1:
           width = 'AUTO'
 
-        result = 'PBJSON_BIND(%s, %s, %s)\n' % (
+        result = self.key_table_definition()
+        if self.json_codegen_enabled():
+            result += '#define %s_JSON_ENCODE %s\n' % (Globals.naming_style.define_name(self.name), self.json_encode_name())
+            result += '#define %s_JSON_DECODE %s\n' % (Globals.naming_style.define_name(self.name), self.json_decode_name())
+        else:
+            result += '#define %s_JSON_ENCODE NULL\n' % Globals.naming_style.define_name(self.name)
+            result += '#define %s_JSON_DECODE NULL\n' % Globals.naming_style.define_name(self.name)
+        result += 'PBJSON_BIND(%s, %s, %s)\n' % (
             Globals.naming_style.define_name(self.name),
             Globals.naming_style.type_name(self.name),
             width)
         return result
 
+    def json_compact_fields(self):
+        '''Return the fields for json_compact_tables(), in FIELDLIST order.'''
+        result = []
+        for field in sorted(self.all_fields(), key = lambda x: x.tag):
+            target = None
+            if field.pbtype in ['MESSAGE', 'MSG_W_CB', 'ENUM', 'UENUM']:
+                target = str(field.ctype)
+            pbtype = 'MESSAGE' if field.pbtype == 'MSG_W_CB' else field.pbtype
+            result.append((Globals.naming_style.type_name(self.name),
+                           Globals.naming_style.var_name(field.name), pbtype, target))
+        return result
+
+    def key_table_definition(self):
+        '''Return the perfect hash table used by the decoder to look up JSON keys.'''
+        # Must follow the FIELDLIST order, which is sorted by tag.
+        sorted_fields = sorted(self.all_fields(), key = lambda x: x.tag)
+        keys = [Globals.naming_style.var_name(f.name) for f in sorted_fields]
+        define_name = Globals.naming_style.define_name(self.name)
+
+        found = json_key_table(keys)
+        if found is None:
+            raise Exception("Could not build JSON key hash table for message %s" % self.name)
+        seed, table = found
+
+        result = '#define %s_KEYHASH_SEED 0x%08xu\n' % (define_name, seed)
+        result += '#define %s_KEYHASH_TABLE %s\n' % (define_name, ', '.join(str(x) for x in table))
+        return result
+
+    json_codegen_types = {
+        'BOOL': 'bool', 'FLOAT': 'float', 'DOUBLE': 'double',
+        'INT32': 'int', 'SINT32': 'int', 'SFIXED32': 'int', 'INT64': 'int', 'SINT64': 'int', 'SFIXED64': 'int',
+        'ENUM': 'enum', 'UINT32': 'uint', 'FIXED32': 'uint', 'UINT64': 'uint', 'FIXED64': 'uint', 'UENUM': 'enum',
+        'STRING': 'string', 'BYTES': 'bytes', 'MESSAGE': 'message',
+    }
+
+    def json_codegen_supported(self):
+        '''Return None if a straight-line encoder and decoder can be generated
+        for this message, otherwise the reason why not.'''
+        for field in self.fields:
+            if isinstance(field, (OneOf, ExtensionRange)):
+                return 'oneofs and extensions are encoded and decoded from the field table'
+            if field.allocation != 'STATIC' and not field.is_string_view():
+                return 'field %s is not statically allocated' % field.name
+            if field.rules not in ['REQUIRED', 'SINGULAR', 'OPTIONAL', 'REPEATED']:
+                return 'field %s is a fixed size array' % field.name
+            if field.pbtype not in self.json_codegen_types:
+                return 'field %s has type %s' % (field.name, field.pbtype)
+        return None
+
+    def json_codegen_enabled(self):
+        '''Return True if --json-codegen selects this message and it can be specialized.'''
+        if not hasattr(self, 'json_codegen'):
+            name = str(self.name)
+            self.json_codegen = bool([p for p in Globals.json_codegen if fnmatchcase(name, p)])
+            reason = self.json_codegen_supported() if self.json_codegen else None
+            if reason is not None:
+                if Globals.verbose_options:
+                    sys.stderr.write('Not generating a JSON encoder and decoder for %s: %s\n' % (name, reason))
+                self.json_codegen = False
+        return self.json_codegen
+
+    def json_encode_name(self):
+        return '%s_json_encode' % Globals.naming_style.define_name(self.name)
+
+    def json_encode_declaration(self):
+        return 'static int %s(pbjson_ostream_t *stream, const void *src_struct);' % self.json_encode_name()
+
+    def json_encode_definition(self, codegen_messages):
+        '''Return a straight-line encoder that writes the same JSON as the
+        table driven pbjson_encode_dict(). Constant text ('{', '"key":', ',' and
+        ']') is merged into as few pbjson_write() calls as possible and the
+        separator before a key is only decided at run time after a field that
+        may be absent.'''
+        body = []
+        pending = ['{']
+        state = {'sep': 'none', 'is_first': False, 'loop': False}
+
+        def c_literal(text):
+            return '"%s"' % text.replace('\\', '\\\\').replace('"', '\\"')
+
+        def flush(indent):
+            text = ''.join(pending)
+            if text:
+                body.append('%sif (pbjson_write(stream, %s, %d))\n' % (indent, c_literal(text), len(text)))
+                body.append('%s    return -1;\n' % indent)
+            del pending[:]
+
+        def call(indent, expr):
+            body.append('%sif (%s)\n' % (indent, expr))
+            body.append('%s    return -1;\n' % indent)
+
+        def value(field, expr):
+            kind = self.json_codegen_types[field.pbtype]
+            if field.is_string_view():
+                # Escaped views keep the escape sequences of their input and are written as they are.
+                return ('(%s.escaped ? (pbjson_write(stream, "\\"", 1) || pbjson_write(stream, %s.data, %s.size) || '
+                        'pbjson_write(stream, "\\"", 1)) : pbjson_write_string(stream, %s.data, %s.size))'
+                        % (expr, expr, expr, expr, expr))
+            if kind == 'string':
+                return 'pbjson_write_string(stream, %s, strlen(%s))' % (expr, expr)
+            if kind == 'bytes':
+                # Same bound as the table encoder, the capacity includes the padding.
+                return ('(%s.size > sizeof(%s) - offsetof(pb_bytes_array_t, bytes)) || '
+                        'pbjson_write_bytes(stream, %s.bytes, %s.size)' % (expr, expr, expr, expr))
+            if kind == 'enum':
+                return 'pbjson_write_enum(stream, &%s_enum, (int32_t)%s)' % (Globals.naming_style.type_name(field.ctype), expr)
+            if kind == 'message':
+                if str(field.submsgname) in codegen_messages:
+                    return '%s(stream, &%s)' % (codegen_messages[str(field.submsgname)].json_encode_name(), expr)
+                return 'pbjson_encode_message(stream, %s, &%s)' % (
+                    Globals.naming_style.define_name('%s_fields' % field.submsgname), expr)
+            return 'pbjson_write_%s(stream, %s)' % (kind, expr)
+
+        for field in sorted(self.fields, key = lambda x: x.tag):
+            var_name = Globals.naming_style.var_name(field.name)
+            key = '"%s":' % var_name
+
+            if field.is_string_view():
+                condition = 'msg->%s.data != NULL' % var_name
+            elif field.rules == 'OPTIONAL':
+                condition = 'msg->has_%s' % var_name
+            else:
+                condition = None
+
+            indent = '    '
+            if condition is not None:
+                flush(indent)
+                body.append('    if (%s)\n' % condition)
+                body.append('    {\n')
+                indent = '        '
+
+            if state['sep'] == 'some':
+                pending.append(',' + key)
+            elif state['sep'] == 'none':
+                pending.append(key)
+            else:
+                flush(indent)
+                call(indent, '!is_first && pbjson_write(stream, ",", 1)')
+                pending.append(key)
+
+            if field.rules == 'REPEATED':
+                state['loop'] = True
+                pending.append('[')
+                flush(indent)
+                body.append('%sfor (i = 0; i < msg->%s_count; i++)\n' % (indent, var_name))
+                body.append('%s{\n' % indent)
+                call(indent + '    ', 'i != 0 && pbjson_write(stream, ",", 1)')
+                call(indent + '    ', value(field, 'msg->%s[i]' % var_name))
+                body.append('%s}\n' % indent)
+                pending.append(']')
+            else:
+                flush(indent)
+                call(indent, value(field, 'msg->%s' % var_name))
+
+            if condition is not None:
+                flush(indent)
+                if state['sep'] != 'some':
+                    body.append('%sis_first = false;\n' % indent)
+                    state['is_first'] = True
+                    state['sep'] = 'unknown'
+                body.append('    }\n')
+            else:
+                state['sep'] = 'some'
+
+        pending.append('}')
+        flush('    ')
+
+        type_name = Globals.naming_style.type_name(self.name)
+        result = 'static int %s(pbjson_ostream_t *stream, const void *src_struct)\n' % self.json_encode_name()
+        result += '{\n'
+        result += '    const %s *msg = (const %s *)src_struct;\n' % (type_name, type_name)
+        if state['is_first']:
+            result += '    bool is_first = true;\n'
+        if state['loop']:
+            result += '    uint32_t i;\n'
+        result += '\n'
+        result += ''.join(body)
+        result += '\n'
+        result += '    return 0;\n'
+        result += '}\n'
+        return result
+
+    json_decode_numbers = {
+        'INT32': 'int32', 'SINT32': 'int32', 'SFIXED32': 'int32',
+        'INT64': 'int64', 'SINT64': 'int64', 'SFIXED64': 'int64',
+        'UINT32': 'uint32', 'FIXED32': 'uint32', 'UINT64': 'uint64', 'FIXED64': 'uint64',
+        'FLOAT': 'float', 'DOUBLE': 'double', 'BOOL': 'bool',
+    }
+
+    def json_decode_name(self):
+        return '%s_json_decode' % Globals.naming_style.define_name(self.name)
+
+    def json_decode_declaration(self):
+        return 'static int %s(pbjson_parser_t *parser, void *dst_struct, bool *p_has_msg);' % self.json_decode_name()
+
+    def json_decode_definition(self):
+        '''Return a straight-line decoder that reads the same JSON as the
+        table driven pbjson_decode_dict(). Keys are looked up by the library
+        and the value of each field is read by a switch case with the reader
+        of its type. Submessages go through pbjson_parse_message(), which
+        uses their generated decoder if they have one.'''
+        fields_name = Globals.naming_style.define_name('%s_fields' % self.name)
+        body = []
+        state = {'loop': False}
+
+        def call(indent, expr):
+            body.append('%sif (%s)\n' % (indent, expr))
+            body.append('%s    return -1;\n' % indent)
+
+        def value(field, expr, size, p_has):
+            kind = self.json_codegen_types[field.pbtype]
+            if field.is_string_view():
+                return 'pbjson_parse_string_view(parser, &%s)' % expr
+            if kind == 'string':
+                return 'pbjson_parse_string(parser, %s, %s)' % (expr, size)
+            if kind == 'bytes':
+                return 'pbjson_parse_bytes(parser, (pb_bytes_array_t *)(void *)&%s, %s)' % (expr, size)
+            if kind == 'enum':
+                return 'pbjson_parse_%s(parser, &%s_enum, &%s, %s)' % (
+                    'uenum' if field.pbtype == 'UENUM' else 'enum',
+                    Globals.naming_style.type_name(field.ctype), expr, size)
+            if kind == 'message':
+                return 'pbjson_parse_message(parser, %s, &%s, %s)' % (
+                    Globals.naming_style.define_name('%s_fields' % field.submsgname), expr, p_has)
+            return 'pbjson_parse_%s(parser, &%s)' % (self.json_decode_numbers[field.pbtype], expr)
+
+        # The switch cases are the indexes of the fields in FIELDLIST order.
+        for index, field in enumerate(sorted(self.fields, key = lambda x: x.tag)):
+            var_name = Globals.naming_style.var_name(field.name)
+            indent = '            '
+            body.append('        case %d:\n' % index)
+
+            if field.rules == 'REPEATED':
+                state['loop'] = True
+                count = 'msg->%s_count' % var_name
+                body.append('%s%s = 0;\n' % (indent, count))
+                body.append('%sitem = pbjson_parse_array(parser);\n' % indent)
+                body.append('\n')
+                body.append('%swhile (item == 0)\n' % indent)
+                body.append('%s{\n' % indent)
+                call(indent + '    ', '(%s >= sizeof(msg->%s) / sizeof(msg->%s[0])) ||\n%s    %s' % (
+                    count, var_name, var_name, indent + '    ',
+                    value(field, 'msg->%s[%s]' % (var_name, count), 'sizeof(msg->%s[0])' % var_name, 'NULL')))
+                body.append('\n')
+                body.append('%s    %s++;\n' % (indent, count))
+                body.append('%s    item = pbjson_parse_item(parser);\n' % indent)
+                body.append('%s}\n' % indent)
+                body.append('\n')
+                call(indent, 'item != PBJSON_PARSE_END')
+            elif self.json_codegen_types[field.pbtype] == 'message':
+                p_has = '&msg->has_%s' % var_name if field.rules == 'OPTIONAL' else 'NULL'
+                call(indent, value(field, 'msg->%s' % var_name, None, p_has))
+            else:
+                if field.rules == 'OPTIONAL':
+                    body.append('%smsg->has_%s = true;\n' % (indent, var_name))
+                call(indent, value(field, 'msg->%s' % var_name, 'sizeof(msg->%s)' % var_name, 'NULL'))
+
+            body.append('%sbreak;\n' % indent)
+
+        type_name = Globals.naming_style.type_name(self.name)
+        result = 'static int %s(pbjson_parser_t *parser, void *dst_struct, bool *p_has_msg)\n' % self.json_decode_name()
+        result += '{\n'
+        result += '    %s *msg = (%s *)dst_struct;\n' % (type_name, type_name)
+        result += '    uint32_t next;\n'
+        if state['loop']:
+            result += '    int item;\n'
+        result += '    int index = pbjson_parse_object(parser, %s, p_has_msg, &next);\n' % fields_name
+        result += '\n'
+        result += '    while (index >= 0)\n'
+        result += '    {\n'
+        result += '        switch (index)\n'
+        result += '        {\n'
+        result += ''.join(body)
+        result += '        }\n'
+        result += '\n'
+        result += '        index = pbjson_parse_member(parser, %s, &next);\n' % fields_name
+        result += '    }\n'
+        result += '\n'
+        result += '    return (index == PBJSON_PARSE_END) ? 0 : -1;\n'
+        result += '}\n'
+        return result
+
     def required_descriptor_width(self, dependencies):
         '''Estimate how many words are necessary for each field descriptor.'''
         if self.descriptorsize != nanopb_pb2.DS_AUTO:
@@ -1632,6 +2137,19 @@ class Message(ProtoElement):
 
         return size
 
+    def json_encoded_size(self, dependencies):
+        '''Return the maximum size of this message in the output of
+        pbjson_encode(). If the size cannot be determined, returns None.
+        '''
+        size = EncodedSize(2) # Braces
+        for field in self.fields:
+            fsize = field.json_encoded_size(dependencies)
+            if fsize is None:
+                return None
+            size += fsize
+
+        return size
+
     def default_value(self, dependencies):
         '''Generate serialized protobuf message that contains the
         default values for optional fields.'''
@@ -2116,9 +2634,10 @@ class ProtoFile:
                 for enum in self.enums:
                     yield enum.auxiliary_defines() + '\n'
 
-                for msg in self.messages:
-                    yield msg.enumtype_defines() + '\n'
-                yield '\n'
+        # Enum fields refer to the names of their type, which may be defined in another file.
+        enumtype_defines = ''.join(msg.enumtype_defines() for msg in self.messages)
+        if enumtype_defines:
+            yield enumtype_defines + '\n'
 
         if self.messages:
             yield '/* Initializer values for message structs */\n'
@@ -2213,6 +2732,26 @@ class ProtoFile:
                     yield '#endif\n'
             yield '\n'
 
+            yield '/* Maximum JSON encoded size of messages (where known) */\n'
+            jsonsizes = []
+            for msg in self.messages:
+                identifier = '%s_json_max_size' % msg.name
+                jsonsizes.append((identifier, msg.json_encoded_size(self.dependencies)))
+
+            local_defines += [identifier for identifier, jsize in jsonsizes if jsize is not None]
+
+            for identifier, jsize in jsonsizes:
+                if jsize is not None:
+                    cpp_guard = jsize.get_cpp_guard(local_defines)
+                    if cpp_guard:
+                        yield cpp_guard
+                    yield '#define %-40s %s\n' % (Globals.naming_style.define_name(identifier), jsize)
+                    if cpp_guard:
+                        yield '#endif\n'
+                else:
+                    yield '/* %s depends on runtime parameters */\n' % identifier
+            yield '\n'
+
             if [msg for msg in self.messages if hasattr(msg,'msgid')]:
               yield '/* Message IDs (where set with "msgid" option) */\n'
               for msg in self.messages:
@@ -2300,10 +2839,36 @@ class ProtoFile:
             yield '#error Enable PB_FIELD_32BIT to support messages exceeding 64kB in size: ' + ', '.join(exceeds_64kB) + '\n'
             yield '#endif\n'
 
+        # Straight-line encoders and decoders selected with --json-codegen
+        codegen_messages = dict((str(msg.name), msg) for msg in self.messages if msg.json_codegen_enabled())
+        if codegen_messages:
+            yield '#include <string.h>\n\n'
+            for msg in self.messages:
+                if str(msg.name) in codegen_messages:
+                    yield msg.json_encode_declaration() + '\n'
+                    yield msg.json_decode_declaration() + '\n'
+            yield '\n'
+
+        # Generate the enum name tables (PBJSON_ENUM_BIND() call)
+        for enum in self.enums:
+            yield enum.json_table_definition() + '\n'
+
+        # Generate the key pool and descriptor table of PBJSON_COMPACT_DESCRIPTORS
+        compact_fields = []
+        for msg in self.messages:
+            compact_fields += msg.json_compact_fields()
+        if compact_fields:
+            yield json_compact_tables(compact_fields) + '\n'
+
         # Generate the message field definitions (PBJSON_BIND() call)
         for msg in self.messages:
             yield msg.fields_definition(self.dependencies) + '\n\n'
 
+        for msg in self.messages:
+            if str(msg.name) in codegen_messages:
+                yield msg.json_encode_definition(codegen_messages) + '\n'
+                yield msg.json_decode_definition() + '\n'
+
         # Generate pb_extension_type_t definitions if extensions are used in proto file
         for ext in self.extensions:
             yield ext.extension_def(self.dependencies) + '\n'
@@ -2489,6 +3054,8 @@ optparser.add_option("--protoc-opt", dest="protoc_opts", action="append", defaul
     help="Pass an option to protoc when compiling .proto files")
 optparser.add_option("--protoc-insertion-points", dest="protoc_insertion_points", action="store_true", default=False,
     help="Include insertion point comments in output for use by custom protoc plugins")
+optparser.add_option("--json-codegen", dest="json_codegen", action="append", default=[], metavar="MESSAGE",
+    help="Generate a straight-line JSON encoder and decoder for matching messages (wildcards allowed, '*' for all)")
 optparser.add_option("-C", "--c-style", dest="c_style", action="store_true", default=False,
     help="Use C naming convention.")
 
@@ -2601,6 +3168,7 @@ def parse_file(filename, fdesc, options):
 
     Globals.matched_namemasks = set()
     Globals.protoc_insertion_points = options.protoc_insertion_points
+    Globals.json_codegen = options.json_codegen
 
     # Parse the file
     file_options = get_nanopb_suboptions(fdesc, toplevel_options, Names([filename]))
@@ -0,0 +1,327 @@
+/**
+ * @file pbjson_base64.h
+ * @brief Base64 codec for bytes fields, shared by the encoder and decoder.
+ *
+ * The encoder writes the standard alphabet with padding, as the proto3 JSON
+ * mapping does. The decoder also accepts the URL-safe alphabet and missing
+ * padding, one quantum at a time with pbjson_base64_digit(). Long runs in the
+ * standard alphabet go through the vector kernel of the build, AVX2 (24 bytes
+ * to 32 characters per step) or NEON (48 bytes to 64 characters). SSE2 lacks
+ * the byte shuffle the kernels are built on, so it uses the scalar code.
+ */
+
+#ifndef PBJSON_BASE64_H
+#define PBJSON_BASE64_H
+
+#include "pbjson_simd.h"
+
+/**
+ * @brief Number of characters that encode @p len bytes, with padding.
+ */
+#define PBJSON_BASE64_LENGTH(len) ((((len) + 2) / 3) * 4)
+
+/**
+ * @brief Value of a base64 digit.
+ *
+ * @param c The character, from the standard or the URL-safe alphabet.
+ * @return 0 to 63, or -1 if @p c is not a digit.
+ */
+static inline int pbjson_base64_digit(char c)
+{
+    if ((c >= 'A') && (c <= 'Z'))
+    {
+        return c - 'A';
+    }
+
+    if ((c >= 'a') && (c <= 'z'))
+    {
+        return c - 'a' + 26;
+    }
+
+    if ((c >= '0') && (c <= '9'))
+    {
+        return c - '0' + 52;
+    }
+
+    if ((c == '+') || (c == '-'))
+    {
+        return 62;
+    }
+
+    if ((c == '/') || (c == '_'))
+    {
+        return 63;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Decodes one quantum of base64 text.
+ *
+ * @param q The characters. Four of them may end in one or two '=', the last
+ *          quantum may also come as two or three characters without padding.
+ * @param n Number of characters, 1 to 4.
+ * @param out Receives up to 3 bytes.
+ * @return Number of bytes, or -1 if the characters are not a valid quantum.
+ */
+static inline int pbjson_base64_quantum(const char *q, size_t n, uint8_t *out)
+{
+    size_t digits = n;
+    uint32_t v = 0;
+
+    if ((n == 4) && (q[3] == '='))
+    {
+        digits = (q[2] == '=') ? 2 : 3;
+    }
+
+    if (digits < 2)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < 4; i++)
+    {
+        int d = (i < digits) ? pbjson_base64_digit(q[i]) : 0;
+
+        if (d < 0)
+        {
+            return -1;
+        }
+
+        v = (v << 6) | (uint32_t)d;
+    }
+
+    out[0] = (uint8_t)(v >> 16);
+    out[1] = (uint8_t)(v >> 8);
+    out[2] = (uint8_t)v;
+    return (int)digits - 1;
+}
+
+/**
+ * @brief Encodes bytes as base64 text with padding.
+ *
+ * @param src The bytes.
+ * @param len Number of bytes.
+ * @param dst Receives PBJSON_BASE64_LENGTH(len) characters.
+ * @return Number of characters written.
+ */
+static inline size_t pbjson_base64_encode(const uint8_t *src, size_t len, char *dst)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t i = 0;
+    char *out = dst;
+
+#if defined(PBJSON_SIMD_AVX2)
+    /* Each lane takes 12 bytes, the second load starts 12 bytes after the first and reads 16. */
+    const __m256i shuf = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+                                          1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m256i lut = _mm256_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+                                         65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+
+    for (; len - i >= 28; i += 24)
+    {
+        __m256i in = _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(const void *)(src + i)));
+        in = _mm256_inserti128_si256(in, _mm_loadu_si128((const __m128i *)(const void *)(src + i + 12)), 1);
+        in = _mm256_shuffle_epi8(in, shuf);
+
+        /* Move the four 6-bit groups of every 3 bytes into their own byte. */
+        __m256i t0 = _mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)),
+                                        _mm256_set1_epi32(0x04000040));
+        __m256i t1 = _mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)),
+                                        _mm256_set1_epi32(0x01000010));
+        __m256i idx = _mm256_or_si256(t0, t1);
+
+        /* Offset from the digit value to its character, selected by range. */
+        __m256i range = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+        range = _mm256_sub_epi8(range, _mm256_cmpgt_epi8(idx, _mm256_set1_epi8(25)));
+        __m256i chars = _mm256_add_epi8(idx, _mm256_shuffle_epi8(lut, range));
+
+        _mm256_storeu_si256((__m256i *)(void *)out, chars);
+        out += 32;
+    }
+#elif defined(PBJSON_SIMD_NEON)
+    uint8x16x4_t table;
+
+    for (int k = 0; k < 4; k++)
+    {
+        table.val[k] = vld1q_u8((const uint8_t *)alphabet + 16 * k);
+    }
+
+    for (; len - i >= 48; i += 48)
+    {
+        uint8x16x3_t in = vld3q_u8(src + i);
+        uint8x16x4_t chars;
+
+        chars.val[0] = vshrq_n_u8(in.val[0], 2);
+        chars.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[0], 4), vshrq_n_u8(in.val[1], 4)), vdupq_n_u8(0x3F));
+        chars.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[1], 2), vshrq_n_u8(in.val[2], 6)), vdupq_n_u8(0x3F));
+        chars.val[3] = vandq_u8(in.val[2], vdupq_n_u8(0x3F));
+
+        for (int k = 0; k < 4; k++)
+        {
+            chars.val[k] = vqtbl4q_u8(table, chars.val[k]);
+        }
+
+        vst4q_u8((uint8_t *)out, chars);
+        out += 64;
+    }
+#endif
+
+    for (; len - i >= 3; i += 3)
+    {
+        uint32_t v = ((uint32_t)src[i] << 16) | ((uint32_t)src[i + 1] << 8) | src[i + 2];
+        out[0] = alphabet[v >> 18];
+        out[1] = alphabet[(v >> 12) & 0x3F];
+        out[2] = alphabet[(v >> 6) & 0x3F];
+        out[3] = alphabet[v & 0x3F];
+        out += 4;
+    }
+
+    if (i < len)
+    {
+        uint32_t v = (uint32_t)src[i] << 16;
+
+        if (len - i == 2)
+        {
+            v |= (uint32_t)src[i + 1] << 8;
+        }
+
+        out[0] = alphabet[v >> 18];
+        out[1] = alphabet[(v >> 12) & 0x3F];
+        out[2] = (len - i == 2) ? alphabet[(v >> 6) & 0x3F] : '=';
+        out[3] = '=';
+        out += 4;
+    }
+
+    return (size_t)(out - dst);
+}
+
+#if defined(PBJSON_SIMD_AVX2)
+/** @brief Characters the vector decoder takes per step. */
+#define PBJSON_BASE64_BLOCK 32
+/** @brief Bytes the vector decoder may store per step, more than it produces. */
+#define PBJSON_BASE64_BLOCK_STORE 32
+#elif defined(PBJSON_SIMD_NEON)
+#define PBJSON_BASE64_BLOCK 64
+#define PBJSON_BASE64_BLOCK_STORE 48
+#endif
+
+#ifdef PBJSON_BASE64_BLOCK
+/**
+ * @brief Decodes whole blocks of PBJSON_BASE64_BLOCK characters.
+ *
+ * Stops before the first block that holds anything but digits of the
+ * standard alphabet, such as the closing quote, padding or an escape, and
+ * leaves the rest to the scalar decoder.
+ *
+ * @param s The text.
+ * @param len Number of characters available.
+ * @param dst Receives 3 bytes for every 4 characters.
+ * @param room Size of @p dst, the last step needs PBJSON_BASE64_BLOCK_STORE bytes.
+ * @return Number of characters decoded, a multiple of PBJSON_BASE64_BLOCK.
+ */
+static inline size_t pbjson_base64_decode_blocks(const char *s, size_t len, uint8_t *dst, size_t room)
+{
+    size_t i = 0;
+
+#if defined(PBJSON_SIMD_AVX2)
+    /* Nibble lookups from "Faster Base64 Encoding and Decoding using AVX2
+     * Instructions" (Mula, Lemire): a character is valid when the bits
+     * selected by its low and high nibbles do not overlap. */
+    const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+                                            0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                            0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                              0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_2f = _mm256_set1_epi8(0x2F);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+    for (; (len - i >= PBJSON_BASE64_BLOCK) && (room >= PBJSON_BASE64_BLOCK_STORE); i += PBJSON_BASE64_BLOCK)
+    {
+        __m256i in = _mm256_loadu_si256((const __m256i *)(const void *)(s + i));
+        __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask_2f);
+        __m256i lo = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(in, mask_2f));
+        __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+
+        if (!_mm256_testz_si256(lo, hi))
+        {
+            break;
+        }
+
+        /* '/' shares its high nibble with '+', it gets its own offset. */
+        __m256i eq_2f = _mm256_cmpeq_epi8(in, mask_2f);
+        __m256i val = _mm256_add_epi8(in, _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles)));
+
+        /* Join the 6-bit values into 24-bit groups, then drop the empty fourth byte of each. */
+        __m256i merged = _mm256_maddubs_epi16(val, _mm256_set1_epi32(0x01400140));
+        merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+        merged = _mm256_shuffle_epi8(merged, pack);
+        merged = _mm256_permutevar8x32_epi32(merged, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1));
+
+        _mm256_storeu_si256((__m256i *)(void *)dst, merged);
+        dst += 24;
+        room -= 24;
+    }
+#elif defined(PBJSON_SIMD_NEON)
+    /* Digit values by character, 0xFF for anything else, split at 64 for the table lookups. */
+    static const uint8_t values[128] = {
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 62, 0xFF, 0xFF, 0xFF, 63,
+        52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+        15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+        41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    };
+    uint8x16x4_t table_lo;
+    uint8x16x4_t table_hi;
+
+    for (int k = 0; k < 4; k++)
+    {
+        table_lo.val[k] = vld1q_u8(values + 16 * k);
+        table_hi.val[k] = vld1q_u8(values + 64 + 16 * k);
+    }
+
+    for (; (len - i >= PBJSON_BASE64_BLOCK) && (room >= PBJSON_BASE64_BLOCK_STORE); i += PBJSON_BASE64_BLOCK)
+    {
+        uint8x16x4_t in = vld4q_u8((const uint8_t *)s + i);
+        uint8x16_t invalid = vdupq_n_u8(0);
+
+        /* Out of range indexes give 0, so one of the lookups finds the value and
+         * bytes above 0x7F find none, they are caught by their own top bit. */
+        for (int k = 0; k < 4; k++)
+        {
+            uint8x16_t c = in.val[k];
+            in.val[k] = vorrq_u8(vqtbl4q_u8(table_lo, c), vqtbl4q_u8(table_hi, veorq_u8(c, vdupq_n_u8(0x40))));
+            invalid = vorrq_u8(invalid, vorrq_u8(in.val[k], c));
+        }
+
+        if (vmaxvq_u8(invalid) >= 0x80)
+        {
+            break;
+        }
+
+        uint8x16x3_t out;
+        out.val[0] = vorrq_u8(vshlq_n_u8(in.val[0], 2), vshrq_n_u8(in.val[1], 4));
+        out.val[1] = vorrq_u8(vshlq_n_u8(in.val[1], 4), vshrq_n_u8(in.val[2], 2));
+        out.val[2] = vorrq_u8(vshlq_n_u8(in.val[2], 6), in.val[3]);
+
+        vst3q_u8(dst, out);
+        dst += 48;
+        room -= 48;
+    }
+#endif
+
+    return i;
+}
+#endif
+
+#endif // PBJSON_BASE64_H
@@ -8,18 +8,58 @@
  */
 
 #include <pb/json.h>
+#include "pbjson_simd.h"
+#include "pbjson_stats.h"
+#include "pbjson_string.h"
+#include "pbjson_base64.h"
+#include "pbjson_float.h"
 #include <string.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
 
 /**
  * @brief Structure representing the JSON parser state.
  */
-typedef struct pbjson_parser_s
+struct pbjson_parser_s
 {
-    const char *s; /**< Pointer to the current position in the JSON string. */
-} pbjson_parser_t;
+    const char *s;   /**< Pointer to the current position in the JSON string. */
+    const char *end; /**< Pointer one past the last byte of the JSON string. */
+    unsigned depth;  /**< Number of objects/arrays currently open. */
+    pbjson_arena_t *arena; /**< Arena for pointer fields, NULL if there is none. */
+    const pbjson_fieldmask_t *mask; /**< Fields to decode in the current object, NULL for all. */
+    bool apply;                     /**< Decoding a patch for pbjson_decode_apply(). */
+    pbjson_ctx_t *ctx;              /**< Context holding the learned key orders, NULL if there is none. */
+    const pbjson_msgdesc_t *fields; /**< Message of the object being decoded, NULL for none. */
+};
+
+/**
+ * @brief What the grammar check of a skipped value expects next, see pbjson_skip_t.
+ */
+enum pbjson_skip_state_e
+{
+    PBJSON_SKIP_VALUE,       /**< A value. */
+    PBJSON_SKIP_FIRST_VALUE, /**< After '[', a value or ']'. */
+    PBJSON_SKIP_KEY,         /**< After ',' in an object, a key. */
+    PBJSON_SKIP_FIRST_KEY,   /**< After '{', a key or '}'. */
+    PBJSON_SKIP_COLON,       /**< After a key, ':'. */
+    PBJSON_SKIP_NEXT,        /**< After a value, ',' or the closing bracket. */
+};
+
+/**
+ * @brief Peek at the character at the current position.
+ *
+ * @param parser Pointer to the JSON parser state.
+ * @return The current character, or '\0' at the end of the input.
+ */
+static char pbjson_peek(const pbjson_parser_t *parser);
+
+/**
+ * @brief Check for a whitespace character between JSON tokens.
+ *
+ * @param c The character.
+ * @return true for whitespace.
+ */
+static bool pbjson_is_space(char c);
 
 /**
  * @brief Decode a JSON value based on its type.
@@ -60,12 +100,91 @@ static int pbjson_find_first_char(pbjson_parser_t *parser);
 static int pbjson_jumpto_first_char(pbjson_parser_t *parser, char c);
 
 /**
- * @brief Check if the braces in the JSON string are balanced.
+ * @brief Enter a nested object or array.
+ *
+ * @param parser Pointer to the JSON parser state.
+ * @return 0 on success, -1 if PBJSON_MAX_DEPTH would be exceeded.
+ */
+static int pbjson_enter_nested(pbjson_parser_t *parser);
+
+/**
+ * @brief Start the grammar check of a skipped value.
+ *
+ * @param skip The state to initialize.
+ */
+static void pbjson_skip_init(pbjson_skip_t *skip);
+
+/**
+ * @brief Check the next token of a skipped value against the JSON grammar.
+ *
+ * The value is complete once @c skip->depth is 0 and @c skip->state is PBJSON_SKIP_NEXT.
+ *
+ * @param skip The grammar state.
+ * @param nesting Number of objects/arrays open around the skipped value.
+ * @param c '{', '[', '}', ']', ':' or ',', '"' for a string or '0' for a number or literal.
+ * @return 0 if the token may come next, -1 otherwise.
+ */
+static int pbjson_skip_token(pbjson_skip_t *skip, unsigned nesting, char c);
+
+/**
+ * @brief Check the syntax of an escape sequence in a string.
+ *
+ * @param s The backslash that starts the sequence.
+ * @param end End of the input.
+ * @return Length of the sequence, 0 if the input ends inside it, -1 if it is invalid.
+ */
+static int pbjson_check_escape(const char *s, const char *end);
+
+/**
+ * @brief Skip a run of decimal digits.
+ *
+ * @param s First character of the run.
+ * @param end End of the input.
+ * @return Pointer to the first character that is not a digit.
+ */
+static const char *pbjson_skip_digits(const char *s, const char *end);
+
+/**
+ * @brief Skip a number or one of the literals true, false and null, checking its syntax.
+ *
+ * The token must be followed by whitespace, ',', '}', ']' or the end of the input.
+ *
+ * @param s First character of the token.
+ * @param end End of the input.
+ * @return Pointer past the token, NULL on error.
+ */
+static const char *pbjson_skip_scalar(const char *s, const char *end);
+
+/**
+ * @brief Skip a JSON string, including its closing quote, checking its escape sequences.
+ *
+ * @param parser Pointer to the JSON parser state, positioned on the opening quote.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_skip_string(pbjson_parser_t *parser);
+
+/**
+ * @brief Skip an object or array, checking its tokens, brackets and separators.
+ *
+ * @param parser Pointer to the JSON parser state, positioned on the opening bracket.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_skip_container(pbjson_parser_t *parser);
+
+#ifdef PBJSON_SIMD_STRUCTURAL_INDEX
+/**
+ * @brief Skip an object or array using the structural bitmaps of 64-byte blocks.
  *
- * @param s Pointer to the JSON string.
- * @return 0 if balanced, -1 if unbalanced.
+ * Strings are masked out of whole blocks at once. Only the tokens outside of
+ * them are visited: brackets, separators, opening quotes and the first byte
+ * of every number or literal, which is then checked by pbjson_skip_scalar().
+ * The checks are the same as in pbjson_skip_container().
+ *
+ * @param parser Pointer to the JSON parser state, positioned on the opening bracket.
+ * @return 0 on success, -1 on error.
  */
-static int pbjson_check_brace(const char *s);
+static int pbjson_skip_container_indexed(pbjson_parser_t *parser);
+#endif
 
 /**
  * @brief Check if a JSON object is empty.
@@ -86,15 +205,121 @@ static int pbjson_check_obj_empty(pbjson_parser_t *parser, char close_brace);
  */
 static int pbjson_decode_array(pbjson_parser_t *parser, const pbjson_iter_t *key, void *dst);
 
+/**
+ * @brief Read a string value, replacing its escape sequences.
+ *
+ * With PBJSON_VALIDATE_UTF8 the text must also be well-formed UTF-8.
+ *
+ * @param parser Pointer to the JSON parser state, at the opening quote.
+ * @param dst Receives the text without a terminator, NULL to only measure it.
+ * @param size Room in @p dst in bytes.
+ * @param p_len Receives the number of bytes stored, also on error.
+ * @return 0 on success, -1 on error or if the text is longer than @p size.
+ */
+static int pbjson_unescape_string(pbjson_parser_t *parser, char *dst, size_t size, size_t *p_len);
+
 /**
  * @brief Get a string value from the JSON string.
  *
  * @param parser Pointer to the JSON parser state.
- * @param key Pointer to the JSON key descriptor.
  * @param dst Pointer to the destination where the string will be stored.
+ * @param size Size of @p dst in bytes, including the terminator.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_get_string(pbjson_parser_t *parser, char *dst, size_t size);
+
+/**
+ * @brief Get a string value into memory allocated from the parser's arena.
+ *
+ * @param parser Pointer to the JSON parser state.
+ * @param dst Pointer to the field that receives the address of the string.
+ * @return 0 on success, -1 on error or if there is no room in the arena.
+ */
+static int pbjson_get_string_alloc(pbjson_parser_t *parser, char **dst);
+
+/**
+ * @brief Get a string value as a view into the input, without copying it.
+ *
+ * Escape sequences are left as they are, or replaced in a copy in the
+ * parser's arena if there is one.
+ *
+ * @param parser Pointer to the JSON parser state.
+ * @param dst Pointer to the destination where the view will be stored.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_get_string_view(pbjson_parser_t *parser, pbjson_string_view_t *dst);
+
+/**
+ * @brief Read a bytes value, decoding its base64 text.
+ *
+ * @param parser Pointer to the JSON parser state, at the opening quote.
+ * @param dst Receives the bytes, NULL to only measure them.
+ * @param size Room in @p dst in bytes.
+ * @param p_len Receives the number of bytes stored, also on error.
+ * @return 0 on success, -1 on error or if there are more than @p size bytes.
+ */
+static int pbjson_get_base64(pbjson_parser_t *parser, uint8_t *dst, size_t size, size_t *p_len);
+
+/**
+ * @brief Get a bytes value into a static pb_bytes_array_t.
+ *
+ * @param parser Pointer to the JSON parser state.
+ * @param dst Pointer to the destination array.
+ * @param size Size of the array as declared with PB_BYTES_ARRAY_T(), it bounds the bytes.
  * @return 0 on success, -1 on error.
  */
-static int pbjson_get_string(pbjson_parser_t *parser, const pbjson_iter_t *key, char *dst);
+static int pbjson_get_bytes(pbjson_parser_t *parser, pb_bytes_array_t *dst, size_t size);
+
+/**
+ * @brief Get a bytes value into memory allocated from the parser's arena.
+ *
+ * @param parser Pointer to the JSON parser state.
+ * @param dst Pointer to the field that receives the address of the array.
+ * @return 0 on success, -1 on error or if there is no room in the arena.
+ */
+static int pbjson_get_bytes_alloc(pbjson_parser_t *parser, pb_bytes_array_t **dst);
+
+/**
+ * @brief Count the elements of a JSON array without decoding them.
+ *
+ * @param parser Pointer to the JSON parser state, positioned after the opening bracket. It is not advanced.
+ * @param p_count Pointer to the destination where the number of elements will be stored.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_count_items(const pbjson_parser_t *parser, uint32_t *p_count);
+
+/**
+ * @brief Decode a singular pointer field into memory allocated from the parser's arena.
+ *
+ * @param parser Pointer to the JSON parser state.
+ * @param key Pointer to the JSON key descriptor.
+ * @param dst Pointer to the field that receives the address of the value.
+ * @return 0 on success, -1 on error or if there is no room in the arena.
+ */
+static int pbjson_decode_pointer(pbjson_parser_t *parser, const pbjson_iter_t *key, void **dst);
+
+/**
+ * @brief Hand the value of a callback field to its decode callback.
+ *
+ * Each element of a repeated field is passed separately. Without a
+ * callback the value is checked and dropped.
+ *
+ * @param parser Pointer to the JSON parser state.
+ * @param key Pointer to the JSON key descriptor.
+ * @param callback The callback field.
+ * @return 0 on success, -1 on error or if the callback failed.
+ */
+static int pbjson_decode_callback(pbjson_parser_t *parser, const pbjson_iter_t *key, pbjson_callback_t *callback);
+
+/**
+ * @brief Pass the next value to a decode callback.
+ *
+ * @param parser Pointer to the JSON parser state, positioned before the value.
+ * @param key Pointer to the JSON key descriptor.
+ * @param callback The callback field.
+ * @return 0 on success, -1 on error or if the callback failed.
+ */
+static int pbjson_callback_value(pbjson_parser_t *parser, const pbjson_iter_t *key, pbjson_callback_t *callback);
 
 /**
  * @brief Get a boolean value from the JSON string.
@@ -116,34 +341,139 @@ static int pbjson_get_bool(pbjson_parser_t *parser, const pbjson_iter_t *key, bo
  */
 static int pbjson_get_number(pbjson_parser_t *parser, pbjson_type_t type, void *dst);
 
+/**
+ * @brief Parse a JSON integer and check that it fits the destination type.
+ *
+ * Fractions and exponents are rejected, as is any value out of range for
+ * @p type, instead of being silently truncated.
+ *
+ * @param parser Pointer to the JSON parser state.
+ * @param type One of the integer types.
+ * @param dst Pointer to the destination where the integer will be stored.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_get_integer(pbjson_parser_t *parser, pbjson_type_t type, void *dst);
+
+/**
+ * @brief Parse a JSON number into a float or a double.
+ *
+ * Numbers with at most 19 significant digits whose value times or divided
+ * by the power of ten is exact are converted directly, the rest with
+ * pbjson_eisel_lemire() and, where it cannot decide, the exact decimal code
+ * of pbjson_float.h. Numbers too large for the type are rejected rather than
+ * read as infinity, which is only accepted as the quoted string "Infinity".
+ *
+ * @param parser Pointer to the JSON parser state.
+ * @param type PBJSON_FLOAT_TYPE or PBJSON_DOUBLE_TYPE.
+ * @param dst Pointer to the destination where the value will be stored.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_get_float(pbjson_parser_t *parser, pbjson_type_t type, void *dst);
+
+/**
+ * @brief Parse the quoted non-finite values "NaN", "Infinity" and "-Infinity".
+ *
+ * @param parser Pointer to the JSON parser state, positioned at the opening quote.
+ * @param type PBJSON_FLOAT_TYPE or PBJSON_DOUBLE_TYPE.
+ * @param dst Pointer to the destination where the value will be stored.
+ * @return 0 on success, -1 if the string is not one of these values.
+ */
+static int pbjson_get_non_finite(pbjson_parser_t *parser, pbjson_type_t type, void *dst);
+
+/**
+ * @brief Parse the quoted name of an enum value.
+ *
+ * Names with escape sequences are not recognized.
+ *
+ * @param parser Pointer to the JSON parser state, positioned at the opening quote.
+ * @param desc Names of the enum.
+ * @param p_value Receives the value.
+ * @return 0 on success, -1 if the string is not one of the names.
+ */
+static int pbjson_get_enum_name(pbjson_parser_t *parser, const pbjson_enumdesc_t *desc, int32_t *p_value);
+
+/**
+ * @brief Parse an enum value given by name or by number.
+ *
+ * @param parser Pointer to the JSON parser state.
+ * @param desc Names of the enum, NULL to accept numbers only.
+ * @param type PBJSON_INT32_TYPE or PBJSON_UINT32_TYPE, the type of @p dst.
+ * @param dst Pointer to the destination where the value will be stored.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_get_enum_value(pbjson_parser_t *parser, const pbjson_enumdesc_t *desc, pbjson_type_t type, void *dst);
+
 /**
  * @brief Get an enum value from the JSON string.
  *
  * @param parser Pointer to the JSON parser state.
- * @param key Pointer to the JSON key descriptor.
+ * @param desc Names of the enum, NULL to accept numbers only.
  * @param dst Pointer to the destination where the enum value will be stored.
+ * @param size Size of @p dst in bytes, 1, 2 or 4.
  * @return 0 on success, -1 on error.
  */
-static int pbjson_get_enum(pbjson_parser_t *parser, const pbjson_iter_t *key, void *dst);
+static int pbjson_get_enum(pbjson_parser_t *parser, const pbjson_enumdesc_t *desc, void *dst, size_t size);
 
 /**
  * @brief Get an unsigned enum value from the JSON string.
  *
  * @param parser Pointer to the JSON parser state.
- * @param key Pointer to the JSON key descriptor.
+ * @param desc Names of the enum, NULL to accept numbers only.
  * @param dst Pointer to the destination where the unsigned enum value will be stored.
+ * @param size Size of @p dst in bytes, 1, 2 or 4.
  * @return 0 on success, -1 on error.
  */
-static int pbjson_get_uenum(pbjson_parser_t *parser, const pbjson_iter_t *key, void *dst);
+static int pbjson_get_uenum(pbjson_parser_t *parser, const pbjson_enumdesc_t *desc, void *dst, size_t size);
 
 /**
  * @brief Check if the JSON key matches the expected key.
  *
  * @param parser Pointer to the JSON parser state.
- * @param key The expected key.
+ * @param fields Descriptor of the message holding @p key.
+ * @param key The field whose name is expected.
  * @return 0 if the key matches, -1 otherwise.
  */
-static int pbjson_check_key(pbjson_parser_t *parser, const char *key);
+static int pbjson_check_key(pbjson_parser_t *parser, const pbjson_msgdesc_t *fields, const pbjson_iter_t *key);
+
+/**
+ * @brief Hash a JSON key, must match json_key_hash() in nanopb_generator.py.
+ *
+ * @param key Pointer to the key characters.
+ * @param len Number of characters in the key.
+ * @param seed Per-message seed chosen by the generator.
+ * @return The seeded FNV-1a hash of the key.
+ */
+static uint32_t pbjson_key_hash(const char *key, size_t len, uint32_t seed);
+
+/**
+ * @brief Look up the field named by the JSON key at the current position.
+ *
+ * The field following the previously decoded one is tried first, which
+ * matches input produced by pbjson_encode(). Otherwise the generated perfect
+ * hash table is used, or a linear search for descriptors without one.
+ * Keys with escape sequences are looked up unescaped.
+ * The key and its closing quote are consumed.
+ *
+ * @param parser Pointer to the JSON parser state, positioned after the opening quote.
+ * @param fields Pointer to the descriptor of the nanopb message fields.
+ * @param expected Index of the field expected next.
+ * @param p_iter Set to the matching field descriptor, or NULL for an unknown key.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_find_field(pbjson_parser_t *parser, const pbjson_msgdesc_t *fields, uint32_t expected,
+                             const pbjson_iter_t **p_iter);
+
+/**
+ * @brief Replace the escape sequences of a key that pbjson_find_field() has checked.
+ *
+ * @param key Pointer to the key characters, without the quotes.
+ * @param len Number of characters in the key.
+ * @param dst Receives the unescaped key.
+ * @param size Room in @p dst in bytes.
+ * @param p_len Receives the length of the unescaped key.
+ * @return 0 on success, -1 if it does not fit or has an unpaired surrogate.
+ */
+static int pbjson_unescape_key(const char *key, size_t len, char *dst, size_t size, size_t *p_len);
 
 /**
  * @brief Discard the current JSON value.
@@ -153,19 +483,75 @@ static int pbjson_check_key(pbjson_parser_t *parser, const char *key);
  */
 static int pbjson_discard_value(pbjson_parser_t *parser);
 
+/**
+ * @brief Skip the remaining members of an object, including its closing brace.
+ *
+ * @param parser Pointer to the JSON parser state, positioned after a member value.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_skip_members(pbjson_parser_t *parser);
+
+/**
+ * @brief Check if a field mask selects a field.
+ *
+ * @param mask The field mask.
+ * @param index Index of the field in @c mask->fields->iter.
+ * @return true if the field is selected.
+ */
+static bool pbjson_fieldmask_has(const pbjson_fieldmask_t *mask, uint32_t index);
+
 /**
  * @brief Decode a JSON key-value pair.
  *
+ * Keys of fields that @c parser->mask does not select are skipped. While
+ * the value is decoded @c parser->mask is the mask of the field.
+ *
  * @param parser Pointer to the JSON parser state.
  * @param fields Pointer to the descriptor of the nanopb message fields.
+ * @param order Key order learned by the context, NULL to expect the declaration order.
  * @param dst Pointer to the destination where the decoded value will be stored.
+ * @param p_next Index of the previously decoded field + 1, 0 for the first key; updated to follow the decoded field.
+ * @param p_field Receives the decoded field, NULL if the key was skipped.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_decode_key(pbjson_parser_t *parser, const pbjson_msgdesc_t *fields, uint16_t *order, void *dst,
+                             uint32_t *p_next, const pbjson_iter_t **p_field);
+
+/**
+ * @brief Key order of a descriptor in a decode context, created on first use.
+ *
+ * @param ctx The context, may be NULL.
+ * @param fields Descriptor of the message.
+ * @return One entry per field + 1, see pbjson_ctx_slot_t, or NULL without a
+ *         context or once its slots or memory are used up.
+ */
+static uint16_t *pbjson_ctx_order(pbjson_ctx_t *ctx, const pbjson_msgdesc_t *fields);
+
+/**
+ * @brief Decode the value of a known field into its member.
+ *
+ * @param parser Pointer to the JSON parser state, positioned after the colon.
+ * @param piter The field.
+ * @param dst Pointer to the structure holding the field.
  * @return 0 on success, -1 on error.
  */
-static int pbjson_decode_key(pbjson_parser_t *parser, const pbjson_msgdesc_t *fields, void *dst);
+static int pbjson_decode_member(pbjson_parser_t *parser, const pbjson_iter_t *piter, void *dst);
+
+/**
+ * @brief Reset a field to its default value if the next value is null, for pbjson_decode_apply().
+ *
+ * @param parser Pointer to the JSON parser state, positioned before the value.
+ * @param key Pointer to the JSON key descriptor.
+ * @param dst Pointer to the structure holding the field.
+ * @return 0 if the value was null, 1 if it is not null, -1 on error.
+ */
+static int pbjson_apply_null(pbjson_parser_t *parser, const pbjson_iter_t *key, void *dst);
 
 /**
  * @brief Decode a JSON object into a nanopb message.
  *
+ * While the object is decoded @c parser->fields is @p fields.
+ *
  * @param parser Pointer to the JSON parser state.
  * @param fields Pointer to the descriptor of the nanopb message fields.
  * @param dst Pointer to the destination where the decoded message will be stored.
@@ -174,114 +560,409 @@ static int pbjson_decode_key(pbjson_parser_t *parser, const pbjson_msgdesc_t *fi
  */
 static int pbjson_decode_dict(pbjson_parser_t *parser, const pbjson_msgdesc_t *fields, void *dst, void *p_has_msg);
 
+/**
+ * @brief Decode the members of a JSON object, the part of pbjson_decode_dict() that is not instrumented.
+ *
+ * @param parser Pointer to the JSON parser state.
+ * @param fields Pointer to the descriptor of the nanopb message fields.
+ * @param dst Pointer to the destination where the decoded message will be stored.
+ * @param p_has_msg Pointer to a flag indicating if the message is present.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_decode_object(pbjson_parser_t *parser, const pbjson_msgdesc_t *fields, void *dst, void *p_has_msg);
 
-static int pbjson_find_first_char(pbjson_parser_t *parser)
-{
-    while ((*parser->s == ' ') || (*parser->s == '\n') || (*parser->s == '\t'))
-    {
-        parser->s++;
-        if (*parser->s == '\0')
-        {
-            return -1;
-        }
-    }
+/**
+ * @brief Read keys and skip the values of unknown ones until a known key, for generated decoders.
+ *
+ * @param parser Pointer to the JSON parser state.
+ * @param fields Pointer to the descriptor of the nanopb message fields.
+ * @param p_next Index of the previously read field + 1, 0 for the first key; updated to follow the read field.
+ * @param first True after the opening brace, where the first key follows without a separator.
+ * @return Index of the field, PBJSON_PARSE_END after the closing brace, -1 on error.
+ */
+static int pbjson_parse_key(pbjson_parser_t *parser, const pbjson_msgdesc_t *fields, uint32_t *p_next, bool first);
 
-    return 0;
-}
+/**
+ * @brief Skip whitespace and parse a number for generated decoders, counted and timed as in pbjson_decode_value().
+ *
+ * @param parser Pointer to the JSON parser state.
+ * @param type One of the number types.
+ * @param dst Pointer to the destination where the number will be stored.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_parse_number(pbjson_parser_t *parser, pbjson_type_t type, void *dst);
 
-static int pbjson_jumpto_first_char(pbjson_parser_t *parser, char c)
-{
-    int err = pbjson_find_first_char(parser);
-    if (err)
-    {
-        return err;
-    }
+/**
+ * @brief Decode a JSON buffer that holds one object and nothing else.
+ *
+ * @param s The JSON buffer.
+ * @param len Number of bytes in @p s.
+ * @param fields Pointer to the descriptor of the nanopb message fields.
+ * @param mask Fields to decode, NULL for all.
+ * @param apply true to decode a patch written by pbjson_encode_delta().
+ * @param dst Pointer to the destination where the decoded message will be stored.
+ * @param arena Arena for pointer fields, may be NULL.
+ * @param ctx Decode context, may be NULL.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_decode_root(const char *s, size_t len, const pbjson_msgdesc_t *fields,
+                              const pbjson_fieldmask_t *mask, bool apply, void *dst, pbjson_arena_t *arena,
+                              pbjson_ctx_t *ctx);
 
-    if (*parser->s == c)
-    {
-        parser->s++;
-        return 0;
-    }
+/**
+ * @brief Allocate a field mask that selects no field.
+ *
+ * @param fields Descriptor of the message.
+ * @param arena Arena to allocate from.
+ * @return The mask, NULL if the arena is full.
+ */
+static pbjson_fieldmask_t *pbjson_fieldmask_new(const pbjson_msgdesc_t *fields, pbjson_arena_t *arena);
 
-    return -1;
-}
+/**
+ * @brief Add one path to a field mask.
+ *
+ * @param mask Mask of the message the path starts in.
+ * @param path First character of the path.
+ * @param end One past the last character of the path.
+ * @param arena Arena for the masks of submessages.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_fieldmask_add(pbjson_fieldmask_t *mask, const char *path, const char *end, pbjson_arena_t *arena);
 
-static int pbjson_check_brace(const char *s)
+/**
+ * @brief Output buffer of the JSON to protobuf transcoder.
+ */
+typedef struct pbjson_pb_writer_s
 {
-    char buff_brace[64];
-    unsigned buff_brace_cur_i = 0;
-    bool is_string_open = false;
+    uint8_t *buf; /**< Output buffer, NULL to only count the bytes. */
+    size_t size;  /**< Size of @c buf in bytes. */
+    size_t pos;   /**< Number of bytes written. */
+    bool dedup;   /**< Set while an object with duplicate keys is transcoded again, see pbjson_transcode_members(). */
+} pbjson_pb_writer_t;
 
-    buff_brace[0] = ' ';
+/**
+ * @brief Maximum length of a varint in bytes.
+ */
+#define PBJSON_PB_VARINT_MAX 10
 
-    while (*s != '\0')
-    {
-        if (is_string_open)
-        {
-            if (*s == '"')
-            {
-                is_string_open = false;
-            }
+/**
+ * @brief Format a protobuf varint.
+ *
+ * @param buf Receives the varint, at least PBJSON_PB_VARINT_MAX bytes.
+ * @param val Value to format.
+ * @return Number of bytes written to @p buf.
+ */
+static size_t pbjson_pb_format_varint(uint8_t *buf, uint64_t val);
 
-            s++;
-            continue;
-        }
+/**
+ * @brief Write raw bytes to the protobuf output.
+ *
+ * @param w Pointer to the output buffer.
+ * @param data Bytes to write.
+ * @param len Number of bytes.
+ * @return 0 on success, -1 if the buffer is full.
+ */
+static int pbjson_pb_write(pbjson_pb_writer_t *w, const void *data, size_t len);
 
-        switch (*s)
-        {
-        case '{':
-            buff_brace_cur_i++;
-            if (buff_brace_cur_i >= sizeof(buff_brace))
-            {
-                return -1;
-            }
-            buff_brace[buff_brace_cur_i] = '{';
-            break;
+/**
+ * @brief Write a varint to the protobuf output.
+ *
+ * @param w Pointer to the output buffer.
+ * @param val Value to write.
+ * @return 0 on success, -1 if the buffer is full.
+ */
+static int pbjson_pb_write_varint(pbjson_pb_writer_t *w, uint64_t val);
 
-        case '}':
-            if (buff_brace[buff_brace_cur_i] != '{')
-            {
-                return -1;
-            }
-            else
-            {
-                buff_brace_cur_i--;
-            }
+/**
+ * @brief Write the tag of a field to the protobuf output.
+ *
+ * @param w Pointer to the output buffer.
+ * @param key The field.
+ * @param wire_type Protobuf wire type to tag the value with.
+ * @return 0 on success, -1 if the buffer is full.
+ */
+static int pbjson_pb_write_tag(pbjson_pb_writer_t *w, const pbjson_iter_t *key, unsigned wire_type);
 
-            break;
+/**
+ * @brief Start a length-delimited value, reserving one byte for its length.
+ *
+ * @param w Pointer to the output buffer.
+ * @param p_start Receives the offset of the value, to pass to pbjson_pb_end_len().
+ * @return 0 on success, -1 if the buffer is full.
+ */
+static int pbjson_pb_begin_len(pbjson_pb_writer_t *w, size_t *p_start);
 
-        case '[':
-            buff_brace_cur_i++;
-            if (buff_brace_cur_i >= sizeof(buff_brace))
-            {
-                return -1;
-            }
-            buff_brace[buff_brace_cur_i] = '[';
-            break;
+/**
+ * @brief Finish a length-delimited value, moving it if its length needs more than one byte.
+ *
+ * @param w Pointer to the output buffer.
+ * @param start Offset returned by pbjson_pb_begin_len().
+ * @return 0 on success, -1 if the buffer is full.
+ */
+static int pbjson_pb_end_len(pbjson_pb_writer_t *w, size_t start);
 
-        case ']':
-            if (buff_brace[buff_brace_cur_i] != '[')
-            {
-                return -1;
-            }
-            else
-            {
-                buff_brace_cur_i--;
-            }
-            break;
+/**
+ * @brief Transcode a JSON scalar, string or object into the protobuf encoding of a field.
+ *
+ * @param parser Pointer to the JSON parser state.
+ * @param key The field the value belongs to.
+ * @param w Pointer to the output buffer.
+ * @param packed True for an element of a packed array, which is written without a tag.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_transcode_value(pbjson_parser_t *parser, const pbjson_iter_t *key, pbjson_pb_writer_t *w,
+                                  bool packed);
 
-        case '"':
-            is_string_open = true;
-            break;
+/**
+ * @brief Transcode a JSON array into the protobuf encoding of a repeated field.
+ *
+ * Numeric fields are written packed, strings and messages as one tagged value per element.
+ *
+ * @param parser Pointer to the JSON parser state.
+ * @param key The repeated field.
+ * @param w Pointer to the output buffer.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_transcode_array(pbjson_parser_t *parser, const pbjson_iter_t *key, pbjson_pb_writer_t *w);
 
-        default:
-            break;
-        }
+/**
+ * @brief Transcode a JSON object into the fields of a protobuf message.
+ *
+ * Sets @c parser->fields to @p fields, the caller restores it.
+ *
+ * @param parser Pointer to the JSON parser state.
+ * @param fields Pointer to the descriptor of the nanopb message fields.
+ * @param w Pointer to the output buffer.
+ * @param p_has_members Set if the object is not @c {}, which pbjson_decode() treats as absent.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_transcode_object(pbjson_parser_t *parser, const pbjson_msgdesc_t *fields, pbjson_pb_writer_t *w,
+                                   bool *p_has_members);
 
-        s++;
+/**
+ * @brief Transcode the members of a JSON object, including its closing brace.
+ *
+ * A repeated field that occurs again is reset by pbjson_decode(), and an
+ * optional submessage is absent after a later @c {}. Unless @c w->dedup is
+ * set such a key stops the transcoding with 1, and the caller starts over
+ * with @c w->dedup to leave out the values that a later occurrence overrides.
+ *
+ * @param parser Pointer to the JSON parser state, at the first key.
+ * @param fields Pointer to the descriptor of the nanopb message fields.
+ * @param w Pointer to the output buffer.
+ * @param dups Bits of the fields that occur more than once, by index modulo 64, from pbjson_transcode_scan_keys().
+ * @param empty Bits of the fields whose last occurrence is @c {}.
+ * @return 0 on success, 1 for a key that needs @c w->dedup, -1 on error.
+ */
+static int pbjson_transcode_members(pbjson_parser_t *parser, const pbjson_msgdesc_t *fields, pbjson_pb_writer_t *w,
+                                    uint64_t dups, uint64_t empty);
+
+/**
+ * @brief Find the fields of an object that a later occurrence resets, for pbjson_transcode_members().
+ *
+ * @param parser Pointer to the JSON parser state, at the first key.
+ * @param fields Pointer to the descriptor of the nanopb message fields.
+ * @param p_dups Receives the bits of the fields that occur more than once.
+ * @param p_empty Receives the bits of the fields whose last occurrence is @c {}.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_transcode_scan_keys(const pbjson_parser_t *parser, const pbjson_msgdesc_t *fields,
+                                      uint64_t *p_dups, uint64_t *p_empty);
+
+/**
+ * @brief Check if a field is reset by a later occurrence in the same object.
+ *
+ * @param key The field.
+ * @return true for repeated fields and optional submessages.
+ */
+static bool pbjson_transcode_resets(const pbjson_iter_t *key);
+
+/**
+ * @brief Check if the rest of an object overrides the current value of a field, see pbjson_transcode_members().
+ *
+ * @param parser Pointer to the JSON parser state, at the value.
+ * @param fields Pointer to the descriptor of the nanopb message fields.
+ * @param key The field the value belongs to, one that pbjson_transcode_resets() accepts.
+ * @param empty Bits of the fields whose last occurrence is @c {}.
+ * @return true if the value is left out.
+ */
+static bool pbjson_transcode_is_overridden(const pbjson_parser_t *parser, const pbjson_msgdesc_t *fields,
+                                           const pbjson_iter_t *key, uint64_t empty);
+
+
+/**
+ * @brief States of the incremental decoder.
+ */
+enum pbjson_decoder_state_e
+{
+    PBJSON_DECODER_BEGIN,     /**< Expecting the top-level '{'. */
+    PBJSON_DECODER_OBJ_FIRST, /**< After '{', expecting a key or '}'. */
+    PBJSON_DECODER_OBJ_KEY,   /**< After ',', expecting a key. */
+    PBJSON_DECODER_KEY,       /**< Inside a key. */
+    PBJSON_DECODER_COLON,     /**< Expecting ':'. */
+    PBJSON_DECODER_ARR_FIRST, /**< After '[', expecting a value or ']'. */
+    PBJSON_DECODER_VALUE,     /**< Expecting a value. */
+    PBJSON_DECODER_STRING,    /**< Inside a string value. */
+    PBJSON_DECODER_BYTES,     /**< Inside the base64 text of a bytes value. */
+    PBJSON_DECODER_SCALAR,    /**< Inside a number or literal. */
+    PBJSON_DECODER_SKIP,      /**< Inside a discarded string, object or array. */
+    PBJSON_DECODER_NEXT,      /**< After a value, expecting ',' or the closing bracket. */
+    PBJSON_DECODER_DONE,      /**< The top-level object is complete. */
+    PBJSON_DECODER_ERROR,     /**< Decoding failed. */
+};
+
+/**
+ * @brief Process the input at the current position of the incremental decoder.
+ *
+ * @param dec Pointer to the decoder.
+ * @param in Parser over the current chunk, at least one byte remains.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_decoder_step(pbjson_decoder_t *dec, pbjson_parser_t *in);
+
+/**
+ * @brief Start the value at the current position of the incremental decoder.
+ *
+ * @param dec Pointer to the decoder.
+ * @param in Parser over the current chunk, positioned at the first character of the value.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_decoder_value(pbjson_decoder_t *dec, pbjson_parser_t *in);
+
+/**
+ * @brief Continue a key of the incremental decoder and look up its field once complete.
+ *
+ * @param dec Pointer to the decoder.
+ * @param in Parser over the current chunk.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_decoder_key(pbjson_decoder_t *dec, pbjson_parser_t *in);
+
+/**
+ * @brief Continue a string value of the incremental decoder, copying it into the destination.
+ *
+ * @param dec Pointer to the decoder.
+ * @param in Parser over the current chunk.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_decoder_string(pbjson_decoder_t *dec, pbjson_parser_t *in);
+
+/**
+ * @brief Continue a bytes value of the incremental decoder, decoding it into the destination.
+ *
+ * @param dec Pointer to the decoder.
+ * @param in Parser over the current chunk.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_decoder_bytes(pbjson_decoder_t *dec, pbjson_parser_t *in);
+
+/**
+ * @brief Continue a number or literal of the incremental decoder and convert it once complete.
+ *
+ * @param dec Pointer to the decoder.
+ * @param in Parser over the current chunk.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_decoder_scalar(pbjson_decoder_t *dec, pbjson_parser_t *in);
+
+/**
+ * @brief Continue a discarded string, object or array of the incremental decoder.
+ *
+ * @param dec Pointer to the decoder.
+ * @param in Parser over the current chunk.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_decoder_skip(pbjson_decoder_t *dec, pbjson_parser_t *in);
+
+/**
+ * @brief Append bytes to the token buffer of the incremental decoder.
+ *
+ * @param dec Pointer to the decoder.
+ * @param s Bytes to append.
+ * @param len Number of bytes.
+ * @return 0 on success, -1 if the buffer is full, in which case the overflow flag is set.
+ */
+static int pbjson_decoder_append(pbjson_decoder_t *dec, const char *s, size_t len);
+
+/**
+ * @brief Open an object or array in the incremental decoder.
+ *
+ * @param dec Pointer to the decoder.
+ * @param key Field holding the object or array, NULL for the top level.
+ * @param fields Descriptor of an object, NULL for an array.
+ * @param base Structure the object decodes into, or the one holding the array.
+ * @return 0 on success, -1 if the nesting is too deep.
+ */
+static int pbjson_decoder_push(pbjson_decoder_t *dec, const pbjson_iter_t *key, const pbjson_msgdesc_t *fields,
+                               char *base);
+
+/**
+ * @brief Close the innermost object or array of the incremental decoder.
+ *
+ * @param dec Pointer to the decoder.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_decoder_pop(pbjson_decoder_t *dec);
+
+/**
+ * @brief Finish a value of the incremental decoder.
+ *
+ * @param dec Pointer to the decoder.
+ */
+static void pbjson_decoder_end_value(pbjson_decoder_t *dec);
+
+/**
+ * @brief Find the message of the field the incremental decoder is at.
+ *
+ * @param dec Pointer to the decoder.
+ * @return The innermost object of the stack, the one holding the array for an array element.
+ */
+static const pbjson_msgdesc_t *pbjson_decoder_owner(const pbjson_decoder_t *dec);
+
+
+static char pbjson_peek(const pbjson_parser_t *parser)
+{
+    return (parser->s < parser->end) ? *parser->s : '\0';
+}
+
+static bool pbjson_is_space(char c)
+{
+    return (c == ' ') || (c == '\n') || (c == '\t') || (c == '\r');
+}
+
+static int pbjson_find_first_char(pbjson_parser_t *parser)
+{
+    parser->s = pbjson_simd_find(parser->s, parser->end, PBJSON_SIMD_NOT_SPACE);
+
+    return (parser->s < parser->end) ? 0 : -1;
+}
+
+static int pbjson_jumpto_first_char(pbjson_parser_t *parser, char c)
+{
+    int err = pbjson_find_first_char(parser);
+    if (err)
+    {
+        return err;
+    }
+
+    if (pbjson_peek(parser) == c)
+    {
+        parser->s++;
+        return 0;
+    }
+
+    return -1;
+}
+
+static int pbjson_enter_nested(pbjson_parser_t *parser)
+{
+    if (parser->depth >= PBJSON_MAX_DEPTH)
+    {
+        return -1;
     }
 
-    return (buff_brace_cur_i == 0) ? 0 : -1;
+    parser->depth++;
+    return 0;
 }
 
 static int pbjson_check_obj_empty(pbjson_parser_t *parser, char close_brace)
@@ -289,7 +970,7 @@ static int pbjson_check_obj_empty(pbjson_parser_t *parser, char close_brace)
     const char *s = parser->s;
     while (true)
     {
-        if (*s == '\0')
+        if ((s >= parser->end) || (*s == '\0'))
         {
             return -1;
         }
@@ -301,7 +982,7 @@ static int pbjson_check_obj_empty(pbjson_parser_t *parser, char close_brace)
             return 1;
         }
 
-        if (*s != ' ')
+        if (!pbjson_is_space(*s))
         {
             return 0;
         }
@@ -319,7 +1000,15 @@ static int pbjson_decode_array(pbjson_parser_t *parser, const pbjson_iter_t *key
         return err;
     }
 
+    err = pbjson_enter_nested(parser);
+
+    if (err)
+    {
+        return err;
+    }
+
     uint32_t count = 0;
+    uint32_t max_count = key->max_count;
     int list_empty_stt = pbjson_check_obj_empty(parser, ']');
 
     if (list_empty_stt < 0)
@@ -332,11 +1021,43 @@ static int pbjson_decode_array(pbjson_parser_t *parser, const pbjson_iter_t *key
 
         char *data = (char *)dst + key->data_offset;
 
+        if (key->atype == PBJSON_POINTER_ATYPE)
+        {
+            /* The array is allocated once, with room for exactly the elements in the input. */
+            err = pbjson_count_items(parser, &max_count);
+
+            if (err)
+            {
+                return err;
+            }
+
+            char *items = (char *)pbjson_arena_alloc(parser->arena, (size_t)max_count * key->item_size);
+
+            if (items == NULL)
+            {
+                return -1;
+            }
+
+            *(char **)(void *)data = items;
+            data = items;
+        }
+
         while (true)
         {
+            if (count >= max_count)
+            {
+                return -1;
+            }
+
             if (key->data_type == PBJSON_MESSAGE_TYPE)
             {
-                err = pbjson_decode_dict(parser, key->submsg, data, NULL);
+                /* Arrays are replaced by a patch, their elements are not merged. */
+                if (parser->apply)
+                {
+                    memset(data, 0, key->item_size);
+                }
+
+                err = pbjson_decode_dict(parser, PBJSON_ITER_SUBMSG(parser->fields, key), data, NULL);
             }
             else
             {
@@ -356,13 +1077,13 @@ static int pbjson_decode_array(pbjson_parser_t *parser, const pbjson_iter_t *key
 
             count++;
 
-            if (*parser->s == ']')
+            if (pbjson_peek(parser) == ']')
             {
                 parser->s++;
                 break;
             }
 
-            if (*parser->s != ',')
+            if (pbjson_peek(parser) != ',')
             {
                 return -1;
             }
@@ -372,457 +1093,3998 @@ static int pbjson_decode_array(pbjson_parser_t *parser, const pbjson_iter_t *key
         }
     }
 
+    if ((count == 0) && (key->atype == PBJSON_POINTER_ATYPE))
+    {
+        *(char **)(void *)((char *)dst + key->data_offset) = NULL;
+    }
+
     char *count_offset = ((char *)dst) + key->count_offset;
     *(uint32_t *)(void *)count_offset = count;
 
+    parser->depth--;
     return 0;
 }
 
-static int pbjson_get_string(pbjson_parser_t *parser, const pbjson_iter_t *key, char *dst)
+static int pbjson_unescape_string(pbjson_parser_t *parser, char *dst, size_t size, size_t *p_len)
 {
-    if (*parser->s != '"')
+    const char *s = parser->s + 1;
+    size_t len = 0;
+    int err = -1;
+
+    while (true)
     {
-        return -1;
-    }
+        const char *stop = pbjson_simd_find(s, parser->end, PBJSON_SIMD_UNESCAPE);
+        size_t count = (size_t)(stop - s);
 
-    parser->s++;
+        if (count > size - len)
+        {
+            break;
+        }
 
-    for (uint32_t i = 0; i < key->item_size; i++)
-    {
-        if (*parser->s == '"')
+        if (dst != NULL)
         {
-            parser->s++;
-            *dst = '\0';
-            return 0;
+            memcpy(dst + len, s, count);
         }
 
-        if (*parser->s == '\0')
+        len += count;
+        s = stop;
+
+        /* Control characters must be escaped. */
+        if ((s >= parser->end) || (((unsigned char)*s) < 0x20))
         {
-            *dst = '\0';
-            return -1;
+            break;
         }
 
-        *dst = *parser->s;
-        dst++;
-        parser->s++;
+        if (*s == '"')
+        {
+            parser->s = s + 1;
+            err = 0;
+            break;
+        }
+
+        char utf8[4];
+        int n;
+
+        if (*s == '\\')
+        {
+            n = pbjson_unescape(s, parser->end, utf8, &s);
+        }
+        else
+        {
+            /* Non-ASCII with PBJSON_VALIDATE_UTF8, copied once it is known to be well-formed. */
+            n = (int)pbjson_utf8_length(s, parser->end);
+            memcpy(utf8, s, (size_t)n);
+            s += n;
+        }
+
+        /* An escaped NUL would end the string early in a NUL-terminated field. */
+        if ((n <= 0) || ((size_t)n > size - len) || (utf8[0] == '\0'))
+        {
+            break;
+        }
+
+        if (dst != NULL)
+        {
+            memcpy(dst + len, utf8, (size_t)n);
+        }
+
+        len += (size_t)n;
     }
 
-    return 0;
+    *p_len = len;
+    return err;
 }
 
-static int pbjson_get_bool(pbjson_parser_t *parser, const pbjson_iter_t *key, bool *dst)
+static int pbjson_get_string(pbjson_parser_t *parser, char *dst, size_t size)
 {
-    bool val;
-    if (!strncmp("true", parser->s, 4))
-    {
-        val = true;
-        parser->s += 4;
-    }
-    else if (!strncmp("false", parser->s, 5))
-    {
-        val = false;
-        parser->s += 5;
-    }
-    else
+    if (pbjson_peek(parser) != '"')
     {
         return -1;
     }
 
-    *dst = val;
+    /* Leave room for the terminating '\0'. */
+    size_t len;
+    int err = pbjson_unescape_string(parser, dst, size - 1, &len);
 
-    return 0;
+    dst[len] = '\0';
+    return err;
 }
 
-static int pbjson_get_number(pbjson_parser_t *parser, pbjson_type_t type, void *dst)
+static int pbjson_get_string_alloc(pbjson_parser_t *parser, char **dst)
 {
+    if (pbjson_peek(parser) != '"')
+    {
+        return -1;
+    }
 
-    char *end_ptr;
+    pbjson_parser_t scan = *parser;
+    int err = pbjson_skip_string(&scan);
 
-    switch (type)
+    if (err)
     {
-    case PBJSON_FLOAT_TYPE:
-        *(float *)dst = strtof(parser->s, &end_ptr);
-        break;
-
-    case PBJSON_DOUBLE_TYPE:
-        *(double *)dst = strtod(parser->s, &end_ptr);
-        break;
-
-    case PBJSON_INT32_TYPE:
-        *(int32_t *)dst = strtol(parser->s, &end_ptr, 10);
-        break;
-
-    case PBJSON_INT64_TYPE:
-        *(int64_t *)dst = strtoll(parser->s, &end_ptr, 10);
-        break;
-
-    case PBJSON_UINT32_TYPE:
-        *(uint32_t *)dst = strtoul(parser->s, &end_ptr, 10);
-        break;
-
-    case PBJSON_UINT64_TYPE:
-        *(uint64_t *)dst = strtoull(parser->s, &end_ptr, 10);
-        break;
-    default:
-        end_ptr = (char *)parser->s;
-        break;
+        return err;
     }
 
-    if (parser->s == end_ptr)
+    /* The text without escape sequences is never longer than in the input. */
+    size_t size = (size_t)(scan.s - 2 - parser->s);
+    char *str = (char *)pbjson_arena_alloc(parser->arena, size + 1);
+
+    if (str == NULL)
     {
         return -1;
     }
 
-    parser->s = end_ptr;
-
-    return 0;
-}
-
-static int pbjson_get_enum(pbjson_parser_t *parser, const pbjson_iter_t *key, void *dst)
-{
-    int32_t number;
-    int err = pbjson_get_number(parser, PBJSON_INT32_TYPE, &number);
+    size_t len;
+    err = pbjson_unescape_string(parser, str, size, &len);
 
     if (err)
     {
         return err;
     }
 
-    switch (key->item_size)
-    {
-    case 1:
-        *(int8_t *)dst = (int8_t)number;
-        break;
-
-    case 2:
-        *(int16_t *)dst = (int16_t)number;
-        break;
-
-    case 4:
-        *(int32_t *)dst = (int32_t)number;
-        break;
-
-    default:
-        return -1;
-    }
+    str[len] = '\0';
+    *dst = str;
     return 0;
 }
 
-static int pbjson_get_uenum(pbjson_parser_t *parser, const pbjson_iter_t *key, void *dst)
+static int pbjson_get_string_view(pbjson_parser_t *parser, pbjson_string_view_t *dst)
 {
-    uint32_t number;
-    int err = pbjson_get_number(parser, PBJSON_UINT32_TYPE, &number);
-
-    if (err)
-    {
-        return err;
-    }
-
-    switch (key->item_size)
+    if (pbjson_peek(parser) != '"')
     {
-    case 1:
-        *(uint8_t *)dst = (uint8_t)number;
-        break;
-
-    case 2:
-        *(uint16_t *)dst = (uint16_t)number;
-        break;
-
-    case 4:
-        *(uint32_t *)dst = (uint32_t)number;
-        break;
-
-    default:
         return -1;
     }
-    return 0;
-}
 
-static int pbjson_decode_value(pbjson_parser_t *parser, const pbjson_iter_t *key, void *dst)
-{
-    int err;
-    err = pbjson_find_first_char(parser);
+    pbjson_parser_t scan = *parser;
+    const char *start = parser->s + 1;
+    int err = pbjson_skip_string(parser);
 
     if (err)
     {
         return err;
     }
 
-    switch (key->data_type)
-    {
-    case PBJSON_STRING_TYPE:
-        err = pbjson_get_string(parser, key, (char *)dst);
-        break;
-
-    case PBJSON_BOOL_TYPE:
-        err = pbjson_get_bool(parser, key, (bool *)dst);
-        break;
-
-    case PBJSON_FLOAT_TYPE:
-    case PBJSON_DOUBLE_TYPE:
-    case PBJSON_INT32_TYPE:
-    case PBJSON_INT64_TYPE:
-    case PBJSON_UINT32_TYPE:
-    case PBJSON_UINT64_TYPE:
-        err = pbjson_get_number(parser, key->data_type, dst);
-        break;
+    dst->data = start;
+    dst->size = (size_t)(parser->s - 1 - start);
+    dst->escaped = (memchr(start, '\\', dst->size) != NULL);
 
-    case PBJSON_ENUM_TYPE:
-        err = pbjson_get_enum(parser, key, dst);
-        break;
-    case PBJSON_UENUM_TYPE:
-        err = pbjson_get_uenum(parser, key, dst);
-        break;
+    /* With an arena the text is unescaped, one that the strings of other fields reject keeps its escapes. */
+    char *text = (dst->escaped && (parser->arena != NULL)) ? (char *)pbjson_arena_alloc(parser->arena, dst->size)
+                                                           : NULL;
+    size_t len;
 
-    default:
-        err = -1;
-        break;
+    if ((text != NULL) && (pbjson_unescape_string(&scan, text, dst->size, &len) == 0))
+    {
+        dst->data = text;
+        dst->size = len;
+        dst->escaped = false;
     }
 
-    return err;
+    return 0;
 }
 
-static int pbjson_check_key(pbjson_parser_t *parser, const char *key)
+static int pbjson_get_base64(pbjson_parser_t *parser, uint8_t *dst, size_t size, size_t *p_len)
 {
-    const char *s = parser->s;
+    const char *s = parser->s + 1;
+    size_t len = 0;
+    char quantum[4];
+    size_t count = 0;
+    int err = -1;
+#ifdef PBJSON_BASE64_BLOCK
+    const char *retry = s;
+#endif
 
     while (true)
     {
-        if (*key == '\0')
+#ifdef PBJSON_BASE64_BLOCK
+        /* After a block the kernel turned down, the scalar loop takes the next one before it tries again. */
+        if ((count == 0) && (dst != NULL) && (s >= retry))
         {
-            if (*s != '"')
-            {
-                return -1;
-            }
-            else
-            {
-                break;
-            }
+            size_t n = pbjson_base64_decode_blocks(s, (size_t)(parser->end - s), dst + len, size - len);
+            s += n;
+            len += n / 4 * 3;
+            retry = s + PBJSON_BASE64_BLOCK;
         }
+#endif
 
-        if (*key != *s)
-            return -1;
-
-        key++;
-        s++;
-    }
-
-    s++;
-    parser->s = s;
-    return 0;
-}
+        if (s >= parser->end)
+        {
+            break;
+        }
 
-static int pbjson_discard_value(pbjson_parser_t *parser)
-{
-    unsigned n_brace_open = 0;
-    bool is_string_open = false;
-    bool is_end = false;
+        char c = *s++;
 
-    while ((*parser->s != '\0') && !is_end)
-    {
-        if (is_string_open)
+        if (c == '"')
         {
-            if (*parser->s == '"')
-            {
-                is_string_open = false;
-            }
-
-            parser->s++;
-            continue;
+            err = 0;
+            break;
         }
 
-        switch (*parser->s)
+        /* Only a quantum that ends in padding is held back, nothing may follow it. */
+        if (count == 4)
         {
-        case '{':
-        case '[':
-            n_brace_open++;
             break;
+        }
 
-        case ']':
-        case '}':
-            if (n_brace_open == 0)
-            {
-                is_end = true;
-            }
-            else
+        if (c == '\\')
+        {
+            /* The standard alphabet contains '/', which JSON may escape. */
+            if ((s >= parser->end) || (*s != '/'))
             {
-                n_brace_open--;
+                break;
             }
 
-            break;
+            c = *s++;
+        }
 
-        case '"':
-            is_string_open = true;
-            break;
+        quantum[count++] = c;
 
-        case ',':
-            if (n_brace_open == 0)
+        if ((count == 4) && (c != '='))
+        {
+            uint8_t bytes[3];
+
+            if ((pbjson_base64_quantum(quantum, count, bytes) != 3) || (size - len < 3))
             {
-                is_end = true;
+                break;
             }
-            else
+
+            if (dst != NULL)
             {
-                return -1;
+                memcpy(dst + len, bytes, 3);
             }
 
-            break;
-
-        default:
-            break;
+            len += 3;
+            count = 0;
         }
-
-        parser->s++;
     }
 
-    return is_end ? 0 : -1;
-}
-
-static int pbjson_decode_key(pbjson_parser_t *parser, const pbjson_msgdesc_t *fields, void *dst)
-{
-    int err;
-    err = pbjson_jumpto_first_char(parser, '"');
-
-    if (err)
+    if ((err == 0) && (count != 0))
     {
-        return err;
-    }
+        /* The last quantum, with or without padding. */
+        uint8_t bytes[3];
+        int n = pbjson_base64_quantum(quantum, count, bytes);
 
-    const pbjson_iter_t *piter = NULL;
-    for (unsigned i = 0; i < fields->num_field; i++)
-    {
-        err =
-            pbjson_check_key(parser, fields->iter[i].name);
-        if (err == 0)
+        if ((n < 0) || ((size_t)n > size - len))
         {
-            piter = &fields->iter[i];
-            break;
+            err = -1;
         }
-    }
-
-    if (!piter)
-    {
-        while (*parser->s != '"')
+        else
         {
-            if (*parser->s == '\0')
-                return -1;
-            parser->s++;
-        }
-
-        parser->s++;
-    }
-
-    err = pbjson_jumpto_first_char(parser, ':');
+            if (dst != NULL)
+            {
+                memcpy(dst + len, bytes, (size_t)n);
+            }
 
-    if (err)
-    {
-        return err;
+            len += (size_t)n;
+        }
     }
 
-    if (!piter)
+    if (err == 0)
     {
-        return pbjson_discard_value(parser);
+        parser->s = s;
     }
 
-    if (piter->option == PBJSON_OPTION_REPEATED)
-    {
-        return pbjson_decode_array(parser, piter, dst);
-    }
+    *p_len = len;
+    return err;
+}
 
-    char *data = (char *)dst + piter->data_offset;
-    if (piter->data_type == PBJSON_MESSAGE_TYPE)
+static int pbjson_get_bytes(pbjson_parser_t *parser, pb_bytes_array_t *dst, size_t size)
+{
+    if ((pbjson_peek(parser) != '"') || (size < offsetof(pb_bytes_array_t, bytes)))
     {
-
-        return pbjson_decode_dict(parser, piter->submsg, data, (char *)dst + piter->count_offset);
+        return -1;
     }
 
-    if (piter->option == PBJSON_OPTION_OPTIONAL)
-    {
-        char *pHasMsg = (char *)dst + piter->count_offset;
-        *(bool *)pHasMsg = true;
-    }
+    /* The capacity includes any padding after the array, as in nanopb. */
+    size_t len;
+    int err = pbjson_get_base64(parser, dst->bytes, size - offsetof(pb_bytes_array_t, bytes), &len);
 
-    return pbjson_decode_value(parser, piter, data);
+    dst->size = (pbjson_size_t)len;
+    return err;
 }
 
-static int pbjson_decode_dict(pbjson_parser_t *parser, const pbjson_msgdesc_t *fields, void *dst, void *p_has_msg)
+static int pbjson_get_bytes_alloc(pbjson_parser_t *parser, pb_bytes_array_t **dst)
 {
-    int err;
+    if (pbjson_peek(parser) != '"')
+    {
+        return -1;
+    }
 
-    err = pbjson_jumpto_first_char(parser, '{');
+    pbjson_parser_t scan = *parser;
+    int err = pbjson_skip_string(&scan);
 
     if (err)
     {
         return err;
     }
 
-    int dict_empty_stt = pbjson_check_obj_empty(parser, '}');
-
-    if (dict_empty_stt < 0)
-    {
-        return dict_empty_stt;
-    }
+    /* Every 4 characters hold at most 3 bytes, a last partial quantum at most 2. */
+    size_t chars = (size_t)(scan.s - 2 - parser->s);
+    size_t size = chars / 4 * 3 + 2;
+    pb_bytes_array_t *bytes = (pb_bytes_array_t *)pbjson_arena_alloc(parser->arena,
+                                                                      offsetof(pb_bytes_array_t, bytes) + size);
 
-    if (dict_empty_stt != 0)
+    if (bytes == NULL)
     {
-        if (p_has_msg)
-        {
-            *(bool *)p_has_msg = false;
-
-            return 0;
-        }
-
         return -1;
     }
 
-    if (p_has_msg)
+    size_t len;
+    err = pbjson_get_base64(parser, bytes->bytes, size, &len);
+
+    if (err)
     {
-        *(bool *)p_has_msg = true;
+        return err;
     }
 
+    bytes->size = (pbjson_size_t)len;
+    *dst = bytes;
+    return 0;
+}
+
+static int pbjson_count_items(const pbjson_parser_t *parser, uint32_t *p_count)
+{
+    pbjson_parser_t scan = *parser;
+    uint32_t count = 0;
+
     while (true)
     {
-        err = pbjson_decode_key(parser, fields, dst);
+        int err = pbjson_discard_value(&scan);
 
         if (err)
         {
             return err;
         }
 
-        err = pbjson_find_first_char(parser);
+        err = pbjson_find_first_char(&scan);
 
         if (err)
         {
             return err;
         }
 
-        if (*parser->s == '}')
+        count++;
+
+        if (pbjson_peek(&scan) == ']')
         {
-            parser->s++;
             break;
         }
-        else if (*parser->s != ',')
+
+        if (pbjson_peek(&scan) != ',')
         {
             return -1;
         }
 
-        parser->s++;
+        scan.s++;
     }
 
+    *p_count = count;
     return 0;
 }
 
-int pbjson_decode(const char *s, const pbjson_msgdesc_t *fields, void *dst)
+static int pbjson_decode_pointer(pbjson_parser_t *parser, const pbjson_iter_t *key, void **dst)
 {
+    if ((key->data_type == PBJSON_STRING_TYPE) || (key->data_type == PBJSON_BYTES_TYPE))
+    {
+        return pbjson_decode_value(parser, key, dst);
+    }
 
-    pbjson_parser_t parser;
-    parser.s = s;
+    void *item = pbjson_arena_alloc(parser->arena, key->item_size);
+
+    if (item == NULL)
+    {
+        return -1;
+    }
 
-    int err = pbjson_check_brace(s);
+    if (key->data_type == PBJSON_MESSAGE_TYPE)
+    {
+        /* An empty object leaves the submessage unset, like for static fields. */
+        bool has_msg;
+        int err = pbjson_decode_dict(parser, PBJSON_ITER_SUBMSG(parser->fields, key), item, &has_msg);
+        *dst = has_msg ? item : NULL;
+        return err;
+    }
+
+    *dst = item;
+    return pbjson_decode_value(parser, key, item);
+}
+
+static int pbjson_callback_value(pbjson_parser_t *parser, const pbjson_iter_t *key, pbjson_callback_t *callback)
+{
+    int err = pbjson_find_first_char(parser);
 
     if (err)
     {
         return err;
     }
 
-    return pbjson_decode_dict(&parser, fields, dst, NULL);
-}
\ No newline at end of file
+    pbjson_istream_t stream;
+    stream.s = parser->s;
+
+    err = pbjson_discard_value(parser);
+
+    if (err)
+    {
+        return err;
+    }
+
+    stream.len = (size_t)(parser->s - stream.s);
+    return (callback->funcs.decode(&stream, key, &callback->arg) == 0) ? 0 : -1;
+}
+
+static int pbjson_decode_callback(pbjson_parser_t *parser, const pbjson_iter_t *key, pbjson_callback_t *callback)
+{
+    if (callback->funcs.decode == NULL)
+    {
+        PBJSON_STATS_ADD(values_skipped, 1);
+        PBJSON_STATS_START(skip_start);
+        int err = pbjson_discard_value(parser);
+        PBJSON_STATS_STOP(skip_start, PBJSON_PHASE_SKIP);
+        return err;
+    }
+
+    if (key->option != PBJSON_OPTION_REPEATED)
+    {
+        return pbjson_callback_value(parser, key, callback);
+    }
+
+    int err = pbjson_jumpto_first_char(parser, '[');
+
+    if (err)
+    {
+        return err;
+    }
+
+    err = pbjson_enter_nested(parser);
+
+    if (err)
+    {
+        return err;
+    }
+
+    int list_empty_stt = pbjson_check_obj_empty(parser, ']');
+
+    if (list_empty_stt < 0)
+    {
+        return list_empty_stt;
+    }
+
+    while (list_empty_stt == 0)
+    {
+        err = pbjson_callback_value(parser, key, callback);
+
+        if (err)
+        {
+            return err;
+        }
+
+        err = pbjson_find_first_char(parser);
+
+        if (err)
+        {
+            return err;
+        }
+
+        if (pbjson_peek(parser) == ']')
+        {
+            parser->s++;
+            break;
+        }
+
+        if (pbjson_peek(parser) != ',')
+        {
+            return -1;
+        }
+
+        parser->s++;
+    }
+
+    parser->depth--;
+    return 0;
+}
+
+static int pbjson_get_bool(pbjson_parser_t *parser, const pbjson_iter_t *key, bool *dst)
+{
+    bool val;
+    size_t remain = (size_t)(parser->end - parser->s);
+
+    if ((remain >= 4) && !memcmp("true", parser->s, 4))
+    {
+        val = true;
+        parser->s += 4;
+    }
+    else if ((remain >= 5) && !memcmp("false", parser->s, 5))
+    {
+        val = false;
+        parser->s += 5;
+    }
+    else
+    {
+        return -1;
+    }
+
+    *dst = val;
+
+    return 0;
+}
+
+static int pbjson_get_number(pbjson_parser_t *parser, pbjson_type_t type, void *dst)
+{
+    bool is_float = (type == PBJSON_FLOAT_TYPE) || (type == PBJSON_DOUBLE_TYPE);
+
+    if (pbjson_peek(parser) != '"')
+    {
+        return is_float ? pbjson_get_float(parser, type, dst) : pbjson_get_integer(parser, type, dst);
+    }
+
+    /* The proto3 JSON mapping also allows numbers in quotes. */
+    if (is_float && (pbjson_get_non_finite(parser, type, dst) == 0))
+    {
+        return 0;
+    }
+
+    parser->s++;
+
+    int err = is_float ? pbjson_get_float(parser, type, dst) : pbjson_get_integer(parser, type, dst);
+    if (err)
+    {
+        return err;
+    }
+
+    if (pbjson_peek(parser) != '"')
+    {
+        return -1;
+    }
+
+    parser->s++;
+    return 0;
+}
+
+static int pbjson_get_integer(pbjson_parser_t *parser, pbjson_type_t type, void *dst)
+{
+    const char *s = parser->s;
+    bool negative = false;
+
+    if ((s < parser->end) && (*s == '-'))
+    {
+        negative = true;
+        s++;
+    }
+
+    if ((s >= parser->end) || (*s < '0') || (*s > '9'))
+    {
+        return -1;
+    }
+
+    /* JSON does not allow leading zeros. */
+    if ((*s == '0') && (s + 1 < parser->end) && (s[1] >= '0') && (s[1] <= '9'))
+    {
+        return -1;
+    }
+
+    uint64_t val = 0;
+
+    while ((s < parser->end) && (*s >= '0') && (*s <= '9'))
+    {
+        unsigned digit = (unsigned)(*s - '0');
+
+        if (val > (UINT64_MAX - digit) / 10)
+        {
+            return -1;
+        }
+
+        val = val * 10 + digit;
+        s++;
+    }
+
+    if ((s < parser->end) && ((*s == '.') || (*s == 'e') || (*s == 'E')))
+    {
+        return -1;
+    }
+
+    switch (type)
+    {
+    case PBJSON_INT32_TYPE:
+        if (val > (negative ? (uint64_t)INT32_MAX + 1 : (uint64_t)INT32_MAX))
+        {
+            return -1;
+        }
+
+        *(int32_t *)dst = negative ? (int32_t)(-(int64_t)val) : (int32_t)val;
+        break;
+
+    case PBJSON_INT64_TYPE:
+        if (val > (negative ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX))
+        {
+            return -1;
+        }
+
+        *(int64_t *)dst = negative ? ((val == (uint64_t)INT64_MAX + 1) ? INT64_MIN : -(int64_t)val) : (int64_t)val;
+        break;
+
+    case PBJSON_UINT32_TYPE:
+        if ((negative && val) || (val > UINT32_MAX))
+        {
+            return -1;
+        }
+
+        *(uint32_t *)dst = (uint32_t)val;
+        break;
+
+    case PBJSON_UINT64_TYPE:
+        if (negative && val)
+        {
+            return -1;
+        }
+
+        *(uint64_t *)dst = val;
+        break;
+
+    default:
+        return -1;
+    }
+
+    parser->s = s;
+    return 0;
+}
+
+static int pbjson_get_float(pbjson_parser_t *parser, pbjson_type_t type, void *dst)
+{
+    static const double pow10_double[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                          1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    static const float pow10_float[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+
+    const char *start = parser->s;
+    const char *s = start;
+    bool negative = false;
+
+    if ((s < parser->end) && (*s == '-'))
+    {
+        negative = true;
+        s++;
+    }
+
+    if ((s >= parser->end) || (*s < '0') || (*s > '9'))
+    {
+        return -1;
+    }
+
+    if ((*s == '0') && (s + 1 < parser->end) && (s[1] >= '0') && (s[1] <= '9'))
+    {
+        return -1;
+    }
+
+    /* Collect up to 19 significant digits, the value is mantissa * 10^exponent. */
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool is_truncated = false;
+
+    while ((s < parser->end) && (*s >= '0') && (*s <= '9'))
+    {
+        if (digits < 19)
+        {
+            mantissa = mantissa * 10 + (uint64_t)(*s - '0');
+            digits += (mantissa != 0);
+        }
+        else
+        {
+            exponent++;
+            is_truncated = true;
+        }
+
+        s++;
+    }
+
+    if ((s < parser->end) && (*s == '.'))
+    {
+        s++;
+
+        if ((s >= parser->end) || (*s < '0') || (*s > '9'))
+        {
+            return -1;
+        }
+
+        while ((s < parser->end) && (*s >= '0') && (*s <= '9'))
+        {
+            if (digits < 19)
+            {
+                mantissa = mantissa * 10 + (uint64_t)(*s - '0');
+                digits += (mantissa != 0);
+                exponent--;
+            }
+            else
+            {
+                is_truncated = true;
+            }
+
+            s++;
+        }
+    }
+
+    if ((s < parser->end) && ((*s == 'e') || (*s == 'E')))
+    {
+        s++;
+
+        bool exp_negative = false;
+        if ((s < parser->end) && ((*s == '-') || (*s == '+')))
+        {
+            exp_negative = (*s == '-');
+            s++;
+        }
+
+        if ((s >= parser->end) || (*s < '0') || (*s > '9'))
+        {
+            return -1;
+        }
+
+        int exp_val = 0;
+        while ((s < parser->end) && (*s >= '0') && (*s <= '9'))
+        {
+            /* Saturate, anything this large is zero or infinity anyway. */
+            if (exp_val < 100000)
+            {
+                exp_val = exp_val * 10 + (*s - '0');
+            }
+
+            s++;
+        }
+
+        exponent += exp_negative ? -exp_val : exp_val;
+    }
+
+    if (mantissa == 0)
+    {
+        if (type == PBJSON_FLOAT_TYPE)
+        {
+            *(float *)dst = negative ? -0.0f : 0.0f;
+        }
+        else
+        {
+            *(double *)dst = negative ? -0.0 : 0.0;
+        }
+
+        parser->s = s;
+        return 0;
+    }
+
+    /* Both the mantissa and the power of ten are exact in the target type,
+     * so a single multiplication or division gives the correctly rounded result. */
+    if (!is_truncated && (type == PBJSON_FLOAT_TYPE) && (mantissa <= ((uint64_t)1 << 24)) && (exponent >= -10) &&
+        (exponent <= 10))
+    {
+        float val = (float)mantissa;
+        val = (exponent < 0) ? val / pow10_float[-exponent] : val * pow10_float[exponent];
+        *(float *)dst = negative ? -val : val;
+        parser->s = s;
+        return 0;
+    }
+
+    if (!is_truncated && (type == PBJSON_DOUBLE_TYPE) && (mantissa <= ((uint64_t)1 << 53)) && (exponent >= -22) &&
+        (exponent <= 22))
+    {
+        double val = (double)mantissa;
+        val = (exponent < 0) ? val / pow10_double[-exponent] : val * pow10_double[exponent];
+        *(double *)dst = negative ? -val : val;
+        parser->s = s;
+        return 0;
+    }
+
+    /* With dropped digits the value lies between mantissa and mantissa + 1,
+     * both must round the same for the short form to be trusted. */
+    const pbjson_float_info_t *info = (type == PBJSON_FLOAT_TYPE) ? &pbjson_float32_info : &pbjson_float64_info;
+    uint64_t bits = 0;
+    uint64_t bits_up = 0;
+
+    if (!pbjson_eisel_lemire(mantissa, exponent, info, &bits) ||
+        (is_truncated && (!pbjson_eisel_lemire(mantissa + 1, exponent, info, &bits_up) || (bits_up != bits))))
+    {
+        if (pbjson_decimal_to_bits(start + negative, s, info, &bits))
+        {
+            return -1;
+        }
+    }
+
+    if (type == PBJSON_FLOAT_TYPE)
+    {
+        uint32_t bits32 = (uint32_t)bits;
+        float val;
+
+        memcpy(&val, &bits32, sizeof(val));
+        *(float *)dst = negative ? -val : val;
+    }
+    else
+    {
+        double val;
+
+        memcpy(&val, &bits, sizeof(val));
+        *(double *)dst = negative ? -val : val;
+    }
+
+    parser->s = s;
+    return 0;
+}
+
+static int pbjson_get_non_finite(pbjson_parser_t *parser, pbjson_type_t type, void *dst)
+{
+    size_t remaining = (size_t)(parser->end - parser->s);
+    int sign;
+    size_t len;
+
+    if ((remaining >= 5) && (memcmp(parser->s, "\"NaN\"", 5) == 0))
+    {
+        sign = 0;
+        len = 5;
+    }
+    else if ((remaining >= 10) && (memcmp(parser->s, "\"Infinity\"", 10) == 0))
+    {
+        sign = 1;
+        len = 10;
+    }
+    else if ((remaining >= 11) && (memcmp(parser->s, "\"-Infinity\"", 11) == 0))
+    {
+        sign = -1;
+        len = 11;
+    }
+    else
+    {
+        return -1;
+    }
+
+    if (type == PBJSON_FLOAT_TYPE)
+    {
+        *(float *)dst = (sign == 0) ? NAN : sign * INFINITY;
+    }
+    else
+    {
+        *(double *)dst = (sign == 0) ? (double)NAN : sign * (double)INFINITY;
+    }
+
+    parser->s += len;
+    return 0;
+}
+
+static int pbjson_get_enum_name(pbjson_parser_t *parser, const pbjson_enumdesc_t *desc, int32_t *p_value)
+{
+    const char *name = parser->s + 1;
+    const char *end = pbjson_simd_find(name, parser->end, PBJSON_SIMD_STRING_END);
+
+    if ((end >= parser->end) || (*end != '"'))
+    {
+        return -1;
+    }
+
+    size_t len = (size_t)(end - name);
+    const pbjson_enum_value_t *entry = NULL;
+
+    if (desc->key_table)
+    {
+        uint16_t slot = desc->key_table[pbjson_key_hash(name, len, desc->key_seed) & desc->key_table_mask];
+
+        if (slot != 0)
+        {
+            entry = &desc->values[slot - 1];
+        }
+    }
+    else
+    {
+        for (uint32_t i = 0; i < desc->num_values; i++)
+        {
+            if ((desc->values[i].name_len == len) && !memcmp(desc->values[i].json_name + 1, name, len))
+            {
+                entry = &desc->values[i];
+                break;
+            }
+        }
+    }
+
+    /* A hash slot may hold another name. */
+    if ((entry == NULL) || (entry->name_len != len) || memcmp(entry->json_name + 1, name, len))
+    {
+        return -1;
+    }
+
+    *p_value = entry->value;
+    parser->s = end + 1;
+    return 0;
+}
+
+static int pbjson_get_enum_value(pbjson_parser_t *parser, const pbjson_enumdesc_t *desc, pbjson_type_t type, void *dst)
+{
+    int32_t value;
+
+    /* Anything else in quotes may still be a quoted number. */
+    if ((desc != NULL) && (pbjson_peek(parser) == '"') && (pbjson_get_enum_name(parser, desc, &value) == 0))
+    {
+        if (type == PBJSON_UINT32_TYPE)
+        {
+            if (value < 0)
+            {
+                return -1;
+            }
+
+            *(uint32_t *)dst = (uint32_t)value;
+        }
+        else
+        {
+            *(int32_t *)dst = value;
+        }
+
+        return 0;
+    }
+
+    return pbjson_get_number(parser, type, dst);
+}
+
+static int pbjson_get_enum(pbjson_parser_t *parser, const pbjson_enumdesc_t *desc, void *dst, size_t size)
+{
+    int32_t number;
+    int err = pbjson_get_enum_value(parser, desc, PBJSON_INT32_TYPE, &number);
+
+    if (err)
+    {
+        return err;
+    }
+
+    switch (size)
+    {
+    case 1:
+        if ((number < INT8_MIN) || (number > INT8_MAX))
+        {
+            return -1;
+        }
+
+        *(int8_t *)dst = (int8_t)number;
+        break;
+
+    case 2:
+        if ((number < INT16_MIN) || (number > INT16_MAX))
+        {
+            return -1;
+        }
+
+        *(int16_t *)dst = (int16_t)number;
+        break;
+
+    case 4:
+        *(int32_t *)dst = (int32_t)number;
+        break;
+
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+static int pbjson_get_uenum(pbjson_parser_t *parser, const pbjson_enumdesc_t *desc, void *dst, size_t size)
+{
+    uint32_t number;
+    int err = pbjson_get_enum_value(parser, desc, PBJSON_UINT32_TYPE, &number);
+
+    if (err)
+    {
+        return err;
+    }
+
+    switch (size)
+    {
+    case 1:
+        if (number > UINT8_MAX)
+        {
+            return -1;
+        }
+
+        *(uint8_t *)dst = (uint8_t)number;
+        break;
+
+    case 2:
+        if (number > UINT16_MAX)
+        {
+            return -1;
+        }
+
+        *(uint16_t *)dst = (uint16_t)number;
+        break;
+
+    case 4:
+        *(uint32_t *)dst = (uint32_t)number;
+        break;
+
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+static int pbjson_decode_value(pbjson_parser_t *parser, const pbjson_iter_t *key, void *dst)
+{
+    int err;
+    err = pbjson_find_first_char(parser);
+
+    if (err)
+    {
+        return err;
+    }
+
+    switch (key->data_type)
+    {
+    case PBJSON_STRING_TYPE:
+        if (key->atype == PBJSON_VIEW_ATYPE)
+        {
+            err = pbjson_get_string_view(parser, (pbjson_string_view_t *)dst);
+        }
+        else if (key->atype == PBJSON_POINTER_ATYPE)
+        {
+            err = pbjson_get_string_alloc(parser, (char **)dst);
+        }
+        else
+        {
+            err = pbjson_get_string(parser, (char *)dst, key->item_size);
+        }
+        break;
+
+    case PBJSON_BYTES_TYPE:
+        if (key->atype == PBJSON_POINTER_ATYPE)
+        {
+            err = pbjson_get_bytes_alloc(parser, (pb_bytes_array_t **)dst);
+        }
+        else
+        {
+            err = pbjson_get_bytes(parser, (pb_bytes_array_t *)dst, key->item_size);
+        }
+        break;
+
+    case PBJSON_BOOL_TYPE:
+        err = pbjson_get_bool(parser, key, (bool *)dst);
+        break;
+
+    case PBJSON_FLOAT_TYPE:
+    case PBJSON_DOUBLE_TYPE:
+    case PBJSON_INT32_TYPE:
+    case PBJSON_INT64_TYPE:
+    case PBJSON_UINT32_TYPE:
+    case PBJSON_UINT64_TYPE:
+    {
+        PBJSON_STATS_ADD(numbers, 1);
+        PBJSON_STATS_START(number_start);
+        err = pbjson_get_number(parser, key->data_type, dst);
+        PBJSON_STATS_STOP(number_start, PBJSON_PHASE_NUMBER);
+        break;
+    }
+
+    case PBJSON_ENUM_TYPE:
+        err = pbjson_get_enum(parser, PBJSON_ITER_ENUMDESC(parser->fields, key), dst, key->item_size);
+        break;
+    case PBJSON_UENUM_TYPE:
+        err = pbjson_get_uenum(parser, PBJSON_ITER_ENUMDESC(parser->fields, key), dst, key->item_size);
+        break;
+
+    default:
+        err = -1;
+        break;
+    }
+
+    return err;
+}
+
+static int pbjson_check_key(pbjson_parser_t *parser, const pbjson_msgdesc_t *fields, const pbjson_iter_t *key)
+{
+    /* The JSON key from its third byte is the name followed by the closing quote. */
+    size_t len = (size_t)key->name_len + 1;
+
+    PBJSON_STATS_ADD(key_compares, 1);
+
+    if (((size_t)(parser->end - parser->s) < len) || (memcmp(parser->s, PBJSON_ITER_KEY(fields, key) + 2, len) != 0))
+    {
+        return -1;
+    }
+
+    parser->s += len;
+    return 0;
+}
+
+static void pbjson_skip_init(pbjson_skip_t *skip)
+{
+    skip->depth = 0;
+    skip->state = PBJSON_SKIP_VALUE;
+}
+
+static int pbjson_skip_token(pbjson_skip_t *skip, unsigned nesting, char c)
+{
+    unsigned depth = skip->depth;
+    bool in_object = (depth != 0) && (((skip->stack[(depth - 1) / 8] >> ((depth - 1) % 8)) & 1u) != 0);
+    uint8_t state = skip->state;
+
+    switch (c)
+    {
+    case '{':
+    case '[':
+        if (((state != PBJSON_SKIP_VALUE) && (state != PBJSON_SKIP_FIRST_VALUE)) ||
+            (nesting + depth >= PBJSON_MAX_DEPTH))
+        {
+            return -1;
+        }
+
+        if (c == '{')
+        {
+            skip->stack[depth / 8] |= (uint8_t)(1u << (depth % 8));
+            skip->state = PBJSON_SKIP_FIRST_KEY;
+        }
+        else
+        {
+            skip->stack[depth / 8] &= (uint8_t)~(1u << (depth % 8));
+            skip->state = PBJSON_SKIP_FIRST_VALUE;
+        }
+
+        skip->depth++;
+        return 0;
+
+    case '}':
+    case ']':
+        if ((depth == 0) || (in_object != (c == '}')) ||
+            ((state != PBJSON_SKIP_NEXT) && (state != (in_object ? PBJSON_SKIP_FIRST_KEY : PBJSON_SKIP_FIRST_VALUE))))
+        {
+            return -1;
+        }
+
+        skip->depth--;
+        skip->state = PBJSON_SKIP_NEXT;
+        return 0;
+
+    case ':':
+        if (state != PBJSON_SKIP_COLON)
+        {
+            return -1;
+        }
+
+        skip->state = PBJSON_SKIP_VALUE;
+        return 0;
+
+    case ',':
+        if ((state != PBJSON_SKIP_NEXT) || (depth == 0))
+        {
+            return -1;
+        }
+
+        skip->state = in_object ? PBJSON_SKIP_KEY : PBJSON_SKIP_VALUE;
+        return 0;
+
+    default:
+        break;
+    }
+
+    if ((c == '"') && ((state == PBJSON_SKIP_KEY) || (state == PBJSON_SKIP_FIRST_KEY)))
+    {
+        skip->state = PBJSON_SKIP_COLON;
+        return 0;
+    }
+
+    if ((state != PBJSON_SKIP_VALUE) && (state != PBJSON_SKIP_FIRST_VALUE))
+    {
+        return -1;
+    }
+
+    skip->state = PBJSON_SKIP_NEXT;
+    return 0;
+}
+
+static int pbjson_check_escape(const char *s, const char *end)
+{
+    if (end - s < 2)
+    {
+        return 0;
+    }
+
+    switch (s[1])
+    {
+    case '"':
+    case '\\':
+    case '/':
+    case 'b':
+    case 'f':
+    case 'n':
+    case 'r':
+    case 't':
+        return 2;
+
+    case 'u':
+    {
+        /* Surrogates are paired up by pbjson_unescape() when a value is decoded. */
+        int32_t cp = pbjson_hex4(s + 2, end);
+        return (cp >= 0) ? 6 : ((cp == -2) ? 0 : -1);
+    }
+
+    default:
+        return -1;
+    }
+}
+
+static const char *pbjson_skip_digits(const char *s, const char *end)
+{
+    while ((s < end) && (*s >= '0') && (*s <= '9'))
+    {
+        s++;
+    }
+
+    return s;
+}
+
+static const char *pbjson_skip_scalar(const char *s, const char *end)
+{
+    size_t remain = (size_t)(end - s);
+
+    if ((remain >= 4) && (!memcmp(s, "true", 4) || !memcmp(s, "null", 4)))
+    {
+        s += 4;
+    }
+    else if ((remain >= 5) && !memcmp(s, "false", 5))
+    {
+        s += 5;
+    }
+    else
+    {
+        /* -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)? */
+        if ((s < end) && (*s == '-'))
+        {
+            s++;
+        }
+
+        const char *digits = s;
+
+        s = ((s < end) && (*s == '0')) ? s + 1 : pbjson_skip_digits(s, end);
+
+        if (s == digits)
+        {
+            return NULL;
+        }
+
+        if ((s < end) && (*s == '.'))
+        {
+            digits = ++s;
+            s = pbjson_skip_digits(s, end);
+
+            if (s == digits)
+            {
+                return NULL;
+            }
+        }
+
+        if ((s < end) && ((*s == 'e') || (*s == 'E')))
+        {
+            s++;
+
+            if ((s < end) && ((*s == '+') || (*s == '-')))
+            {
+                s++;
+            }
+
+            digits = s;
+            s = pbjson_skip_digits(s, end);
+
+            if (s == digits)
+            {
+                return NULL;
+            }
+        }
+    }
+
+    if ((s < end) && (*s != ',') && (*s != '}') && (*s != ']') && !pbjson_is_space(*s))
+    {
+        return NULL;
+    }
+
+    return s;
+}
+
+static int pbjson_skip_string(pbjson_parser_t *parser)
+{
+    const char *s = parser->s + 1;
+
+    while (true)
+    {
+        s = pbjson_simd_find(s, parser->end, PBJSON_SIMD_STRING_END);
+
+        if ((s >= parser->end) || (((unsigned char)*s) < 0x20))
+        {
+            return -1;
+        }
+
+        if (*s == '"')
+        {
+            break;
+        }
+
+        int len = pbjson_check_escape(s, parser->end);
+
+        if (len <= 0)
+        {
+            return -1;
+        }
+
+        s += len;
+    }
+
+    parser->s = s + 1;
+    return 0;
+}
+
+static int pbjson_skip_container(pbjson_parser_t *parser)
+{
+    pbjson_skip_t skip;
+
+    pbjson_skip_init(&skip);
+
+    do
+    {
+        int err = pbjson_find_first_char(parser);
+
+        if (err)
+        {
+            return err;
+        }
+
+        char c = *parser->s;
+
+        switch (c)
+        {
+        case '"':
+            err = pbjson_skip_string(parser);
+            break;
+
+        case '{':
+        case '[':
+        case '}':
+        case ']':
+        case ':':
+        case ',':
+            parser->s++;
+            break;
+
+        default:
+        {
+            const char *next = pbjson_skip_scalar(parser->s, parser->end);
+
+            c = '0';
+            err = next ? 0 : -1;
+            parser->s = next ? next : parser->s;
+            break;
+        }
+        }
+
+        if (err || pbjson_skip_token(&skip, parser->depth, c))
+        {
+            return -1;
+        }
+    } while (skip.depth != 0);
+
+    return 0;
+}
+
+#ifdef PBJSON_SIMD_STRUCTURAL_INDEX
+static int pbjson_skip_container_indexed(pbjson_parser_t *parser)
+{
+    pbjson_skip_t skip;
+    char tail[PBJSON_SIMD_BLOCK_SIZE];
+    uint64_t in_string = 0; /* All ones while a string continues into the next block. */
+    uint64_t escaped = 0;   /* Bit 0 set if the first byte of the next block is escaped. */
+    uint64_t in_scalar = 0; /* Bit 0 set if a number or literal continues into the next block. */
+
+    pbjson_skip_init(&skip);
+
+    for (const char *block_start = parser->s; block_start < parser->end; block_start += PBJSON_SIMD_BLOCK_SIZE)
+    {
+        const char *block = block_start;
+        pbjson_simd_block_t b;
+
+        if (parser->end - block_start < PBJSON_SIMD_BLOCK_SIZE)
+        {
+            /* Pad the last block with spaces, which change nothing. */
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, block_start, (size_t)(parser->end - block_start));
+            block = tail;
+        }
+
+        pbjson_simd_classify(block, &b);
+
+        /* A backslash escapes the next byte unless it is escaped itself. Backslashes
+         * are rare, so they are resolved and checked one by one. */
+        uint64_t escapes = escaped;
+        uint64_t backslash = b.backslash & ~escaped;
+        uint64_t invalid = 0;
+        escaped = 0;
+
+        while (backslash != 0)
+        {
+            unsigned i = pbjson_simd_ctz64(backslash);
+
+            if (pbjson_check_escape(block_start + i, parser->end) <= 0)
+            {
+                invalid |= 1ull << i;
+            }
+
+            if (i == 63)
+            {
+                escaped = 1;
+                break;
+            }
+
+            escapes |= 2ull << i;
+            backslash &= ~(3ull << i);
+        }
+
+        uint64_t strings = pbjson_simd_prefix_xor(b.quote & ~escapes) ^ in_string;
+        in_string = (uint64_t)0 - (strings >> 63);
+
+        /* Everything else outside of strings belongs to a number or literal, only its first byte is visited. */
+        uint64_t scalar = ~(strings | b.quote | b.open | b.close | b.sep | b.space);
+        uint64_t starts = scalar & ~((scalar << 1) | in_scalar);
+        in_scalar = scalar >> 63;
+
+        /* Control characters are errors inside strings, backslashes and bad escapes anywhere. */
+        uint64_t errors = (b.ctrl & strings) | (b.backslash & ~strings) | invalid;
+        uint64_t events = (b.quote & ~escapes & strings) | ((b.open | b.close | b.sep) & ~strings) | starts | errors;
+
+        while (events != 0)
+        {
+            unsigned i = pbjson_simd_ctz64(events);
+            uint64_t bit = 1ull << i;
+            char c = block[i];
+
+            events &= events - 1;
+
+            if (errors & bit)
+            {
+                return -1;
+            }
+
+            if (starts & bit)
+            {
+                if (pbjson_skip_scalar(block_start + i, parser->end) == NULL)
+                {
+                    return -1;
+                }
+
+                c = '0';
+            }
+
+            if (pbjson_skip_token(&skip, parser->depth, c))
+            {
+                return -1;
+            }
+
+            if (skip.depth == 0)
+            {
+                parser->s = block_start + i + 1;
+                return 0;
+            }
+        }
+    }
+
+    /* The input ended inside the container. */
+    return -1;
+}
+#endif
+
+static int pbjson_discard_value(pbjson_parser_t *parser)
+{
+    int err = pbjson_find_first_char(parser);
+
+    if (err)
+    {
+        return err;
+    }
+
+    switch (pbjson_peek(parser))
+    {
+    case '"':
+        return pbjson_skip_string(parser);
+
+    case '{':
+    case '[':
+#ifdef PBJSON_SIMD_STRUCTURAL_INDEX
+        /* Building the bitmaps only pays off for containers that span several blocks. */
+        if (parser->end - parser->s >= 2 * PBJSON_SIMD_BLOCK_SIZE)
+        {
+            return pbjson_skip_container_indexed(parser);
+        }
+#endif
+        return pbjson_skip_container(parser);
+
+    default:
+        break;
+    }
+
+    const char *next = pbjson_skip_scalar(parser->s, parser->end);
+
+    if (next == NULL)
+    {
+        return -1;
+    }
+
+    parser->s = next;
+    return 0;
+}
+
+static uint32_t pbjson_key_hash(const char *key, size_t len, uint32_t seed)
+{
+    uint32_t h = 2166136261u ^ seed;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (uint8_t)key[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+static int pbjson_find_field(pbjson_parser_t *parser, const pbjson_msgdesc_t *fields, uint32_t expected,
+                             const pbjson_iter_t **p_iter)
+{
+    if ((expected < fields->num_field) && (pbjson_check_key(parser, fields, &fields->iter[expected]) == 0))
+    {
+        *p_iter = &fields->iter[expected];
+        return 0;
+    }
+
+    const char *key = parser->s;
+    bool escaped = false;
+
+    while (true)
+    {
+        parser->s = pbjson_simd_find(parser->s, parser->end, PBJSON_SIMD_STRING_END);
+
+        if (pbjson_peek(parser) == '"')
+            break;
+
+        if (((unsigned char)pbjson_peek(parser)) < 0x20)
+            return -1;
+
+        int esc = pbjson_check_escape(parser->s, parser->end);
+
+        if (esc <= 0)
+            return -1;
+
+        parser->s += esc;
+        escaped = true;
+    }
+
+    size_t len = (size_t)(parser->s - key);
+    parser->s++;
+
+    *p_iter = NULL;
+
+    /* Field names have no escapes, so such a key is compared unescaped. */
+    char name[PBJSON_KEY_UNESCAPE_SIZE];
+
+    if (escaped)
+    {
+        if (pbjson_unescape_key(key, len, name, sizeof(name), &len))
+        {
+            return 0;
+        }
+
+        key = name;
+    }
+
+    if (fields->key_table)
+    {
+        uint16_t slot = fields->key_table[pbjson_key_hash(key, len, fields->key_seed) & fields->key_table_mask];
+
+        if (slot != 0)
+        {
+            const pbjson_iter_t *piter = &fields->iter[slot - 1];
+
+            PBJSON_STATS_ADD(key_compares, 1);
+
+            if ((piter->name_len == len) && !memcmp(PBJSON_ITER_NAME(fields, piter), key, len))
+            {
+                *p_iter = piter;
+            }
+        }
+
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < fields->num_field; i++)
+    {
+        PBJSON_STATS_ADD(key_compares, 1);
+
+        if ((fields->iter[i].name_len == len) && !memcmp(PBJSON_ITER_NAME(fields, &fields->iter[i]), key, len))
+        {
+            *p_iter = &fields->iter[i];
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static int pbjson_unescape_key(const char *key, size_t len, char *dst, size_t size, size_t *p_len)
+{
+    const char *s = key;
+    const char *end = key + len;
+    size_t pos = 0;
+
+    while (s < end)
+    {
+        char utf8[4];
+        int n = 1;
+
+        if (*s == '\\')
+        {
+            n = pbjson_unescape(s, end, utf8, &s);
+        }
+        else
+        {
+            utf8[0] = *s++;
+        }
+
+        if ((n <= 0) || ((size_t)n > size - pos))
+        {
+            return -1;
+        }
+
+        memcpy(dst + pos, utf8, (size_t)n);
+        pos += (size_t)n;
+    }
+
+    *p_len = pos;
+    return 0;
+}
+
+static int pbjson_skip_members(pbjson_parser_t *parser)
+{
+    while (true)
+    {
+        int err = pbjson_find_first_char(parser);
+
+        if (err)
+        {
+            return err;
+        }
+
+        if (pbjson_peek(parser) == '}')
+        {
+            parser->s++;
+            return 0;
+        }
+
+        if ((pbjson_peek(parser) != ',') || (parser->s++, pbjson_find_first_char(parser) != 0) ||
+            (pbjson_peek(parser) != '"'))
+        {
+            return -1;
+        }
+
+        err = pbjson_skip_string(parser);
+
+        if (err == 0)
+        {
+            err = pbjson_jumpto_first_char(parser, ':');
+        }
+
+        if (err == 0)
+        {
+            PBJSON_STATS_ADD(values_skipped, 1);
+            err = pbjson_discard_value(parser);
+        }
+
+        if (err)
+        {
+            return err;
+        }
+    }
+}
+
+static bool pbjson_fieldmask_has(const pbjson_fieldmask_t *mask, uint32_t index)
+{
+    return ((mask->bits[index / 32] >> (index % 32)) & 1u) != 0;
+}
+
+static int pbjson_decode_key(pbjson_parser_t *parser, const pbjson_msgdesc_t *fields, uint16_t *order, void *dst,
+                             uint32_t *p_next, const pbjson_iter_t **p_field)
+{
+    int err;
+    *p_field = NULL;
+    err = pbjson_jumpto_first_char(parser, '"');
+
+    if (err)
+    {
+        return err;
+    }
+
+    const pbjson_iter_t *piter;
+    PBJSON_STATS_START(lookup_start);
+    err = pbjson_find_field(parser, fields, (order != NULL) ? order[*p_next] : *p_next, &piter);
+    PBJSON_STATS_STOP(lookup_start, PBJSON_PHASE_KEY_LOOKUP);
+
+    if (err)
+    {
+        return err;
+    }
+
+    const pbjson_fieldmask_t *mask = parser->mask;
+    bool selected = (piter != NULL);
+
+    if (piter)
+    {
+        uint32_t index = (uint32_t)(piter - fields->iter);
+
+        /* The next message from the same producer will most likely list the keys the same way. */
+        if (order != NULL)
+        {
+            order[*p_next] = (uint16_t)index;
+        }
+
+        *p_next = index + 1;
+        selected = (mask == NULL) || pbjson_fieldmask_has(mask, *p_next - 1);
+        PBJSON_STATS_ADD(decode_fields, selected);
+    }
+    else
+    {
+        PBJSON_STATS_ADD(unknown_keys, 1);
+    }
+
+    err = pbjson_jumpto_first_char(parser, ':');
+
+    if (err)
+    {
+        return err;
+    }
+
+    if (!selected)
+    {
+        PBJSON_STATS_ADD(values_skipped, 1);
+        PBJSON_STATS_START(skip_start);
+        err = pbjson_discard_value(parser);
+        PBJSON_STATS_STOP(skip_start, PBJSON_PHASE_SKIP);
+        return err;
+    }
+
+    *p_field = piter;
+
+    if (mask != NULL)
+    {
+        /* The value is decoded with the mask of the field, NULL takes it whole. */
+        parser->mask = mask->sub[*p_next - 1];
+        err = pbjson_decode_member(parser, piter, dst);
+        parser->mask = mask;
+        return err;
+    }
+
+    return pbjson_decode_member(parser, piter, dst);
+}
+
+static int pbjson_apply_null(pbjson_parser_t *parser, const pbjson_iter_t *key, void *dst)
+{
+    int err = pbjson_find_first_char(parser);
+
+    if (err)
+    {
+        return err;
+    }
+
+    if (((size_t)(parser->end - parser->s) < 4) || (memcmp(parser->s, "null", 4) != 0))
+    {
+        return 1;
+    }
+
+    parser->s += 4;
+
+    char *data = (char *)dst + key->data_offset;
+
+    if (key->option == PBJSON_OPTION_REPEATED)
+    {
+        *(uint32_t *)(void *)((char *)dst + key->count_offset) = 0;
+    }
+    else if (key->option == PBJSON_OPTION_OPTIONAL)
+    {
+        *(bool *)((char *)dst + key->count_offset) = false;
+    }
+
+    if (key->atype == PBJSON_POINTER_ATYPE)
+    {
+        *(void **)(void *)data = NULL;
+    }
+    else if (key->option != PBJSON_OPTION_REPEATED)
+    {
+        memset(data, 0, key->item_size);
+    }
+
+    return 0;
+}
+
+static int pbjson_decode_member(pbjson_parser_t *parser, const pbjson_iter_t *piter, void *dst)
+{
+    if (piter->atype == PBJSON_CALLBACK_ATYPE)
+    {
+        return pbjson_decode_callback(parser, piter, (pbjson_callback_t *)(void *)((char *)dst + piter->data_offset));
+    }
+
+    if (parser->apply)
+    {
+        int err = pbjson_apply_null(parser, piter, dst);
+
+        if (err <= 0)
+        {
+            return err;
+        }
+    }
+
+    if (piter->option == PBJSON_OPTION_REPEATED)
+    {
+        return pbjson_decode_array(parser, piter, dst);
+    }
+
+    char *data = (char *)dst + piter->data_offset;
+    if (piter->atype == PBJSON_POINTER_ATYPE)
+    {
+        return pbjson_decode_pointer(parser, piter, (void **)(void *)data);
+    }
+
+    if (piter->data_type == PBJSON_MESSAGE_TYPE)
+    {
+        void *p_has_msg = (piter->option == PBJSON_OPTION_OPTIONAL) ? (char *)dst + piter->count_offset : NULL;
+
+        /* A patch only merges into a submessage that is already there. */
+        if (parser->apply && (p_has_msg != NULL) && !*(bool *)p_has_msg)
+        {
+            memset(data, 0, piter->item_size);
+        }
+
+        return pbjson_decode_dict(parser, PBJSON_ITER_SUBMSG(parser->fields, piter), data, p_has_msg);
+    }
+
+    if (piter->option == PBJSON_OPTION_OPTIONAL)
+    {
+        char *pHasMsg = (char *)dst + piter->count_offset;
+        *(bool *)pHasMsg = true;
+    }
+
+    return pbjson_decode_value(parser, piter, data);
+}
+
+static int pbjson_decode_dict(pbjson_parser_t *parser, const pbjson_msgdesc_t *fields, void *dst, void *p_has_msg)
+{
+    const pbjson_msgdesc_t *owner = parser->fields;
+#ifdef PBJSON_STATS
+    const char *start = parser->s;
+    uint64_t cycles = PBJSON_STATS_NOW();
+#endif
+
+    parser->fields = fields;
+    int err = pbjson_decode_object(parser, fields, dst, p_has_msg);
+    parser->fields = owner;
+
+#ifdef PBJSON_STATS
+    if (err == 0)
+    {
+        pbjson_stats_message(fields, false, (size_t)(parser->s - start), cycles);
+    }
+#endif
+
+    return err;
+}
+
+static int pbjson_decode_object(pbjson_parser_t *parser, const pbjson_msgdesc_t *fields, void *dst, void *p_has_msg)
+{
+    int err;
+
+    /* Masks and patches need the field table. */
+    if ((fields->decode != NULL) && (parser->mask == NULL) && !parser->apply)
+    {
+        return fields->decode(parser, dst, (bool *)p_has_msg);
+    }
+
+    err = pbjson_jumpto_first_char(parser, '{');
+
+    if (err)
+    {
+        return err;
+    }
+
+    err = pbjson_enter_nested(parser);
+
+    if (err)
+    {
+        return err;
+    }
+
+    int dict_empty_stt = pbjson_check_obj_empty(parser, '}');
+
+    if (dict_empty_stt < 0)
+    {
+        return dict_empty_stt;
+    }
+
+    if (dict_empty_stt != 0)
+    {
+        parser->depth--;
+
+        /* In a patch, removed submessages are null and {} is one with nothing changed. */
+        if (p_has_msg)
+        {
+            *(bool *)p_has_msg = parser->apply;
+        }
+
+        return 0;
+    }
+
+    if (p_has_msg)
+    {
+        *(bool *)p_has_msg = true;
+    }
+
+    const pbjson_fieldmask_t *mask = parser->mask;
+    uint16_t *order = pbjson_ctx_order(parser->ctx, fields);
+    uint32_t next_field = 0;
+    uint32_t fields_left = 0;
+    uint64_t seen = 0;
+
+    if (mask != NULL)
+    {
+        if (mask->fields != fields)
+        {
+            return -1;
+        }
+
+        fields_left = mask->count;
+
+        /* Nothing after the last selected field of the top-level object is read. */
+        if ((fields_left == 0) && (parser->depth == 1))
+        {
+            parser->s = parser->end;
+            parser->depth--;
+            return 0;
+        }
+    }
+
+    while (true)
+    {
+        const pbjson_iter_t *field;
+        err = pbjson_decode_key(parser, fields, order, dst, &next_field, &field);
+
+        if (err)
+        {
+            return err;
+        }
+
+        if (mask != NULL)
+        {
+            if (field != NULL)
+            {
+                /* Fields that share a bit are counted once, which only delays stopping. */
+                uint64_t bit = (uint64_t)1 << ((uint32_t)(field - fields->iter) % 64);
+
+                fields_left -= ((seen & bit) == 0);
+                seen |= bit;
+            }
+
+            if (fields_left == 0)
+            {
+                if (parser->depth == 1)
+                {
+                    parser->s = parser->end;
+                    break;
+                }
+
+                err = pbjson_skip_members(parser);
+
+                if (err)
+                {
+                    return err;
+                }
+
+                break;
+            }
+        }
+
+        err = pbjson_find_first_char(parser);
+
+        if (err)
+        {
+            return err;
+        }
+
+        if (pbjson_peek(parser) == '}')
+        {
+            parser->s++;
+            break;
+        }
+        else if (pbjson_peek(parser) != ',')
+        {
+            return -1;
+        }
+
+        parser->s++;
+    }
+
+    parser->depth--;
+    return 0;
+}
+
+static size_t pbjson_pb_format_varint(uint8_t *buf, uint64_t val)
+{
+    size_t len = 0;
+
+    while (val >= 0x80)
+    {
+        buf[len++] = (uint8_t)(val | 0x80);
+        val >>= 7;
+    }
+
+    buf[len++] = (uint8_t)val;
+    return len;
+}
+
+static int pbjson_pb_write(pbjson_pb_writer_t *w, const void *data, size_t len)
+{
+    if (len > w->size - w->pos)
+    {
+        return -1;
+    }
+
+    if (w->buf != NULL)
+    {
+        memcpy(w->buf + w->pos, data, len);
+    }
+
+    w->pos += len;
+    return 0;
+}
+
+static int pbjson_pb_write_varint(pbjson_pb_writer_t *w, uint64_t val)
+{
+    /* Tags and most lengths take one byte. */
+    if ((val < 0x80) && (w->pos < w->size))
+    {
+        if (w->buf != NULL)
+        {
+            w->buf[w->pos] = (uint8_t)val;
+        }
+
+        w->pos++;
+        return 0;
+    }
+
+    uint8_t buf[PBJSON_PB_VARINT_MAX];
+    return pbjson_pb_write(w, buf, pbjson_pb_format_varint(buf, val));
+}
+
+static int pbjson_pb_write_tag(pbjson_pb_writer_t *w, const pbjson_iter_t *key, unsigned wire_type)
+{
+    return pbjson_pb_write_varint(w, ((uint64_t)key->tag << 3) | wire_type);
+}
+
+static int pbjson_pb_begin_len(pbjson_pb_writer_t *w, size_t *p_start)
+{
+    static const uint8_t zero = 0;
+
+    *p_start = w->pos + 1;
+    return pbjson_pb_write(w, &zero, 1);
+}
+
+static int pbjson_pb_end_len(pbjson_pb_writer_t *w, size_t start)
+{
+    uint8_t prefix[PBJSON_PB_VARINT_MAX];
+    size_t len = w->pos - start;
+    size_t prefix_len = pbjson_pb_format_varint(prefix, len);
+
+    /* Values of 128 bytes or more move up to make room for a longer length. */
+    if (prefix_len > 1)
+    {
+        if (prefix_len - 1 > w->size - w->pos)
+        {
+            return -1;
+        }
+
+        if (w->buf != NULL)
+        {
+            memmove(w->buf + start + prefix_len - 1, w->buf + start, len);
+        }
+
+        w->pos += prefix_len - 1;
+    }
+
+    if (w->buf != NULL)
+    {
+        memcpy(w->buf + start - 1, prefix, prefix_len);
+    }
+
+    return 0;
+}
+
+static int pbjson_transcode_value(pbjson_parser_t *parser, const pbjson_iter_t *key, pbjson_pb_writer_t *w,
+                                  bool packed)
+{
+    union
+    {
+        bool b;
+        int32_t i32;
+        int64_t i64;
+        uint32_t u32;
+        uint64_t u64;
+        float f;
+        double d;
+    } val;
+    uint64_t raw;
+    int err = pbjson_find_first_char(parser);
+
+    if (err)
+    {
+        return err;
+    }
+
+    /* The getters may fail before they store anything, and a stale bool is not a valid value. */
+    memset(&val, 0, sizeof(val));
+
+    if ((key->data_type == PBJSON_STRING_TYPE) || (key->data_type == PBJSON_BYTES_TYPE))
+    {
+        bool is_bytes = (key->data_type == PBJSON_BYTES_TYPE);
+
+        if (pbjson_peek(parser) != '"')
+        {
+            return -1;
+        }
+
+        /* Measure the value first, its length goes before it. */
+        pbjson_parser_t scan = *parser;
+        size_t len;
+        err = is_bytes ? pbjson_get_base64(&scan, NULL, SIZE_MAX, &len)
+                       : pbjson_unescape_string(&scan, NULL, SIZE_MAX, &len);
+
+        if (err)
+        {
+            return err;
+        }
+
+        /* Static fields must fit the structure the receiver decodes into, strings with the terminator. */
+        size_t room = (size_t)key->item_size - (is_bytes ? offsetof(pb_bytes_array_t, bytes) : 1);
+
+        if ((key->atype == PBJSON_STATIC_ATYPE) && (len > room))
+        {
+            return -1;
+        }
+
+        if (pbjson_pb_write_tag(w, key, PBJSON_WIRE_LEN) || pbjson_pb_write_varint(w, len) ||
+            (len > w->size - w->pos))
+        {
+            return -1;
+        }
+
+        if ((w->buf != NULL) && is_bytes)
+        {
+            pbjson_get_base64(parser, w->buf + w->pos, len, &len);
+        }
+        else if (w->buf != NULL)
+        {
+            pbjson_unescape_string(parser, (char *)(w->buf + w->pos), len, &len);
+        }
+
+        parser->s = scan.s;
+        w->pos += len;
+        return 0;
+    }
+
+    if (key->data_type == PBJSON_MESSAGE_TYPE)
+    {
+        size_t tag_pos = w->pos;
+        size_t start;
+
+        if (pbjson_pb_write_tag(w, key, PBJSON_WIRE_LEN) || pbjson_pb_begin_len(w, &start))
+        {
+            return -1;
+        }
+
+        const pbjson_msgdesc_t *owner = parser->fields;
+        bool has_members;
+
+        err = pbjson_transcode_object(parser, PBJSON_ITER_SUBMSG(owner, key), w, &has_members);
+        parser->fields = owner;
+
+        if (err)
+        {
+            return err;
+        }
+
+        /* pbjson_decode() treats an empty object as absent, so it is left out here too.
+         * An object with only unknown keys is present and kept as an empty message. */
+        if (!has_members && (key->option == PBJSON_OPTION_OPTIONAL))
+        {
+            w->pos = tag_pos;
+            return 0;
+        }
+
+        return pbjson_pb_end_len(w, start);
+    }
+
+    switch (key->data_type)
+    {
+    case PBJSON_BOOL_TYPE:
+        err = pbjson_get_bool(parser, key, &val.b);
+        raw = val.b ? 1 : 0;
+        break;
+
+    case PBJSON_ENUM_TYPE:
+        err = pbjson_get_enum_value(parser, PBJSON_ITER_ENUMDESC(parser->fields, key), PBJSON_INT32_TYPE, &val.i32);
+        raw = (uint64_t)(int64_t)val.i32;
+        break;
+
+    case PBJSON_INT32_TYPE:
+        /* Negative values are sign-extended to 64 bits, as protobuf requires. */
+        err = pbjson_get_number(parser, PBJSON_INT32_TYPE, &val.i32);
+        raw = (uint64_t)(int64_t)val.i32;
+        break;
+
+    case PBJSON_UENUM_TYPE:
+        err = pbjson_get_enum_value(parser, PBJSON_ITER_ENUMDESC(parser->fields, key), PBJSON_UINT32_TYPE, &val.u32);
+        raw = val.u32;
+        break;
+
+    case PBJSON_UINT32_TYPE:
+        err = pbjson_get_number(parser, PBJSON_UINT32_TYPE, &val.u32);
+        raw = val.u32;
+        break;
+
+    case PBJSON_INT64_TYPE:
+        err = pbjson_get_number(parser, PBJSON_INT64_TYPE, &val.i64);
+        raw = (uint64_t)val.i64;
+        break;
+
+    case PBJSON_UINT64_TYPE:
+        err = pbjson_get_number(parser, PBJSON_UINT64_TYPE, &val.u64);
+        raw = val.u64;
+        break;
+
+    case PBJSON_FLOAT_TYPE:
+    {
+        err = pbjson_get_number(parser, PBJSON_FLOAT_TYPE, &val.f);
+        uint32_t bits;
+        memcpy(&bits, &val.f, sizeof(bits));
+        raw = bits;
+        break;
+    }
+
+    case PBJSON_DOUBLE_TYPE:
+        err = pbjson_get_number(parser, PBJSON_DOUBLE_TYPE, &val.d);
+        memcpy(&raw, &val.d, sizeof(raw));
+        break;
+
+    default:
+        return -1;
+    }
+
+    if (err)
+    {
+        return err;
+    }
+
+    if (key->wire == PBJSON_WIRE_ZIGZAG)
+    {
+        raw = (raw << 1) ^ (((raw >> 63) != 0) ? UINT64_MAX : 0);
+    }
+
+    if (!packed && pbjson_pb_write_tag(w, key, PBJSON_WIRE_TYPE(key->wire)))
+    {
+        return -1;
+    }
+
+    if ((key->wire == PBJSON_WIRE_FIXED32) || (key->wire == PBJSON_WIRE_FIXED64))
+    {
+        uint8_t buf[8];
+        size_t len = (key->wire == PBJSON_WIRE_FIXED32) ? 4 : 8;
+
+        for (size_t i = 0; i < len; i++)
+        {
+            buf[i] = (uint8_t)(raw >> (8 * i));
+        }
+
+        return pbjson_pb_write(w, buf, len);
+    }
+
+    return pbjson_pb_write_varint(w, raw);
+}
+
+static int pbjson_transcode_array(pbjson_parser_t *parser, const pbjson_iter_t *key, pbjson_pb_writer_t *w)
+{
+    int err = pbjson_jumpto_first_char(parser, '[');
+
+    if (err)
+    {
+        return err;
+    }
+
+    err = pbjson_enter_nested(parser);
+
+    if (err)
+    {
+        return err;
+    }
+
+    int list_empty_stt = pbjson_check_obj_empty(parser, ']');
+
+    if (list_empty_stt < 0)
+    {
+        return list_empty_stt;
+    }
+
+    if (list_empty_stt == 0)
+    {
+        bool packed = (key->wire != PBJSON_WIRE_LEN);
+        size_t start = 0;
+        uint32_t count = 0;
+
+        if (packed && (pbjson_pb_write_tag(w, key, PBJSON_WIRE_LEN) || pbjson_pb_begin_len(w, &start)))
+        {
+            return -1;
+        }
+
+        while (true)
+        {
+            if (count >= key->max_count)
+            {
+                return -1;
+            }
+
+            err = pbjson_transcode_value(parser, key, w, packed);
+
+            if (err)
+            {
+                return err;
+            }
+
+            err = pbjson_find_first_char(parser);
+
+            if (err)
+            {
+                return err;
+            }
+
+            count++;
+
+            if (pbjson_peek(parser) == ']')
+            {
+                parser->s++;
+                break;
+            }
+
+            if (pbjson_peek(parser) != ',')
+            {
+                return -1;
+            }
+
+            parser->s++;
+        }
+
+        if (packed && pbjson_pb_end_len(w, start))
+        {
+            return -1;
+        }
+    }
+
+    parser->depth--;
+    return 0;
+}
+
+static int pbjson_transcode_object(pbjson_parser_t *parser, const pbjson_msgdesc_t *fields, pbjson_pb_writer_t *w,
+                                   bool *p_has_members)
+{
+    int err = pbjson_jumpto_first_char(parser, '{');
+
+    parser->fields = fields;
+
+    if (err)
+    {
+        return err;
+    }
+
+    err = pbjson_enter_nested(parser);
+
+    if (err)
+    {
+        return err;
+    }
+
+    int dict_empty_stt = pbjson_check_obj_empty(parser, '}');
+
+    if (dict_empty_stt < 0)
+    {
+        return dict_empty_stt;
+    }
+
+    *p_has_members = (dict_empty_stt == 0);
+
+    if (dict_empty_stt != 0)
+    {
+        parser->depth--;
+        return 0;
+    }
+
+    uint64_t dups = 0;
+    uint64_t empty = 0;
+
+    if (w->dedup)
+    {
+        err = pbjson_transcode_scan_keys(parser, fields, &dups, &empty) ||
+              pbjson_transcode_members(parser, fields, w, dups, empty);
+    }
+    else
+    {
+        const char *members = parser->s;
+        size_t start = w->pos;
+
+        err = pbjson_transcode_members(parser, fields, w, 0, 0);
+
+        /* Duplicate keys are rare, only then are the keys scanned. Nested
+         * objects go through one pass as well, which bounds the work. */
+        if (err == 1)
+        {
+            parser->s = members;
+            w->pos = start;
+            w->dedup = true;
+            err = pbjson_transcode_scan_keys(parser, fields, &dups, &empty) ||
+                  pbjson_transcode_members(parser, fields, w, dups, empty);
+            w->dedup = false;
+        }
+    }
+
+    if (err)
+    {
+        return -1;
+    }
+
+    parser->depth--;
+    return 0;
+}
+
+static int pbjson_transcode_members(pbjson_parser_t *parser, const pbjson_msgdesc_t *fields, pbjson_pb_writer_t *w,
+                                    uint64_t dups, uint64_t empty)
+{
+    uint32_t next_field = 0;
+    uint64_t seen = 0;
+
+    while (true)
+    {
+        const pbjson_iter_t *piter;
+
+        int err = pbjson_jumpto_first_char(parser, '"');
+
+        if (err)
+        {
+            return err;
+        }
+
+        err = pbjson_find_field(parser, fields, next_field, &piter);
+
+        if (err)
+        {
+            return err;
+        }
+
+        err = pbjson_jumpto_first_char(parser, ':');
+
+        if (err)
+        {
+            return err;
+        }
+
+        bool skip = (piter == NULL);
+
+        if (!skip && pbjson_transcode_resets(piter))
+        {
+            /* Fields that share a bit only cost a needless look ahead. */
+            uint64_t bit = (uint64_t)1 << ((uint32_t)(piter - fields->iter) % 64);
+
+            if (!w->dedup && (seen & bit))
+            {
+                return 1;
+            }
+
+            seen |= bit;
+            skip = w->dedup && (dups & bit) && pbjson_transcode_is_overridden(parser, fields, piter, empty);
+        }
+
+        if (skip)
+        {
+            err = pbjson_discard_value(parser);
+        }
+        else
+        {
+            next_field = (uint32_t)(piter - fields->iter) + 1;
+            err = (piter->option == PBJSON_OPTION_REPEATED) ? pbjson_transcode_array(parser, piter, w)
+                                                             : pbjson_transcode_value(parser, piter, w, false);
+        }
+
+        if (err)
+        {
+            return err;
+        }
+
+        err = pbjson_find_first_char(parser);
+
+        if (err)
+        {
+            return err;
+        }
+
+        if (pbjson_peek(parser) == '}')
+        {
+            parser->s++;
+            return 0;
+        }
+        else if (pbjson_peek(parser) != ',')
+        {
+            return -1;
+        }
+
+        parser->s++;
+    }
+}
+
+static int pbjson_transcode_scan_keys(const pbjson_parser_t *parser, const pbjson_msgdesc_t *fields,
+                                      uint64_t *p_dups, uint64_t *p_empty)
+{
+    pbjson_parser_t scan = *parser;
+    uint64_t seen = 0;
+
+    *p_dups = 0;
+    *p_empty = 0;
+
+    while (true)
+    {
+        const pbjson_iter_t *piter;
+
+        if (pbjson_jumpto_first_char(&scan, '"') || pbjson_find_field(&scan, fields, 0, &piter) ||
+            pbjson_jumpto_first_char(&scan, ':'))
+        {
+            return -1;
+        }
+
+        if ((piter != NULL) && pbjson_transcode_resets(piter))
+        {
+            uint64_t bit = (uint64_t)1 << ((uint32_t)(piter - fields->iter) % 64);
+            pbjson_parser_t value = scan;
+            bool is_empty = (pbjson_jumpto_first_char(&value, '{') == 0) && (pbjson_check_obj_empty(&value, '}') == 1);
+
+            *p_dups |= seen & bit;
+            *p_empty = is_empty ? (*p_empty | bit) : (*p_empty & ~bit);
+            seen |= bit;
+        }
+
+        if (pbjson_discard_value(&scan) || pbjson_find_first_char(&scan))
+        {
+            return -1;
+        }
+
+        if (pbjson_peek(&scan) == '}')
+        {
+            return 0;
+        }
+
+        if (pbjson_peek(&scan) != ',')
+        {
+            return -1;
+        }
+
+        scan.s++;
+    }
+}
+
+static bool pbjson_transcode_resets(const pbjson_iter_t *key)
+{
+    return ((key->option == PBJSON_OPTION_REPEATED) && (key->atype != PBJSON_CALLBACK_ATYPE)) ||
+           ((key->option == PBJSON_OPTION_OPTIONAL) && (key->data_type == PBJSON_MESSAGE_TYPE));
+}
+
+static bool pbjson_transcode_is_overridden(const pbjson_parser_t *parser, const pbjson_msgdesc_t *fields,
+                                           const pbjson_iter_t *key, uint64_t empty)
+{
+    pbjson_parser_t scan = *parser;
+    uint64_t bit = (uint64_t)1 << ((uint32_t)(key - fields->iter) % 64);
+    bool found = false;
+    bool last_empty = false;
+
+    /* Only with more than 64 fields do the bits of several fields mix, then the last occurrence is searched. */
+    bool exact = (fields->num_field <= 64);
+
+    /* The key scan has already checked the rest of the object. */
+    while ((pbjson_discard_value(&scan) == 0) && (pbjson_find_first_char(&scan) == 0) && (pbjson_peek(&scan) == ','))
+    {
+        const pbjson_iter_t *piter;
+
+        scan.s++;
+
+        if (pbjson_jumpto_first_char(&scan, '"') || pbjson_find_field(&scan, fields, 0, &piter) ||
+            pbjson_jumpto_first_char(&scan, ':'))
+        {
+            break;
+        }
+
+        if (piter != key)
+        {
+            continue;
+        }
+
+        /* A repeated field keeps only its last array, a submessage is merged unless a later {} removes it. */
+        if ((key->option == PBJSON_OPTION_REPEATED) || exact)
+        {
+            return (key->option == PBJSON_OPTION_REPEATED) || ((empty & bit) != 0);
+        }
+
+        pbjson_parser_t value = scan;
+
+        found = true;
+        last_empty = (pbjson_jumpto_first_char(&value, '{') == 0) && (pbjson_check_obj_empty(&value, '}') == 1);
+    }
+
+    return found && last_empty;
+}
+
+void pbjson_arena_init(pbjson_arena_t *arena, void *buf, size_t size)
+{
+    arena->buf = (char *)buf;
+    arena->size = size;
+    arena->used = 0;
+}
+
+void *pbjson_arena_alloc(pbjson_arena_t *arena, size_t size)
+{
+    if (arena == NULL)
+    {
+        return NULL;
+    }
+
+    /* Padding that aligns the next block, measured on the address so any buffer works. */
+    size_t pad = (size_t)(-(uintptr_t)(arena->buf + arena->used)) & (PBJSON_ARENA_ALIGN - 1);
+
+    if ((pad > arena->size - arena->used) || (size > arena->size - arena->used - pad))
+    {
+        return NULL;
+    }
+
+    char *p = arena->buf + arena->used + pad;
+    arena->used += pad + size;
+    memset(p, 0, size);
+    return p;
+}
+
+void pbjson_arena_reset(pbjson_arena_t *arena)
+{
+    arena->used = 0;
+}
+
+int pbjson_read_value(const pbjson_istream_t *stream, pbjson_type_t type, void *dst, size_t size)
+{
+    pbjson_parser_t parser = {stream->s, stream->s + stream->len, 0, NULL, NULL, false, NULL, NULL};
+    pbjson_iter_t key;
+
+    if ((type == PBJSON_MESSAGE_TYPE) || (size == 0) || (size > UINT32_MAX))
+    {
+        return -1;
+    }
+
+#ifdef PBJSON_COMPACT_DESCRIPTORS
+    /* Only strings and bytes can be this large, a smaller capacity is safe for them. */
+    size = (size < UINT16_MAX) ? size : UINT16_MAX;
+#endif
+
+    memset(&key, 0, sizeof(key));
+    key.item_size = (uint32_t)size;
+    key.data_type = type;
+    key.max_count = 1;
+
+    int err = pbjson_decode_value(&parser, &key, dst);
+
+    if (err)
+    {
+        return err;
+    }
+
+    /* The value must be the whole text, apart from surrounding whitespace. */
+    return (pbjson_find_first_char(&parser) == 0) ? -1 : 0;
+}
+
+static int pbjson_parse_key(pbjson_parser_t *parser, const pbjson_msgdesc_t *fields, uint32_t *p_next, bool first)
+{
+    uint16_t *order = pbjson_ctx_order(parser->ctx, fields);
+
+    while (true)
+    {
+        if (!first)
+        {
+            if (pbjson_find_first_char(parser))
+            {
+                return -1;
+            }
+
+            if (pbjson_peek(parser) == '}')
+            {
+                parser->s++;
+                parser->depth--;
+                return PBJSON_PARSE_END;
+            }
+
+            if (pbjson_peek(parser) != ',')
+            {
+                return -1;
+            }
+
+            parser->s++;
+        }
+
+        first = false;
+
+        const pbjson_iter_t *piter;
+
+        if (pbjson_jumpto_first_char(parser, '"'))
+        {
+            return -1;
+        }
+
+        PBJSON_STATS_START(lookup_start);
+        int err = pbjson_find_field(parser, fields, (order != NULL) ? order[*p_next] : *p_next, &piter);
+        PBJSON_STATS_STOP(lookup_start, PBJSON_PHASE_KEY_LOOKUP);
+
+        if (err || pbjson_jumpto_first_char(parser, ':'))
+        {
+            return -1;
+        }
+
+        if (piter != NULL)
+        {
+            uint32_t index = (uint32_t)(piter - fields->iter);
+
+            if (order != NULL)
+            {
+                order[*p_next] = (uint16_t)index;
+            }
+
+            *p_next = index + 1;
+            PBJSON_STATS_ADD(decode_fields, 1);
+            return (int)index;
+        }
+
+        PBJSON_STATS_ADD(unknown_keys, 1);
+        PBJSON_STATS_ADD(values_skipped, 1);
+        PBJSON_STATS_START(skip_start);
+        err = pbjson_discard_value(parser);
+        PBJSON_STATS_STOP(skip_start, PBJSON_PHASE_SKIP);
+
+        if (err)
+        {
+            return -1;
+        }
+    }
+}
+
+int pbjson_parse_object(pbjson_parser_t *parser, const pbjson_msgdesc_t *fields, bool *p_has_msg, uint32_t *p_next)
+{
+    if (pbjson_jumpto_first_char(parser, '{') || pbjson_enter_nested(parser))
+    {
+        return -1;
+    }
+
+    int empty = pbjson_check_obj_empty(parser, '}');
+
+    if (empty < 0)
+    {
+        return -1;
+    }
+
+    if (p_has_msg != NULL)
+    {
+        *p_has_msg = (empty == 0);
+    }
+
+    if (empty != 0)
+    {
+        parser->depth--;
+        return PBJSON_PARSE_END;
+    }
+
+    *p_next = 0;
+    return pbjson_parse_key(parser, fields, p_next, true);
+}
+
+int pbjson_parse_member(pbjson_parser_t *parser, const pbjson_msgdesc_t *fields, uint32_t *p_next)
+{
+    return pbjson_parse_key(parser, fields, p_next, false);
+}
+
+int pbjson_parse_array(pbjson_parser_t *parser)
+{
+    if (pbjson_jumpto_first_char(parser, '[') || pbjson_enter_nested(parser))
+    {
+        return -1;
+    }
+
+    int empty = pbjson_check_obj_empty(parser, ']');
+
+    if (empty < 0)
+    {
+        return -1;
+    }
+
+    if (empty != 0)
+    {
+        parser->depth--;
+        return PBJSON_PARSE_END;
+    }
+
+    return 0;
+}
+
+int pbjson_parse_item(pbjson_parser_t *parser)
+{
+    if (pbjson_find_first_char(parser))
+    {
+        return -1;
+    }
+
+    if (pbjson_peek(parser) == ']')
+    {
+        parser->s++;
+        parser->depth--;
+        return PBJSON_PARSE_END;
+    }
+
+    if (pbjson_peek(parser) != ',')
+    {
+        return -1;
+    }
+
+    parser->s++;
+    return 0;
+}
+
+static int pbjson_parse_number(pbjson_parser_t *parser, pbjson_type_t type, void *dst)
+{
+    if (pbjson_find_first_char(parser))
+    {
+        return -1;
+    }
+
+    PBJSON_STATS_ADD(numbers, 1);
+    PBJSON_STATS_START(number_start);
+    int err = pbjson_get_number(parser, type, dst);
+    PBJSON_STATS_STOP(number_start, PBJSON_PHASE_NUMBER);
+    return err;
+}
+
+int pbjson_parse_int32(pbjson_parser_t *parser, int32_t *dst)
+{
+    return pbjson_parse_number(parser, PBJSON_INT32_TYPE, dst);
+}
+
+int pbjson_parse_int64(pbjson_parser_t *parser, int64_t *dst)
+{
+    return pbjson_parse_number(parser, PBJSON_INT64_TYPE, dst);
+}
+
+int pbjson_parse_uint32(pbjson_parser_t *parser, uint32_t *dst)
+{
+    return pbjson_parse_number(parser, PBJSON_UINT32_TYPE, dst);
+}
+
+int pbjson_parse_uint64(pbjson_parser_t *parser, uint64_t *dst)
+{
+    return pbjson_parse_number(parser, PBJSON_UINT64_TYPE, dst);
+}
+
+int pbjson_parse_float(pbjson_parser_t *parser, float *dst)
+{
+    return pbjson_parse_number(parser, PBJSON_FLOAT_TYPE, dst);
+}
+
+int pbjson_parse_double(pbjson_parser_t *parser, double *dst)
+{
+    return pbjson_parse_number(parser, PBJSON_DOUBLE_TYPE, dst);
+}
+
+int pbjson_parse_bool(pbjson_parser_t *parser, bool *dst)
+{
+    return pbjson_find_first_char(parser) ? -1 : pbjson_get_bool(parser, NULL, dst);
+}
+
+int pbjson_parse_enum(pbjson_parser_t *parser, const pbjson_enumdesc_t *desc, void *dst, size_t size)
+{
+    return pbjson_find_first_char(parser) ? -1 : pbjson_get_enum(parser, desc, dst, size);
+}
+
+int pbjson_parse_uenum(pbjson_parser_t *parser, const pbjson_enumdesc_t *desc, void *dst, size_t size)
+{
+    return pbjson_find_first_char(parser) ? -1 : pbjson_get_uenum(parser, desc, dst, size);
+}
+
+int pbjson_parse_string(pbjson_parser_t *parser, char *dst, size_t size)
+{
+    return pbjson_find_first_char(parser) ? -1 : pbjson_get_string(parser, dst, size);
+}
+
+int pbjson_parse_string_view(pbjson_parser_t *parser, pbjson_string_view_t *dst)
+{
+    return pbjson_find_first_char(parser) ? -1 : pbjson_get_string_view(parser, dst);
+}
+
+int pbjson_parse_bytes(pbjson_parser_t *parser, pb_bytes_array_t *dst, size_t size)
+{
+    return pbjson_find_first_char(parser) ? -1 : pbjson_get_bytes(parser, dst, size);
+}
+
+int pbjson_parse_message(pbjson_parser_t *parser, const pbjson_msgdesc_t *fields, void *dst, bool *p_has_msg)
+{
+    return pbjson_decode_dict(parser, fields, dst, p_has_msg);
+}
+
+int pbjson_decode(const char *s, const pbjson_msgdesc_t *fields, void *dst)
+{
+    return pbjson_decode_n(s, strlen(s), fields, dst);
+}
+
+int pbjson_decode_n(const char *s, size_t len, const pbjson_msgdesc_t *fields, void *dst)
+{
+    return pbjson_decode_arena(s, len, fields, dst, NULL);
+}
+
+static int pbjson_decode_root(const char *s, size_t len, const pbjson_msgdesc_t *fields,
+                              const pbjson_fieldmask_t *mask, bool apply, void *dst, pbjson_arena_t *arena,
+                              pbjson_ctx_t *ctx)
+{
+    pbjson_parser_t parser;
+    parser.s = s;
+    parser.end = s + len;
+    parser.depth = 0;
+    parser.arena = arena;
+    parser.mask = mask;
+    parser.apply = apply;
+    parser.ctx = ctx;
+    parser.fields = NULL;
+
+    PBJSON_STATS_ADD(decode_calls, 1);
+    PBJSON_STATS_ADD(decode_bytes, len);
+    PBJSON_STATS_START(decode_start);
+
+    int err = pbjson_decode_dict(&parser, fields, dst, NULL);
+
+    /* Only whitespace may follow the top-level object. */
+    if ((err == 0) && (pbjson_find_first_char(&parser) == 0))
+    {
+        err = -1;
+    }
+
+    PBJSON_STATS_STOP(decode_start, PBJSON_PHASE_DECODE);
+    PBJSON_STATS_ADD(decode_errors, err != 0);
+
+    return err;
+}
+
+int pbjson_decode_arena(const char *s, size_t len, const pbjson_msgdesc_t *fields, void *dst, pbjson_arena_t *arena)
+{
+    return pbjson_decode_root(s, len, fields, NULL, false, dst, arena, NULL);
+}
+
+int pbjson_decode_apply(const char *s, size_t len, const pbjson_msgdesc_t *fields, void *dst, pbjson_arena_t *arena)
+{
+    return pbjson_decode_root(s, len, fields, NULL, true, dst, arena, NULL);
+}
+
+int pbjson_decode_masked(const char *s, size_t len, const pbjson_fieldmask_t *mask, void *dst, pbjson_arena_t *arena)
+{
+    return pbjson_decode_root(s, len, mask->fields, mask, false, dst, arena, NULL);
+}
+
+static uint16_t *pbjson_ctx_order(pbjson_ctx_t *ctx, const pbjson_msgdesc_t *fields)
+{
+    if ((ctx == NULL) || (fields->num_field >= UINT16_MAX))
+    {
+        return NULL;
+    }
+
+    uint32_t i = (uint32_t)(((uintptr_t)fields / sizeof(void *)) % PBJSON_CTX_SLOTS);
+
+    for (uint32_t probe = 0; probe < PBJSON_CTX_SLOTS; probe++)
+    {
+        pbjson_ctx_slot_t *slot = &ctx->slots[i];
+
+        if (slot->fields == fields)
+        {
+            return slot->order;
+        }
+
+        if (slot->fields == NULL)
+        {
+            uint16_t *order = (uint16_t *)pbjson_arena_alloc(&ctx->cache, (fields->num_field + 1) * sizeof(uint16_t));
+
+            if (order == NULL)
+            {
+                return NULL;
+            }
+
+            /* Until a message has been seen the keys are expected in declaration order. */
+            for (uint32_t k = 0; k <= fields->num_field; k++)
+            {
+                order[k] = (uint16_t)k;
+            }
+
+            slot->fields = fields;
+            slot->order = order;
+            return order;
+        }
+
+        i = (i + 1) % PBJSON_CTX_SLOTS;
+    }
+
+    return NULL;
+}
+
+void pbjson_ctx_init(pbjson_ctx_t *ctx, void *buf, size_t size, pbjson_arena_t *arena)
+{
+    pbjson_arena_init(&ctx->cache, buf, size);
+    ctx->arena = arena;
+    memset(ctx->slots, 0, sizeof(ctx->slots));
+}
+
+void pbjson_ctx_clear(pbjson_ctx_t *ctx)
+{
+    pbjson_arena_reset(&ctx->cache);
+    memset(ctx->slots, 0, sizeof(ctx->slots));
+}
+
+int pbjson_ctx_decode(pbjson_ctx_t *ctx, const char *s, size_t len, const pbjson_msgdesc_t *fields, void *dst)
+{
+    if (ctx->arena != NULL)
+    {
+        pbjson_arena_reset(ctx->arena);
+    }
+
+    return pbjson_decode_root(s, len, fields, NULL, false, dst, ctx->arena, ctx);
+}
+
+static pbjson_fieldmask_t *pbjson_fieldmask_new(const pbjson_msgdesc_t *fields, pbjson_arena_t *arena)
+{
+    pbjson_fieldmask_t *mask = (pbjson_fieldmask_t *)pbjson_arena_alloc(arena, sizeof(*mask));
+
+    if (mask == NULL)
+    {
+        return NULL;
+    }
+
+    mask->fields = fields;
+    mask->bits = (uint32_t *)pbjson_arena_alloc(arena, ((fields->num_field + 31) / 32) * sizeof(uint32_t));
+    mask->sub = (pbjson_fieldmask_t **)pbjson_arena_alloc(arena, fields->num_field * sizeof(*mask->sub));
+
+    return ((mask->bits != NULL) && (mask->sub != NULL)) ? mask : NULL;
+}
+
+static int pbjson_fieldmask_add(pbjson_fieldmask_t *mask, const char *path, const char *end, pbjson_arena_t *arena)
+{
+    while (true)
+    {
+        const char *dot = (const char *)memchr(path, '.', (size_t)(end - path));
+        size_t len = (size_t)(((dot != NULL) ? dot : end) - path);
+        const pbjson_iter_t *iter = mask->fields->iter;
+        uint32_t i = 0;
+
+        while ((i < mask->fields->num_field) &&
+               ((iter[i].name_len != len) || memcmp(PBJSON_ITER_NAME(mask->fields, &iter[i]), path, len)))
+        {
+            i++;
+        }
+
+        if (i == mask->fields->num_field)
+        {
+            return -1;
+        }
+
+        bool is_set = pbjson_fieldmask_has(mask, i);
+
+        if (!is_set)
+        {
+            mask->bits[i / 32] |= 1u << (i % 32);
+            mask->count++;
+        }
+
+        if (dot == NULL)
+        {
+            mask->sub[i] = NULL;
+            return 0;
+        }
+
+        if (mask->fields->iter[i].data_type != PBJSON_MESSAGE_TYPE)
+        {
+            return -1;
+        }
+
+        if (is_set && (mask->sub[i] == NULL))
+        {
+            /* Already selected whole. */
+            return 0;
+        }
+
+        if (!is_set)
+        {
+            mask->sub[i] = pbjson_fieldmask_new(PBJSON_ITER_SUBMSG(mask->fields, &mask->fields->iter[i]), arena);
+
+            if (mask->sub[i] == NULL)
+            {
+                return -1;
+            }
+        }
+
+        mask = mask->sub[i];
+        path = dot + 1;
+    }
+}
+
+pbjson_fieldmask_t *pbjson_fieldmask_compile(const pbjson_msgdesc_t *fields, const char *paths,
+                                             pbjson_arena_t *arena)
+{
+    pbjson_fieldmask_t *mask = pbjson_fieldmask_new(fields, arena);
+
+    if ((mask == NULL) || (*paths == '\0'))
+    {
+        return mask;
+    }
+
+    while (true)
+    {
+        const char *comma = strchr(paths, ',');
+        const char *end = (comma != NULL) ? comma : paths + strlen(paths);
+
+        if (pbjson_fieldmask_add(mask, paths, end, arena))
+        {
+            return NULL;
+        }
+
+        if (comma == NULL)
+        {
+            return mask;
+        }
+
+        paths = comma + 1;
+    }
+}
+
+void pbjson_ndjson_init(pbjson_ndjson_reader_t *reader, const char *buf, size_t len)
+{
+    reader->s = buf;
+    reader->end = buf + len;
+    reader->line = 0;
+    reader->record.s = buf;
+    reader->record.len = 0;
+    reader->ctx = NULL;
+}
+
+int pbjson_ndjson_read(pbjson_ndjson_reader_t *reader, const pbjson_msgdesc_t *fields, void *dst,
+                       pbjson_arena_t *arena)
+{
+    while (reader->s < reader->end)
+    {
+        const char *start = reader->s;
+        const char *eol = pbjson_simd_find(start, reader->end, PBJSON_SIMD_NEWLINE);
+
+        reader->s = (eol < reader->end) ? eol + 1 : eol;
+        reader->line++;
+
+        pbjson_parser_t parser = {start, eol, 0, NULL, NULL, false, NULL, NULL};
+
+        if (pbjson_find_first_char(&parser) != 0)
+        {
+            continue;
+        }
+
+        reader->record.s = start;
+        reader->record.len = (size_t)(eol - start);
+
+        int err = (reader->ctx != NULL) ? pbjson_ctx_decode(reader->ctx, start, reader->record.len, fields, dst)
+                                        : pbjson_decode_arena(start, reader->record.len, fields, dst, arena);
+
+        return (err == 0) ? 0 : -1;
+    }
+
+    return PBJSON_NDJSON_END;
+}
+
+int pbjson_transcode_to_pb(const char *s, size_t len, const pbjson_msgdesc_t *fields, uint8_t *buf, size_t size)
+{
+    pbjson_parser_t parser = {s, s + len, 0, NULL, NULL, false, NULL, NULL};
+    pbjson_pb_writer_t w = {buf, (buf != NULL) ? size : SIZE_MAX, 0, false};
+    bool has_members;
+
+    int err = pbjson_transcode_object(&parser, fields, &w, &has_members);
+
+    /* Only whitespace may follow the top-level object. */
+    if ((err == 0) && (pbjson_find_first_char(&parser) == 0))
+    {
+        err = -1;
+    }
+
+    if (err || (w.pos > (size_t)INT_MAX))
+    {
+        return -1;
+    }
+
+    return (int)w.pos;
+}
+
+static int pbjson_decoder_append(pbjson_decoder_t *dec, const char *s, size_t len)
+{
+    if (len > sizeof(dec->token) - dec->token_len)
+    {
+        dec->overflow = true;
+        return -1;
+    }
+
+    memcpy(dec->token + dec->token_len, s, len);
+    dec->token_len += (uint32_t)len;
+    return 0;
+}
+
+static int pbjson_decoder_push(pbjson_decoder_t *dec, const pbjson_iter_t *key, const pbjson_msgdesc_t *fields,
+                               char *base)
+{
+    if (dec->depth >= PBJSON_MAX_DEPTH)
+    {
+        return -1;
+    }
+
+    pbjson_decoder_frame_t *frame = &dec->stack[dec->depth];
+    frame->key = key;
+    frame->fields = fields;
+    frame->base = base;
+    frame->index = 0;
+
+    dec->depth++;
+    dec->state = (fields != NULL) ? PBJSON_DECODER_OBJ_FIRST : PBJSON_DECODER_ARR_FIRST;
+    return 0;
+}
+
+static int pbjson_decoder_pop(pbjson_decoder_t *dec)
+{
+    pbjson_decoder_frame_t *frame = &dec->stack[dec->depth - 1];
+
+    if (frame->fields == NULL)
+    {
+        *(uint32_t *)(void *)(frame->base + frame->key->count_offset) = frame->index;
+    }
+
+    dec->depth--;
+
+    if (dec->depth == 0)
+    {
+        dec->state = PBJSON_DECODER_DONE;
+        return 0;
+    }
+
+    pbjson_decoder_end_value(dec);
+    return 0;
+}
+
+static void pbjson_decoder_end_value(pbjson_decoder_t *dec)
+{
+    pbjson_decoder_frame_t *frame = &dec->stack[dec->depth - 1];
+
+    if (frame->fields == NULL)
+    {
+        frame->index++;
+    }
+
+    dec->state = PBJSON_DECODER_NEXT;
+}
+
+static const pbjson_msgdesc_t *pbjson_decoder_owner(const pbjson_decoder_t *dec)
+{
+    const pbjson_decoder_frame_t *frame = &dec->stack[dec->depth - 1];
+
+    /* Arrays are only opened inside an object. */
+    return (frame->fields != NULL) ? frame->fields : frame[-1].fields;
+}
+
+static int pbjson_decoder_value(pbjson_decoder_t *dec, pbjson_parser_t *in)
+{
+    pbjson_decoder_frame_t *frame = &dec->stack[dec->depth - 1];
+    const pbjson_iter_t *key;
+    char *dst;
+    char c = *in->s;
+
+    if (frame->fields == NULL)
+    {
+        /* Next element of a repeated field. */
+        key = frame->key;
+
+        if (frame->index >= key->max_count)
+        {
+            return -1;
+        }
+
+        dst = frame->base + key->data_offset + frame->index * key->item_size;
+    }
+    else
+    {
+        key = dec->field;
+
+        if (key == NULL)
+        {
+            /* Unknown key, the value is checked against the JSON grammar and dropped. */
+            pbjson_skip_init(&dec->skip);
+            dec->in_string = false;
+            dec->escape = false;
+            dec->token_len = 0;
+            dec->state = PBJSON_DECODER_SKIP;
+            return 0;
+        }
+
+        if (key->atype != PBJSON_STATIC_ATYPE)
+        {
+            /* Pointer fields need an arena, see pbjson_decode_arena(),
+             * callbacks receive complete values and views point into the input. */
+            return -1;
+        }
+
+        if (key->option == PBJSON_OPTION_REPEATED)
+        {
+            if (c != '[')
+            {
+                return -1;
+            }
+
+            in->s++;
+            return pbjson_decoder_push(dec, key, NULL, frame->base);
+        }
+
+        dst = frame->base + key->data_offset;
+
+        if (key->option == PBJSON_OPTION_OPTIONAL)
+        {
+            *(bool *)(void *)(frame->base + key->count_offset) = true;
+        }
+    }
+
+    if (key->data_type == PBJSON_MESSAGE_TYPE)
+    {
+        if (c != '{')
+        {
+            return -1;
+        }
+
+        in->s++;
+        return pbjson_decoder_push(dec, key, PBJSON_ITER_SUBMSG(pbjson_decoder_owner(dec), key), dst);
+    }
+
+    dec->field = key;
+    dec->value = dst;
+    dec->pos = 0;
+    dec->token_len = 0;
+
+    if (key->data_type == PBJSON_STRING_TYPE)
+    {
+        if (c != '"')
+        {
+            return -1;
+        }
+
+        in->s++;
+        dec->state = PBJSON_DECODER_STRING;
+        return 0;
+    }
+
+    if (key->data_type == PBJSON_BYTES_TYPE)
+    {
+        if ((c != '"') || (key->item_size < offsetof(pb_bytes_array_t, bytes)))
+        {
+            return -1;
+        }
+
+        ((pb_bytes_array_t *)(void *)dst)->size = 0;
+        in->s++;
+        dec->state = PBJSON_DECODER_BYTES;
+        return 0;
+    }
+
+    /* The first character belongs to the token, it is not consumed here. */
+    dec->state = PBJSON_DECODER_SCALAR;
+    return 0;
+}
+
+static int pbjson_decoder_key(pbjson_decoder_t *dec, pbjson_parser_t *in)
+{
+    const char *start = in->s;
+    const char *s = start;
+    bool escape = dec->escape;
+
+    while (s < in->end)
+    {
+        if (escape)
+        {
+            escape = false;
+            s++;
+            continue;
+        }
+
+        s = pbjson_simd_find(s, in->end, PBJSON_SIMD_STRING_END);
+
+        if ((s >= in->end) || (*s == '"'))
+        {
+            break;
+        }
+
+        if (((unsigned char)*s) < 0x20)
+        {
+            return -1;
+        }
+
+        escape = true;
+        s++;
+    }
+
+    dec->escape = escape;
+
+    if (s == in->end)
+    {
+        /* An overlong key cannot name a field, it is only tracked until its end. */
+        if (!dec->overflow)
+        {
+            pbjson_decoder_append(dec, start, (size_t)(s - start));
+        }
+
+        in->s = s;
+        return 0;
+    }
+
+    pbjson_decoder_frame_t *frame = &dec->stack[dec->depth - 1];
+    const pbjson_iter_t *piter = NULL;
+    int err = 0;
+
+    if ((dec->token_len == 0) && !dec->overflow)
+    {
+        /* The whole key is in this chunk. */
+        pbjson_parser_t parser = {start, s + 1, 0, NULL, NULL, false, NULL, NULL};
+        err = pbjson_find_field(&parser, frame->fields, frame->index, &piter);
+    }
+    else if (!dec->overflow && (pbjson_decoder_append(dec, start, (size_t)(s + 1 - start)) == 0))
+    {
+        pbjson_parser_t parser = {dec->token, dec->token + dec->token_len, 0, NULL, NULL, false, NULL, NULL};
+        err = pbjson_find_field(&parser, frame->fields, frame->index, &piter);
+    }
+
+    if (err)
+    {
+        return err;
+    }
+
+    if (piter)
+    {
+        frame->index = (uint32_t)(piter - frame->fields->iter) + 1;
+    }
+
+    in->s = s + 1;
+    dec->field = piter;
+    dec->state = PBJSON_DECODER_COLON;
+    return 0;
+}
+
+static int pbjson_decoder_string(pbjson_decoder_t *dec, pbjson_parser_t *in)
+{
+    while (in->s < in->end)
+    {
+        if (dec->escape)
+        {
+            /* Escape sequences are collected in the token buffer, they can be split across chunks. */
+            char utf8[4];
+            const char *next;
+
+            dec->token[dec->token_len++] = *in->s++;
+            int n = pbjson_unescape(dec->token, dec->token + dec->token_len, utf8, &next);
+
+            if (n == 0)
+            {
+                continue;
+            }
+
+            /* Leave room for the terminating '\0', which cannot be part of the text. */
+            if ((n < 0) || ((size_t)n >= dec->field->item_size - dec->pos) || (utf8[0] == '\0'))
+            {
+                dec->value[dec->pos] = '\0';
+                return -1;
+            }
+
+            memcpy(dec->value + dec->pos, utf8, (size_t)n);
+            dec->pos += (uint32_t)n;
+            dec->escape = false;
+            dec->token_len = 0;
+            continue;
+        }
+
+        const char *stop = pbjson_simd_find(in->s, in->end, PBJSON_SIMD_STRING_END);
+        size_t len = (size_t)(stop - in->s);
+
+        if (len >= dec->field->item_size - dec->pos)
+        {
+            dec->value[dec->pos] = '\0';
+            return -1;
+        }
+
+        memcpy(dec->value + dec->pos, in->s, len);
+        dec->pos += (uint32_t)len;
+        in->s = stop;
+
+        if (in->s >= in->end)
+        {
+            break;
+        }
+
+        if (*in->s == '\\')
+        {
+            dec->escape = true;
+            dec->token[0] = '\\';
+            dec->token_len = 1;
+            in->s++;
+            continue;
+        }
+
+        if (*in->s != '"')
+        {
+            return -1;
+        }
+
+        dec->value[dec->pos] = '\0';
+        in->s++;
+
+#ifdef PBJSON_VALIDATE_UTF8
+        /* The characters may have been split across chunks, so the whole text is checked here. */
+        for (const char *c = dec->value; c < dec->value + dec->pos; c += len)
+        {
+            len = pbjson_utf8_length(c, dec->value + dec->pos);
+
+            if (len == 0)
+            {
+                return -1;
+            }
+        }
+#endif
+
+        pbjson_decoder_end_value(dec);
+        return 0;
+    }
+
+    return 0;
+}
+
+static int pbjson_decoder_bytes(pbjson_decoder_t *dec, pbjson_parser_t *in)
+{
+    pb_bytes_array_t *bytes = (pb_bytes_array_t *)(void *)dec->value;
+    size_t room = dec->field->item_size - offsetof(pb_bytes_array_t, bytes);
+
+    /* The characters of the current quantum are kept in the token buffer, as in pbjson_get_base64(). */
+    while (in->s < in->end)
+    {
+        char c = *in->s++;
+        int n = 0;
+        uint8_t out[3];
+
+        if (dec->escape)
+        {
+            if (c != '/')
+            {
+                return -1;
+            }
+
+            dec->escape = false;
+        }
+        else if (c == '\\')
+        {
+            dec->escape = true;
+            continue;
+        }
+        else if (c == '"')
+        {
+            if (dec->token_len != 0)
+            {
+                n = pbjson_base64_quantum(dec->token, dec->token_len, out);
+            }
+
+            if ((n < 0) || ((size_t)n > room - dec->pos))
+            {
+                return -1;
+            }
+
+            memcpy(bytes->bytes + dec->pos, out, (size_t)n);
+            dec->pos += (uint32_t)n;
+            bytes->size = dec->pos;
+            pbjson_decoder_end_value(dec);
+            return 0;
+        }
+
+        if (dec->token_len == 4)
+        {
+            return -1;
+        }
+
+        dec->token[dec->token_len++] = c;
+
+        if ((dec->token_len == 4) && (c != '='))
+        {
+            n = pbjson_base64_quantum(dec->token, 4, out);
+
+            if ((n != 3) || (room - dec->pos < 3))
+            {
+                return -1;
+            }
+
+            memcpy(bytes->bytes + dec->pos, out, 3);
+            dec->pos += 3;
+            bytes->size = dec->pos;
+            dec->token_len = 0;
+        }
+    }
+
+    return 0;
+}
+
+static int pbjson_decoder_scalar(pbjson_decoder_t *dec, pbjson_parser_t *in)
+{
+    const char *start = in->s;
+    const char *s = start;
+    bool is_complete = false;
+
+    if ((dec->token_len != 0) ? (dec->token[0] == '"') : (*s == '"'))
+    {
+        /* Quoted number, ends after the closing quote. */
+        if (dec->token_len == 0)
+        {
+            s++;
+        }
+
+        const char *quote = (const char *)memchr(s, '"', (size_t)(in->end - s));
+        is_complete = (quote != NULL);
+        s = is_complete ? quote + 1 : in->end;
+    }
+    else
+    {
+        while ((s < in->end) && (*s != ',') && (*s != '}') && (*s != ']') && !pbjson_is_space(*s))
+        {
+            s++;
+        }
+
+        is_complete = (s < in->end);
+    }
+
+    in->s = s;
+
+    if (!is_complete || (dec->token_len != 0))
+    {
+        if (pbjson_decoder_append(dec, start, (size_t)(s - start)))
+        {
+            return -1;
+        }
+
+        if (!is_complete)
+        {
+            return 0;
+        }
+
+        start = dec->token;
+        s = dec->token + dec->token_len;
+    }
+
+    /* The complete token is converted by the same code as pbjson_decode_n(). */
+    pbjson_parser_t parser = {start, s, 0, NULL, NULL, false, NULL, pbjson_decoder_owner(dec)};
+    int err = pbjson_decode_value(&parser, dec->field, dec->value);
+
+    if (err || (parser.s != s))
+    {
+        return -1;
+    }
+
+    pbjson_decoder_end_value(dec);
+    return 0;
+}
+
+static int pbjson_decoder_skip(pbjson_decoder_t *dec, pbjson_parser_t *in)
+{
+    while (in->s < in->end)
+    {
+        if (dec->in_string && dec->escape)
+        {
+            /* The escape sequence is collected in the token buffer until it can be checked. */
+            dec->token[dec->token_len++] = *in->s++;
+
+            int len = pbjson_check_escape(dec->token, dec->token + dec->token_len);
+
+            if (len < 0)
+            {
+                return -1;
+            }
+
+            if (len > 0)
+            {
+                dec->escape = false;
+                dec->token_len = 0;
+            }
+
+            continue;
+        }
+
+        if (dec->in_string)
+        {
+            in->s = pbjson_simd_find(in->s, in->end, PBJSON_SIMD_STRING_END);
+
+            if (in->s >= in->end)
+            {
+                break;
+            }
+
+            char c = *in->s++;
+
+            if (c == '\\')
+            {
+                dec->escape = true;
+                dec->token[0] = c;
+                dec->token_len = 1;
+                continue;
+            }
+
+            if (c != '"')
+            {
+                return -1;
+            }
+
+            dec->in_string = false;
+        }
+        else if (dec->token_len != 0)
+        {
+            /* A number or literal, collected until the next delimiter and then checked. */
+            const char *start = in->s;
+
+            while ((in->s < in->end) && (*in->s != ',') && (*in->s != '}') && (*in->s != ']') &&
+                   !pbjson_is_space(*in->s))
+            {
+                in->s++;
+            }
+
+            if (pbjson_decoder_append(dec, start, (size_t)(in->s - start)))
+            {
+                return -1;
+            }
+
+            if (in->s >= in->end)
+            {
+                break;
+            }
+
+            if (pbjson_skip_scalar(dec->token, dec->token + dec->token_len) != dec->token + dec->token_len)
+            {
+                return -1;
+            }
+
+            dec->token_len = 0;
+        }
+        else
+        {
+            in->s = pbjson_simd_find(in->s, in->end, PBJSON_SIMD_NOT_SPACE);
+
+            if (in->s >= in->end)
+            {
+                break;
+            }
+
+            char c = *in->s++;
+
+            switch (c)
+            {
+            case '"':
+                dec->in_string = true;
+                break;
+
+            case '{':
+            case '[':
+            case '}':
+            case ']':
+            case ':':
+            case ',':
+                break;
+
+            default:
+                dec->token[0] = c;
+                dec->token_len = 1;
+                c = '0';
+                break;
+            }
+
+            /* Tokens are checked when they start, strings and scalars are completed above. */
+            if (pbjson_skip_token(&dec->skip, dec->depth, c))
+            {
+                return -1;
+            }
+        }
+
+        if (!dec->in_string && (dec->token_len == 0) && (dec->skip.depth == 0) &&
+            (dec->skip.state == PBJSON_SKIP_NEXT))
+        {
+            pbjson_decoder_end_value(dec);
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+static int pbjson_decoder_step(pbjson_decoder_t *dec, pbjson_parser_t *in)
+{
+    switch (dec->state)
+    {
+    case PBJSON_DECODER_KEY:
+        return pbjson_decoder_key(dec, in);
+
+    case PBJSON_DECODER_STRING:
+        return pbjson_decoder_string(dec, in);
+
+    case PBJSON_DECODER_BYTES:
+        return pbjson_decoder_bytes(dec, in);
+
+    case PBJSON_DECODER_SCALAR:
+        return pbjson_decoder_scalar(dec, in);
+
+    case PBJSON_DECODER_SKIP:
+        return pbjson_decoder_skip(dec, in);
+
+    default:
+        break;
+    }
+
+    char c = *in->s;
+
+    if (pbjson_is_space(c))
+    {
+        in->s++;
+        return 0;
+    }
+
+    pbjson_decoder_frame_t *frame = &dec->stack[(dec->depth != 0) ? dec->depth - 1 : 0];
+
+    switch (dec->state)
+    {
+    case PBJSON_DECODER_BEGIN:
+        if (c != '{')
+        {
+            return -1;
+        }
+
+        in->s++;
+        return pbjson_decoder_push(dec, NULL, dec->fields, (char *)dec->dst);
+
+    case PBJSON_DECODER_OBJ_FIRST:
+        if (c == '}')
+        {
+            /* An empty object leaves an optional submessage unset. */
+            if ((frame->key != NULL) && (frame->key->option == PBJSON_OPTION_OPTIONAL))
+            {
+                *(bool *)(void *)(dec->stack[dec->depth - 2].base + frame->key->count_offset) = false;
+            }
+
+            in->s++;
+            return pbjson_decoder_pop(dec);
+        }
+        /* fall through */
+
+    case PBJSON_DECODER_OBJ_KEY:
+        if (c != '"')
+        {
+            return -1;
+        }
+
+        in->s++;
+        dec->token_len = 0;
+        dec->escape = false;
+        dec->overflow = false;
+        dec->state = PBJSON_DECODER_KEY;
+        return 0;
+
+    case PBJSON_DECODER_COLON:
+        if (c != ':')
+        {
+            return -1;
+        }
+
+        in->s++;
+        dec->state = PBJSON_DECODER_VALUE;
+        return 0;
+
+    case PBJSON_DECODER_ARR_FIRST:
+        if (c == ']')
+        {
+            in->s++;
+            return pbjson_decoder_pop(dec);
+        }
+        /* fall through */
+
+    case PBJSON_DECODER_VALUE:
+        return pbjson_decoder_value(dec, in);
+
+    case PBJSON_DECODER_NEXT:
+        if (c == ',')
+        {
+            in->s++;
+            dec->state = (frame->fields != NULL) ? PBJSON_DECODER_OBJ_KEY : PBJSON_DECODER_VALUE;
+            return 0;
+        }
+
+        if (c != ((frame->fields != NULL) ? '}' : ']'))
+        {
+            return -1;
+        }
+
+        in->s++;
+        return pbjson_decoder_pop(dec);
+
+    default:
+        /* Only whitespace may follow the top-level object. */
+        return -1;
+    }
+}
+
+void pbjson_decoder_init(pbjson_decoder_t *dec, const pbjson_msgdesc_t *fields, void *dst)
+{
+    memset(dec, 0, sizeof(*dec));
+    dec->fields = fields;
+    dec->dst = dst;
+    dec->state = PBJSON_DECODER_BEGIN;
+}
+
+int pbjson_decoder_feed(pbjson_decoder_t *dec, const char *chunk, size_t len)
+{
+    pbjson_parser_t in = {chunk, chunk + len, 0, NULL, NULL, false, NULL, NULL};
+
+    while ((dec->state != PBJSON_DECODER_ERROR) && (in.s < in.end))
+    {
+        if (pbjson_decoder_step(dec, &in))
+        {
+            dec->state = PBJSON_DECODER_ERROR;
+        }
+    }
+
+    if (dec->state == PBJSON_DECODER_ERROR)
+    {
+        return -1;
+    }
+
+    return (dec->state == PBJSON_DECODER_DONE) ? 0 : PBJSON_DECODE_NEED_MORE;
+}
+
+#ifdef PBJSON_STATS
+PBJSON_THREAD_LOCAL pbjson_stats_t pbjson_stats_tls;
+static PBJSON_THREAD_LOCAL pbjson_stats_hook_t pbjson_stats_hook;
+static PBJSON_THREAD_LOCAL void *pbjson_stats_hook_arg;
+
+void pbjson_stats_message(const pbjson_msgdesc_t *fields, bool is_encode, size_t bytes, uint64_t start)
+{
+    if (is_encode)
+    {
+        pbjson_stats_tls.encode_messages++;
+    }
+    else
+    {
+        pbjson_stats_tls.decode_messages++;
+    }
+
+    if (pbjson_stats_hook != NULL)
+    {
+        pbjson_stats_hook(fields, is_encode, bytes, PBJSON_STATS_NOW() - start, pbjson_stats_hook_arg);
+    }
+}
+
+void pbjson_stats_get(pbjson_stats_t *stats)
+{
+    *stats = pbjson_stats_tls;
+}
+
+void pbjson_stats_reset(void)
+{
+    memset(&pbjson_stats_tls, 0, sizeof(pbjson_stats_tls));
+}
+
+void pbjson_stats_set_hook(pbjson_stats_hook_t hook, void *arg)
+{
+    pbjson_stats_hook = hook;
+    pbjson_stats_hook_arg = arg;
+}
+#endif
@@ -7,42 +7,43 @@
  */
 
 #include <pb/json.h>
+#include "pbjson_stats.h"
+#include "pbjson_simd.h"
+#include "pbjson_string.h"
+#include "pbjson_base64.h"
 #include <string.h>
-#include <stdio.h>
-#include <inttypes.h>
 #include <limits.h>
 
 /**
- * @struct pbjson_ostream_s
- * @brief Structure representing the JSON output stream.
+ * @brief Floating point number as a 64-bit significand and a binary exponent.
  *
- * @var pbjson_ostream_s::s
- * Pointer to the output buffer.
- * @var pbjson_ostream_s::max_size
- * Maximum size of the output buffer.
- * @var pbjson_ostream_s::bytes_written
- * Number of bytes written to the output buffer.
- * @var pbjson_ostream_s::is_wait_first_key
- * Flag indicating if the first key is being waited for.
+ * @var pbjson_diyfp_s::f
+ * Significand.
+ * @var pbjson_diyfp_s::e
+ * Binary exponent, the value is f * 2^e.
  */
-struct pbjson_ostream_s
+struct pbjson_diyfp_s
 {
-    char *s;
-    uint32_t max_size;
-    uint32_t bytes_written;
-    bool is_wait_first_key;
+    uint64_t f;
+    int e;
 };
 
-typedef struct pbjson_ostream_s pbjson_ostream_t;
+typedef struct pbjson_diyfp_s pbjson_diyfp_t;
 
 /**
- * @brief Copies a string from source to destination.
- *
- * @param dst Destination buffer.
- * @param src Source string.
- * @return Pointer to the end of the destination string.
+ * @brief Cached power of ten, c = f * 2^e ~= 10^k.
+ */
+struct pbjson_cached_power_s
+{
+    uint64_t f;
+    int e;
+    int k;
+};
+
+/**
+ * @brief Size of the scratch buffer needed by the number formatters.
  */
-static char *strcopy(char *dst, const char *src);
+#define PBJSON_NUMBER_BUF_SIZE 32
 
 /**
  * @brief Writes a character to the JSON output stream.
@@ -57,48 +58,133 @@ static int pbjson_ostream_put_char(pbjson_ostream_t *stream, char c);
  * @brief Writes a key to the JSON output stream.
  *
  * @param stream Pointer to the JSON output stream.
- * @param s Key string to write.
+ * @param fields Descriptor of the message holding @p key.
+ * @param key The field whose precomputed key literal is written.
+ * @param p_is_first Set while no key of the current object has been written, cleared by this call.
  * @return 0 on success, -1 on error.
  */
-static int pbjson_ostream_put_key(pbjson_ostream_t *stream, const char *s);
+static int pbjson_ostream_put_key(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const pbjson_iter_t *key,
+                                  bool *p_is_first);
 
 /**
  * @brief Writes a string value to the JSON output stream.
  *
  * @param stream Pointer to the JSON output stream.
  * @param s String value to write.
- * @return Number of bytes written on success, -1 on error.
+ * @return 0 on success, -1 on error.
  */
 static int pbjson_ostream_put_string(pbjson_ostream_t *stream, const char *s);
 
+/**
+ * @brief Writes a string value of known length to the JSON output stream.
+ *
+ * Quotes, backslashes and control characters are escaped. With
+ * PBJSON_VALIDATE_UTF8 text that is not well-formed UTF-8 is an error.
+ *
+ * @param stream Pointer to the JSON output stream.
+ * @param s String value to write, it does not need a terminator.
+ * @param len Length of @p s in bytes.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_ostream_put_string_n(pbjson_ostream_t *stream, const char *s, size_t len);
+
+/**
+ * @brief Writes bytes as a quoted base64 string to the JSON output stream.
+ *
+ * @param stream Pointer to the JSON output stream.
+ * @param data The bytes.
+ * @param len Number of bytes.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_ostream_put_bytes(pbjson_ostream_t *stream, const uint8_t *data, size_t len);
+
 /**
  * @brief Writes a boolean value to the JSON output stream.
  *
  * @param stream Pointer to the JSON output stream.
  * @param val Boolean value to write.
- * @return Number of bytes written on success, -1 on error.
+ * @return 0 on success, -1 on error.
  */
 static int pbjson_ostream_put_bool(pbjson_ostream_t *stream, bool val);
 
+/**
+ * @brief Finds the name the encoder writes for an enum value.
+ *
+ * Enums whose values have no gaps and no aliases are indexed by value,
+ * the others are binary searched for the first name of the value.
+ *
+ * @param desc Names of the enum.
+ * @param val The value.
+ * @return The name, or NULL if the enum has none for @p val.
+ */
+static const pbjson_enum_value_t *pbjson_enum_find(const pbjson_enumdesc_t *desc, int64_t val);
+
+/**
+ * @brief Writes an enum value by name if the stream asks for names and the enum has one, otherwise as a number.
+ *
+ * @param stream Pointer to the JSON output stream.
+ * @param desc Names of the enum, may be NULL.
+ * @param val The value.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_ostream_put_enum_value(pbjson_ostream_t *stream, const pbjson_enumdesc_t *desc, int64_t val);
+
 /**
  * @brief Writes an enum value to the JSON output stream.
  *
  * @param stream Pointer to the JSON output stream.
- * @param item_size Size of the enum item.
+ * @param fields Descriptor of the message holding @p key.
+ * @param key The enum field, its item size and names.
  * @param data Pointer to the enum data.
- * @return Number of bytes written on success, -1 on error.
+ * @return 0 on success, -1 on error.
  */
-static int pbjson_ostream_put_enum(pbjson_ostream_t *stream, uint32_t item_size, const void *data);
+static int pbjson_ostream_put_enum(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const pbjson_iter_t *key,
+                                   const void *data);
 
 /**
  * @brief Writes an unsigned enum value to the JSON output stream.
  *
  * @param stream Pointer to the JSON output stream.
- * @param item_size Size of the unsigned enum item.
+ * @param fields Descriptor of the message holding @p key.
+ * @param key The enum field, its item size and names.
  * @param data Pointer to the unsigned enum data.
- * @return Number of bytes written on success, -1 on error.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_ostream_put_uenum(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields,
+                                    const pbjson_iter_t *key, const void *data);
+
+/**
+ * @brief Formats an unsigned integer in decimal.
+ *
+ * @param buf Output buffer, at least 20 bytes.
+ * @param val Value to format.
+ * @return Number of characters written.
+ */
+static uint32_t pbjson_format_uint(char *buf, uint64_t val);
+
+/**
+ * @brief Formats a signed integer in decimal.
+ *
+ * @param buf Output buffer, at least 21 bytes.
+ * @param val Value to format.
+ * @return Number of characters written.
+ */
+static uint32_t pbjson_format_int(char *buf, int64_t val);
+
+/**
+ * @brief Formats a floating point number with digits that read back to the same value.
+ *
+ * Uses the Grisu2 algorithm on the binary representation of the value: the
+ * digits round-trip and are the shortest in almost all cases.
+ * Non-finite values are written as the quoted strings "NaN", "Infinity"
+ * and "-Infinity", as in the proto3 JSON mapping.
+ *
+ * @param buf Output buffer, at least PBJSON_NUMBER_BUF_SIZE bytes.
+ * @param val Value to format.
+ * @param is_single True to format (float)val, with the digits that read back as that float.
+ * @return Number of characters written.
  */
-static int pbjson_ostream_put_uenum(pbjson_ostream_t *stream, uint32_t item_size, const void *data);
+static uint32_t pbjson_format_float(char *buf, double val, bool is_single);
 
 /**
  * @brief Encodes a dictionary (object) into the JSON output stream.
@@ -110,16 +196,37 @@ static int pbjson_ostream_put_uenum(pbjson_ostream_t *stream, uint32_t item_size
  */
 static int pbjson_encode_dict(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const void *src_struct);
 
+/**
+ * @brief Encodes the members of an object, the part of pbjson_encode_dict() that is not instrumented.
+ *
+ * @param stream Pointer to the JSON output stream.
+ * @param fields Pointer to the message descriptor.
+ * @param src_struct Pointer to the source structure.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_encode_object(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const void *src_struct);
+
 /**
  * @brief Encodes an array into the JSON output stream.
  *
  * @param stream Pointer to the JSON output stream.
+ * @param fields Descriptor of the message holding @p key.
  * @param key Pointer to the key descriptor.
  * @param count Number of elements in the array.
  * @param src_struct Pointer to the source structure.
  * @return 0 on success, -1 on error.
  */
-static int pbjson_encode_array(pbjson_ostream_t *stream, const pbjson_iter_t *key, uint32_t count, const void *src_struct);
+static int pbjson_encode_array(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const pbjson_iter_t *key,
+                               uint32_t count, const void *src_struct);
+
+/**
+ * @brief Check if a field mask selects a field.
+ *
+ * @param mask The field mask.
+ * @param index Index of the field in @c mask->fields->iter.
+ * @return true if the field is selected.
+ */
+static bool pbjson_fieldmask_has(const pbjson_fieldmask_t *mask, uint32_t index);
 
 /**
  * @brief Checks if a structure has a specific key.
@@ -130,138 +237,720 @@ static int pbjson_encode_array(pbjson_ostream_t *stream, const pbjson_iter_t *ke
  */
 static bool pbjson_struct_has_key(const pbjson_iter_t *key, const void *src_struct);
 
+/**
+ * @brief Checks if a block of memory is all zero bytes.
+ *
+ * @param data Start of the block.
+ * @param size Size of the block in bytes.
+ * @return true if every byte is zero.
+ */
+static bool pbjson_is_zero(const void *data, size_t size);
+
+/**
+ * @brief Checks if a field holds its default value, for PBJSON_ENCODE_OMIT_DEFAULTS.
+ *
+ * Only called for fields that pbjson_struct_has_key() reports as present.
+ *
+ * @param fields Descriptor of the message holding @p key.
+ * @param key Pointer to the key descriptor.
+ * @param src_struct Pointer to the source structure.
+ * @return true if the field can be left out.
+ */
+static bool pbjson_key_is_default(const pbjson_msgdesc_t *fields, const pbjson_iter_t *key, const void *src_struct);
+
+/**
+ * @brief Checks if every field of a message holds its default value.
+ *
+ * @param fields Pointer to the message descriptor.
+ * @param src_struct Pointer to the source structure.
+ * @return true if the message encodes as an empty object with PBJSON_ENCODE_OMIT_DEFAULTS.
+ */
+static bool pbjson_message_is_default(const pbjson_msgdesc_t *fields, const void *src_struct);
+
 /**
  * @brief Encodes a value into the JSON output stream.
  *
  * @param stream Pointer to the JSON output stream.
+ * @param fields Descriptor of the message holding @p key.
  * @param key Pointer to the key descriptor.
  * @param data_offset Pointer to the data offset.
  * @return 0 on success, -1 on error.
  */
-static int pbjson_encode_value(pbjson_ostream_t *stream, const pbjson_iter_t *key, const void *data_offset);
+static int pbjson_encode_value(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const pbjson_iter_t *key,
+                               const void *data_offset);
 
 /**
  * @brief Encodes a key-value pair into the JSON output stream.
  *
  * @param stream Pointer to the JSON output stream.
+ * @param fields Descriptor of the message holding @p key.
  * @param key Pointer to the key descriptor.
  * @param src_struct Pointer to the source structure.
+ * @param p_is_first Set while no key of the current object has been written.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_encode_key(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const pbjson_iter_t *key,
+                             const void *src_struct, bool *p_is_first);
+
+/**
+ * @brief Counts the fields from @p first on that are static, singular and stored in ascending order.
+ *
+ * The data of such a run lies in one block, which the delta encoder
+ * compares with a single memcmp() before looking at the fields one by one.
+ *
+ * @param fields Pointer to the message descriptor.
+ * @param first Index of the first field of the run.
+ * @param p_end Receives the offset one past the data of the last field of the run.
+ * @return Number of fields in the run, 0 if @p first cannot start one.
+ */
+static uint32_t pbjson_static_run(const pbjson_msgdesc_t *fields, uint32_t first, size_t *p_end);
+
+/**
+ * @brief Checks if one element of a field has the same value in two places.
+ *
+ * @param fields Descriptor of the message holding @p key.
+ * @param key Pointer to the key descriptor.
+ * @param a Pointer to the first element.
+ * @param b Pointer to the second element.
+ * @return true if both encode the same.
+ */
+static bool pbjson_item_equal(const pbjson_msgdesc_t *fields, const pbjson_iter_t *key, const void *a, const void *b);
+
+/**
+ * @brief Checks if a field has the same value in two structures.
+ *
+ * Callback fields cannot be compared: they count as changed whenever @p b
+ * has an encode callback.
+ *
+ * @param fields Descriptor of the message holding @p key.
+ * @param key Pointer to the key descriptor.
+ * @param a Pointer to the first structure.
+ * @param b Pointer to the second structure.
+ * @return true if the field need not be written to turn @p a into @p b.
+ */
+static bool pbjson_key_equal(const pbjson_msgdesc_t *fields, const pbjson_iter_t *key, const void *a, const void *b);
+
+/**
+ * @brief Checks if two structures hold the same message.
+ *
+ * @param fields Pointer to the message descriptor.
+ * @param a Pointer to the first structure.
+ * @param b Pointer to the second structure.
+ * @return true if pbjson_key_equal() holds for every field.
+ */
+static bool pbjson_message_equal(const pbjson_msgdesc_t *fields, const void *a, const void *b);
+
+/**
+ * @brief Writes one field that differs between two structures.
+ *
+ * Removed fields are written as null, submessages present in both
+ * structures as their own delta and everything else with its whole value.
+ *
+ * @param stream Pointer to the JSON output stream.
+ * @param fields Descriptor of the message holding @p key.
+ * @param key Pointer to the key descriptor.
+ * @param prev Pointer to the previous structure.
+ * @param cur Pointer to the current structure.
+ * @param p_is_first Set while no key of the current object has been written.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_encode_delta_key(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const pbjson_iter_t *key,
+                                   const void *prev, const void *cur, bool *p_is_first);
+
+/**
+ * @brief Writes an object with the fields that differ between two structures.
+ *
+ * @param stream Pointer to the JSON output stream.
+ * @param fields Pointer to the message descriptor.
+ * @param prev Pointer to the previous structure.
+ * @param cur Pointer to the current structure.
  * @return 0 on success, -1 on error.
  */
-static int pbjson_encode_key(pbjson_ostream_t *stream, const pbjson_iter_t *key, const void *src_struct);
+static int pbjson_encode_delta_object(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const void *prev,
+                                      const void *cur);
 
+/**
+ * @brief One field read from protobuf binary input.
+ */
+typedef struct pbjson_pb_field_s
+{
+    uint32_t tag;        /**< Field number. */
+    unsigned wire_type;  /**< Protobuf wire type. */
+    uint64_t raw;        /**< Value of a varint, fixed32 or fixed64 field. */
+    const uint8_t *data; /**< Contents of a length-delimited field. */
+    size_t len;          /**< Length of @c data in bytes. */
+} pbjson_pb_field_t;
 
-static char *strcopy(char *dst, const char *src)
+/**
+ * @brief A protobuf message to transcode, one buffer or every occurrence of a singular submessage.
+ */
+typedef struct pbjson_pb_source_s
 {
-    while (*src != '\0')
-    {
-        *dst = *src;
-        dst++;
-        src++;
-    }
+    const struct pbjson_pb_source_s *parent; /**< Message holding the occurrences, NULL for a single buffer. */
+    uint32_t tag;                            /**< Field number of the occurrences in @c parent. */
+    const uint8_t *buf;                      /**< The buffer if @c parent is NULL. */
+    size_t size;                             /**< Size of @c buf in bytes. */
+} pbjson_pb_source_t;
 
-    return dst;
-}
+/**
+ * @brief Called by pbjson_pb_foreach_segment() with each buffer of a source.
+ *
+ * @param ctx User pointer passed to pbjson_pb_foreach_segment().
+ * @param buf The buffer.
+ * @param size Size of @p buf in bytes.
+ * @return 0 to go on, -1 to stop with an error.
+ */
+typedef int (*pbjson_pb_segment_fn)(void *ctx, const uint8_t *buf, size_t size);
 
-static int pbjson_ostream_put_char(pbjson_ostream_t *stream, char c)
+/**
+ * @brief State of pbjson_pb_scan_segment(), the occurrences of one field in the segments of the parent.
+ */
+typedef struct pbjson_pb_segment_scan_s
 {
-    if (stream->bytes_written >= stream->max_size)
-    {
-        return -1;
-    }
+    uint32_t tag;            /**< Field number of the occurrences. */
+    pbjson_pb_segment_fn fn; /**< Called with the contents of each occurrence. */
+    void *ctx;               /**< User pointer of @c fn. */
+} pbjson_pb_segment_scan_t;
+
+/**
+ * @brief State of pbjson_transcode_segment(), the occurrences of one field of a message.
+ */
+typedef struct pbjson_pb_occurrences_s
+{
+    pbjson_ostream_t *stream;       /**< Pointer to the JSON output stream. */
+    const pbjson_msgdesc_t *fields; /**< Descriptor of the message holding @c key. */
+    const pbjson_iter_t *key;       /**< The field. */
+    pbjson_pb_field_t *last;        /**< Receives the value of a singular field. */
+    uint32_t *p_count;              /**< Number of values seen so far. */
+    unsigned depth;                 /**< Nesting depth of the message holding the field. */
+    bool *p_is_first;               /**< Set while no key of the current object has been written. */
+    bool is_default;                /**< Cleared by pbjson_pb_default_segment() for a value that is not the default. */
+} pbjson_pb_occurrences_t;
+
+/**
+ * @brief Reads a varint from protobuf binary input.
+ *
+ * @param p Position in the input, advanced past the varint.
+ * @param end End of the input.
+ * @param val Receives the value.
+ * @return 0 on success, -1 if the varint is truncated or too long.
+ */
+static int pbjson_pb_read_varint(const uint8_t **p, const uint8_t *end, uint64_t *val);
+
+/**
+ * @brief Reads a little-endian fixed32 or fixed64 value from protobuf binary input.
+ *
+ * @param p Position in the input, advanced past the value.
+ * @param end End of the input.
+ * @param len 4 or 8.
+ * @param val Receives the value.
+ * @return 0 on success, -1 if the value is truncated.
+ */
+static int pbjson_pb_read_fixed(const uint8_t **p, const uint8_t *end, size_t len, uint64_t *val);
+
+/**
+ * @brief Reads the next field of a protobuf message.
+ *
+ * @param p Position in the message, advanced past the field.
+ * @param end End of the message.
+ * @param field Receives the field.
+ * @return 1 if a field was read, 0 at the end of the message, -1 on malformed input.
+ */
+static int pbjson_pb_next_field(const uint8_t **p, const uint8_t *end, pbjson_pb_field_t *field);
+
+/**
+ * @brief Passes the buffers of a source to @p fn in input order.
+ *
+ * The occurrences of a merged source are the contents of every field with
+ * its tag, in every buffer of the parent. Their concatenation is the message,
+ * as protobuf merges them.
+ *
+ * @param src The source.
+ * @param fn Called with each buffer.
+ * @param ctx User pointer of @p fn.
+ * @return 0 on success, -1 on malformed input or if @p fn failed.
+ */
+static int pbjson_pb_foreach_segment(const pbjson_pb_source_t *src, pbjson_pb_segment_fn fn, void *ctx);
+
+/**
+ * @brief Passes the fields of one buffer with the tag of a merged source on, see pbjson_pb_segment_scan_t.
+ */
+static int pbjson_pb_scan_segment(void *ctx, const uint8_t *buf, size_t size);
+
+/**
+ * @brief Checks that one buffer of a source is a well-formed message, @p ctx is not used.
+ */
+static int pbjson_pb_check_segment(void *ctx, const uint8_t *buf, size_t size);
+
+/**
+ * @brief Adds the occurrences of a field in one buffer of a source to the JSON output, see pbjson_pb_occurrences_t.
+ */
+static int pbjson_transcode_segment(void *ctx, const uint8_t *buf, size_t size);
+
+/**
+ * @brief Checks if one occurrence of a merged submessage holds only defaults, see pbjson_pb_occurrences_t.
+ */
+static int pbjson_pb_default_segment(void *ctx, const uint8_t *buf, size_t size);
+
+/**
+ * @brief Writes one protobuf value of a field as JSON.
+ *
+ * @param stream Pointer to the JSON output stream.
+ * @param fields Descriptor of the message holding @p key.
+ * @param key The field the value belongs to.
+ * @param field The value, its tag is not used.
+ * @param depth Nesting depth of the message holding the field.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_transcode_put_value(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields,
+                                      const pbjson_iter_t *key, const pbjson_pb_field_t *field, unsigned depth);
+
+/**
+ * @brief Adds one occurrence of a field of a protobuf message to the JSON output.
+ *
+ * Repeated fields are written as they come, singular fields only remember the
+ * value until pbjson_transcode_finish(), taking the last occurrence like protobuf.
+ *
+ * @param stream Pointer to the JSON output stream.
+ * @param fields Descriptor of the message holding @p key.
+ * @param key The field.
+ * @param field The occurrence, its tag matches the field.
+ * @param last Receives the value of a singular field.
+ * @param p_count Number of values seen so far, incremented by this call.
+ * @param depth Nesting depth of the message holding the field.
+ * @param p_is_first Set while no key of the current object has been written.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_transcode_occurrence(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields,
+                                       const pbjson_iter_t *key, const pbjson_pb_field_t *field,
+                                       pbjson_pb_field_t *last, uint32_t *p_count, unsigned depth, bool *p_is_first);
+
+/**
+ * @brief Completes a field of a protobuf message in the JSON output once all its occurrences were added.
+ *
+ * Missing fields are written like pbjson_encode() writes a zeroed structure.
+ * A singular submessage that occurs more than once is written merged.
+ *
+ * @param stream Pointer to the JSON output stream.
+ * @param src The message holding @p key.
+ * @param fields Descriptor of the message holding @p key.
+ * @param key The field.
+ * @param last Value of a singular field, zero if there was none.
+ * @param count Number of values seen.
+ * @param depth Nesting depth of the message holding the field.
+ * @param p_is_first Set while no key of the current object has been written.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_transcode_finish(pbjson_ostream_t *stream, const pbjson_pb_source_t *src,
+                                   const pbjson_msgdesc_t *fields, const pbjson_iter_t *key,
+                                   const pbjson_pb_field_t *last, uint32_t count, unsigned depth, bool *p_is_first);
+
+/**
+ * @brief Checks if a protobuf value holds the default of its field, for PBJSON_ENCODE_OMIT_DEFAULTS.
+ *
+ * @param fields Descriptor of the message holding @p key.
+ * @param key The field.
+ * @param field The value.
+ * @param depth Nesting depth of the message holding the field.
+ * @return true if the field can be left out, with the same rules as for structures.
+ */
+static bool pbjson_pb_value_is_default(const pbjson_msgdesc_t *fields, const pbjson_iter_t *key,
+                                       const pbjson_pb_field_t *field, unsigned depth);
+
+/**
+ * @brief Writes a protobuf message as a JSON object.
+ *
+ * @param stream Pointer to the JSON output stream.
+ * @param fields Pointer to the message descriptor.
+ * @param src The encoded message.
+ * @param depth Nesting depth of the message, 0 for the top level.
+ * @return 0 on success, -1 on error.
+ */
+static int pbjson_transcode_message(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields,
+                                    const pbjson_pb_source_t *src, unsigned depth);
+
+/* Two decimal digits for every value 0..99. */
+static const char pbjson_digit_pairs[200] = {
+    '0', '0', '0', '1', '0', '2', '0', '3', '0', '4', '0', '5', '0', '6', '0', '7', '0', '8', '0', '9',
+    '1', '0', '1', '1', '1', '2', '1', '3', '1', '4', '1', '5', '1', '6', '1', '7', '1', '8', '1', '9',
+    '2', '0', '2', '1', '2', '2', '2', '3', '2', '4', '2', '5', '2', '6', '2', '7', '2', '8', '2', '9',
+    '3', '0', '3', '1', '3', '2', '3', '3', '3', '4', '3', '5', '3', '6', '3', '7', '3', '8', '3', '9',
+    '4', '0', '4', '1', '4', '2', '4', '3', '4', '4', '4', '5', '4', '6', '4', '7', '4', '8', '4', '9',
+    '5', '0', '5', '1', '5', '2', '5', '3', '5', '4', '5', '5', '5', '6', '5', '7', '5', '8', '5', '9',
+    '6', '0', '6', '1', '6', '2', '6', '3', '6', '4', '6', '5', '6', '6', '6', '7', '6', '8', '6', '9',
+    '7', '0', '7', '1', '7', '2', '7', '3', '7', '4', '7', '5', '7', '6', '7', '7', '7', '8', '7', '9',
+    '8', '0', '8', '1', '8', '2', '8', '3', '8', '4', '8', '5', '8', '6', '8', '7', '8', '8', '8', '9',
+    '9', '0', '9', '1', '9', '2', '9', '3', '9', '4', '9', '5', '9', '6', '9', '7', '9', '8', '9', '9',
+};
+
+/* Normalized powers of ten 10^k for k = -300, -292, ..., 324. */
+static const struct pbjson_cached_power_s pbjson_cached_powers[] = {
+    {0xAB70FE17C79AC6CA, -1060, -300},
+    {0xFF77B1FCBEBCDC4F, -1034, -292},
+    {0xBE5691EF416BD60C, -1007, -284},
+    {0x8DD01FAD907FFC3C,  -980, -276},
+    {0xD3515C2831559A83,  -954, -268},
+    {0x9D71AC8FADA6C9B5,  -927, -260},
+    {0xEA9C227723EE8BCB,  -901, -252},
+    {0xAECC49914078536D,  -874, -244},
+    {0x823C12795DB6CE57,  -847, -236},
+    {0xC21094364DFB5637,  -821, -228},
+    {0x9096EA6F3848984F,  -794, -220},
+    {0xD77485CB25823AC7,  -768, -212},
+    {0xA086CFCD97BF97F4,  -741, -204},
+    {0xEF340A98172AACE5,  -715, -196},
+    {0xB23867FB2A35B28E,  -688, -188},
+    {0x84C8D4DFD2C63F3B,  -661, -180},
+    {0xC5DD44271AD3CDBA,  -635, -172},
+    {0x936B9FCEBB25C996,  -608, -164},
+    {0xDBAC6C247D62A584,  -582, -156},
+    {0xA3AB66580D5FDAF6,  -555, -148},
+    {0xF3E2F893DEC3F126,  -529, -140},
+    {0xB5B5ADA8AAFF80B8,  -502, -132},
+    {0x87625F056C7C4A8B,  -475, -124},
+    {0xC9BCFF6034C13053,  -449, -116},
+    {0x964E858C91BA2655,  -422, -108},
+    {0xDFF9772470297EBD,  -396, -100},
+    {0xA6DFBD9FB8E5B88F,  -369,  -92},
+    {0xF8A95FCF88747D94,  -343,  -84},
+    {0xB94470938FA89BCF,  -316,  -76},
+    {0x8A08F0F8BF0F156B,  -289,  -68},
+    {0xCDB02555653131B6,  -263,  -60},
+    {0x993FE2C6D07B7FAC,  -236,  -52},
+    {0xE45C10C42A2B3B06,  -210,  -44},
+    {0xAA242499697392D3,  -183,  -36},
+    {0xFD87B5F28300CA0E,  -157,  -28},
+    {0xBCE5086492111AEB,  -130,  -20},
+    {0x8CBCCC096F5088CC,  -103,  -12},
+    {0xD1B71758E219652C,   -77,   -4},
+    {0x9C40000000000000,   -50,    4},
+    {0xE8D4A51000000000,   -24,   12},
+    {0xAD78EBC5AC620000,     3,   20},
+    {0x813F3978F8940984,    30,   28},
+    {0xC097CE7BC90715B3,    56,   36},
+    {0x8F7E32CE7BEA5C70,    83,   44},
+    {0xD5D238A4ABE98068,   109,   52},
+    {0x9F4F2726179A2245,   136,   60},
+    {0xED63A231D4C4FB27,   162,   68},
+    {0xB0DE65388CC8ADA8,   189,   76},
+    {0x83C7088E1AAB65DB,   216,   84},
+    {0xC45D1DF942711D9A,   242,   92},
+    {0x924D692CA61BE758,   269,  100},
+    {0xDA01EE641A708DEA,   295,  108},
+    {0xA26DA3999AEF774A,   322,  116},
+    {0xF209787BB47D6B85,   348,  124},
+    {0xB454E4A179DD1877,   375,  132},
+    {0x865B86925B9BC5C2,   402,  140},
+    {0xC83553C5C8965D3D,   428,  148},
+    {0x952AB45CFA97A0B3,   455,  156},
+    {0xDE469FBD99A05FE3,   481,  164},
+    {0xA59BC234DB398C25,   508,  172},
+    {0xF6C69A72A3989F5C,   534,  180},
+    {0xB7DCBF5354E9BECE,   561,  188},
+    {0x88FCF317F22241E2,   588,  196},
+    {0xCC20CE9BD35C78A5,   614,  204},
+    {0x98165AF37B2153DF,   641,  212},
+    {0xE2A0B5DC971F303A,   667,  220},
+    {0xA8D9D1535CE3B396,   694,  228},
+    {0xFB9B7CD9A4A7443C,   720,  236},
+    {0xBB764C4CA7A44410,   747,  244},
+    {0x8BAB8EEFB6409C1A,   774,  252},
+    {0xD01FEF10A657842C,   800,  260},
+    {0x9B10A4E5E9913129,   827,  268},
+    {0xE7109BFBA19C0C9D,   853,  276},
+    {0xAC2820D9623BF429,   880,  284},
+    {0x80444B5E7AA7CF85,   907,  292},
+    {0xBF21E44003ACDD2D,   933,  300},
+    {0x8E679C2F5E44FF8F,   960,  308},
+    {0xD433179D9C8CB841,   986,  316},
+    {0x9E19DB92B4E31BA9,  1013,  324},
+};
 
-    *stream->s = c;
-    stream->s++;
-    stream->bytes_written++;
-    return (stream->bytes_written >= stream->max_size) ? -1 : 0;
-    
+pbjson_ostream_t pbjson_ostream_from_buffer(char *buf, size_t bufsize)
+{
+    pbjson_ostream_t stream;
+    stream.callback = NULL;
+    stream.state = NULL;
+    stream.buf = buf;
+    stream.max_size = bufsize;
+    stream.pos = 0;
+    stream.bytes_written = 0;
+    stream.flags = 0;
+    stream.mask = NULL;
+    return stream;
 }
 
-static int pbjson_ostream_put_key(pbjson_ostream_t *stream, const char *s)
+pbjson_ostream_t pbjson_ostream_from_callback(int (*callback)(pbjson_ostream_t *stream, const char *buf, size_t count),
+                                              void *state, char *chunk, size_t chunk_size)
 {
+    pbjson_ostream_t stream;
+    stream.callback = callback;
+    stream.state = state;
+    stream.buf = chunk;
+    stream.max_size = (chunk != NULL) ? chunk_size : 0;
+    stream.pos = 0;
+    stream.bytes_written = 0;
+    stream.flags = 0;
+    stream.mask = NULL;
+    return stream;
+}
 
-    if (!stream->is_wait_first_key)
+int pbjson_write(pbjson_ostream_t *stream, const char *buf, size_t count)
+{
+    if (count == 0)
     {
-        int err = pbjson_ostream_put_char(stream, ',');
-        if (err)
-            return err;
+        return 0;
     }
 
-    if (stream->bytes_written >= stream->max_size)
+    if (stream->callback == NULL)
     {
-        return -1;
-    }
-    
-
-    int len = snprintf(stream->s, stream->max_size - stream->bytes_written, "\"%s\":", s);
-    if (len <= 0)
-        return -1;
-    stream->bytes_written += len;
-    stream->s += len;
-    return 0;
-}
+        /* Flat buffer, or only counting when there is no buffer. */
+        if (count > stream->max_size - stream->pos)
+        {
+            return -1;
+        }
 
-static int pbjson_ostream_put_string(pbjson_ostream_t *stream, const char *s)
-{
+        if (stream->buf != NULL)
+        {
+            memcpy(stream->buf + stream->pos, buf, count);
+        }
 
-    size_t temp_len = strlen(s);
-    if (temp_len > INT_MAX)
-    {
-        return -1; // or any other error handling mechanism
+        stream->pos += count;
+        stream->bytes_written += count;
+        return 0;
     }
-    int len = (int)temp_len;
 
-    len += 2;
+    stream->bytes_written += count;
 
-    uint32_t newLen = stream->bytes_written + len;
+    if (count <= stream->max_size - stream->pos)
+    {
+        memcpy(stream->buf + stream->pos, buf, count);
+        stream->pos += count;
+        return 0;
+    }
 
-    if (newLen >= stream->max_size)
+    /* The chunk is full: send what it holds, then either start a new chunk
+     * or pass writes that would not fit into an empty chunk straight through. */
+    if (pbjson_ostream_flush(stream))
     {
         return -1;
     }
 
-    char *dst = stream->s;
+    if (count >= stream->max_size)
+    {
+        return stream->callback(stream, buf, count);
+    }
 
-    *dst = '"';
-    dst++;
+    memcpy(stream->buf, buf, count);
+    stream->pos = count;
+    return 0;
+}
 
-    dst = strcopy(dst, s);
+int pbjson_ostream_flush(pbjson_ostream_t *stream)
+{
+    if ((stream->callback == NULL) || (stream->pos == 0))
+    {
+        return 0;
+    }
 
-    *dst = '"';
+    size_t count = stream->pos;
+    stream->pos = 0;
+    return stream->callback(stream, stream->buf, count);
+}
 
-    return len;
+static int pbjson_ostream_put_char(pbjson_ostream_t *stream, char c)
+{
+    return pbjson_write(stream, &c, 1);
 }
 
-static int pbjson_ostream_put_bool(pbjson_ostream_t *stream, bool val)
+static int pbjson_ostream_put_key(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const pbjson_iter_t *key,
+                                  bool *p_is_first)
 {
-    uint32_t len = (val ? 4 : 5);
-    uint32_t new_len = stream->bytes_written + len;
+    /* One write of ",\"name\":", starting after the comma for the first key. */
+    size_t skip = *p_is_first ? 1 : 0;
 
-    if (new_len >= stream->max_size)
-    {
-        return -1;
-    }
+    *p_is_first = false;
 
-    strcopy(stream->s, val ? "true" : "false");
+    return pbjson_write(stream, PBJSON_ITER_KEY(fields, key) + skip, key->name_len + 4 - skip);
+}
 
-    return len;
+static int pbjson_ostream_put_string(pbjson_ostream_t *stream, const char *s)
+{
+    return pbjson_ostream_put_string_n(stream, s, strlen(s));
 }
 
-static int pbjson_ostream_put_enum(pbjson_ostream_t *stream, uint32_t item_size, const void *data)
+static int pbjson_ostream_put_string_n(pbjson_ostream_t *stream, const char *s, size_t len)
 {
-    int val;
+    const char *end = s + len;
+    const char *run = s;
+
+    int err = pbjson_ostream_put_char(stream, '"');
+    if (err)
+        return err;
 
-    switch (item_size)
+    /* Text without special characters is written in one piece. */
+    while (s < end)
     {
-#if INT_MAX > INT16_MAX
-    case sizeof(int):
-        val = *(const unsigned *)data;
-        break;
-#endif
+        const char *stop = pbjson_simd_find(s, end, PBJSON_SIMD_ESCAPE);
 
-    case sizeof(int16_t):
-        val = *(const int16_t *)data;
-        break;
+        if (stop == end)
+        {
+            break;
+        }
+
+        if (PBJSON_SIMD_IS_UTF8(*stop))
+        {
+            size_t n = pbjson_utf8_length(stop, end);
+            if (n == 0)
+                return -1;
+
+            s = stop + n;
+            continue;
+        }
+
+        char escape[PBJSON_ESCAPE_MAX];
+
+        if (pbjson_write(stream, run, (size_t)(stop - run)) ||
+            pbjson_write(stream, escape, pbjson_escape_char(*stop, escape)))
+        {
+            return -1;
+        }
+
+        s = stop + 1;
+        run = s;
+    }
+
+    err = pbjson_write(stream, run, (size_t)(end - run));
+    if (err)
+        return err;
+
+    return pbjson_ostream_put_char(stream, '"');
+}
+
+static int pbjson_ostream_put_bytes(pbjson_ostream_t *stream, const uint8_t *data, size_t len)
+{
+    size_t chars = PBJSON_BASE64_LENGTH(len);
+
+    if ((len > SIZE_MAX / 4) || pbjson_ostream_put_char(stream, '"'))
+    {
+        return -1;
+    }
+
+    if (stream->callback == NULL)
+    {
+        /* Flat buffers take the text in place, sizing streams only count it. */
+        if (chars > stream->max_size - stream->pos)
+        {
+            return -1;
+        }
+
+        if (stream->buf != NULL)
+        {
+            pbjson_base64_encode(data, len, stream->buf + stream->pos);
+        }
+
+        stream->pos += chars;
+        stream->bytes_written += chars;
+    }
+    else
+    {
+        /* Whole quanta per chunk, so only the last one is padded. */
+        char chunk[512];
+        size_t step = sizeof(chunk) / 4 * 3;
+
+        for (size_t i = 0; i < len; i += step)
+        {
+            size_t n = (len - i < step) ? len - i : step;
+
+            if (pbjson_write(stream, chunk, pbjson_base64_encode(data + i, n, chunk)))
+            {
+                return -1;
+            }
+        }
+    }
+
+    return pbjson_ostream_put_char(stream, '"');
+}
+
+static int pbjson_ostream_put_bool(pbjson_ostream_t *stream, bool val)
+{
+    return val ? pbjson_write(stream, "true", 4) : pbjson_write(stream, "false", 5);
+}
+
+static const pbjson_enum_value_t *pbjson_enum_find(const pbjson_enumdesc_t *desc, int64_t val)
+{
+    const pbjson_enum_value_t *values = desc->values;
+    uint32_t count = desc->num_values;
+
+    if (count == 0)
+    {
+        return NULL;
+    }
+
+    int64_t first = values[0].value;
+
+    /* Without gaps or aliases the value is its own index. An alias plus a gap
+     * can give the same span, so the entry found this way is checked, and
+     * must not be a later alias of the one before it. */
+    if (((int64_t)values[count - 1].value - first == (int64_t)count - 1) && (val >= first) &&
+        (val - first < (int64_t)count) && (values[val - first].value == val) &&
+        ((val == first) || (values[val - first - 1].value != val)))
+    {
+        return &values[val - first];
+    }
+
+    uint32_t lo = 0;
+    uint32_t hi = count;
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (values[mid].value < val)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    return ((lo < count) && (values[lo].value == val)) ? &values[lo] : NULL;
+}
+
+static int pbjson_ostream_put_enum_value(pbjson_ostream_t *stream, const pbjson_enumdesc_t *desc, int64_t val)
+{
+    if ((stream->flags & PBJSON_ENCODE_ENUM_NAMES) && (desc != NULL))
+    {
+        const pbjson_enum_value_t *name = pbjson_enum_find(desc, val);
+
+        if (name != NULL)
+        {
+            return pbjson_write(stream, name->json_name, (size_t)name->name_len + 2);
+        }
+    }
+
+    char buf[PBJSON_NUMBER_BUF_SIZE];
+    return pbjson_write(stream, buf, pbjson_format_int(buf, val));
+}
+
+static int pbjson_ostream_put_enum(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const pbjson_iter_t *key,
+                                   const void *data)
+{
+    int val;
+
+    switch (key->item_size)
+    {
+#if INT_MAX > INT16_MAX
+    case sizeof(int):
+        val = *(const int *)data;
+        break;
+#endif
+
+    case sizeof(int16_t):
+        val = *(const int16_t *)data;
+        break;
     case sizeof(int8_t):
         val = *(const int8_t *)data;
         break;
@@ -270,14 +959,15 @@ static int pbjson_ostream_put_enum(pbjson_ostream_t *stream, uint32_t item_size,
         return -1;
     }
 
-    return snprintf(stream->s, stream->max_size - stream->bytes_written, "%d", val);
+    return pbjson_ostream_put_enum_value(stream, PBJSON_ITER_ENUMDESC(fields, key), val);
 }
 
-static int pbjson_ostream_put_uenum(pbjson_ostream_t *stream, uint32_t item_size, const void *data)
+static int pbjson_ostream_put_uenum(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields,
+                                    const pbjson_iter_t *key, const void *data)
 {
     unsigned val;
 
-    switch (item_size)
+    switch (key->item_size)
     {
 #if UINT_MAX > INT16_MAX
     case sizeof(int):
@@ -295,23 +985,372 @@ static int pbjson_ostream_put_uenum(pbjson_ostream_t *stream, uint32_t item_size
         return -1;
     }
 
-    return snprintf(stream->s, stream->max_size - stream->bytes_written, "%u", val);
+    return pbjson_ostream_put_enum_value(stream, PBJSON_ITER_ENUMDESC(fields, key), val);
+}
+
+static uint32_t pbjson_format_uint(char *buf, uint64_t val)
+{
+    char tmp[20];
+    char *p = tmp + sizeof(tmp);
+
+    while (val >= 100)
+    {
+        const char *pair = &pbjson_digit_pairs[(val % 100) * 2];
+        val /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+
+    if (val >= 10)
+    {
+        const char *pair = &pbjson_digit_pairs[val * 2];
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    else
+    {
+        *--p = (char)('0' + val);
+    }
+
+    uint32_t len = (uint32_t)(tmp + sizeof(tmp) - p);
+    memcpy(buf, p, len);
+    return len;
+}
+
+static uint32_t pbjson_format_int(char *buf, int64_t val)
+{
+    if (val < 0)
+    {
+        *buf = '-';
+        /* Negate in unsigned arithmetic so that INT64_MIN works. */
+        return 1 + pbjson_format_uint(buf + 1, 0 - (uint64_t)val);
+    }
+
+    return pbjson_format_uint(buf, (uint64_t)val);
+}
+
+static pbjson_diyfp_t pbjson_diyfp_make(uint64_t f, int e)
+{
+    pbjson_diyfp_t x;
+    x.f = f;
+    x.e = e;
+    return x;
+}
+
+static pbjson_diyfp_t pbjson_diyfp_mul(pbjson_diyfp_t x, pbjson_diyfp_t y)
+{
+    /* 64x64 -> 128 bit multiplication, keeping the rounded upper half. */
+    uint64_t u_lo = x.f & 0xFFFFFFFFu;
+    uint64_t u_hi = x.f >> 32;
+    uint64_t v_lo = y.f & 0xFFFFFFFFu;
+    uint64_t v_hi = y.f >> 32;
+
+    uint64_t p0 = u_lo * v_lo;
+    uint64_t p1 = u_lo * v_hi;
+    uint64_t p2 = u_hi * v_lo;
+    uint64_t p3 = u_hi * v_hi;
+
+    uint64_t q = (p0 >> 32) + (p1 & 0xFFFFFFFFu) + (p2 & 0xFFFFFFFFu);
+    q += (uint64_t)1 << 31;
+
+    return pbjson_diyfp_make(p3 + (p2 >> 32) + (p1 >> 32) + (q >> 32), x.e + y.e + 64);
+}
+
+static pbjson_diyfp_t pbjson_diyfp_normalize(pbjson_diyfp_t x)
+{
+    while ((x.f >> 63) == 0)
+    {
+        x.f <<= 1;
+        x.e--;
+    }
+
+    return x;
+}
+
+static void pbjson_grisu2_round(char *buf, uint32_t len, uint64_t dist, uint64_t delta, uint64_t rest, uint64_t ten_k)
+{
+    /* Move the last digit towards the exact value while it stays inside the rounding interval. */
+    while ((rest < dist) && (delta - rest >= ten_k) && ((rest + ten_k < dist) || (dist - rest > rest + ten_k - dist)))
+    {
+        buf[len - 1]--;
+        rest += ten_k;
+    }
+}
+
+static uint32_t pbjson_grisu2_digits(char *buf, int *decimal_exponent, pbjson_diyfp_t m_minus, pbjson_diyfp_t w,
+                                     pbjson_diyfp_t m_plus)
+{
+    uint64_t delta = m_plus.f - m_minus.f;
+    uint64_t dist = m_plus.f - w.f;
+    int shift = -m_plus.e;
+    uint64_t one = (uint64_t)1 << shift;
+
+    uint32_t p1 = (uint32_t)(m_plus.f >> shift);
+    uint64_t p2 = m_plus.f & (one - 1);
+    uint32_t len = 0;
+
+    uint32_t pow10 = 1;
+    int n = 1;
+    while ((n < 10) && (p1 / pow10 >= 10))
+    {
+        pow10 *= 10;
+        n++;
+    }
+
+    while (n > 0)
+    {
+        buf[len++] = (char)('0' + p1 / pow10);
+        p1 %= pow10;
+        n--;
+
+        uint64_t rest = ((uint64_t)p1 << shift) + p2;
+        if (rest <= delta)
+        {
+            *decimal_exponent += n;
+            pbjson_grisu2_round(buf, len, dist, delta, rest, (uint64_t)pow10 << shift);
+            return len;
+        }
+
+        pow10 /= 10;
+    }
+
+    int m = 0;
+    while (true)
+    {
+        p2 *= 10;
+        buf[len++] = (char)('0' + (p2 >> shift));
+        p2 &= one - 1;
+        m++;
+
+        delta *= 10;
+        dist *= 10;
+
+        if (p2 <= delta)
+        {
+            break;
+        }
+    }
+
+    *decimal_exponent -= m;
+    pbjson_grisu2_round(buf, len, dist, delta, p2, one);
+    return len;
+}
+
+static uint32_t pbjson_grisu2(char *buf, int *decimal_exponent, double val, bool is_single)
+{
+    /* Decompose val into significand and exponent of its own precision,
+     * so that a float gets the boundaries of a float. */
+    uint64_t f;
+    int e;
+    bool lower_boundary_is_closer;
+
+    if (is_single)
+    {
+        float fval = (float)val;
+        uint32_t bits;
+        memcpy(&bits, &fval, sizeof(bits));
+
+        uint32_t biased_e = bits >> 23;
+        f = bits & 0x7FFFFFu;
+        lower_boundary_is_closer = (f == 0) && (biased_e > 1);
+
+        if (biased_e == 0)
+        {
+            e = 1 - 150;
+        }
+        else
+        {
+            f |= 0x800000u;
+            e = (int)biased_e - 150;
+        }
+    }
+    else
+    {
+        uint64_t bits;
+        memcpy(&bits, &val, sizeof(bits));
+
+        uint32_t biased_e = (uint32_t)(bits >> 52);
+        f = bits & 0xFFFFFFFFFFFFFu;
+        lower_boundary_is_closer = (f == 0) && (biased_e > 1);
+
+        if (biased_e == 0)
+        {
+            e = 1 - 1075;
+        }
+        else
+        {
+            f |= (uint64_t)1 << 52;
+            e = (int)biased_e - 1075;
+        }
+    }
+
+    /* Boundaries halfway to the neighbouring floating point values. */
+    pbjson_diyfp_t v = pbjson_diyfp_normalize(pbjson_diyfp_make(f, e));
+    pbjson_diyfp_t m_plus = pbjson_diyfp_normalize(pbjson_diyfp_make(2 * f + 1, e - 1));
+    pbjson_diyfp_t m_minus = lower_boundary_is_closer ? pbjson_diyfp_make(4 * f - 1, e - 2)
+                                                      : pbjson_diyfp_make(2 * f - 1, e - 1);
+    m_minus.f <<= m_minus.e - m_plus.e;
+    m_minus.e = m_plus.e;
+
+    /* Pick a cached power of ten that brings the exponent into [-60, -32]. */
+    int target = -60 - m_plus.e - 1;
+    int k = (target * 78913) / (1 << 18) + (target > 0);
+    unsigned index = (unsigned)(300 + k + 7) / 8;
+    const struct pbjson_cached_power_s *cached = &pbjson_cached_powers[index];
+    pbjson_diyfp_t c = pbjson_diyfp_make(cached->f, cached->e);
+
+    pbjson_diyfp_t w = pbjson_diyfp_mul(v, c);
+    pbjson_diyfp_t w_minus = pbjson_diyfp_mul(m_minus, c);
+    pbjson_diyfp_t w_plus = pbjson_diyfp_mul(m_plus, c);
+
+    /* Shrink the interval by one unit to account for the rounding in mul(). */
+    w_minus.f++;
+    w_plus.f--;
+
+    *decimal_exponent = -cached->k;
+    return pbjson_grisu2_digits(buf, decimal_exponent, w_minus, w, w_plus);
+}
+
+static uint32_t pbjson_format_float(char *buf, double val, bool is_single)
+{
+    if (val != val)
+    {
+        memcpy(buf, "\"NaN\"", 5);
+        return 5;
+    }
+
+    char *p = buf;
+    uint64_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+
+    if (bits >> 63)
+    {
+        *p++ = '-';
+        val = -val;
+    }
+
+    if (val > (is_single ? 3.40282346638528859812e+38 : 1.7976931348623157e308))
+    {
+        if (p != buf)
+        {
+            memcpy(buf, "\"-Infinity\"", 11);
+            return 11;
+        }
+
+        memcpy(buf, "\"Infinity\"", 10);
+        return 10;
+    }
+
+    if (val == 0)
+    {
+        *p++ = '0';
+        return (uint32_t)(p - buf);
+    }
+
+    int decimal_exponent;
+    uint32_t len = pbjson_grisu2(p, &decimal_exponent, val, is_single);
+
+    /* The value is digits * 10^decimal_exponent, n is the position of the decimal point. */
+    int n = (int)len + decimal_exponent;
+
+    if ((decimal_exponent >= 0) && (n <= 15))
+    {
+        /* 1234e3 -> 1234000 */
+        memset(p + len, '0', (size_t)decimal_exponent);
+        p += n;
+    }
+    else if ((n > 0) && (n <= 15))
+    {
+        /* 1234e-2 -> 12.34 */
+        memmove(p + n + 1, p + n, len - (uint32_t)n);
+        p[n] = '.';
+        p += len + 1;
+    }
+    else if ((n > -6) && (n <= 0))
+    {
+        /* 1234e-6 -> 0.001234 */
+        memmove(p + 2 - n, p, len);
+        p[0] = '0';
+        p[1] = '.';
+        memset(p + 2, '0', (size_t)-n);
+        p += 2 - n + len;
+    }
+    else
+    {
+        /* 1234e30 -> 1.234e33 */
+        if (len > 1)
+        {
+            memmove(p + 2, p + 1, len - 1);
+            p[1] = '.';
+            p += len + 1;
+        }
+        else
+        {
+            p++;
+        }
+
+        *p++ = 'e';
+        p += pbjson_format_int(p, n - 1);
+    }
+
+    return (uint32_t)(p - buf);
 }
 
 static int pbjson_encode_dict(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const void *src_struct)
 {
+#ifdef PBJSON_STATS
+    size_t start = stream->bytes_written;
+    uint64_t cycles = PBJSON_STATS_NOW();
+    int err = pbjson_encode_object(stream, fields, src_struct);
+
+    if (err == 0)
+    {
+        pbjson_stats_message(fields, true, stream->bytes_written - start, cycles);
+    }
+
+    return err;
+#else
+    return pbjson_encode_object(stream, fields, src_struct);
+#endif
+}
+
+static int pbjson_encode_object(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const void *src_struct)
+{
+    const pbjson_fieldmask_t *mask = stream->mask;
+
+    /* Generated encoders write every field. */
+    if ((fields->encode != NULL) && !(stream->flags & PBJSON_ENCODE_OMIT_DEFAULTS) && (mask == NULL))
+    {
+        return fields->encode(stream, src_struct);
+    }
+
+    if ((mask != NULL) && (mask->fields != fields))
+    {
+        return -1;
+    }
+
     int err;
     err = pbjson_ostream_put_char(stream, '{');
     if (err)
         return err;
 
-    stream->is_wait_first_key = true;
+    bool is_first = true;
 
     unsigned i = 0;
     for (; i < fields->num_field; i++)
     {
-        err = pbjson_encode_key(stream, &fields->iter[i], src_struct);
-        stream->is_wait_first_key = false;
+        if (mask == NULL)
+        {
+            err = pbjson_encode_key(stream, fields, &fields->iter[i], src_struct, &is_first);
+        }
+        else if (pbjson_fieldmask_has(mask, i))
+        {
+            /* The value is written with the mask of the field, NULL takes it whole. */
+            stream->mask = mask->sub[i];
+            err = pbjson_encode_key(stream, fields, &fields->iter[i], src_struct, &is_first);
+            stream->mask = mask;
+        }
+
         if (err)
             return err;
     }
@@ -321,7 +1360,8 @@ static int pbjson_encode_dict(pbjson_ostream_t *stream, const pbjson_msgdesc_t *
     return err;
 }
 
-static int pbjson_encode_array(pbjson_ostream_t *stream, const pbjson_iter_t *key, uint32_t count, const void *src_struct)
+static int pbjson_encode_array(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const pbjson_iter_t *key,
+                               uint32_t count, const void *src_struct)
 {
     int err;
     err = pbjson_ostream_put_char(stream, '[');
@@ -335,12 +1375,25 @@ static int pbjson_encode_array(pbjson_ostream_t *stream, const pbjson_iter_t *ke
     {
         if (key->data_type == PBJSON_MESSAGE_TYPE)
         {
-            err = pbjson_encode_dict(stream, key->submsg, pSrc);
+            err = pbjson_encode_dict(stream, PBJSON_ITER_SUBMSG(fields, key), pSrc);
+        }
+        else if ((key->atype == PBJSON_POINTER_ATYPE) && (key->data_type == PBJSON_STRING_TYPE))
+        {
+            /* Pointer string arrays hold the address of each string. */
+            const char *str = *(const char *const *)(const void *)pSrc;
+            err = pbjson_encode_value(stream, fields, key, (str != NULL) ? str : "");
+        }
+        else if ((key->atype == PBJSON_POINTER_ATYPE) && (key->data_type == PBJSON_BYTES_TYPE))
+        {
+            /* Pointer bytes arrays likewise, NULL is written as "". */
+            const pb_bytes_array_t *bytes = *(const pb_bytes_array_t *const *)(const void *)pSrc;
+            err = (bytes != NULL) ? pbjson_encode_value(stream, fields, key, bytes)
+                                  : pbjson_ostream_put_bytes(stream, NULL, 0);
         }
         else
         {
 
-            err = pbjson_encode_value(stream, key, pSrc);
+            err = pbjson_encode_value(stream, fields, key, pSrc);
         }
 
         if (err)
@@ -363,8 +1416,32 @@ static int pbjson_encode_array(pbjson_ostream_t *stream, const pbjson_iter_t *ke
     return err;
 }
 
+static bool pbjson_fieldmask_has(const pbjson_fieldmask_t *mask, uint32_t index)
+{
+    return ((mask->bits[index / 32] >> (index % 32)) & 1u) != 0;
+}
+
 static bool pbjson_struct_has_key(const pbjson_iter_t *key, const void *src_struct)
 {
+    if (key->atype == PBJSON_VIEW_ATYPE)
+    {
+        return ((const pbjson_string_view_t *)(const void *)(((const char *)src_struct) + key->data_offset))->data !=
+               NULL;
+    }
+
+    if (key->atype == PBJSON_CALLBACK_ATYPE)
+    {
+        /* Without an encode callback there is nothing to write. */
+        return ((const pbjson_callback_t *)(const void *)(((const char *)src_struct) + key->data_offset))->funcs.encode !=
+               NULL;
+    }
+
+    if ((key->atype == PBJSON_POINTER_ATYPE) && (key->option != PBJSON_OPTION_REPEATED))
+    {
+        /* A NULL pointer means the field is absent. */
+        return *(const void *const *)(const void *)(((const char *)src_struct) + key->data_offset) != NULL;
+    }
+
     if (key->option == PBJSON_OPTION_OPTIONAL)
     {
         const bool *pHasMsg = (const bool *)(const void *)(((const char *)src_struct) + key->count_offset);
@@ -374,117 +1451,1250 @@ static bool pbjson_struct_has_key(const pbjson_iter_t *key, const void *src_stru
     return true;
 }
 
-static int pbjson_encode_value(pbjson_ostream_t *stream, const pbjson_iter_t *key, const void *data_offset)
+static bool pbjson_is_zero(const void *data, size_t size)
 {
-    int len;
+    const unsigned char *p = (const unsigned char *)data;
+    size_t i = 0;
 
-    if(stream->bytes_written >= stream->max_size)
+    /* Word at a time, structures are mostly a few cache lines. */
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
     {
-        return -1;
+        uint64_t word;
+        memcpy(&word, p + i, sizeof(word));
+
+        if (word != 0)
+        {
+            return false;
+        }
     }
 
-    switch (key->data_type)
+    for (; i < size; i++)
     {
-    case PBJSON_STRING_TYPE:
-        len = pbjson_ostream_put_string(stream, (const char *)data_offset);
-        break;
-    case PBJSON_BOOL_TYPE:
-        len = pbjson_ostream_put_bool(stream, *(const bool *)data_offset);
+        if (p[i] != 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool pbjson_key_is_default(const pbjson_msgdesc_t *fields, const pbjson_iter_t *key, const void *src_struct)
+{
+    const void *data = (const void *)(((const char *)src_struct) + key->data_offset);
+
+    if (key->option == PBJSON_OPTION_REPEATED)
+    {
+        /* Callback arrays are up to their callback. */
+        return (key->atype != PBJSON_CALLBACK_ATYPE) &&
+               (*(const uint32_t *)(const void *)(((const char *)src_struct) + key->count_offset) == 0);
+    }
+
+    switch (key->atype)
+    {
+    case PBJSON_CALLBACK_ATYPE:
+        return false;
+
+    case PBJSON_VIEW_ATYPE:
+        return ((const pbjson_string_view_t *)data)->size == 0;
+
+    case PBJSON_POINTER_ATYPE:
+        /* A set pointer is presence, except for strings and bytes, which have none in proto3. */
+        if (key->data_type == PBJSON_BYTES_TYPE)
+        {
+            return (*(const pb_bytes_array_t *const *)data)->size == 0;
+        }
+        return (key->data_type == PBJSON_STRING_TYPE) && (**(const char *const *)data == '\0');
+
+    default:
         break;
+    }
+
+    /* Set has_ flags are presence too. */
+    if (key->option == PBJSON_OPTION_OPTIONAL)
+    {
+        return false;
+    }
+
+    if (key->data_type == PBJSON_STRING_TYPE)
+    {
+        return *(const char *)data == '\0';
+    }
+
+    if (key->data_type == PBJSON_BYTES_TYPE)
+    {
+        /* Bytes past the size may hold anything. */
+        return ((const pb_bytes_array_t *)data)->size == 0;
+    }
+
+    if (key->data_type == PBJSON_MESSAGE_TYPE)
+    {
+        /* Padding or old bytes after a string terminator can hide a default message from the fast test. */
+        return pbjson_is_zero(data, key->item_size) || pbjson_message_is_default(PBJSON_ITER_SUBMSG(fields, key), data);
+    }
+
+    /* Scalars compare by bit pattern, so -0.0 is kept, like in protobuf. */
+    return pbjson_is_zero(data, key->item_size);
+}
+
+static bool pbjson_message_is_default(const pbjson_msgdesc_t *fields, const void *src_struct)
+{
+    for (uint32_t i = 0; i < fields->num_field; i++)
+    {
+        const pbjson_iter_t *key = &fields->iter[i];
+
+        if (pbjson_struct_has_key(key, src_struct) && !pbjson_key_is_default(fields, key, src_struct))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int pbjson_encode_value(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const pbjson_iter_t *key,
+                               const void *data_offset)
+{
+    char buf[PBJSON_NUMBER_BUF_SIZE];
+    uint32_t len;
+
+    switch (key->data_type)
+    {
+    case PBJSON_STRING_TYPE:
+        if (key->atype == PBJSON_VIEW_ATYPE)
+        {
+            /* An escaped view is JSON text as the decoder left it, other views are plain text. */
+            const pbjson_string_view_t *view = (const pbjson_string_view_t *)data_offset;
+            if (!view->escaped)
+            {
+                return pbjson_ostream_put_string_n(stream, view->data, view->size);
+            }
+            if (pbjson_ostream_put_char(stream, '"') || pbjson_write(stream, view->data, view->size))
+            {
+                return -1;
+            }
+            return pbjson_ostream_put_char(stream, '"');
+        }
+        return pbjson_ostream_put_string(stream, (const char *)data_offset);
+    case PBJSON_BYTES_TYPE:
+    {
+        const pb_bytes_array_t *bytes = (const pb_bytes_array_t *)data_offset;
+
+        /* The size comes from the structure, a static array may not claim more than it holds. */
+        if ((key->atype == PBJSON_STATIC_ATYPE) && (key->item_size != 0) &&
+            (bytes->size > key->item_size - offsetof(pb_bytes_array_t, bytes)))
+        {
+            return -1;
+        }
+        return pbjson_ostream_put_bytes(stream, bytes->bytes, bytes->size);
+    }
+    case PBJSON_BOOL_TYPE:
+        return pbjson_ostream_put_bool(stream, *(const bool *)data_offset);
     case PBJSON_INT32_TYPE:
-        len = snprintf(stream->s, stream->max_size - stream->bytes_written, "%" PRId32, *(const int32_t *)data_offset);
+        len = pbjson_format_int(buf, *(const int32_t *)data_offset);
         break;
     case PBJSON_INT64_TYPE:
-        len = snprintf(stream->s, stream->max_size - stream->bytes_written, "%" PRId64, *(const int64_t *)data_offset);
+        len = pbjson_format_int(buf, *(const int64_t *)data_offset);
         break;
     case PBJSON_UINT32_TYPE:
-        len = snprintf(stream->s, stream->max_size - stream->bytes_written, "%" PRIu32, *(const uint32_t *)data_offset);
+        len = pbjson_format_uint(buf, *(const uint32_t *)data_offset);
         break;
     case PBJSON_UINT64_TYPE:
-        len = snprintf(stream->s, stream->max_size - stream->bytes_written, "%" PRIu64, *(const uint64_t *)data_offset);
+        len = pbjson_format_uint(buf, *(const uint64_t *)data_offset);
         break;
 
     case PBJSON_FLOAT_TYPE:
-        len = snprintf(stream->s, stream->max_size - stream->bytes_written, "%f", *(const float *)data_offset);
+        len = pbjson_format_float(buf, *(const float *)data_offset, true);
         break;
     case PBJSON_DOUBLE_TYPE:
-        len = snprintf(stream->s, stream->max_size - stream->bytes_written, "%lf", *(const double *)data_offset);
+        len = pbjson_format_float(buf, *(const double *)data_offset, false);
         break;
 
     case PBJSON_ENUM_TYPE:
-        len = pbjson_ostream_put_enum(stream, key->item_size, data_offset);
-        break;
+        return pbjson_ostream_put_enum(stream, fields, key, data_offset);
 
     case PBJSON_UENUM_TYPE:
-        len = pbjson_ostream_put_uenum(stream, key->item_size, data_offset);
-        break;
+        return pbjson_ostream_put_uenum(stream, fields, key, data_offset);
 
     default:
-        len = -1;
-        break;
-    }
-
-    if (len <= 0)
         return -1;
+    }
 
-    stream->bytes_written += len;
-    stream->s += len;
-    return 0;
+    return pbjson_write(stream, buf, len);
 }
 
-static int pbjson_encode_key(pbjson_ostream_t *stream, const pbjson_iter_t *key, const void *src_struct)
+static int pbjson_encode_key(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const pbjson_iter_t *key,
+                             const void *src_struct, bool *p_is_first)
 {
     if (!pbjson_struct_has_key(key, src_struct))
     {
         return 0;
     }
 
+    if ((stream->flags & PBJSON_ENCODE_OMIT_DEFAULTS) && pbjson_key_is_default(fields, key, src_struct))
+    {
+        return 0;
+    }
+
     int err;
-    err = pbjson_ostream_put_key(stream, key->name);
+    err = pbjson_ostream_put_key(stream, fields, key, p_is_first);
     if (err)
         return err;
 
+    PBJSON_STATS_ADD(encode_fields, 1);
+
     err = -1;
 
     const void *data_offset = (const void *)(((const char *)src_struct) + key->data_offset);
 
+    if (key->atype == PBJSON_CALLBACK_ATYPE)
+    {
+        const pbjson_callback_t *callback = (const pbjson_callback_t *)data_offset;
+        return (callback->funcs.encode(stream, key, &callback->arg) == 0) ? 0 : -1;
+    }
+
+    if (key->atype == PBJSON_POINTER_ATYPE)
+    {
+        data_offset = *(const void *const *)data_offset;
+    }
+
     if (key->option == PBJSON_OPTION_REPEATED)
     {
         const uint32_t *pdata_cout = (const uint32_t *)(const void *)(((const char *)src_struct) + key->count_offset);
-        err = pbjson_encode_array(stream, key, *pdata_cout, data_offset);
+
+        if ((data_offset == NULL) && (*pdata_cout != 0))
+        {
+            return -1;
+        }
+
+        err = pbjson_encode_array(stream, fields, key, *pdata_cout, data_offset);
     }
     else if (key->data_type == PBJSON_MESSAGE_TYPE)
     {
-        err = pbjson_encode_dict(stream, key->submsg, data_offset);
+        err = pbjson_encode_dict(stream, PBJSON_ITER_SUBMSG(fields, key), data_offset);
     }
 
     else
     {
-        err = pbjson_encode_value(stream, key, data_offset);
+        err = pbjson_encode_value(stream, fields, key, data_offset);
     }
 
     return err;
 }
 
-int pbjson_encode(char *s, uint32_t len, const pbjson_msgdesc_t *fields, const void *src_struct)
+static uint32_t pbjson_static_run(const pbjson_msgdesc_t *fields, uint32_t first, size_t *p_end)
 {
-    if (len < 3)
+    size_t end = fields->iter[first].data_offset;
+    uint32_t i = first;
+
+    for (; i < fields->num_field; i++)
+    {
+        const pbjson_iter_t *key = &fields->iter[i];
+
+        if ((key->atype != PBJSON_STATIC_ATYPE) || (key->option != PBJSON_OPTION_SINGULAR) || (key->data_offset < end))
+        {
+            break;
+        }
+
+        /* Bytes between the fields are compared as well, if they differ the fields are checked one by one. */
+        end = (size_t)key->data_offset + key->item_size;
+    }
+
+    *p_end = end;
+    return i - first;
+}
+
+static bool pbjson_item_equal(const pbjson_msgdesc_t *fields, const pbjson_iter_t *key, const void *a, const void *b)
+{
+    if (a == b)
+    {
+        return true;
+    }
+
+    if (key->data_type == PBJSON_MESSAGE_TYPE)
+    {
+        return pbjson_message_equal(PBJSON_ITER_SUBMSG(fields, key), a, b);
+    }
+
+    if (key->data_type == PBJSON_BYTES_TYPE)
+    {
+        if ((key->atype == PBJSON_POINTER_ATYPE) && (key->option == PBJSON_OPTION_REPEATED))
+        {
+            /* Pointer bytes arrays hold the address of each value, NULL is written as "". */
+            a = *(const void *const *)a;
+            b = *(const void *const *)b;
+        }
+
+        pbjson_size_t size_a = (a != NULL) ? ((const pb_bytes_array_t *)a)->size : 0;
+        pbjson_size_t size_b = (b != NULL) ? ((const pb_bytes_array_t *)b)->size : 0;
+
+        /* Only the bytes up to the size count. */
+        return (size_a == size_b) &&
+               ((size_a == 0) ||
+                (memcmp(((const pb_bytes_array_t *)a)->bytes, ((const pb_bytes_array_t *)b)->bytes, size_a) == 0));
+    }
+
+    if (key->data_type != PBJSON_STRING_TYPE)
+    {
+        return memcmp(a, b, key->item_size) == 0;
+    }
+
+    if (key->atype == PBJSON_VIEW_ATYPE)
+    {
+        const pbjson_string_view_t *va = (const pbjson_string_view_t *)a;
+        const pbjson_string_view_t *vb = (const pbjson_string_view_t *)b;
+        return (va->size == vb->size) && (va->escaped == vb->escaped) &&
+               ((va->size == 0) || (memcmp(va->data, vb->data, va->size) == 0));
+    }
+
+    if (key->atype == PBJSON_POINTER_ATYPE)
+    {
+        if (key->option == PBJSON_OPTION_REPEATED)
+        {
+            /* Pointer string arrays hold the address of each string, NULL is written as "". */
+            a = *(const char *const *)a;
+            b = *(const char *const *)b;
+            a = (a != NULL) ? a : "";
+            b = (b != NULL) ? b : "";
+        }
+
+        return strcmp((const char *)a, (const char *)b) == 0;
+    }
+
+    /* Only the text up to the terminator counts. */
+    return strncmp((const char *)a, (const char *)b, key->item_size) == 0;
+}
+
+static bool pbjson_key_equal(const pbjson_msgdesc_t *fields, const pbjson_iter_t *key, const void *a, const void *b)
+{
+    bool has_b = pbjson_struct_has_key(key, b);
+
+    if (key->atype == PBJSON_CALLBACK_ATYPE)
+    {
+        return !has_b;
+    }
+
+    if (pbjson_struct_has_key(key, a) != has_b)
+    {
+        return false;
+    }
+
+    if (!has_b)
+    {
+        return true;
+    }
+
+    const char *pa = (const char *)a + key->data_offset;
+    const char *pb = (const char *)b + key->data_offset;
+
+    if (key->atype == PBJSON_POINTER_ATYPE)
+    {
+        pa = *(const char *const *)(const void *)pa;
+        pb = *(const char *const *)(const void *)pb;
+    }
+
+    if (key->option != PBJSON_OPTION_REPEATED)
+    {
+        return pbjson_item_equal(fields, key, pa, pb);
+    }
+
+    uint32_t count = *(const uint32_t *)(const void *)((const char *)a + key->count_offset);
+
+    if (count != *(const uint32_t *)(const void *)((const char *)b + key->count_offset))
+    {
+        return false;
+    }
+
+    if ((count == 0) || (pa == pb))
+    {
+        return true;
+    }
+
+    if ((pa == NULL) || (pb == NULL))
+    {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (!pbjson_item_equal(fields, key, pa + (size_t)i * key->item_size, pb + (size_t)i * key->item_size))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool pbjson_message_equal(const pbjson_msgdesc_t *fields, const void *a, const void *b)
+{
+    uint32_t i = 0;
+
+    while (i < fields->num_field)
+    {
+        size_t end;
+        uint32_t n = pbjson_static_run(fields, i, &end);
+        size_t start = fields->iter[i].data_offset;
+
+        if ((n > 1) && (memcmp((const char *)a + start, (const char *)b + start, end - start) == 0))
+        {
+            i += n;
+            continue;
+        }
+
+        for (uint32_t stop = i + ((n > 1) ? n : 1); i < stop; i++)
+        {
+            if (!pbjson_key_equal(fields, &fields->iter[i], a, b))
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static int pbjson_encode_delta_key(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const pbjson_iter_t *key,
+                                   const void *prev, const void *cur, bool *p_is_first)
+{
+    if (!pbjson_struct_has_key(key, cur))
+    {
+        PBJSON_STATS_ADD(encode_fields, 1);
+
+        /* The field was removed. */
+        if (pbjson_ostream_put_key(stream, fields, key, p_is_first))
+        {
+            return -1;
+        }
+
+        return pbjson_write(stream, "null", 4);
+    }
+
+    /* Pointer submessages are replaced as a whole by the decoder, static ones are merged. */
+    if ((key->data_type == PBJSON_MESSAGE_TYPE) && (key->atype == PBJSON_STATIC_ATYPE) &&
+        (key->option != PBJSON_OPTION_REPEATED) && pbjson_struct_has_key(key, prev))
+    {
+        PBJSON_STATS_ADD(encode_fields, 1);
+
+        if (pbjson_ostream_put_key(stream, fields, key, p_is_first))
+        {
+            return -1;
+        }
+
+        return pbjson_encode_delta_object(stream, PBJSON_ITER_SUBMSG(fields, key),
+                                          (const char *)prev + key->data_offset,
+                                          (const char *)cur + key->data_offset);
+    }
+
+    return pbjson_encode_key(stream, fields, key, cur, p_is_first);
+}
+
+static int pbjson_encode_delta_object(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const void *prev,
+                                      const void *cur)
+{
+    const pbjson_fieldmask_t *mask = stream->mask;
+
+    if (((mask != NULL) && (mask->fields != fields)) || pbjson_ostream_put_char(stream, '{'))
     {
         return -1;
     }
-    
-    pbjson_ostream_t stream;
-    stream.s = s;
-    stream.max_size = len - 1;
-    stream.bytes_written = 0;
 
-    int err = pbjson_encode_dict(&stream, fields, src_struct);
-    *stream.s = '\0';
+    bool is_first = true;
+    uint32_t i = 0;
+
+    while (i < fields->num_field)
+    {
+        size_t end;
+        uint32_t n = pbjson_static_run(fields, i, &end);
+        size_t start = fields->iter[i].data_offset;
+
+        /* Runs of fields that did not change are passed over with a single compare. */
+        if ((n > 1) && (memcmp((const char *)prev + start, (const char *)cur + start, end - start) == 0))
+        {
+            i += n;
+            continue;
+        }
+
+        for (uint32_t stop = i + ((n > 1) ? n : 1); i < stop; i++)
+        {
+            const pbjson_iter_t *key = &fields->iter[i];
+
+            if (((mask != NULL) && !pbjson_fieldmask_has(mask, i)) || pbjson_key_equal(fields, key, prev, cur))
+            {
+                continue;
+            }
+
+            stream->mask = (mask != NULL) ? mask->sub[i] : NULL;
+            int err = pbjson_encode_delta_key(stream, fields, key, prev, cur, &is_first);
+            stream->mask = mask;
+
+            if (err)
+            {
+                return err;
+            }
+        }
+    }
+
+    return pbjson_ostream_put_char(stream, '}');
+}
+
+static int pbjson_pb_read_varint(const uint8_t **p, const uint8_t *end, uint64_t *val)
+{
+    const uint8_t *s = *p;
+    uint64_t result = 0;
+
+    for (unsigned shift = 0; shift < 64; shift += 7)
+    {
+        if (s >= end)
+        {
+            return -1;
+        }
+
+        uint8_t byte = *s++;
+        result |= (uint64_t)(byte & 0x7F) << shift;
+
+        if ((byte & 0x80) == 0)
+        {
+            *p = s;
+            *val = result;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static int pbjson_pb_read_fixed(const uint8_t **p, const uint8_t *end, size_t len, uint64_t *val)
+{
+    if ((size_t)(end - *p) < len)
+    {
+        return -1;
+    }
+
+    uint64_t result = 0;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        result |= (uint64_t)(*p)[i] << (8 * i);
+    }
+
+    *p += len;
+    *val = result;
+    return 0;
+}
+
+static int pbjson_pb_next_field(const uint8_t **p, const uint8_t *end, pbjson_pb_field_t *field)
+{
+    uint64_t tag;
+
+    if (*p >= end)
+    {
+        return 0;
+    }
+
+    if (pbjson_pb_read_varint(p, end, &tag) || ((tag >> 3) == 0) || ((tag >> 3) > UINT32_MAX))
+    {
+        return -1;
+    }
+
+    field->tag = (uint32_t)(tag >> 3);
+    field->wire_type = (unsigned)(tag & 7);
+    field->data = NULL;
+    field->len = 0;
+
+    switch (field->wire_type)
+    {
+    case PBJSON_WIRE_VARINT:
+        return pbjson_pb_read_varint(p, end, &field->raw) ? -1 : 1;
+
+    case PBJSON_WIRE_FIXED32:
+        return pbjson_pb_read_fixed(p, end, 4, &field->raw) ? -1 : 1;
+
+    case PBJSON_WIRE_FIXED64:
+        return pbjson_pb_read_fixed(p, end, 8, &field->raw) ? -1 : 1;
+
+    case PBJSON_WIRE_LEN:
+        if (pbjson_pb_read_varint(p, end, &field->raw) || (field->raw > (uint64_t)(end - *p)))
+        {
+            return -1;
+        }
+
+        field->data = *p;
+        field->len = (size_t)field->raw;
+        *p += field->len;
+        return 1;
+
+    default:
+        /* Groups are not supported. */
+        return -1;
+    }
+}
+
+static int pbjson_transcode_put_value(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields,
+                                      const pbjson_iter_t *key, const pbjson_pb_field_t *field, unsigned depth)
+{
+    uint64_t raw = field->raw;
+
+    if (key->wire == PBJSON_WIRE_ZIGZAG)
+    {
+        raw = (raw >> 1) ^ (((raw & 1) != 0) ? UINT64_MAX : 0);
+    }
+
+    switch (key->data_type)
+    {
+    case PBJSON_STRING_TYPE:
+        return pbjson_ostream_put_string_n(stream, (const char *)field->data, field->len);
+    case PBJSON_BYTES_TYPE:
+        return pbjson_ostream_put_bytes(stream, field->data, field->len);
+    case PBJSON_MESSAGE_TYPE:
+    {
+        pbjson_pb_source_t src = {NULL, 0, field->data, field->len};
+        return pbjson_transcode_message(stream, PBJSON_ITER_SUBMSG(fields, key), &src, depth + 1);
+    }
+    case PBJSON_BOOL_TYPE:
+        return pbjson_ostream_put_bool(stream, raw != 0);
+    case PBJSON_ENUM_TYPE:
+        return pbjson_ostream_put_enum_value(stream, PBJSON_ITER_ENUMDESC(fields, key), (int32_t)(uint32_t)raw);
+    case PBJSON_INT32_TYPE:
+        return pbjson_write_int(stream, (int32_t)(uint32_t)raw);
+    case PBJSON_INT64_TYPE:
+        return pbjson_write_int(stream, (int64_t)raw);
+    case PBJSON_UENUM_TYPE:
+        return pbjson_ostream_put_enum_value(stream, PBJSON_ITER_ENUMDESC(fields, key), (uint32_t)raw);
+    case PBJSON_UINT32_TYPE:
+        return pbjson_write_uint(stream, (uint32_t)raw);
+    case PBJSON_UINT64_TYPE:
+        return pbjson_write_uint(stream, raw);
+
+    case PBJSON_FLOAT_TYPE:
+    {
+        uint32_t bits = (uint32_t)raw;
+        float val;
+        memcpy(&val, &bits, sizeof(val));
+        return pbjson_write_float(stream, val);
+    }
+
+    case PBJSON_DOUBLE_TYPE:
+    {
+        double val;
+        memcpy(&val, &raw, sizeof(val));
+        return pbjson_write_double(stream, val);
+    }
+
+    default:
+        return -1;
+    }
+}
+
+static int pbjson_transcode_occurrence(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields,
+                                       const pbjson_iter_t *key, const pbjson_pb_field_t *field,
+                                       pbjson_pb_field_t *last, uint32_t *p_count, unsigned depth, bool *p_is_first)
+{
+    unsigned wire_type = PBJSON_WIRE_TYPE(key->wire);
+    bool is_repeated = (key->option == PBJSON_OPTION_REPEATED);
+
+    /* Numeric repeated fields may also come packed, several values in one length-delimited field. */
+    bool is_packed = is_repeated && (wire_type != PBJSON_WIRE_LEN) && (field->wire_type == PBJSON_WIRE_LEN);
+
+    if ((field->wire_type != wire_type) && !is_packed)
+    {
+        return -1;
+    }
+
+    if (!is_repeated)
+    {
+        *last = *field;
+        (*p_count)++;
+        return 0;
+    }
+
+    if ((*p_count == 0) && (pbjson_ostream_put_key(stream, fields, key, p_is_first) || pbjson_ostream_put_char(stream,
+                                                                                                               '[')))
+    {
+        return -1;
+    }
+
+    if (!is_packed)
+    {
+        if (((*p_count != 0) && pbjson_ostream_put_char(stream, ',')) ||
+            pbjson_transcode_put_value(stream, fields, key, field, depth))
+        {
+            return -1;
+        }
+
+        (*p_count)++;
+        return 0;
+    }
+
+    pbjson_pb_field_t value = *field;
+    const uint8_t *s = field->data;
+    const uint8_t *end = field->data + field->len;
+
+    while (s < end)
+    {
+        int err = (wire_type == PBJSON_WIRE_VARINT)
+                      ? pbjson_pb_read_varint(&s, end, &value.raw)
+                      : pbjson_pb_read_fixed(&s, end, (wire_type == PBJSON_WIRE_FIXED32) ? 4 : 8, &value.raw);
+
+        if (err || ((*p_count != 0) && pbjson_ostream_put_char(stream, ',')) ||
+            pbjson_transcode_put_value(stream, fields, key, &value, depth))
+        {
+            return -1;
+        }
+
+        (*p_count)++;
+    }
+
+    return 0;
+}
+
+static bool pbjson_pb_value_is_default(const pbjson_msgdesc_t *fields, const pbjson_iter_t *key,
+                                       const pbjson_pb_field_t *field, unsigned depth)
+{
+    if ((key->option != PBJSON_OPTION_SINGULAR) || (key->atype == PBJSON_CALLBACK_ATYPE) ||
+        ((key->atype == PBJSON_POINTER_ATYPE) && (key->data_type != PBJSON_STRING_TYPE) &&
+         (key->data_type != PBJSON_BYTES_TYPE)))
+    {
+        return false;
+    }
+
+    if ((key->data_type == PBJSON_STRING_TYPE) || (key->data_type == PBJSON_BYTES_TYPE))
+    {
+        return field->len == 0;
+    }
+
+    if (key->data_type != PBJSON_MESSAGE_TYPE)
+    {
+        return field->raw == 0;
+    }
+
+    if (depth + 1 >= PBJSON_MAX_DEPTH)
+    {
+        return false;
+    }
+
+    const uint8_t *p = field->data;
+    const uint8_t *end = field->data + field->len;
+    const pbjson_msgdesc_t *submsg = PBJSON_ITER_SUBMSG(fields, key);
+    pbjson_pb_field_t member;
+    int res;
+
+    while ((res = pbjson_pb_next_field(&p, end, &member)) > 0)
+    {
+        for (uint32_t i = 0; i < submsg->num_field; i++)
+        {
+            const pbjson_iter_t *member_key = &submsg->iter[i];
+            bool is_default;
+
+            if (member_key->tag != member.tag)
+            {
+                continue;
+            }
+
+            if (member_key->option == PBJSON_OPTION_REPEATED)
+            {
+                /* Only an empty packed run leaves the array empty. */
+                is_default = (member.wire_type == PBJSON_WIRE_LEN) && (member.len == 0) &&
+                             (member_key->wire != PBJSON_WIRE_LEN);
+            }
+            else
+            {
+                is_default = pbjson_pb_value_is_default(submsg, member_key, &member, depth + 1);
+            }
+
+            if (!is_default)
+            {
+                return false;
+            }
+
+            break;
+        }
+    }
+
+    /* Malformed data is left to the transcoder to report. */
+    return res == 0;
+}
+
+static int pbjson_pb_foreach_segment(const pbjson_pb_source_t *src, pbjson_pb_segment_fn fn, void *ctx)
+{
+    if (src->parent == NULL)
+    {
+        return fn(ctx, src->buf, src->size);
+    }
+
+    pbjson_pb_segment_scan_t scan = {src->tag, fn, ctx};
+    return pbjson_pb_foreach_segment(src->parent, pbjson_pb_scan_segment, &scan);
+}
+
+static int pbjson_pb_scan_segment(void *ctx, const uint8_t *buf, size_t size)
+{
+    const pbjson_pb_segment_scan_t *scan = (const pbjson_pb_segment_scan_t *)ctx;
+    const uint8_t *p = buf;
+    pbjson_pb_field_t field;
+    int res;
+
+    while ((res = pbjson_pb_next_field(&p, buf + size, &field)) > 0)
+    {
+        if ((field.tag == scan->tag) && (field.wire_type == PBJSON_WIRE_LEN) &&
+            scan->fn(scan->ctx, field.data, field.len))
+        {
+            return -1;
+        }
+    }
+
+    return res;
+}
+
+static int pbjson_pb_check_segment(void *ctx, const uint8_t *buf, size_t size)
+{
+    const uint8_t *p = buf;
+    pbjson_pb_field_t field;
+    int res;
+
+    (void)ctx;
+
+    while ((res = pbjson_pb_next_field(&p, buf + size, &field)) > 0)
+    {
+    }
+
+    return res;
+}
+
+static int pbjson_transcode_segment(void *ctx, const uint8_t *buf, size_t size)
+{
+    pbjson_pb_occurrences_t *occ = (pbjson_pb_occurrences_t *)ctx;
+    const uint8_t *p = buf;
+    pbjson_pb_field_t field;
+    int res;
+
+    while ((res = pbjson_pb_next_field(&p, buf + size, &field)) > 0)
+    {
+        if ((field.tag == occ->key->tag) && pbjson_transcode_occurrence(occ->stream, occ->fields, occ->key, &field,
+                                                                         occ->last, occ->p_count, occ->depth,
+                                                                         occ->p_is_first))
+        {
+            return -1;
+        }
+    }
+
+    return res;
+}
+
+static int pbjson_pb_default_segment(void *ctx, const uint8_t *buf, size_t size)
+{
+    pbjson_pb_occurrences_t *occ = (pbjson_pb_occurrences_t *)ctx;
+    pbjson_pb_field_t field;
+
+    memset(&field, 0, sizeof(field));
+    field.tag = occ->key->tag;
+    field.wire_type = PBJSON_WIRE_LEN;
+    field.data = buf;
+    field.len = size;
+
+    occ->is_default = occ->is_default && pbjson_pb_value_is_default(occ->fields, occ->key, &field, occ->depth);
+    return 0;
+}
+
+static int pbjson_transcode_finish(pbjson_ostream_t *stream, const pbjson_pb_source_t *src,
+                                   const pbjson_msgdesc_t *fields, const pbjson_iter_t *key,
+                                   const pbjson_pb_field_t *last, uint32_t count, unsigned depth, bool *p_is_first)
+{
+    if (key->option == PBJSON_OPTION_REPEATED)
+    {
+        if (count != 0)
+        {
+            return pbjson_ostream_put_char(stream, ']');
+        }
+
+        /* Callback fields are only written when they have values, other arrays always. */
+        if ((key->atype == PBJSON_CALLBACK_ATYPE) || (stream->flags & PBJSON_ENCODE_OMIT_DEFAULTS))
+        {
+            return 0;
+        }
+
+        if (pbjson_ostream_put_key(stream, fields, key, p_is_first))
+        {
+            return -1;
+        }
+
+        return pbjson_write(stream, "[]", 2);
+    }
+
+    /* Fields with presence are left out when absent, like in pbjson_encode(). */
+    if ((count == 0) && ((key->option == PBJSON_OPTION_OPTIONAL) || (key->atype != PBJSON_STATIC_ATYPE)))
+    {
+        return 0;
+    }
+
+    /* Occurrences of a submessage are merged, the message is their concatenation. */
+    pbjson_pb_source_t merged = {src, key->tag, NULL, 0};
+    bool is_merged = (key->data_type == PBJSON_MESSAGE_TYPE) && (count > 1);
+
+    if (stream->flags & PBJSON_ENCODE_OMIT_DEFAULTS)
+    {
+        bool is_default = (count == 0);
+
+        if (is_merged && (key->option == PBJSON_OPTION_SINGULAR))
+        {
+            /* Defaults in every occurrence, which misses a value that a later occurrence resets. */
+            pbjson_pb_occurrences_t occ = {stream, fields, key, NULL, NULL, depth, NULL, true};
+
+            is_default = (pbjson_pb_foreach_segment(&merged, pbjson_pb_default_segment, &occ) == 0) && occ.is_default;
+        }
+        else if (count != 0)
+        {
+            is_default = pbjson_pb_value_is_default(fields, key, last, depth);
+        }
+
+        if (is_default)
+        {
+            return 0;
+        }
+    }
+
+    if (pbjson_ostream_put_key(stream, fields, key, p_is_first))
+    {
+        return -1;
+    }
+
+    if (is_merged)
+    {
+        return pbjson_transcode_message(stream, PBJSON_ITER_SUBMSG(fields, key), &merged, depth + 1);
+    }
+
+    return pbjson_transcode_put_value(stream, fields, key, last, depth);
+}
+
+static int pbjson_transcode_message(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields,
+                                    const pbjson_pb_source_t *src, unsigned depth)
+{
+    static const uint8_t empty[1] = {0};
+    pbjson_pb_field_t field;
+    uint32_t prev_tag = 0;
+    bool sorted = (src->parent == NULL);
+    int res = 0;
+
+    if (depth >= PBJSON_MAX_DEPTH)
+    {
+        return -1;
+    }
+
+    /* An absent submessage has no data at all. */
+    const uint8_t *buf = (src->buf != NULL) ? src->buf : empty;
+    const uint8_t *end = buf + src->size;
+    const uint8_t *p = buf;
+
+    /* Check the message once. Encoders write fields in tag order, the order of
+     * iter[], and then a single walk over the message visits every field.
+     * Merged submessages are searched for every field. */
+    if (sorted)
+    {
+        while ((res = pbjson_pb_next_field(&p, end, &field)) > 0)
+        {
+            sorted = sorted && (field.tag >= prev_tag);
+            prev_tag = field.tag;
+        }
+    }
+    else
+    {
+        res = pbjson_pb_foreach_segment(src, pbjson_pb_check_segment, NULL);
+    }
+
+    const pbjson_fieldmask_t *mask = stream->mask;
+
+    if ((res < 0) || ((mask != NULL) && (mask->fields != fields)) || pbjson_ostream_put_char(stream, '{'))
+    {
+        return -1;
+    }
+
+    bool is_first = true;
+    int err = 0;
+
+    p = buf;
+    res = pbjson_pb_next_field(&p, end, &field);
+
+    for (uint32_t i = 0; (i < fields->num_field) && (err == 0); i++)
+    {
+        const pbjson_iter_t *key = &fields->iter[i];
+        pbjson_pb_field_t last;
+        uint32_t count = 0;
+
+        /* Fields left out by the mask are skipped like unknown ones. */
+        if ((mask != NULL) && !pbjson_fieldmask_has(mask, i))
+        {
+            continue;
+        }
+
+        if (mask != NULL)
+        {
+            stream->mask = mask->sub[i];
+        }
+
+        memset(&last, 0, sizeof(last));
+
+        if (sorted)
+        {
+            /* Lower tags are unknown fields. */
+            while ((res > 0) && (field.tag < key->tag))
+            {
+                res = pbjson_pb_next_field(&p, end, &field);
+            }
+
+            while ((res > 0) && (field.tag == key->tag) && (err == 0))
+            {
+                err = pbjson_transcode_occurrence(stream, fields, key, &field, &last, &count, depth, &is_first);
+                res = pbjson_pb_next_field(&p, end, &field);
+            }
+        }
+        else
+        {
+            pbjson_pb_occurrences_t occ = {stream, fields, key, &last, &count, depth, &is_first, false};
+            pbjson_pb_source_t whole = {NULL, 0, buf, src->size};
+
+            err = pbjson_pb_foreach_segment((src->parent != NULL) ? src : &whole, pbjson_transcode_segment, &occ);
+        }
+
+        if (err == 0)
+        {
+            err = pbjson_transcode_finish(stream, src, fields, key, &last, count, depth, &is_first);
+        }
+
+        stream->mask = mask;
+    }
+
+    if (err)
+    {
+        return -1;
+    }
+
+    return pbjson_ostream_put_char(stream, '}');
+}
+
+int pbjson_write_int(pbjson_ostream_t *stream, int64_t val)
+{
+    char buf[PBJSON_NUMBER_BUF_SIZE];
+    return pbjson_write(stream, buf, pbjson_format_int(buf, val));
+}
+
+int pbjson_write_uint(pbjson_ostream_t *stream, uint64_t val)
+{
+    char buf[PBJSON_NUMBER_BUF_SIZE];
+    return pbjson_write(stream, buf, pbjson_format_uint(buf, val));
+}
+
+int pbjson_write_float(pbjson_ostream_t *stream, float val)
+{
+    char buf[PBJSON_NUMBER_BUF_SIZE];
+    return pbjson_write(stream, buf, pbjson_format_float(buf, val, true));
+}
+
+int pbjson_write_double(pbjson_ostream_t *stream, double val)
+{
+    char buf[PBJSON_NUMBER_BUF_SIZE];
+    return pbjson_write(stream, buf, pbjson_format_float(buf, val, false));
+}
+
+int pbjson_write_bool(pbjson_ostream_t *stream, bool val)
+{
+    return pbjson_ostream_put_bool(stream, val);
+}
+
+int pbjson_write_string(pbjson_ostream_t *stream, const char *s, size_t len)
+{
+    return pbjson_ostream_put_string_n(stream, s, len);
+}
+
+int pbjson_write_bytes(pbjson_ostream_t *stream, const uint8_t *data, size_t len)
+{
+    return pbjson_ostream_put_bytes(stream, data, len);
+}
+
+int pbjson_write_enum(pbjson_ostream_t *stream, const pbjson_enumdesc_t *desc, int32_t val)
+{
+    return pbjson_ostream_put_enum_value(stream, desc, val);
+}
+
+int pbjson_encode_message(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const void *src_struct)
+{
+    return pbjson_encode_dict(stream, fields, src_struct);
+}
+
+int pbjson_write_value(pbjson_ostream_t *stream, pbjson_type_t type, size_t size, const void *src)
+{
+    pbjson_iter_t key;
+
+    if ((type == PBJSON_MESSAGE_TYPE) || (size > UINT32_MAX))
+    {
+        return -1;
+    }
+
+    memset(&key, 0, sizeof(key));
+    key.item_size = (uint32_t)size;
+    key.data_type = type;
+    key.max_count = 1;
+
+    return pbjson_encode_value(stream, NULL, &key, src);
+}
+
+int pbjson_encode_stream(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const void *src_struct)
+{
+#ifdef PBJSON_STATS
+    size_t start = stream->bytes_written;
+#endif
+    PBJSON_STATS_ADD(encode_calls, 1);
+    PBJSON_STATS_START(encode_start);
+
+    int err = pbjson_encode_dict(stream, fields, src_struct);
+    if (err == 0)
+    {
+        err = pbjson_ostream_flush(stream);
+    }
+
+    PBJSON_STATS_STOP(encode_start, PBJSON_PHASE_ENCODE);
+    PBJSON_STATS_ADD(encode_bytes, stream->bytes_written - start);
+
+    return err;
+}
+
+int pbjson_encode_batch(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const void *src_array,
+                        size_t count, size_t stride, pbjson_batch_mode_t mode, size_t *offsets)
+{
+    const char *pSrc = (const char *)src_array;
+    size_t start = stream->bytes_written;
+    int err;
+
+    PBJSON_STATS_ADD(encode_calls, 1);
+    PBJSON_STATS_START(encode_start);
+
+    if ((mode != PBJSON_BATCH_NDJSON) && (mode != PBJSON_BATCH_ARRAY))
+    {
+        return -1;
+    }
+
+    if (mode == PBJSON_BATCH_ARRAY)
+    {
+        err = pbjson_ostream_put_char(stream, '[');
+        if (err)
+            return err;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if ((mode == PBJSON_BATCH_ARRAY) && (i != 0))
+        {
+            err = pbjson_ostream_put_char(stream, ',');
+            if (err)
+                return err;
+        }
+
+        if (offsets != NULL)
+        {
+            offsets[i] = stream->bytes_written - start;
+        }
+
+        err = pbjson_encode_dict(stream, fields, pSrc);
+        if (err)
+            return err;
+
+        if (mode == PBJSON_BATCH_NDJSON)
+        {
+            err = pbjson_ostream_put_char(stream, '\n');
+            if (err)
+                return err;
+        }
+
+        pSrc += stride;
+    }
+
+    if (mode == PBJSON_BATCH_ARRAY)
+    {
+        err = pbjson_ostream_put_char(stream, ']');
+        if (err)
+            return err;
+    }
+
+    if (offsets != NULL)
+    {
+        offsets[count] = stream->bytes_written - start;
+    }
+
+    err = pbjson_ostream_flush(stream);
+
+    PBJSON_STATS_STOP(encode_start, PBJSON_PHASE_ENCODE);
+    PBJSON_STATS_ADD(encode_bytes, stream->bytes_written - start);
+
+    return err;
+}
+
+int pbjson_encode_delta(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const void *prev, const void *cur)
+{
+    unsigned flags = stream->flags;
+#ifdef PBJSON_STATS
+    size_t start = stream->bytes_written;
+#endif
+    PBJSON_STATS_ADD(encode_calls, 1);
+    PBJSON_STATS_START(encode_start);
+
+    /* A field that changed to its default value must still be written. */
+    stream->flags &= ~PBJSON_ENCODE_OMIT_DEFAULTS;
+    int err = pbjson_encode_delta_object(stream, fields, prev, cur);
+    stream->flags = flags;
+
+    if (err == 0)
+    {
+        err = pbjson_ostream_flush(stream);
+    }
+
+    PBJSON_STATS_STOP(encode_start, PBJSON_PHASE_ENCODE);
+    PBJSON_STATS_ADD(encode_bytes, stream->bytes_written - start);
+
+    return err;
+}
+
+int pbjson_transcode_to_json(pbjson_ostream_t *stream, const pbjson_msgdesc_t *fields, const uint8_t *buf, size_t size)
+{
+    pbjson_pb_source_t src = {NULL, 0, buf, size};
+
+    int err = pbjson_transcode_message(stream, fields, &src, 0);
+    if (err == 0)
+    {
+        err = pbjson_ostream_flush(stream);
+    }
+
+    return err;
+}
+
+int pbjson_encoded_size(const pbjson_msgdesc_t *fields, const void *src_struct)
+{
+    pbjson_ostream_t stream = PBJSON_OSTREAM_SIZING;
+
+    int err = pbjson_encode_stream(&stream, fields, src_struct);
+
+    if (err || (stream.bytes_written > INT_MAX))
+    {
+        return -1;
+    }
+
+    return (int)stream.bytes_written;
+}
+
+int pbjson_encode(char *s, uint32_t len, const pbjson_msgdesc_t *fields, const void *src_struct)
+{
+    if (len < 3)
+    {
+        return -1;
+    }
+
+    /* Keep the last byte for the terminator. */
+    pbjson_ostream_t stream = pbjson_ostream_from_buffer(s, len - 1);
+
+    int err = pbjson_encode_stream(&stream, fields, src_struct);
+    s[stream.pos] = '\0';
 
     if (err)
     {
         return err;
     }
 
-    return stream.bytes_written;
+    return (int)stream.bytes_written;
 }
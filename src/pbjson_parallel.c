@@ -0,0 +1,205 @@
+/**
+ * @file pbjson_parallel.c
+ * @brief Multi-threaded batch decoding on top of pbjson_decode_arena().
+ *
+ * The decoder keeps all of its state on the stack, so records can be decoded
+ * concurrently as long as each thread writes to its own destination slots and
+ * arena. This file only distributes the work, using POSIX threads.
+ */
+
+#include <pb/json_parallel.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+/**
+ * @brief The records one thread starts out with, and the shared job.
+ */
+typedef struct pbjson_parallel_worker_s
+{
+    atomic_size_t next; /**< First record of the range not claimed yet, by its owner or a thief. */
+    size_t end;         /**< End of the range. */
+    unsigned index;     /**< Position in the worker array, also selects the arena. */
+    struct pbjson_parallel_job_s *job;
+} pbjson_parallel_worker_t;
+
+typedef struct pbjson_parallel_job_s
+{
+    const pbjson_msgdesc_t *fields;
+    const pbjson_istream_t *inputs;
+    char *dst;
+    size_t stride;
+    int *results;
+    pbjson_arena_t *arenas;
+    pbjson_parallel_worker_t *workers;
+    unsigned num_workers;
+    atomic_int failed;
+} pbjson_parallel_job_t;
+
+/**
+ * @brief Claims the next batch of a range.
+ *
+ * @param worker The range to take records from.
+ * @param p_begin Receives the first record of the batch.
+ * @param p_end Receives the end of the batch.
+ * @return true if a non-empty batch was claimed.
+ */
+static bool pbjson_parallel_claim(pbjson_parallel_worker_t *worker, size_t *p_begin, size_t *p_end);
+
+/**
+ * @brief Decodes the records of one batch.
+ *
+ * @param job The job.
+ * @param arena Arena of the calling thread, may be NULL.
+ * @param begin First record.
+ * @param end End of the batch.
+ */
+static void pbjson_parallel_run(pbjson_parallel_job_t *job, pbjson_arena_t *arena, size_t begin, size_t end);
+
+/**
+ * @brief Thread body: drains its own range, then steals from the others.
+ *
+ * @param arg The pbjson_parallel_worker_t of the thread.
+ * @return NULL.
+ */
+static void *pbjson_parallel_thread(void *arg);
+
+static bool pbjson_parallel_claim(pbjson_parallel_worker_t *worker, size_t *p_begin, size_t *p_end)
+{
+    /* Cheap check first, so exhausted ranges are not pushed further past their end. */
+    if (atomic_load_explicit(&worker->next, memory_order_relaxed) >= worker->end)
+    {
+        return false;
+    }
+
+    size_t begin = atomic_fetch_add_explicit(&worker->next, PBJSON_PARALLEL_BATCH, memory_order_relaxed);
+
+    if (begin >= worker->end)
+    {
+        return false;
+    }
+
+    *p_begin = begin;
+    *p_end = (worker->end - begin > PBJSON_PARALLEL_BATCH) ? begin + PBJSON_PARALLEL_BATCH : worker->end;
+    return true;
+}
+
+static void pbjson_parallel_run(pbjson_parallel_job_t *job, pbjson_arena_t *arena, size_t begin, size_t end)
+{
+    int failed = 0;
+
+    for (size_t i = begin; i < end; i++)
+    {
+        int err = pbjson_decode_arena(job->inputs[i].s, job->inputs[i].len, job->fields, job->dst + i * job->stride,
+                                      arena);
+
+        err = (err == 0) ? 0 : -1;
+        failed -= err;
+
+        if (job->results != NULL)
+        {
+            job->results[i] = err;
+        }
+    }
+
+    if (failed)
+    {
+        atomic_fetch_add_explicit(&job->failed, failed, memory_order_relaxed);
+    }
+}
+
+static void *pbjson_parallel_thread(void *arg)
+{
+    pbjson_parallel_worker_t *self = (pbjson_parallel_worker_t *)arg;
+    pbjson_parallel_job_t *job = self->job;
+    pbjson_arena_t *arena = (job->arenas != NULL) ? &job->arenas[self->index] : NULL;
+    size_t begin, end;
+
+    /* Victims are visited starting with the next worker, so thieves spread out. */
+    for (unsigned n = 0; n < job->num_workers; n++)
+    {
+        pbjson_parallel_worker_t *victim = &job->workers[(self->index + n) % job->num_workers];
+
+        while (pbjson_parallel_claim(victim, &begin, &end))
+        {
+            pbjson_parallel_run(job, arena, begin, end);
+        }
+    }
+
+    return NULL;
+}
+
+int pbjson_parallel_decode(const pbjson_msgdesc_t *fields, const pbjson_istream_t *inputs, size_t count,
+                           void *dst_array, size_t stride, int *results, unsigned num_threads,
+                           pbjson_arena_t *arenas)
+{
+    pbjson_parallel_worker_t workers[PBJSON_PARALLEL_MAX_THREADS];
+    pthread_t threads[PBJSON_PARALLEL_MAX_THREADS];
+    bool started[PBJSON_PARALLEL_MAX_THREADS];
+    pbjson_parallel_job_t job;
+
+    /* Arenas come one per thread, so their number must be known. */
+    if ((fields == NULL) || ((count != 0) && ((inputs == NULL) || (dst_array == NULL))) ||
+        ((arenas != NULL) && (num_threads == 0)))
+    {
+        return -1;
+    }
+
+    if (num_threads == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = (cpus > 0) ? (unsigned)cpus : 1;
+    }
+
+    if (num_threads > PBJSON_PARALLEL_MAX_THREADS)
+    {
+        num_threads = PBJSON_PARALLEL_MAX_THREADS;
+    }
+
+    /* No point in threads that would start out without a full batch. */
+    if (num_threads > (count + PBJSON_PARALLEL_BATCH - 1) / PBJSON_PARALLEL_BATCH)
+    {
+        num_threads = (unsigned)((count + PBJSON_PARALLEL_BATCH - 1) / PBJSON_PARALLEL_BATCH);
+    }
+
+    if (num_threads == 0)
+    {
+        return 0;
+    }
+
+    job.fields = fields;
+    job.inputs = inputs;
+    job.dst = (char *)dst_array;
+    job.stride = stride;
+    job.results = results;
+    job.arenas = arenas;
+    job.workers = workers;
+    job.num_workers = num_threads;
+    atomic_init(&job.failed, 0);
+
+    for (unsigned i = 0; i < num_threads; i++)
+    {
+        atomic_init(&workers[i].next, count * i / num_threads);
+        workers[i].end = count * (i + 1) / num_threads;
+        workers[i].index = i;
+        workers[i].job = &job;
+    }
+
+    /* The calling thread is worker 0. */
+    for (unsigned i = 1; i < num_threads; i++)
+    {
+        started[i] = (pthread_create(&threads[i], NULL, pbjson_parallel_thread, &workers[i]) == 0);
+    }
+
+    pbjson_parallel_thread(&workers[0]);
+
+    for (unsigned i = 1; i < num_threads; i++)
+    {
+        if (started[i])
+        {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    return atomic_load(&job.failed);
+}
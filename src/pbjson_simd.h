@@ -0,0 +1,376 @@
+/**
+ * @file pbjson_simd.h
+ * @brief Vectorized scanning helpers for the JSON decoder and encoder.
+ *
+ * The kernel is chosen at build time from the compiler's target flags:
+ * AVX2 (32 bytes per step), SSE2 or NEON (16 bytes per step), or a plain
+ * byte loop. Define PBJSON_NO_SIMD to force the byte loop, for example on
+ * microcontrollers where code size matters more than throughput.
+ *
+ * All functions take the current position and the end of the input and
+ * never read outside of [s, end).
+ *
+ * With PBJSON_VALIDATE_UTF8 the escape classes also stop at every byte
+ * above 0x7F, so the caller can check each non-ASCII character in the same
+ * pass that copies or escapes the text.
+ */
+
+#ifndef PBJSON_SIMD_H
+#define PBJSON_SIMD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#if !defined(PBJSON_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define PBJSON_SIMD_AVX2 1
+#elif !defined(PBJSON_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define PBJSON_SIMD_SSE2 1
+#elif !defined(PBJSON_NO_SIMD) && (defined(__ARM_NEON) || defined(__ARM_NEON__)) && defined(__aarch64__)
+#include <arm_neon.h>
+#define PBJSON_SIMD_NEON 1
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__) && (defined(PBJSON_SIMD_AVX2) || defined(PBJSON_SIMD_SSE2))
+#include <intrin.h>
+#endif
+
+/**
+ * @brief Character classes the scanners look for.
+ */
+enum pbjson_simd_class_e
+{
+    PBJSON_SIMD_NOT_SPACE,   /**< Anything except ' ', '\t', '\n' and '\r'. */
+    PBJSON_SIMD_STRING_END,  /**< '"', '\\' or below 0x20. */
+    PBJSON_SIMD_NEWLINE,     /**< '\n'. */
+    PBJSON_SIMD_UNESCAPE,    /**< '"', '\\' or below 0x20, and non-ASCII bytes with PBJSON_VALIDATE_UTF8. */
+    PBJSON_SIMD_ESCAPE,      /**< '"', '\\' or below 0x20, and non-ASCII bytes with PBJSON_VALIDATE_UTF8. */
+};
+
+#ifdef PBJSON_VALIDATE_UTF8
+#define PBJSON_SIMD_IS_UTF8(c) (((unsigned char)(c)) >= 0x80)
+#else
+#define PBJSON_SIMD_IS_UTF8(c) false
+#endif
+
+/**
+ * @brief Check whether a character belongs to a class.
+ *
+ * @param c The character.
+ * @param cls One of pbjson_simd_class_e.
+ * @return true if @p c is in the class.
+ */
+static inline bool pbjson_simd_match(char c, int cls)
+{
+    switch (cls)
+    {
+    case PBJSON_SIMD_NOT_SPACE:
+        return (c != ' ') && (c != '\t') && (c != '\n') && (c != '\r');
+
+    case PBJSON_SIMD_STRING_END:
+        return (c == '"') || (c == '\\') || (((unsigned char)c) < 0x20);
+
+    case PBJSON_SIMD_NEWLINE:
+        return c == '\n';
+
+    default:
+        /* PBJSON_SIMD_UNESCAPE and PBJSON_SIMD_ESCAPE. */
+        return (c == '"') || (c == '\\') || (((unsigned char)c) < 0x20) || PBJSON_SIMD_IS_UTF8(c);
+    }
+}
+
+#if defined(PBJSON_SIMD_AVX2) || defined(PBJSON_SIMD_SSE2)
+/**
+ * @brief Index of the lowest set bit of a non-zero mask.
+ */
+static inline unsigned pbjson_simd_ctz(uint32_t mask)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (unsigned)index;
+#else
+    return (unsigned)__builtin_ctz(mask);
+#endif
+}
+#endif
+
+#if defined(PBJSON_SIMD_AVX2)
+/**
+ * @brief Bit mask of the bytes in a 32-byte block that belong to a class.
+ */
+static inline uint32_t pbjson_simd_mask(const char *s, int cls)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i *)(const void *)s);
+    __m256i m;
+
+    switch (cls)
+    {
+    case PBJSON_SIMD_NOT_SPACE:
+        m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+        return ~(uint32_t)_mm256_movemask_epi8(m);
+
+    case PBJSON_SIMD_STRING_END:
+        m = _mm256_cmpeq_epi8(_mm256_max_epu8(v, _mm256_set1_epi8(0x1F)), _mm256_set1_epi8(0x1F));
+        m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                                               _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))));
+        return (uint32_t)_mm256_movemask_epi8(m);
+
+    case PBJSON_SIMD_NEWLINE:
+        return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+
+    default:
+        /* PBJSON_SIMD_UNESCAPE and PBJSON_SIMD_ESCAPE. */
+#ifdef PBJSON_VALIDATE_UTF8
+        /* A signed compare puts non-ASCII bytes below 0x20 too. */
+        m = _mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), v);
+#else
+        m = _mm256_cmpeq_epi8(_mm256_max_epu8(v, _mm256_set1_epi8(0x1F)), _mm256_set1_epi8(0x1F));
+#endif
+        m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                                               _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))));
+        return (uint32_t)_mm256_movemask_epi8(m);
+    }
+}
+
+#define PBJSON_SIMD_WIDTH 32
+
+#elif defined(PBJSON_SIMD_SSE2)
+/**
+ * @brief Bit mask of the bytes in a 16-byte block that belong to a class.
+ */
+static inline uint32_t pbjson_simd_mask(const char *s, int cls)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)(const void *)s);
+    __m128i m;
+
+    switch (cls)
+    {
+    case PBJSON_SIMD_NOT_SPACE:
+        m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+                         _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+        return (uint32_t)_mm_movemask_epi8(m) ^ 0xFFFFu;
+
+    case PBJSON_SIMD_STRING_END:
+        m = _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(0x1F)), _mm_set1_epi8(0x1F));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))));
+        return (uint32_t)_mm_movemask_epi8(m);
+
+    case PBJSON_SIMD_NEWLINE:
+        return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+
+    default:
+        /* PBJSON_SIMD_UNESCAPE and PBJSON_SIMD_ESCAPE. */
+#ifdef PBJSON_VALIDATE_UTF8
+        /* A signed compare puts non-ASCII bytes below 0x20 too. */
+        m = _mm_cmplt_epi8(v, _mm_set1_epi8(0x20));
+#else
+        m = _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(0x1F)), _mm_set1_epi8(0x1F));
+#endif
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))));
+        return (uint32_t)_mm_movemask_epi8(m);
+    }
+}
+
+#define PBJSON_SIMD_WIDTH 16
+
+#elif defined(PBJSON_SIMD_NEON)
+/**
+ * @brief Mask of the bytes in a 16-byte block that belong to a class, four bits per byte.
+ */
+static inline uint64_t pbjson_simd_mask(const char *s, int cls)
+{
+    uint8x16_t v = vld1q_u8((const uint8_t *)s);
+    uint8x16_t m;
+
+    switch (cls)
+    {
+    case PBJSON_SIMD_NOT_SPACE:
+        m = vmvnq_u8(vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')), vceqq_u8(v, vdupq_n_u8('\t'))),
+                              vorrq_u8(vceqq_u8(v, vdupq_n_u8('\n')), vceqq_u8(v, vdupq_n_u8('\r')))));
+        break;
+
+    case PBJSON_SIMD_STRING_END:
+        m = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')), vceqq_u8(v, vdupq_n_u8('\\'))), vcltq_u8(v, vdupq_n_u8(0x20)));
+        break;
+
+    case PBJSON_SIMD_NEWLINE:
+        m = vceqq_u8(v, vdupq_n_u8('\n'));
+        break;
+
+    default:
+        /* PBJSON_SIMD_UNESCAPE and PBJSON_SIMD_ESCAPE. */
+        m = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')), vceqq_u8(v, vdupq_n_u8('\\'))), vcltq_u8(v, vdupq_n_u8(0x20)));
+#ifdef PBJSON_VALIDATE_UTF8
+        m = vorrq_u8(m, vcgeq_u8(v, vdupq_n_u8(0x80)));
+#endif
+        break;
+    }
+
+    /* Narrow each byte to a nibble, there is no movemask on NEON. */
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+}
+
+#define PBJSON_SIMD_WIDTH 16
+#endif
+
+/**
+ * @brief Find the first character of a class.
+ *
+ * @param s Start of the search.
+ * @param end End of the input.
+ * @param cls One of pbjson_simd_class_e.
+ * @return Pointer to the first matching character, or @p end if there is none.
+ */
+static inline const char *pbjson_simd_find(const char *s, const char *end, int cls)
+{
+    /* Most runs are short, so look at the first byte before starting a vector loop. */
+    if ((s < end) && pbjson_simd_match(*s, cls))
+    {
+        return s;
+    }
+
+#if defined(PBJSON_SIMD_AVX2) || defined(PBJSON_SIMD_SSE2)
+    while (end - s >= PBJSON_SIMD_WIDTH)
+    {
+        uint32_t mask = pbjson_simd_mask(s, cls);
+
+        if (mask != 0)
+        {
+            return s + pbjson_simd_ctz(mask);
+        }
+
+        s += PBJSON_SIMD_WIDTH;
+    }
+#elif defined(PBJSON_SIMD_NEON)
+    while (end - s >= PBJSON_SIMD_WIDTH)
+    {
+        uint64_t mask = pbjson_simd_mask(s, cls);
+
+        if (mask != 0)
+        {
+            return s + (__builtin_ctzll(mask) >> 2);
+        }
+
+        s += PBJSON_SIMD_WIDTH;
+    }
+#endif
+
+    while ((s < end) && !pbjson_simd_match(*s, cls))
+    {
+        s++;
+    }
+
+    return s;
+}
+
+#if defined(PBJSON_SIMD_AVX2) || defined(PBJSON_SIMD_SSE2)
+/**
+ * @brief Characters of a 64-byte block that matter for skipping a value, one bit per byte.
+ */
+typedef struct pbjson_simd_block_s
+{
+    uint64_t quote;     /**< '"'. */
+    uint64_t backslash; /**< '\\'. */
+    uint64_t open;      /**< '{' or '['. */
+    uint64_t close;     /**< '}' or ']'. */
+    uint64_t sep;       /**< ':' or ','. */
+    uint64_t space;     /**< ' ', '\t', '\n' or '\r'. */
+    uint64_t ctrl;      /**< Below 0x20. */
+} pbjson_simd_block_t;
+
+#define PBJSON_SIMD_BLOCK_SIZE 64
+
+/**
+ * @brief Builds the bitmaps of a 64-byte block.
+ *
+ * @param s Start of the block, 64 bytes must be readable.
+ * @param block Receives the bitmaps.
+ */
+static inline void pbjson_simd_classify(const char *s, pbjson_simd_block_t *block)
+{
+    block->quote = 0;
+    block->backslash = 0;
+    block->open = 0;
+    block->close = 0;
+    block->sep = 0;
+    block->space = 0;
+    block->ctrl = 0;
+
+    for (unsigned i = 0; i < PBJSON_SIMD_BLOCK_SIZE; i += PBJSON_SIMD_WIDTH)
+    {
+#if defined(PBJSON_SIMD_AVX2)
+        __m256i v = _mm256_loadu_si256((const __m256i *)(const void *)(s + i));
+        __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        __m256i ctrl = _mm256_max_epu8(v, _mm256_set1_epi8(0x1F));
+#define PBJSON_SIMD_EQ(a, c) ((uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, _mm256_set1_epi8(c))))
+#else
+        __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(s + i));
+        __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        __m128i ctrl = _mm_max_epu8(v, _mm_set1_epi8(0x1F));
+#define PBJSON_SIMD_EQ(a, c) ((uint64_t)(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, _mm_set1_epi8(c))))
+#endif
+        /* '[' ']' and '{' '}' differ only in bit 5, so one compare covers each pair. */
+        block->quote |= PBJSON_SIMD_EQ(v, '"') << i;
+        block->backslash |= PBJSON_SIMD_EQ(v, '\\') << i;
+        block->open |= PBJSON_SIMD_EQ(lower, '{') << i;
+        block->close |= PBJSON_SIMD_EQ(lower, '}') << i;
+        block->sep |= (PBJSON_SIMD_EQ(v, ':') | PBJSON_SIMD_EQ(v, ',')) << i;
+        block->space |= (PBJSON_SIMD_EQ(v, ' ') | PBJSON_SIMD_EQ(v, '\t') | PBJSON_SIMD_EQ(v, '\n') |
+                         PBJSON_SIMD_EQ(v, '\r'))
+                        << i;
+        /* Unsigned max(v, 0x1F) equals 0x1F only for the control characters. */
+        block->ctrl |= PBJSON_SIMD_EQ(ctrl, 0x1F) << i;
+#undef PBJSON_SIMD_EQ
+    }
+}
+
+/**
+ * @brief Bit i of the result is the XOR of bits 0 to i of @p x.
+ *
+ * Applied to the unescaped quotes of a block it marks the bytes inside
+ * strings, counting each opening quote as inside and closing quotes as outside.
+ */
+static inline uint64_t pbjson_simd_prefix_xor(uint64_t x)
+{
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+/**
+ * @brief Index of the lowest set bit of a non-zero 64-bit mask.
+ */
+static inline unsigned pbjson_simd_ctz64(uint64_t mask)
+{
+#if defined(_MSC_VER) && !defined(__clang__) && defined(_M_X64)
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return (unsigned)index;
+#elif defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index;
+    if ((uint32_t)mask != 0)
+    {
+        _BitScanForward(&index, (uint32_t)mask);
+        return (unsigned)index;
+    }
+    _BitScanForward(&index, (uint32_t)(mask >> 32));
+    return (unsigned)index + 32;
+#else
+    return (unsigned)__builtin_ctzll(mask);
+#endif
+}
+
+#define PBJSON_SIMD_STRUCTURAL_INDEX 1
+#endif
+
+#endif // PBJSON_SIMD_H
@@ -0,0 +1,88 @@
+/**
+ * @file pbjson_stats.h
+ * @brief Counters and phase timers behind PBJSON_STATS.
+ *
+ * Without PBJSON_STATS every macro expands to nothing, so the hot paths are
+ * the same as in a build without instrumentation. PBJSON_STATS_TIMERS adds
+ * cycle timers around the phases of pbjson_stats_phase_t, read with
+ * PBJSON_STATS_CLOCK(). The default clock is the time stamp counter on x86
+ * and the virtual counter on AArch64; define PBJSON_STATS_CLOCK() to use
+ * another one, for example a cycle counter on a microcontroller.
+ *
+ * Counters live in thread-local storage, the library stays free of shared
+ * state.
+ */
+
+#ifndef PBJSON_STATS_H
+#define PBJSON_STATS_H
+
+#include <pb/json.h>
+
+#ifdef PBJSON_STATS
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define PBJSON_THREAD_LOCAL __declspec(thread)
+#else
+#define PBJSON_THREAD_LOCAL _Thread_local
+#endif
+
+#if defined(PBJSON_STATS_TIMERS) && !defined(PBJSON_STATS_CLOCK)
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define PBJSON_STATS_CLOCK() ((uint64_t)__rdtsc())
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PBJSON_STATS_CLOCK() ((uint64_t)__rdtsc())
+#elif defined(__aarch64__)
+static inline uint64_t pbjson_stats_cntvct(void)
+{
+    uint64_t t;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(t));
+    return t;
+}
+#define PBJSON_STATS_CLOCK() pbjson_stats_cntvct()
+#else
+#error Define PBJSON_STATS_CLOCK() to use PBJSON_STATS_TIMERS on this target.
+#endif
+#endif
+
+#ifdef PBJSON_STATS_TIMERS
+#define PBJSON_STATS_NOW() PBJSON_STATS_CLOCK()
+#else
+#define PBJSON_STATS_NOW() ((uint64_t)0)
+#endif
+
+/**
+ * @brief Counters of the calling thread, defined in pbjson_decode.c.
+ */
+extern PBJSON_THREAD_LOCAL pbjson_stats_t pbjson_stats_tls;
+
+/**
+ * @brief Counts an object and passes it to the hook.
+ *
+ * @param fields Descriptor of the object.
+ * @param is_encode true for the encoder.
+ * @param bytes Length of the JSON text of the object.
+ * @param start PBJSON_STATS_NOW() when the object was started.
+ */
+void pbjson_stats_message(const pbjson_msgdesc_t *fields, bool is_encode, size_t bytes, uint64_t start);
+
+#define PBJSON_STATS_ADD(counter, n) (pbjson_stats_tls.counter += (uint64_t)(n))
+
+#ifdef PBJSON_STATS_TIMERS
+#define PBJSON_STATS_START(t) uint64_t t = PBJSON_STATS_CLOCK()
+#define PBJSON_STATS_STOP(t, phase) (pbjson_stats_tls.cycles[phase] += PBJSON_STATS_CLOCK() - (t))
+#else
+#define PBJSON_STATS_START(t) ((void)0)
+#define PBJSON_STATS_STOP(t, phase) ((void)0)
+#endif
+
+#else
+
+#define PBJSON_STATS_ADD(counter, n) ((void)0)
+#define PBJSON_STATS_START(t) ((void)0)
+#define PBJSON_STATS_STOP(t, phase) ((void)0)
+
+#endif
+
+#endif // PBJSON_STATS_H
@@ -0,0 +1,298 @@
+/**
+ * @file pbjson_string.h
+ * @brief Escape sequences and UTF-8 checks shared by the encoder and decoder.
+ *
+ * The callers find the bytes that need attention with pbjson_simd_find()
+ * and the PBJSON_SIMD_ESCAPE or PBJSON_SIMD_UNESCAPE classes, and handle
+ * one escape sequence or non-ASCII character at a time with these helpers.
+ */
+
+#ifndef PBJSON_STRING_H
+#define PBJSON_STRING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @brief Longest JSON escape of one byte, "\u00XX".
+ */
+#define PBJSON_ESCAPE_MAX 6
+
+/**
+ * @brief Writes the JSON escape sequence of a quote, backslash or control character.
+ *
+ * @param c The character.
+ * @param out Receives the sequence, at least PBJSON_ESCAPE_MAX bytes.
+ * @return Length of the sequence.
+ */
+static inline size_t pbjson_escape_char(char c, char *out)
+{
+    static const char hex[] = "0123456789abcdef";
+    char short_form;
+
+    switch (c)
+    {
+    case '"':
+        short_form = '"';
+        break;
+    case '\\':
+        short_form = '\\';
+        break;
+    case '\b':
+        short_form = 'b';
+        break;
+    case '\f':
+        short_form = 'f';
+        break;
+    case '\n':
+        short_form = 'n';
+        break;
+    case '\r':
+        short_form = 'r';
+        break;
+    case '\t':
+        short_form = 't';
+        break;
+
+    default:
+        out[0] = '\\';
+        out[1] = 'u';
+        out[2] = '0';
+        out[3] = '0';
+        out[4] = hex[((unsigned char)c) >> 4];
+        out[5] = hex[((unsigned char)c) & 0xF];
+        return 6;
+    }
+
+    out[0] = '\\';
+    out[1] = short_form;
+    return 2;
+}
+
+/**
+ * @brief Length of the well-formed UTF-8 character at @p s.
+ *
+ * Overlong forms, surrogates and code points above U+10FFFF are rejected.
+ *
+ * @param s First byte of the character.
+ * @param end End of the input.
+ * @return 1 to 4, or 0 if the bytes are not a complete, well-formed character.
+ */
+static inline size_t pbjson_utf8_length(const char *s, const char *end)
+{
+    const unsigned char *p = (const unsigned char *)s;
+    size_t avail = (size_t)(end - s);
+    size_t len;
+    unsigned char lo = 0x80;
+    unsigned char hi = 0xBF;
+
+    if (p[0] < 0x80)
+    {
+        return 1;
+    }
+    else if (p[0] < 0xC2)
+    {
+        return 0;
+    }
+    else if (p[0] < 0xE0)
+    {
+        len = 2;
+    }
+    else if (p[0] < 0xF0)
+    {
+        len = 3;
+        lo = (p[0] == 0xE0) ? 0xA0 : 0x80;
+        hi = (p[0] == 0xED) ? 0x9F : 0xBF;
+    }
+    else if (p[0] < 0xF5)
+    {
+        len = 4;
+        lo = (p[0] == 0xF0) ? 0x90 : 0x80;
+        hi = (p[0] == 0xF4) ? 0x8F : 0xBF;
+    }
+    else
+    {
+        return 0;
+    }
+
+    /* The second byte carries the range limits, the others are plain continuations. */
+    if ((avail < len) || (p[1] < lo) || (p[1] > hi))
+    {
+        return 0;
+    }
+
+    for (size_t i = 2; i < len; i++)
+    {
+        if ((p[i] & 0xC0) != 0x80)
+        {
+            return 0;
+        }
+    }
+
+    return len;
+}
+
+/**
+ * @brief Value of four hexadecimal digits.
+ *
+ * @param s First digit.
+ * @param end End of the input.
+ * @return The value, -1 for a character that is not a digit, -2 if the input ends first.
+ */
+static inline int32_t pbjson_hex4(const char *s, const char *end)
+{
+    int32_t val = 0;
+
+    for (int i = 0; i < 4; i++)
+    {
+        if (s + i >= end)
+        {
+            return -2;
+        }
+
+        char c = s[i];
+        int32_t digit;
+
+        if ((c >= '0') && (c <= '9'))
+        {
+            digit = c - '0';
+        }
+        else if (((c | 0x20) >= 'a') && ((c | 0x20) <= 'f'))
+        {
+            digit = (c | 0x20) - 'a' + 10;
+        }
+        else
+        {
+            return -1;
+        }
+
+        val = (val << 4) | digit;
+    }
+
+    return val;
+}
+
+/**
+ * @brief Decodes one escape sequence into UTF-8.
+ *
+ * A high surrogate must be followed by the escaped low surrogate, the pair
+ * is one character.
+ *
+ * @param s The backslash that starts the sequence.
+ * @param end End of the input.
+ * @param out Receives the character, at least 4 bytes.
+ * @param p_next Receives the position after the sequence.
+ * @return Length of the character, 0 if the input ends inside the sequence,
+ *         -1 if the sequence is invalid.
+ */
+static inline int pbjson_unescape(const char *s, const char *end, char *out, const char **p_next)
+{
+    if (end - s < 2)
+    {
+        return 0;
+    }
+
+    switch (s[1])
+    {
+    case '"':
+    case '\\':
+    case '/':
+        out[0] = s[1];
+        break;
+    case 'b':
+        out[0] = '\b';
+        break;
+    case 'f':
+        out[0] = '\f';
+        break;
+    case 'n':
+        out[0] = '\n';
+        break;
+    case 'r':
+        out[0] = '\r';
+        break;
+    case 't':
+        out[0] = '\t';
+        break;
+
+    case 'u':
+    {
+        const char *next = s + 6;
+        int32_t cp = pbjson_hex4(s + 2, end);
+
+        if (cp < 0)
+        {
+            return (cp == -2) ? 0 : -1;
+        }
+
+        if ((cp >= 0xD800) && (cp < 0xDC00))
+        {
+            if ((end - next) < 2)
+            {
+                return 0;
+            }
+
+            if ((next[0] != '\\') || (next[1] != 'u'))
+            {
+                return -1;
+            }
+
+            int32_t low = pbjson_hex4(next + 2, end);
+
+            if (low < 0)
+            {
+                return (low == -2) ? 0 : -1;
+            }
+
+            if ((low < 0xDC00) || (low >= 0xE000))
+            {
+                return -1;
+            }
+
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+            next += 6;
+        }
+        else if ((cp >= 0xDC00) && (cp < 0xE000))
+        {
+            return -1;
+        }
+
+        *p_next = next;
+
+        if (cp < 0x80)
+        {
+            out[0] = (char)cp;
+            return 1;
+        }
+
+        if (cp < 0x800)
+        {
+            out[0] = (char)(0xC0 | (cp >> 6));
+            out[1] = (char)(0x80 | (cp & 0x3F));
+            return 2;
+        }
+
+        if (cp < 0x10000)
+        {
+            out[0] = (char)(0xE0 | (cp >> 12));
+            out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+            out[2] = (char)(0x80 | (cp & 0x3F));
+            return 3;
+        }
+
+        out[0] = (char)(0xF0 | (cp >> 18));
+        out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+        out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[3] = (char)(0x80 | (cp & 0x3F));
+        return 4;
+    }
+
+    default:
+        return -1;
+    }
+
+    *p_next = s + 2;
+    return 1;
+}
+
+#endif // PBJSON_STRING_H
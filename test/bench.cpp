@@ -0,0 +1,361 @@
+// Throughput benchmark for pbjson_encode(), pbjson_decode() and pbjson_decoder_feed().
+//
+// Usage: pbjson_bench [milliseconds per case]
+//
+// Every message of the corpus is timed for at least the given time (200 ms by
+// default) and reported as bytes of JSON, ns per message, MB/s and heap
+// allocations per message. Allocations are counted through the global
+// operator new; the library itself never allocates.
+
+#include <pb/json.h>
+#include <test_json.pb.h>
+#include <bench.pb.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string.h>
+
+static unsigned long g_allocations = 0;
+
+void *operator new(std::size_t size)
+{
+    g_allocations++;
+
+    void *p = std::malloc(size ? size : 1);
+
+    if (p == NULL)
+    {
+        throw std::bad_alloc();
+    }
+
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+#define BENCH_BUF_SIZE 65536
+#define BENCH_FEED_CHUNK 64
+
+static char g_json[BENCH_BUF_SIZE];
+static char g_out[BENCH_BUF_SIZE];
+static volatile int g_sink;
+
+typedef struct
+{
+    const char *name;
+    const pbjson_msgdesc_t *fields;
+    const void *msg;
+    void *scratch;
+} bench_case_t;
+
+typedef struct
+{
+    double ns_per_msg;
+    double mb_per_s;
+    double allocs_per_msg;
+} bench_result_t;
+
+typedef int (*bench_fn_t)(const bench_case_t *c, int len);
+
+static int bench_encode(const bench_case_t *c, int len)
+{
+    (void)len;
+    return pbjson_encode(g_out, sizeof(g_out), c->fields, c->msg);
+}
+
+static int bench_decode(const bench_case_t *c, int len)
+{
+    (void)len;
+    return pbjson_decode(g_json, c->fields, c->scratch);
+}
+
+static int bench_feed(const bench_case_t *c, int len)
+{
+    pbjson_decoder_t dec;
+    int err = PBJSON_DECODE_NEED_MORE;
+
+    pbjson_decoder_init(&dec, c->fields, c->scratch);
+
+    for (int pos = 0; pos < len; pos += BENCH_FEED_CHUNK)
+    {
+        int n = (len - pos < BENCH_FEED_CHUNK) ? len - pos : BENCH_FEED_CHUNK;
+        err = pbjson_decoder_feed(&dec, g_json + pos, (size_t)n);
+    }
+
+    return err;
+}
+
+// Runs fn in growing batches until min_ms have passed.
+static bench_result_t bench_run(bench_fn_t fn, const bench_case_t *c, int len, double min_ms)
+{
+    typedef std::chrono::steady_clock clock;
+
+    unsigned long iterations = 0;
+    unsigned long batch = 16;
+    unsigned long allocations = g_allocations;
+    double elapsed_ns = 0;
+    clock::time_point start = clock::now();
+
+    while (elapsed_ns < min_ms * 1e6)
+    {
+        for (unsigned long i = 0; i < batch; i++)
+        {
+            g_sink = fn(c, len);
+        }
+
+        iterations += batch;
+        batch *= 2;
+        elapsed_ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+    }
+
+    bench_result_t r;
+    r.ns_per_msg = elapsed_ns / (double)iterations;
+    r.mb_per_s = (double)len * 1e3 / r.ns_per_msg;
+    r.allocs_per_msg = (double)(g_allocations - allocations) / (double)iterations;
+    return r;
+}
+
+static void bench_print(const char *op, const bench_result_t &r)
+{
+    printf("  %-7s %10.1f ns/msg %9.1f MB/s %6.2f allocs/msg\n", op, r.ns_per_msg, r.mb_per_s, r.allocs_per_msg);
+}
+
+static bool bench_case(const bench_case_t *c, double min_ms)
+{
+    int len = pbjson_encode(g_json, sizeof(g_json), c->fields, c->msg);
+
+    if (len < 0)
+    {
+        printf("%s: encode error\n", c->name);
+        return false;
+    }
+
+    // Check that the JSON round-trips before timing anything.
+    if (pbjson_decode(g_json, c->fields, c->scratch) < 0 ||
+        pbjson_encode(g_out, sizeof(g_out), c->fields, c->scratch) != len || strcmp(g_out, g_json) != 0)
+    {
+        printf("%s: decode error\n", c->name);
+        return false;
+    }
+
+    if (bench_feed(c, len) != 0)
+    {
+        printf("%s: incremental decode error\n", c->name);
+        return false;
+    }
+
+    printf("%s (%d bytes)\n", c->name, len);
+    bench_print("encode", bench_run(bench_encode, c, len, min_ms));
+    bench_print("decode", bench_run(bench_decode, c, len, min_ms));
+    bench_print("feed", bench_run(bench_feed, c, len, min_ms));
+    return true;
+}
+
+static void fill_string(char *s, size_t size, const char *prefix, unsigned n)
+{
+    snprintf(s, size, "%s-%u", prefix, n);
+}
+
+static void fill_point(BenchPoint *p, unsigned n)
+{
+    p->x = 0.25f * (float)n;
+    p->y = -1.5f + (float)n / 3.0f;
+    p->z = 1000.125f;
+    p->flags = (int32_t)(n * 7);
+}
+
+static void fill_level3(BenchLevel3 *m, unsigned n)
+{
+    fill_string(m->tag, sizeof(m->tag), "tag", n);
+    m->has_point = true;
+    fill_point(&m->point, n);
+    m->value = -(int64_t)n * 1234567891LL;
+}
+
+static void fill_level2(BenchLevel2 *m, unsigned n)
+{
+    m->has_inner = true;
+    fill_level3(&m->inner, n);
+    m->items_count = sizeof(m->items) / sizeof(m->items[0]);
+    for (unsigned i = 0; i < m->items_count; i++)
+    {
+        fill_level3(&m->items[i], n * 10 + i);
+    }
+    m->weight = 0.1 * (double)n;
+}
+
+static void fill_level1(BenchLevel1 *m, unsigned n)
+{
+    m->has_inner = true;
+    fill_level2(&m->inner, n);
+    m->items_count = sizeof(m->items) / sizeof(m->items[0]);
+    for (unsigned i = 0; i < m->items_count; i++)
+    {
+        fill_level2(&m->items[i], n * 10 + i);
+    }
+    fill_string(m->label, sizeof(m->label), "level one label", n);
+}
+
+static void fill_deep(BenchDeep *m)
+{
+    m->has_root = true;
+    fill_level1(&m->root, 1);
+    m->items_count = sizeof(m->items) / sizeof(m->items[0]);
+    for (unsigned i = 0; i < m->items_count; i++)
+    {
+        fill_level1(&m->items[i], i + 2);
+    }
+}
+
+static void fill_sensor(BenchSensor *m)
+{
+    fill_string(m->name, sizeof(m->name), "temperature/outdoor", 3);
+    m->timestamp = 1700000000123ULL;
+    m->samples_count = sizeof(m->samples) / sizeof(m->samples[0]);
+    for (unsigned i = 0; i < m->samples_count; i++)
+    {
+        m->samples[i] = 20.0f + (float)i * 0.37f;
+    }
+    m->counters_count = sizeof(m->counters) / sizeof(m->counters[0]);
+    for (unsigned i = 0; i < m->counters_count; i++)
+    {
+        m->counters[i] = (int32_t)(i * i * 97) - 5000;
+    }
+    m->readings_count = sizeof(m->readings) / sizeof(m->readings[0]);
+    for (unsigned i = 0; i < m->readings_count; i++)
+    {
+        m->readings[i] = 1.0 / (double)(i + 3);
+    }
+}
+
+static void fill_wide(BenchWide *m)
+{
+    m->field_01 = -1;
+    m->field_02 = 4000000000u;
+    m->field_03 = -9000000000000LL;
+    m->field_04 = 18000000000000000000ULL;
+    m->field_05 = 3.25f;
+    m->field_06 = 2.718281828459045;
+    m->field_07 = true;
+    strcpy(m->field_08, "alpha");
+    m->field_09 = 123456;
+    m->field_10 = 77;
+    m->field_11 = 42;
+    m->field_12 = 9;
+    m->field_13 = -0.5f;
+    m->field_14 = 1e-7;
+    m->field_15 = false;
+    strcpy(m->field_16, "bravo");
+    m->field_17 = -2147483647;
+    m->field_18 = 1;
+    m->field_19 = -1;
+    m->field_20 = 65536;
+    m->field_21 = 1e10f;
+    m->field_22 = -123.456;
+    m->field_23 = true;
+    strcpy(m->field_24, "charlie");
+    m->field_25 = 2024;
+    m->field_26 = 10;
+    m->field_27 = 1000000;
+    m->field_28 = 5;
+    m->field_29 = 0.1f;
+    m->field_30 = 6.02214076e23;
+    m->field_31 = true;
+    strcpy(m->field_32, "delta echo");
+}
+
+static void fill_log(BenchLog *m)
+{
+    m->level = 3;
+    m->lines_count = sizeof(m->lines) / sizeof(m->lines[0]);
+    for (unsigned i = 0; i < m->lines_count; i++)
+    {
+        snprintf(m->lines[i], sizeof(m->lines[i]), "2024-01-01T00:00:%02u worker[%u]: request handled in %u us", i,
+                 i % 4, 100 + i * 13);
+    }
+}
+
+template <typename T>
+struct bench_msg
+{
+    T msg;
+    T scratch;
+};
+
+static bench_msg<SubMessage4> g_sub4;
+static bench_msg<SubMessage6> g_sub6;
+static bench_msg<SubMessage7> g_sub7;
+static bench_msg<BenchPoint> g_point;
+static bench_msg<BenchSensor> g_sensor;
+static bench_msg<BenchDeep> g_deep;
+static bench_msg<BenchWide> g_wide;
+static bench_msg<BenchLog> g_log;
+
+int main(int argc, char **argv)
+{
+    double min_ms = (argc > 1) ? atof(argv[1]) : 200.0;
+
+    g_sub4.msg.a = 1.5f;
+    g_sub4.msg.b = -2.25;
+    g_sub4.msg.c = -123;
+    g_sub4.msg.d = 456;
+    g_sub4.msg.e = -1234567890123LL;
+    g_sub4.msg.f = 9876543210ULL;
+    g_sub4.msg.g = -7;
+    g_sub4.msg.h = 8;
+    g_sub4.msg.j = true;
+
+    g_sub6.msg.x_count = sizeof(g_sub6.msg.x) / sizeof(g_sub6.msg.x[0]);
+    for (unsigned i = 0; i < g_sub6.msg.x_count; i++)
+    {
+        g_sub6.msg.x[i].x = (float)i + 0.5f;
+        g_sub6.msg.x[i].y = (int32_t)i * -3;
+    }
+
+    g_sub7.msg.has_x = true;
+    g_sub7.msg.x.x = 3.5f;
+    g_sub7.msg.x.y = 12;
+    g_sub7.msg.has_y = true;
+    strcpy(g_sub7.msg.y.x, "nested");
+    g_sub7.msg.y.has_msg = true;
+    g_sub7.msg.y.msg.x = -0.75f;
+    g_sub7.msg.y.opt = TestEnum_Opt2;
+
+    fill_point(&g_point.msg, 5);
+    fill_sensor(&g_sensor.msg);
+    fill_deep(&g_deep.msg);
+    fill_wide(&g_wide.msg);
+    fill_log(&g_log.msg);
+
+    const bench_case_t cases[] = {
+        {"SubMessage4", SubMessage4_fields, &g_sub4.msg, &g_sub4.scratch},
+        {"SubMessage6", SubMessage6_fields, &g_sub6.msg, &g_sub6.scratch},
+        {"SubMessage7", SubMessage7_fields, &g_sub7.msg, &g_sub7.scratch},
+        {"BenchPoint", BenchPoint_fields, &g_point.msg, &g_point.scratch},
+        {"BenchSensor", BenchSensor_fields, &g_sensor.msg, &g_sensor.scratch},
+        {"BenchDeep", BenchDeep_fields, &g_deep.msg, &g_deep.scratch},
+        {"BenchWide", BenchWide_fields, &g_wide.msg, &g_wide.scratch},
+        {"BenchLog", BenchLog_fields, &g_log.msg, &g_log.scratch},
+    };
+
+    int failed = 0;
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        if (!bench_case(&cases[i], min_ms))
+        {
+            failed++;
+        }
+    }
+
+    return failed ? 1 : 0;
+}
@@ -1,7 +1,14 @@
 #include <pb/json.h>
+#include <pb/json.hpp>
+#ifdef PBJSON_PARALLEL
+#include <pb/json_parallel.h>
+#endif
 #include <test_json.pb.h>
 #include <iostream>
+#include <string>
+#include <vector>
 #include <string.h>
+#include <math.h>
 
 void test1()
 {
@@ -357,6 +364,2245 @@ void test_decode7()
     }
 }
 
+void test_decode8()
+{
+    SubMessage2 msg = SubMessage2_init_default;
+
+    const char *s = "{\"z\":{\"a\":[1,{\"b\":\"}\"}],\"c\":null},\"x\":1.5,\"y\":7}";
+
+    int err = pbjson_decode(s, SubMessage2_fields, &msg);
+
+    if (err || msg.y != 7)
+    {
+        std::cout << "decode error" << std::endl;
+    }
+
+    const char *bad[] = {
+        "{\"x\":1.5,\"y\":7",
+        "{\"z\":[1,2},\"y\":7}",
+        "{\"y\":7}}",
+    };
+
+    for (const char *b : bad)
+    {
+        if (pbjson_decode(b, SubMessage2_fields, &msg) == 0)
+        {
+            std::cout << "decode accepted malformed input" << std::endl;
+        }
+    }
+}
+
+void test_decode9()
+{
+    SubMessage3 msg = SubMessage3_init_zero;
+
+    /* Only the first object belongs to the message, the rest of the buffer must not be read. */
+    const char buf[] = "{\"x\":\"Hello\",\"opt\":2}{\"x\":\"World\"";
+
+    size_t len = strchr(buf, '}') - buf + 1;
+
+    int err = pbjson_decode_n(buf, len, SubMessage3_fields, &msg);
+
+    if (err || strcmp(msg.x, "Hello") || msg.opt != TestEnum_Opt2)
+    {
+        std::cout << "decode error" << std::endl;
+    }
+
+    /* Truncated number at the end of the buffer. */
+    err = pbjson_decode_n("{\"opt\":2}", 7, SubMessage3_fields, &msg);
+
+    if (err == 0)
+    {
+        std::cout << "decode accepted truncated input" << std::endl;
+    }
+}
+
+void test_decode10()
+{
+    SubMessage4 msg = SubMessage4_init_zero;
+
+    /* Keys in reverse order and mixed with unknown ones go through the hash lookup. */
+    const char *s = "{\"j\":true,\"h\":-8,\"hh\":1,\"g\":-7,\"f\":6,\"e\":-5,\"d\":4,\"\":0,\"c\":-3,\"b\":2.5,\"a\":1.5}";
+
+    int err = pbjson_decode(s, SubMessage4_fields, &msg);
+
+    if (err || !msg.j || msg.h != -8 || msg.g != -7 || msg.f != 6 || msg.e != -5 || msg.d != 4 || msg.c != -3 ||
+        msg.b != 2.5 || msg.a != 1.5f)
+    {
+        std::cout << "decode error" << std::endl;
+    }
+}
+
+void test_decode11()
+{
+    SubMessage4 msg = SubMessage4_init_zero;
+
+    /* Out of range values are rejected instead of being truncated. */
+    if (pbjson_decode("{\"c\":2147483648}", SubMessage4_fields, &msg) == 0 ||
+        pbjson_decode("{\"d\":-1}", SubMessage4_fields, &msg) == 0 ||
+        pbjson_decode("{\"c\":1.5}", SubMessage4_fields, &msg) == 0)
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    const char *s = "{\"a\":\"NaN\",\"b\":-1.25e-3,\"c\":-2147483648,\"d\":4294967295,"
+                    "\"e\":\"-9223372036854775808\",\"f\":18446744073709551615}";
+
+    int err = pbjson_decode(s, SubMessage4_fields, &msg);
+
+    if (err || msg.a == msg.a || msg.b != -1.25e-3 || msg.c != INT32_MIN || msg.d != UINT32_MAX ||
+        msg.e != INT64_MIN || msg.f != UINT64_MAX)
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    /* Numbers too large for the type are not read as infinity, only "Infinity" is. */
+    if (pbjson_decode("{\"b\":1e400}", SubMessage4_fields, &msg) == 0 ||
+        pbjson_decode("{\"b\":-1.7976931348623159e308}", SubMessage4_fields, &msg) == 0 ||
+        pbjson_decode("{\"a\":3.4028236e38}", SubMessage4_fields, &msg) == 0 ||
+        pbjson_decode("{\"a\":\"1e39\"}", SubMessage4_fields, &msg) == 0 ||
+        pbjson_decode("{\"a\":\"-Infinity\",\"b\":\"Infinity\"}", SubMessage4_fields, &msg) != 0 ||
+        msg.a != -(float)INFINITY || msg.b != (double)INFINITY)
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    /* Correctly rounded at the limits, at halfway points and with more digits than fit a buffer. */
+    struct
+    {
+        const char *json;
+        float a;
+        double b;
+    } cases[] = {
+        {"{\"a\":3.4028235e38,\"b\":1.7976931348623157e308}", 3.4028235e38f, 1.7976931348623157e308},
+        {"{\"a\":1e-46,\"b\":4.9406564584124654e-324}", 0.0f, 4.9406564584124654e-324},
+        {"{\"a\":1.4e-45,\"b\":-1e-400}", 1.4e-45f, -0.0},
+        {"{\"a\":16777217,\"b\":9007199254740993}", 16777216.0f, 9007199254740992.0},
+        {"{\"a\":16777217.000000000001,\"b\":9007199254740993.00000000000000000000000000000000000000000000000001}",
+         16777218.0f, 9007199254740994.0},
+        {"{\"a\":0.1,\"b\":3.141592653589793238462643383279502884197169399375105820974944592307816406286}", 0.1f,
+         3.141592653589793},
+        {"{\"a\":7.038531e-26,\"b\":2.2250738585072011e-308}", 7.038531e-26f, 2.2250738585072011e-308},
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        msg = SubMessage4_init_zero;
+
+        if (pbjson_decode(cases[i].json, SubMessage4_fields, &msg) || memcmp(&msg.a, &cases[i].a, sizeof(msg.a)) ||
+            memcmp(&msg.b, &cases[i].b, sizeof(msg.b)))
+        {
+            std::cout << "decode error" << std::endl;
+            return;
+        }
+    }
+}
+
+void test_decode12()
+{
+    SubMessage7 msg = SubMessage7_init_zero;
+
+    const char *s = "{\"x\":{\"x\":1.23,\"y\":-12},\"skip\":[{\"a\":\"]\"}],\"y\":{\"x\":\"Hello\",\"msg\":{\"x\":1.27,\"y\":-25},\"opt\":2}}";
+
+    pbjson_decoder_t dec;
+    pbjson_decoder_init(&dec, SubMessage7_fields, &msg);
+
+    /* Feed one byte at a time, splitting every key, string and number. */
+    int err = PBJSON_DECODE_NEED_MORE;
+    for (size_t i = 0; s[i] != '\0'; i++)
+    {
+        if (err != PBJSON_DECODE_NEED_MORE)
+        {
+            std::cout << "decode error" << std::endl;
+            return;
+        }
+
+        err = pbjson_decoder_feed(&dec, &s[i], 1);
+    }
+
+    if (err || !msg.has_x || msg.x.x != 1.23f || msg.x.y != -12 || !msg.has_y || strcmp(msg.y.x, "Hello") ||
+        !msg.y.has_msg || msg.y.msg.x != 1.27f || msg.y.msg.y != -25 || msg.y.opt != TestEnum_Opt2)
+    {
+        std::cout << "decode error" << std::endl;
+    }
+}
+
+void test_decode13()
+{
+    SubMessage7 msg = SubMessage7_init_zero;
+
+    /* CRLF line ends, deep indentation and an unknown value long enough for the vector loops. */
+    const char *s = "{\r\n"
+                    "                                    \"x\" : {\"x\": 1.23, \"y\": -12},\r\n"
+                    "        \"unknown\": {\"text\": \"a string with \\\"}]\\\" inside that spans many blocks\"},\r\n"
+                    "        \"y\": {\"x\": \"He said \\\"hi\\\"\"}\r\n"
+                    "}\r\n";
+
+    int err = pbjson_decode(s, SubMessage7_fields, &msg);
+
+    if (err || !msg.has_x || msg.x.x != 1.23f || msg.x.y != -12 || !msg.has_y || strcmp(msg.y.x, "He said \"hi\""))
+    {
+        std::cout << "decode error" << std::endl;
+    }
+}
+
+void test_decode14()
+{
+    char buf[512];
+    char s[256];
+    pbjson_arena_t arena;
+
+    pbjson_arena_init(&arena, buf, sizeof(buf));
+
+    SubMessage8 msg = SubMessage8_init_zero;
+
+    const char *json = "{\"name\":\"a name of any length\",\"values\":[1,-2,3],\"tags\":[\"x\",\"yz\"],"
+                       "\"point\":{\"x\":1.5,\"y\":2},\"points\":[{\"x\":-1,\"y\":0},{\"x\":0,\"y\":7}]}";
+
+    int err = pbjson_decode_arena(json, strlen(json), SubMessage8_fields, &msg, &arena);
+
+    if (err || strcmp(msg.name, "a name of any length") || msg.values_count != 3 || msg.values[1] != -2 ||
+        msg.tags_count != 2 || strcmp(msg.tags[1], "yz") || !msg.point || msg.point->y != 2 || msg.points_count != 2 ||
+        msg.points[1].y != 7)
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    int len = pbjson_encode(s, sizeof(s), SubMessage8_fields, &msg);
+
+    if (len != (int)strlen(json) || strcmp(s, json) != 0)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    /* Pointer fields need an arena that is large enough. */
+    SubMessage8 msg2 = SubMessage8_init_zero;
+    pbjson_arena_init(&arena, buf, 16);
+
+    if (pbjson_decode(json, SubMessage8_fields, &msg2) == 0 ||
+        pbjson_decode_arena(json, strlen(json), SubMessage8_fields, &msg2, &arena) == 0)
+    {
+        std::cout << "decode error" << std::endl;
+    }
+
+    /* Absent pointer fields are left out of the output. */
+    SubMessage8 msg3 = SubMessage8_init_zero;
+    len = pbjson_encode(s, sizeof(s), SubMessage8_fields, &msg3);
+
+    if (len < 0 || strcmp(s, "{\"values\":[],\"tags\":[],\"points\":[]}") != 0)
+    {
+        std::cout << "encode error" << std::endl;
+    }
+}
+
+struct test_samples
+{
+    float sum;
+    int count;
+    int point_y;
+};
+
+static int test_decode_sample(const pbjson_istream_t *stream, const pbjson_iter_t *field, void **arg)
+{
+    float val;
+    test_samples *samples = static_cast<test_samples *>(*arg);
+
+    if (pbjson_read_value(stream, field->data_type, &val, sizeof(val)))
+    {
+        return -1;
+    }
+
+    samples->sum += val;
+    samples->count++;
+    return 0;
+}
+
+static int test_decode_point(const pbjson_istream_t *stream, const pbjson_iter_t *field, void **arg)
+{
+    SubMessage2 point = SubMessage2_init_zero;
+    test_samples *samples = static_cast<test_samples *>(*arg);
+
+    if (pbjson_decode_n(stream->s, stream->len, PBJSON_ITER_SUBMSG(SubMessage9_fields, field), &point))
+    {
+        return -1;
+    }
+
+    samples->point_y += point.y;
+    return 0;
+}
+
+void test_decode15()
+{
+    test_samples samples = {0, 0, 0};
+
+    SubMessage9 msg = SubMessage9_init_zero;
+    msg.samples.funcs.decode = test_decode_sample;
+    msg.samples.arg = &samples;
+    msg.points.funcs.decode = test_decode_point;
+    msg.points.arg = &samples;
+
+    const char *s = "{\"id\": 5, \"samples\": [1.5, 2, -0.5], \"points\": [{\"y\": 3}, {\"x\": 1, \"y\": 4}]}";
+
+    int err = pbjson_decode(s, SubMessage9_fields, &msg);
+
+    if (err || msg.id != 5 || samples.count != 3 || samples.sum != 3.0f || samples.point_y != 7)
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    /* Fields without a callback are skipped, a failing callback aborts decoding. */
+    SubMessage9 msg2 = SubMessage9_init_zero;
+    msg2.points.funcs.decode = test_decode_point;
+    msg2.points.arg = &samples;
+
+    if (pbjson_decode(s, SubMessage9_fields, &msg2) || msg2.id != 5 ||
+        pbjson_decode("{\"points\": [{\"y\": true}]}", SubMessage9_fields, &msg2) == 0)
+    {
+        std::cout << "decode error" << std::endl;
+    }
+}
+
+static int test_encode_samples(pbjson_ostream_t *stream, const pbjson_iter_t *field, void *const *arg)
+{
+    int count = *static_cast<const int *>(*arg);
+
+    if (pbjson_write(stream, "[", 1))
+    {
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        float val = 0.5f * (float)i;
+
+        if ((i != 0 && pbjson_write(stream, ",", 1)) || pbjson_write_value(stream, field->data_type, sizeof(val), &val))
+        {
+            return -1;
+        }
+    }
+
+    return pbjson_write(stream, "]", 1);
+}
+
+void test_encode4()
+{
+    char s[256];
+    int count = 4;
+
+    SubMessage9 msg = SubMessage9_init_zero;
+    msg.id = 1;
+    msg.samples.funcs.encode = test_encode_samples;
+    msg.samples.arg = &count;
+
+    /* The points field has no callback and is left out. */
+    const char *expected = "{\"id\":1,\"samples\":[0,0.5,1,1.5]}";
+
+    int len = pbjson_encode(s, sizeof(s), SubMessage9_fields, &msg);
+
+    if (len != (int)strlen(expected) || strcmp(s, expected) != 0 || pbjson_encoded_size(SubMessage9_fields, &msg) != len)
+    {
+        std::cout << "encode error" << std::endl;
+    }
+}
+
+void test_decode16()
+{
+    char s[256];
+
+    SubMessage10 msg = SubMessage10_init_zero;
+
+    const char *json = "{\"id\":\"3f2a-91c0\",\"token\":\"a \\\"quoted\\\" token\",\"n\":2}";
+
+    int err = pbjson_decode(json, SubMessage10_fields, &msg);
+
+    /* The views point into the input, escapes are kept as they are. */
+    if (err || msg.id.data != json + 7 || msg.id.size != 9 || msg.id.escaped || msg.token.size != 18 ||
+        !msg.token.escaped || memcmp(msg.token.data, "a \\\"quoted\\\" token", 18) || msg.n != 2)
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    int len = pbjson_encode(s, sizeof(s), SubMessage10_fields, &msg);
+
+    if (len != (int)strlen(json) || strcmp(s, json) != 0)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    /* With an arena only text with escapes is copied, unescaped, and escaped again by the encoder. */
+    char mem[64];
+    pbjson_arena_t arena;
+    pbjson_arena_init(&arena, mem, sizeof(mem));
+    msg = SubMessage10_init_zero;
+
+    if (pbjson_decode_arena(json, strlen(json), SubMessage10_fields, &msg, &arena) || msg.id.data != json + 7 ||
+        msg.token.escaped || (msg.token.size != 16) || memcmp(msg.token.data, "a \"quoted\" token", 16) ||
+        pbjson_encode(s, sizeof(s), SubMessage10_fields, &msg) != (int)strlen(json) || strcmp(s, json) != 0)
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    /* Views that were not set are left out, plain text is escaped. */
+    SubMessage10 msg2 = SubMessage10_init_zero;
+    len = pbjson_encode(s, sizeof(s), SubMessage10_fields, &msg2);
+
+    if (len < 0 || strcmp(s, "{\"n\":0}") != 0)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    msg2.id.data = "a\"b";
+    msg2.id.size = 3;
+    len = pbjson_encode(s, sizeof(s), SubMessage10_fields, &msg2);
+
+    if (len < 0 || strcmp(s, "{\"id\":\"a\\\"b\",\"n\":0}") != 0)
+    {
+        std::cout << "encode error" << std::endl;
+    }
+}
+
+void test_decode17()
+{
+    /* Blank lines are skipped, a bad record does not stop the reader. */
+    const char *text = "{\"x\":1,\"y\":2}\n"
+                       "\n"
+                       "{\"x\":oops}\r\n"
+                       "  \t\r\n"
+                       "{\"x\":3.5,\"y\":-4}\r\n"
+                       "{\"x\":5,\"y\":6}";
+
+    const int expected_err[] = {0, -1, 0, 0, PBJSON_NDJSON_END, PBJSON_NDJSON_END};
+    const size_t expected_line[] = {1, 3, 5, 6, 6, 6};
+    const int expected_y[] = {2, 2, -4, 6, 6, 6};
+
+    pbjson_ndjson_reader_t reader;
+    pbjson_ndjson_init(&reader, text, strlen(text));
+
+    SubMessage2 msg = SubMessage2_init_zero;
+
+    for (int i = 0; i < 6; i++)
+    {
+        int err = pbjson_ndjson_read(&reader, SubMessage2_fields, &msg, NULL);
+
+        if (err != expected_err[i] || reader.line != expected_line[i] || (err == 0 && msg.y != expected_y[i]))
+        {
+            std::cout << "decode error" << std::endl;
+            return;
+        }
+
+        if (i == 1 && (reader.record.len != 11 || memcmp(reader.record.s, "{\"x\":oops}", 10) != 0))
+        {
+            std::cout << "decode error" << std::endl;
+            return;
+        }
+    }
+}
+
+#ifdef PBJSON_PARALLEL
+void test_decode18()
+{
+    static char text[1000 * 40];
+    static pbjson_istream_t inputs[1000];
+    static SubMessage2 msgs[1000];
+    static int results[1000];
+
+    size_t pos = 0;
+    for (int i = 0; i < 1000; i++)
+    {
+        /* Every 97th record is broken. */
+        int n = snprintf(text + pos, sizeof(text) - pos, (i % 97 == 5) ? "{\"x\":%d,\"y\":}" : "{\"x\":%d,\"y\":%d}",
+                         i, -i);
+        inputs[i].s = text + pos;
+        inputs[i].len = (size_t)n;
+        pos += (size_t)n;
+    }
+
+    for (unsigned threads = 0; threads <= 5; threads += 5)
+    {
+        memset(msgs, 0, sizeof(msgs));
+
+        int failed = pbjson_parallel_decode(SubMessage2_fields, inputs, 1000, msgs, sizeof(msgs[0]), results, threads,
+                                            NULL);
+
+        if (failed != 11)
+        {
+            std::cout << "decode error" << std::endl;
+            return;
+        }
+
+        /* Results stay in input order whichever thread decoded them. */
+        for (int i = 0; i < 1000; i++)
+        {
+            bool bad = (i % 97 == 5);
+
+            if ((results[i] != (bad ? -1 : 0)) || (msgs[i].x != (float)i) || (!bad && msgs[i].y != -i))
+            {
+                std::cout << "decode error" << std::endl;
+                return;
+            }
+        }
+    }
+
+    /* Arenas need the thread count they were sized for. */
+    pbjson_arena_t arena;
+    pbjson_arena_init(&arena, text, sizeof(text));
+
+    if (pbjson_parallel_decode(SubMessage2_fields, inputs, 1000, msgs, sizeof(msgs[0]), results, 0, &arena) != -1)
+    {
+        std::cout << "decode error" << std::endl;
+    }
+}
+#endif
+
+#ifdef PBJSON_STATS
+static void test_stats_hook(const pbjson_msgdesc_t *fields, bool is_encode, size_t bytes, uint64_t cycles, void *arg)
+{
+    (void)cycles;
+
+    /* Remember the length of the last nested SubMessage2 seen by the decoder. */
+    if (fields == SubMessage2_fields && !is_encode)
+    {
+        *(size_t *)arg = bytes;
+    }
+}
+
+void test_decode19()
+{
+    char s[256];
+    size_t sub_bytes = 0;
+
+    const char *json = "{\"x\":\"abc\",\"extra\":[1,{\"a\":2}],\"msg\":{\"x\":1.5,\"y\":-2},\"opt\":2}";
+
+    pbjson_stats_reset();
+    pbjson_stats_set_hook(test_stats_hook, &sub_bytes);
+
+    SubMessage3 msg = SubMessage3_init_zero;
+    int err = pbjson_decode(json, SubMessage3_fields, &msg);
+    int len = pbjson_encode(s, sizeof(s), SubMessage3_fields, &msg);
+
+    pbjson_stats_set_hook(NULL, NULL);
+
+    pbjson_stats_t stats;
+    pbjson_stats_get(&stats);
+
+    if (err || len < 0 || stats.decode_calls != 1 || stats.decode_errors != 0 || stats.decode_bytes != strlen(json) ||
+        stats.decode_messages != 2 || stats.decode_fields != 5 || stats.unknown_keys != 1 || stats.values_skipped != 1 ||
+        stats.numbers != 2 || sub_bytes != strlen("{\"x\":1.5,\"y\":-2}"))
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    if (stats.encode_calls != 1 || stats.encode_bytes != (uint64_t)len || stats.encode_messages != 2 ||
+        stats.encode_fields != 5)
+    {
+        std::cout << "encode error" << std::endl;
+    }
+}
+#endif
+
+void test_decode20()
+{
+    /* A large unknown value, with brackets, escaped quotes and runs of backslashes
+     * in strings at every offset of a 64-byte block. */
+    std::string extra = "{\"list\":[";
+    for (int i = 0; i < 64; i++)
+    {
+        extra += "{\"k\":\"" + std::string(i % 7, 'a') + "]}[{\\\"\\\\\\\\\",\"n\":[1,[2,{}]]},";
+    }
+    extra += "\"\\\\\"]}";
+
+    std::string json = "{\"x\":\"abc\",\"extra\":" + extra + ",\"opt\":2}";
+
+    SubMessage3 msg = SubMessage3_init_zero;
+    int err = pbjson_decode(json.c_str(), SubMessage3_fields, &msg);
+
+    if (err || strcmp(msg.x, "abc") != 0 || msg.opt != TestEnum_Opt2)
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    /* Mismatched and unterminated containers are still rejected. */
+    const char *bad[] = {"}]", "}", "", "\""};
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+    {
+        std::string broken = "{\"x\":\"abc\",\"extra\":" + extra.substr(0, extra.size() - 2) + bad[i];
+        if (i < 2)
+        {
+            broken += ",\"opt\":2}";
+        }
+
+        SubMessage3 msg2 = SubMessage3_init_zero;
+        if (pbjson_decode(broken.c_str(), SubMessage3_fields, &msg2) == 0)
+        {
+            std::cout << "decode error" << std::endl;
+            return;
+        }
+    }
+
+    /* Skipped values are checked against the grammar, alone, after a large value and one byte at a time. */
+    const char *values[] = {"[1 2 @@@ : ]", "{\"k\"}", "{1:2}",  "\"\\q\"", "tru",    "1.2.3", "[1,]",
+                            "{\"k\":1,}",   "[1:2]", "[\"a\" \"b\"]", "-",      "01",     "1e",    "[\x01]",
+                            "[-0.5e+3,true,null,false,{},[],\"\\u00e9\\n\",{\"k\":[\"v\"]}]"};
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+    {
+        bool valid = (i == sizeof(values) / sizeof(values[0]) - 1);
+        std::string docs[] = {"{\"x\":\"abc\",\"extra\":" + std::string(values[i]) + ",\"opt\":2}",
+                              "{\"x\":\"abc\",\"extra\":[" + extra + "," + values[i] + "],\"opt\":2}"};
+
+        for (const std::string &doc : docs)
+        {
+            SubMessage3 msg2 = SubMessage3_init_zero;
+            if ((pbjson_decode(doc.c_str(), SubMessage3_fields, &msg2) == 0) != valid)
+            {
+                std::cout << "decode error" << std::endl;
+                return;
+            }
+
+            pbjson_decoder_t dec;
+            pbjson_decoder_init(&dec, SubMessage3_fields, &msg2);
+            err = PBJSON_DECODE_NEED_MORE;
+
+            for (size_t j = 0; (j < doc.size()) && (err == PBJSON_DECODE_NEED_MORE); j++)
+            {
+                err = pbjson_decoder_feed(&dec, &doc[j], 1);
+            }
+
+            if ((err == 0) != valid)
+            {
+                std::cout << "decode error" << std::endl;
+                return;
+            }
+        }
+    }
+}
+
+void test_decode21()
+{
+    char s[512];
+    uint8_t pb[256];
+
+    const char *json = "{\"x\":\"ab\",\"msg\":{\"x\":1.5,\"y\":-2},\"opt\":2}";
+
+    /* Fixed32 for floats, negative int32 sign-extended to ten bytes. */
+    const uint8_t expected[] = {0x0A, 0x02, 'a',  'b',  0x12, 0x10, 0x0D, 0x00, 0x00, 0xC0, 0x3F, 0x10,
+                                0xFE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x01, 0x18, 0x02};
+
+    int len = pbjson_transcode_to_pb(json, strlen(json), SubMessage3_fields, pb, sizeof(pb));
+
+    if (len != (int)sizeof(expected) || memcmp(pb, expected, sizeof(expected)) != 0 ||
+        pbjson_transcode_to_pb(json, strlen(json), SubMessage3_fields, NULL, 0) != len ||
+        pbjson_transcode_to_pb(json, strlen(json), SubMessage3_fields, pb, sizeof(expected) - 1) != -1)
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    /* Back to JSON, matching what the structure path produces. */
+    pbjson_ostream_t stream = pbjson_ostream_from_buffer(s, sizeof(s) - 1);
+
+    if (pbjson_transcode_to_json(&stream, SubMessage3_fields, pb, (size_t)len) != 0)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    s[stream.pos] = '\0';
+
+    if (strcmp(s, json) != 0)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    /* Zigzag for sint32/sint64, packed arrays, nested repeated messages and defaults. Duplicate keys
+     * reset arrays, merge submessages or remove them with {}, and unknown keys still make a submessage. */
+    const char *cases[] = {
+        "{\"g\":-7,\"h\":8,\"j\":true,\"a\":0.1,\"f\":18446744073709551615}",
+        "{\"array\":[1,-1,300]}",
+        "{\"array\":[]}",
+        "{\"s\":[\"one\",\"two\",\"a \\\"three\\\"\"]}",
+        "{\"x\":[{\"x\":1,\"y\":2},{},{\"x\":-0.5,\"y\":-3}]}",
+        "{\"y\":{\"x\":\"in\",\"msg\":{}},\"x\":{\"y\":7}}",
+        "{\"y\":{\"zz\":1}}",
+        "{\"array\":[1,2],\"array\":[3]}",
+        "{\"array\":[1,2],\"array\":[]}",
+        "{\"s\":[\"a\"],\"s\":[\"b\",\"c\"]}",
+        "{\"x\":[{\"x\":1}],\"x\":[]}",
+        "{\"x\":{\"x\":1},\"x\":{\"y\":2}}",
+        "{\"x\":{\"x\":1},\"y\":{},\"x\":{}}",
+        "{\"x\":{},\"x\":{\"y\":2},\"x\":{},\"x\":{\"x\":1}}",
+        "{\"y\":{\"msg\":{\"x\":1},\"msg\":{}},\"y\":{\"x\":\"a\",\"msg\":{\"y\":3},\"msg\":{\"x\":2}}}",
+    };
+    const pbjson_msgdesc_t *descs[] = {SubMessage4_fields, SubMessage1_fields, SubMessage1_fields, SubMessage5_fields,
+                                       SubMessage6_fields, SubMessage7_fields, SubMessage7_fields, SubMessage1_fields,
+                                       SubMessage1_fields, SubMessage5_fields, SubMessage6_fields, SubMessage7_fields,
+                                       SubMessage7_fields, SubMessage7_fields, SubMessage7_fields};
+
+    for (size_t i = 0; i < sizeof(descs) / sizeof(descs[0]); i++)
+    {
+        union
+        {
+            SubMessage1 m1;
+            SubMessage4 m4;
+            SubMessage5 m5;
+            SubMessage6 m6;
+            SubMessage7 m7;
+        } msg;
+        char via_struct[512];
+
+        memset(&msg, 0, sizeof(msg));
+
+        if (pbjson_decode(cases[i], descs[i], &msg) != 0 ||
+            pbjson_encode(via_struct, sizeof(via_struct), descs[i], &msg) < 0)
+        {
+            std::cout << "decode error" << std::endl;
+            return;
+        }
+
+        len = pbjson_transcode_to_pb(cases[i], strlen(cases[i]), descs[i], pb, sizeof(pb));
+        stream = pbjson_ostream_from_buffer(s, sizeof(s) - 1);
+
+        if ((len < 0) || (pbjson_transcode_to_pb(cases[i], strlen(cases[i]), descs[i], NULL, 0) != len) ||
+            (pbjson_transcode_to_json(&stream, descs[i], pb, (size_t)len) != 0))
+        {
+            std::cout << "decode error" << std::endl;
+            return;
+        }
+
+        s[stream.pos] = '\0';
+
+        if (strcmp(s, via_struct) != 0)
+        {
+            std::cout << "encode error" << std::endl;
+            return;
+        }
+    }
+
+    /* Unpacked repeated values and unknown fields are accepted, wrong wire types and truncation are not. */
+    const uint8_t unpacked[] = {0x08, 0x01, 0x78, 0x05, 0x08, 0x02};
+    const uint8_t wrong_type[] = {0x0D, 0x01, 0x00, 0x00, 0x00};
+    const uint8_t truncated[] = {0x0A, 0x03, 0x01};
+
+    stream = pbjson_ostream_from_buffer(s, sizeof(s) - 1);
+    int err = pbjson_transcode_to_json(&stream, SubMessage1_fields, unpacked, sizeof(unpacked));
+    s[stream.pos] = '\0';
+
+    if (err || strcmp(s, "{\"array\":[1,2]}") != 0 ||
+        pbjson_transcode_to_json(&stream, SubMessage1_fields, wrong_type, sizeof(wrong_type)) != -1 ||
+        pbjson_transcode_to_json(&stream, SubMessage1_fields, truncated, sizeof(truncated)) != -1)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    /* Occurrences of a singular submessage are merged, the last scalar wins. */
+    const uint8_t twice[] = {0x12, 0x04, 0x0A, 0x02, 'i',  'n',  0x0A, 0x05, 0x0D, 0x00, 0x00, 0x80,
+                             0x3F, 0x12, 0x02, 0x18, 0x02, 0x0A, 0x04, 0x10, 0x07, 0x10, 0x08};
+    SubMessage7 merged = SubMessage7_init_zero;
+    char via_struct[256];
+
+    merged.has_x = true;
+    merged.x.x = 1.0f;
+    merged.x.y = 8;
+    merged.has_y = true;
+    strcpy(merged.y.x, "in");
+    merged.y.opt = TestEnum_Opt2;
+    stream = pbjson_ostream_from_buffer(s, sizeof(s) - 1);
+    err = pbjson_transcode_to_json(&stream, SubMessage7_fields, twice, sizeof(twice));
+    s[stream.pos] = '\0';
+
+    if (err || pbjson_encode(via_struct, sizeof(via_struct), SubMessage7_fields, &merged) < 0 ||
+        strcmp(s, via_struct) != 0)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    /* Arrays and strings beyond the capacity of the structure are rejected. */
+    const char *too_long = "{\"x\":\"0123456789012345678901234567890123\"}";
+
+    if (pbjson_transcode_to_pb(too_long, strlen(too_long), SubMessage3_fields, pb, sizeof(pb)) != -1)
+    {
+        std::cout << "decode error" << std::endl;
+    }
+}
+
+void test_decode22()
+{
+    char mem[512];
+    pbjson_arena_t arena;
+    pbjson_arena_init(&arena, mem, sizeof(mem));
+
+    pbjson_fieldmask_t *mask = pbjson_fieldmask_compile(SubMessage7_fields, "y.msg.y,y.opt", &arena);
+
+    if (mask == NULL || pbjson_fieldmask_compile(SubMessage7_fields, "y.nope", &arena) != NULL ||
+        pbjson_fieldmask_compile(SubMessage7_fields, "y.x.z", &arena) != NULL ||
+        pbjson_fieldmask_compile(SubMessage7_fields, "x,", &arena) != NULL)
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    /* The rest of y.msg is skipped, nothing after y is read. */
+    const char *json = "{\"x\":{\"x\":1,\"y\":2},\"y\":{\"x\":\"abc\",\"msg\":{\"y\":7,\"x\":1.5,\"z\":[{\"a\":\"}\"}]},"
+                       "\"opt\":2},not json";
+    SubMessage7 msg = SubMessage7_init_zero;
+    int err = pbjson_decode_masked(json, strlen(json), mask, &msg, NULL);
+
+    if (err || msg.has_x || msg.x.x != 0 || !msg.has_y || strcmp(msg.y.x, "") != 0 || !msg.y.has_msg ||
+        msg.y.msg.y != 7 || msg.y.msg.x != 0 || msg.y.opt != TestEnum_Opt2)
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    json = "{\"y\":{\"msg\":{\"y\":7,\"x\":1.5,\"z\":[1}},\"opt\":2}}";
+
+    if (pbjson_decode_masked(json, strlen(json), mask, &msg, NULL) == 0)
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    /* The encoder and the transcoder write the same fields, the generated encoder is bypassed. */
+    char s[256];
+    const char *expected = "{\"y\":{\"msg\":{\"y\":7},\"opt\":2}}";
+
+    msg.has_x = true;
+    msg.x.x = 1.5f;
+    msg.y.msg.x = 2.5f;
+    strcpy(msg.y.x, "abc");
+
+    pbjson_ostream_t stream = pbjson_ostream_from_buffer(s, sizeof(s) - 1);
+    stream.mask = mask;
+    err = pbjson_encode_stream(&stream, SubMessage7_fields, &msg);
+    s[stream.pos] = '\0';
+
+    if (err || strcmp(s, expected) != 0)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    uint8_t pb[128];
+    json = "{\"x\":{\"x\":1},\"y\":{\"x\":\"abc\",\"msg\":{\"x\":2.5,\"y\":7},\"opt\":2}}";
+    int len = pbjson_transcode_to_pb(json, strlen(json), SubMessage7_fields, pb, sizeof(pb));
+
+    stream = pbjson_ostream_from_buffer(s, sizeof(s) - 1);
+    stream.mask = mask;
+    err = (len < 0) ? -1 : pbjson_transcode_to_json(&stream, SubMessage7_fields, pb, (size_t)len);
+    s[stream.pos] = '\0';
+
+    if (err || strcmp(s, expected) != 0 || stream.mask != mask)
+    {
+        std::cout << "encode error" << std::endl;
+    }
+}
+
+void test_decode23()
+{
+    char s[256];
+
+    /* Every short escape, \u escapes and a surrogate pair become the characters they stand for. */
+    const char *json = "{\"x\":\"a\\\"b\\\\c\\/d\\n\\u00e9\\ud83d\\ude00\"}";
+    const char *text = "a\"b\\c/d\n\xc3\xa9\xf0\x9f\x98\x80";
+
+    SubMessage3 msg = SubMessage3_init_zero;
+
+    if (pbjson_decode(json, SubMessage3_fields, &msg) || strcmp(msg.x, text) != 0)
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    /* The encoder escapes only what JSON requires, so the result is shorter than the input. */
+    const char *expected = "{\"x\":\"a\\\"b\\\\c/d\\n\xc3\xa9\xf0\x9f\x98\x80\",\"opt\":0}";
+
+    if (pbjson_encode(s, sizeof(s), SubMessage3_fields, &msg) < 0 || strcmp(s, expected) != 0)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    /* The capacity applies to the decoded text, 31 bytes fit next to the terminator. */
+    std::string fits = "{\"x\":\"a";
+    for (int i = 0; i < 15; i++)
+    {
+        fits += "\\u00e9";
+    }
+
+    msg = SubMessage3_init_zero;
+
+    if (pbjson_decode((fits + "\"}").c_str(), SubMessage3_fields, &msg) || strlen(msg.x) != 31 ||
+        pbjson_decode((fits + "\\u00e9\"}").c_str(), SubMessage3_fields, &msg) == 0)
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    const char *invalid[] = {
+        "{\"x\":\"\\x\"}",
+        "{\"x\":\"\\u12\"}",
+        "{\"x\":\"\\u12g4\"}",
+        "{\"x\":\"\\ud83d\"}",
+        "{\"x\":\"\\ud83d\\u0041\"}",
+        "{\"x\":\"\\ude00\"}",
+        "{\"x\":\"a\\u0000b\"}",
+        "{\"x\":\"a\nb\"}",
+        "{\"x\":\"a\tb\"}",
+        "{\"x\":\"\x1f\"}",
+        "{\"unknown\":\"a\nb\",\"x\":\"\"}",
+        "{\"a\nb\":1,\"x\":\"\"}",
+    };
+
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++)
+    {
+        msg = SubMessage3_init_zero;
+
+        if (pbjson_decode(invalid[i], SubMessage3_fields, &msg) == 0)
+        {
+            std::cout << "decode error" << std::endl;
+            return;
+        }
+
+        /* The incremental decoder rejects the same input. */
+        pbjson_decoder_t dec;
+        pbjson_decoder_init(&dec, SubMessage3_fields, &msg);
+
+        if (pbjson_decoder_feed(&dec, invalid[i], strlen(invalid[i])) != -1)
+        {
+            std::cout << "decode error" << std::endl;
+            return;
+        }
+    }
+
+    /* Escapes split across chunks, one byte at a time. */
+    msg = SubMessage3_init_zero;
+    pbjson_decoder_t dec;
+    pbjson_decoder_init(&dec, SubMessage3_fields, &msg);
+    int err = PBJSON_DECODE_NEED_MORE;
+
+    for (size_t i = 0; (i < strlen(json)) && (err == PBJSON_DECODE_NEED_MORE); i++)
+    {
+        err = pbjson_decoder_feed(&dec, &json[i], 1);
+    }
+
+    if (err || strcmp(msg.x, text) != 0)
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    /* Escaped keys name the same fields, in every decoder. */
+    const char *keys = "{\"\\u0078\":\"ab\",\"o\\u0070t\":2,\"\\/x\":\"no\"}";
+    msg = SubMessage3_init_zero;
+
+    if (pbjson_decode(keys, SubMessage3_fields, &msg) || strcmp(msg.x, "ab") != 0 || (msg.opt != TestEnum_Opt2))
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    msg = SubMessage3_init_zero;
+    pbjson_decoder_init(&dec, SubMessage3_fields, &msg);
+    err = PBJSON_DECODE_NEED_MORE;
+
+    for (size_t i = 0; (i < strlen(keys)) && (err == PBJSON_DECODE_NEED_MORE); i++)
+    {
+        err = pbjson_decoder_feed(&dec, &keys[i], 1);
+    }
+
+    SubMessage7 msg7 = SubMessage7_init_zero;
+    const char *keys7 = "{\"\\u0079\":{\"\\u0078\":\"in\"}}";
+
+    if (err || strcmp(msg.x, "ab") != 0 || (msg.opt != TestEnum_Opt2) ||
+        pbjson_decode(keys7, SubMessage7_fields, &msg7) || !msg7.has_y || strcmp(msg7.y.x, "in") != 0)
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    /* Arena strings and the binary transcoder unescape as well. */
+    char mem[256];
+    pbjson_arena_t arena;
+    pbjson_arena_init(&arena, mem, sizeof(mem));
+
+    SubMessage8 msg8 = SubMessage8_init_zero;
+    const char *json8 = "{\"name\":\"tab\\there\",\"tags\":[\"\\\"q\\\"\"]}";
+
+    if (pbjson_decode_arena(json8, strlen(json8), SubMessage8_fields, &msg8, &arena) ||
+        strcmp(msg8.name, "tab\there") != 0 || (msg8.tags_count != 1) || strcmp(msg8.tags[0], "\"q\"") != 0)
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    const char *nul8 = "{\"name\":\"a\\u0000b\"}";
+    msg8 = SubMessage8_init_zero;
+
+    if (pbjson_decode_arena(nul8, strlen(nul8), SubMessage8_fields, &msg8, &arena) == 0 ||
+        pbjson_transcode_to_pb(nul8, strlen(nul8), SubMessage8_fields, NULL, 0) >= 0)
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    uint8_t pb[64];
+    int len = pbjson_transcode_to_pb(json, strlen(json), SubMessage3_fields, pb, sizeof(pb));
+    pbjson_ostream_t stream = pbjson_ostream_from_buffer(s, sizeof(s) - 1);
+
+    if ((len != 2 + (int)strlen(text)) || pbjson_transcode_to_json(&stream, SubMessage3_fields, pb, (size_t)len))
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    s[stream.pos] = '\0';
+
+    if (strcmp(s, expected) != 0)
+    {
+        std::cout << "decode error" << std::endl;
+    }
+}
+
+/* Reference encoder for the base64 tests. */
+static std::string test_base64(const uint8_t *data, size_t len)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+
+    for (size_t i = 0; i < len; i += 3)
+    {
+        uint32_t v = (uint32_t)data[i] << 16;
+        v |= (i + 1 < len) ? (uint32_t)data[i + 1] << 8 : 0;
+        v |= (i + 2 < len) ? data[i + 2] : 0;
+
+        out += alphabet[v >> 18];
+        out += alphabet[(v >> 12) & 0x3F];
+        out += (i + 1 < len) ? alphabet[(v >> 6) & 0x3F] : '=';
+        out += (i + 2 < len) ? alphabet[v & 0x3F] : '=';
+    }
+
+    return out;
+}
+
+void test_decode24()
+{
+    char s[512];
+
+    /* Padding is optional, the URL-safe alphabet and an escaped '/' are accepted as well. */
+    const char *json = "{\"data\":\"aGVsbG8=\",\"chunks\":[\"AA==\",\"\\/w\",\"-_-_\"]}";
+    SubMessage11 msg = SubMessage11_init_zero;
+
+    if (pbjson_decode(json, SubMessage11_fields, &msg) || (msg.data.size != 5) || memcmp(msg.data.bytes, "hello", 5) ||
+        (msg.chunks_count != 3) || (msg.chunks[0].size != 1) || (msg.chunks[0].bytes[0] != 0) ||
+        (msg.chunks[1].size != 1) || (msg.chunks[1].bytes[0] != 0xFF) || (msg.chunks[2].size != 3) ||
+        memcmp(msg.chunks[2].bytes, "\xfb\xff\xbf", 3))
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    const char *invalid[] = {
+        "{\"data\":\"A\"}",
+        "{\"data\":\"AB=\"}",
+        "{\"data\":\"AB=C\"}",
+        "{\"data\":\"AB==C\"}",
+        "{\"data\":\"A===\"}",
+        "{\"data\":\"AB*D\"}",
+        "{\"data\":\"AB\\nD\"}",
+        "{\"data\":12}",
+        "{\"chunks\":[\"AAAAAAAAAAAA\"]}",
+    };
+
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++)
+    {
+        msg = SubMessage11_init_zero;
+
+        if (pbjson_decode(invalid[i], SubMessage11_fields, &msg) == 0)
+        {
+            std::cout << "decode error" << std::endl;
+            return;
+        }
+    }
+
+    /* Lengths around the vector block sizes, decoded by the kernel and the scalar loop alike. */
+    typedef PB_BYTES_ARRAY_T(200) test_bytes_t;
+    uint8_t data[200];
+    uint32_t seed = 12345;
+
+    for (size_t i = 0; i < sizeof(data); i++)
+    {
+        seed = seed * 1103515245u + 12345u;
+        data[i] = (uint8_t)(seed >> 16);
+    }
+
+    for (size_t len = 0; len <= sizeof(data); len += (len < 80) ? 1 : 13)
+    {
+        std::string text = test_base64(data, len);
+        pbjson_ostream_t stream = pbjson_ostream_from_buffer(s, sizeof(s));
+
+        if (pbjson_write_bytes(&stream, data, len) || (stream.pos != text.size() + 2) ||
+            (std::string(s + 1, stream.pos - 2) != text))
+        {
+            std::cout << "encode error" << std::endl;
+            return;
+        }
+
+        /* The same text in the URL-safe alphabet, and with every '/' escaped. */
+        std::string variants[3] = {text, text, ""};
+
+        for (char &c : variants[1])
+        {
+            c = (c == '+') ? '-' : (c == '/') ? '_' : c;
+        }
+
+        for (char c : text)
+        {
+            variants[2] += (c == '/') ? std::string("\\/") : std::string(1, c);
+        }
+
+        for (const std::string &variant : variants)
+        {
+            std::string quoted = "\"" + variant + "\"";
+            pbjson_istream_t in = {quoted.c_str(), quoted.size()};
+            test_bytes_t out;
+
+            if (pbjson_read_value(&in, PBJSON_BYTES_TYPE, &out, sizeof(out)) || (out.size != len) ||
+                ((len != 0) && memcmp(out.bytes, data, len)))
+            {
+                std::cout << "decode error" << std::endl;
+                return;
+            }
+        }
+    }
+
+    /* Pointer bytes are allocated to fit, arrays as pointers to each value. */
+    char mem[256];
+    pbjson_arena_t arena;
+    pbjson_arena_init(&arena, mem, sizeof(mem));
+
+    SubMessage12 msg12 = SubMessage12_init_zero;
+    const char *json12 = "{\"blob\":\"AQID\",\"blobs\":[\"\",\"BA==\"]}";
+
+    if (pbjson_decode_arena(json12, strlen(json12), SubMessage12_fields, &msg12, &arena) || (msg12.blob == NULL) ||
+        (msg12.blob->size != 3) || memcmp(msg12.blob->bytes, "\x01\x02\x03", 3) || (msg12.blobs_count != 2) ||
+        (msg12.blobs[0]->size != 0) || (msg12.blobs[1]->size != 1) || (msg12.blobs[1]->bytes[0] != 4))
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    if (pbjson_encode(s, sizeof(s), SubMessage12_fields, &msg12) < 0 || strcmp(s, json12) != 0)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    /* One byte at a time through the incremental decoder. */
+    msg = SubMessage11_init_zero;
+    pbjson_decoder_t dec;
+    pbjson_decoder_init(&dec, SubMessage11_fields, &msg);
+    int err = PBJSON_DECODE_NEED_MORE;
+
+    for (size_t i = 0; (i < strlen(json)) && (err == PBJSON_DECODE_NEED_MORE); i++)
+    {
+        err = pbjson_decoder_feed(&dec, &json[i], 1);
+    }
+
+    if (err || (msg.data.size != 5) || memcmp(msg.data.bytes, "hello", 5) || (msg.chunks_count != 3) ||
+        (msg.chunks[1].bytes[0] != 0xFF) || (msg.chunks[2].size != 3))
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    /* The transcoder carries the raw bytes and writes them back in the standard alphabet. */
+    uint8_t pb[64];
+    int len = pbjson_transcode_to_pb(json, strlen(json), SubMessage11_fields, pb, sizeof(pb));
+    pbjson_ostream_t stream = pbjson_ostream_from_buffer(s, sizeof(s) - 1);
+
+    if ((len != 2 + 5 + 3 * 2 + 1 + 1 + 3) || pbjson_transcode_to_json(&stream, SubMessage11_fields, pb, (size_t)len))
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    s[stream.pos] = '\0';
+
+    if (strcmp(s, "{\"data\":\"aGVsbG8=\",\"chunks\":[\"AA==\",\"/w==\",\"+/+/\"]}") != 0)
+    {
+        std::cout << "decode error" << std::endl;
+    }
+}
+
+void test_decode25()
+{
+    char s[256];
+
+    /* Names and numbers can be mixed, aliases decode to their value. */
+    const char *json = "{\"level\":\"LEVEL_DOWN\",\"colors\":[\"BLUE\",0,\"GREEN\"],\"opt\":\"Opt2\"}";
+    SubMessage13 msg = SubMessage13_init_zero;
+
+    if (pbjson_decode(json, SubMessage13_fields, &msg) || (msg.level != TestLevel_LEVEL_DOWN) ||
+        (msg.colors_count != 3) || (msg.colors[0] != TestColor_BLUE) || (msg.colors[1] != TestColor_RED) ||
+        (msg.colors[2] != TestColor_GREEN) || (msg.opt != TestEnum_Opt2))
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    const char *valid[] = {
+        "{\"level\":\"LEVEL_MAX\"}",
+        "{\"level\":\"LEVEL_HIGH\"}",
+        "{\"level\":2}",
+        "{\"level\":\"2\"}",
+    };
+
+    for (size_t i = 0; i < sizeof(valid) / sizeof(valid[0]); i++)
+    {
+        msg = SubMessage13_init_zero;
+
+        if (pbjson_decode(valid[i], SubMessage13_fields, &msg) || (msg.level != TestLevel_LEVEL_HIGH))
+        {
+            std::cout << "decode error" << std::endl;
+            return;
+        }
+    }
+
+    /* Names of other enums, other cases or escaped characters are not names of the field's enum. */
+    const char *invalid[] = {
+        "{\"level\":\"RED\"}",
+        "{\"level\":\"LEVEL\"}",
+        "{\"level\":\"LEVEL_HIGHER\"}",
+        "{\"level\":\"level_high\"}",
+        "{\"level\":\"LEVEL_\\u0048IGH\"}",
+        "{\"level\":\"\"}",
+        "{\"colors\":[\"Opt1\"]}",
+        "{\"opt\":\"Opt\"}",
+        "{\"opt\":\"Opt2",
+    };
+
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++)
+    {
+        msg = SubMessage13_init_zero;
+
+        if (pbjson_decode(invalid[i], SubMessage13_fields, &msg) == 0)
+        {
+            std::cout << "decode error" << std::endl;
+            return;
+        }
+    }
+
+    SubMessage3 msg3 = SubMessage3_init_zero;
+
+    if (pbjson_decode("{\"opt\":\"Opt2\"}", SubMessage3_fields, &msg3) || (msg3.opt != TestEnum_Opt2))
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    /* One byte at a time through the incremental decoder. */
+    msg = SubMessage13_init_zero;
+    pbjson_decoder_t dec;
+    pbjson_decoder_init(&dec, SubMessage13_fields, &msg);
+    int err = PBJSON_DECODE_NEED_MORE;
+
+    for (size_t i = 0; (i < strlen(json)) && (err == PBJSON_DECODE_NEED_MORE); i++)
+    {
+        err = pbjson_decoder_feed(&dec, &json[i], 1);
+    }
+
+    if (err || (msg.level != TestLevel_LEVEL_DOWN) || (msg.colors_count != 3) || (msg.colors[2] != TestColor_GREEN) ||
+        (msg.opt != TestEnum_Opt2))
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    /* The transcoder stores the values and can write the names back. */
+    uint8_t pb[64];
+    int len = pbjson_transcode_to_pb(json, strlen(json), SubMessage13_fields, pb, sizeof(pb));
+    pbjson_ostream_t stream = pbjson_ostream_from_buffer(s, sizeof(s) - 1);
+    stream.flags = PBJSON_ENCODE_ENUM_NAMES;
+
+    if ((len != 11 + 5 + 2) || pbjson_transcode_to_json(&stream, SubMessage13_fields, pb, (size_t)len))
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    s[stream.pos] = '\0';
+
+    if (strcmp(s, "{\"level\":\"LEVEL_DOWN\",\"colors\":[\"BLUE\",\"RED\",\"GREEN\"],\"opt\":\"Opt2\"}") != 0)
+    {
+        std::cout << "decode error" << std::endl;
+    }
+}
+
+void test_decode26()
+{
+    uint64_t cache[16];
+    pbjson_ctx_t ctx;
+
+    pbjson_ctx_init(&ctx, cache, sizeof(cache), NULL);
+
+    /* Keys in reverse declaration order, then in declaration order, then with unknown keys in between. */
+    const char *json[] = {
+        "{\"j\":true,\"h\":-8,\"g\":-7,\"f\":6,\"e\":-5,\"d\":4,\"c\":-3,\"b\":2.5,\"a\":1.5}",
+        "{\"j\":true,\"h\":-8,\"g\":-7,\"f\":6,\"e\":-5,\"d\":4,\"c\":-3,\"b\":2.5,\"a\":1.5}",
+        "{\"a\":1.5,\"b\":2.5,\"c\":-3,\"d\":4,\"e\":-5,\"f\":6,\"g\":-7,\"h\":-8,\"j\":true}",
+        "{\"x\":0,\"j\":true,\"h\":-8,\"g\":-7,\"y\":[],\"f\":6,\"e\":-5,\"d\":4,\"c\":-3,\"b\":2.5,\"a\":1.5}",
+    };
+
+    for (size_t i = 0; i < sizeof(json) / sizeof(json[0]); i++)
+    {
+#ifdef PBJSON_STATS
+        pbjson_stats_reset();
+#endif
+        SubMessage4 msg = SubMessage4_init_zero;
+
+        if (pbjson_ctx_decode(&ctx, json[i], strlen(json[i]), SubMessage4_fields, &msg) || (msg.a != 1.5f) ||
+            (msg.b != 2.5) || (msg.c != -3) || (msg.d != 4) || (msg.e != -5) || (msg.f != 6) || (msg.g != -7) ||
+            (msg.h != -8) || !msg.j)
+        {
+            std::cout << "decode error" << std::endl;
+            return;
+        }
+
+#ifdef PBJSON_STATS
+        pbjson_stats_t stats;
+        pbjson_stats_get(&stats);
+
+        /* Once the order is learned every key is matched on the first try. */
+        if ((i == 1) && (stats.key_compares != stats.decode_fields))
+        {
+            std::cout << "decode error" << std::endl;
+            return;
+        }
+#endif
+    }
+
+    /* The arena is reset for every message and nested descriptors get their own order. */
+    char mem[512];
+    pbjson_arena_t arena;
+    pbjson_arena_init(&arena, mem, sizeof(mem));
+    pbjson_ctx_init(&ctx, cache, sizeof(cache), &arena);
+
+    const char *json8 = "{\"points\":[{\"y\":2,\"x\":1},{\"y\":4,\"x\":3}],\"name\":\"abc\"}";
+    size_t used = 0;
+
+    for (int i = 0; i < 3; i++)
+    {
+        SubMessage8 msg = SubMessage8_init_zero;
+
+        if (pbjson_ctx_decode(&ctx, json8, strlen(json8), SubMessage8_fields, &msg) || strcmp(msg.name, "abc") ||
+            (msg.points_count != 2) || (msg.points[1].x != 3) || (msg.points[1].y != 4) ||
+            ((i != 0) && (arena.used != used)))
+        {
+            std::cout << "decode error" << std::endl;
+            return;
+        }
+
+        used = arena.used;
+    }
+
+    /* Without memory for the orders the declaration order is used. */
+    pbjson_ctx_clear(&ctx);
+    pbjson_ctx_init(&ctx, NULL, 0, NULL);
+    SubMessage4 msg = SubMessage4_init_zero;
+
+    if (pbjson_ctx_decode(&ctx, json[0], strlen(json[0]), SubMessage4_fields, &msg) || (msg.h != -8) ||
+        (pbjson_ctx_decode(&ctx, "{\"a\":1,", 7, SubMessage4_fields, &msg) == 0))
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    /* NDJSON records share the context of the reader. */
+    const char *lines = "{\"y\":1,\"x\":2}\n{\"y\":3,\"x\":4}\n";
+    pbjson_ndjson_reader_t reader;
+    pbjson_ndjson_init(&reader, lines, strlen(lines));
+    pbjson_ctx_init(&ctx, cache, sizeof(cache), NULL);
+    reader.ctx = &ctx;
+    int count = 0;
+    SubMessage2 msg2 = SubMessage2_init_zero;
+
+    while (pbjson_ndjson_read(&reader, SubMessage2_fields, &msg2, NULL) == 0)
+    {
+        count++;
+
+        if (msg2.x != 2 * count)
+        {
+            std::cout << "decode error" << std::endl;
+            return;
+        }
+    }
+
+    if ((count != 2) || (ctx.cache.used == 0))
+    {
+        std::cout << "decode error" << std::endl;
+    }
+}
+
+void test_decode27()
+{
+    /* SubMessage7, SubMessage11 and SubMessage13 are generated with --json-codegen, see CMakeLists.txt. */
+    if ((SubMessage7_msg.decode == NULL) || (SubMessage11_msg.decode == NULL) || (SubMessage13_msg.decode == NULL))
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    pbjson_msgdesc_t tables[] = {SubMessage7_msg, SubMessage11_msg, SubMessage13_msg};
+    const pbjson_msgdesc_t *generated[] = {SubMessage7_fields, SubMessage11_fields, SubMessage13_fields};
+    const size_t sizes[] = {sizeof(SubMessage7), sizeof(SubMessage11), sizeof(SubMessage13)};
+
+    const char *json[][8] = {
+        {
+            "{}",
+            "{\"x\":{},\"y\":{\"x\":\"abc\",\"msg\":{\"y\":1},\"opt\":\"Opt2\"}}",
+            "{\"z\":[{\"a\":1}],\"y\":{\"q\":null},\"x\":{\"y\":-3,\"x\":0.5}}",
+            " { \"x\" : { \"x\" : 1 } , \"x\" : { \"y\" : 2 } } ",
+            "{\"x\":{\"x\":1},}",
+            "{\"x\":{\"x\":1}",
+            "{\"x\":[]}",
+            "{\"y\":{\"x\":\"0123456789012345678901234567890123\"}}",
+        },
+        {
+            "{\"data\":\"aGVsbG8=\",\"chunks\":[\"\",\"+w==\"]}",
+            "{\"chunks\":[\"AA==\",\"AQ==\",\"Ag==\"],\"chunks\":[]}",
+            "{\"chunks\":[\"AA==\",\"AQ==\",\"Ag==\",\"Aw==\"]}",
+            "{\"chunks\":[\"AA==\",]}",
+            "{\"chunks\":[\"AA==\"}",
+            "{\"data\":\"aGVsbG8\"}",
+            "{\"other\":\"x\",\"data\":null}",
+            "{\"data\":\"\"}",
+        },
+        {
+            "{\"level\":\"LEVEL_HIGH\",\"colors\":[\"BLUE\",0,7,\"RED\"],\"opt\":\"Opt2\"}",
+            "{\"opt\":1,\"level\":-1,\"colors\":[]}",
+            "{\"colors\":[-1]}",
+            "{\"colors\":[1,1,1,1,1]}",
+            "{\"level\":\"LEVEL_NONE\"}",
+            "{\"level\":\"2\",\"opt\":\"Opt1\"}",
+            "{\"opt\":-1}",
+            "{\"level\":2 \"opt\":1}",
+        },
+    };
+
+    for (int m = 0; m < 3; m++)
+    {
+        tables[m].decode = NULL;
+
+        /* The generated decoder and the field table read the same values and reject the same text. */
+        for (int i = 0; i < 8; i++)
+        {
+            unsigned char a[sizeof(SubMessage11) + sizeof(SubMessage7) + sizeof(SubMessage13)];
+            unsigned char b[sizeof(a)];
+            memset(a, 0xA5, sizes[m]);
+            memset(b, 0xA5, sizes[m]);
+
+            int ra = pbjson_decode(json[m][i], &tables[m], a);
+            int rb = pbjson_decode(json[m][i], generated[m], b);
+
+            if ((ra != rb) || ((ra == 0) && memcmp(a, b, sizes[m])))
+            {
+                std::cout << "decode error" << std::endl;
+                return;
+            }
+        }
+    }
+
+    /* Presence of a submessage as in the table decoder. */
+    SubMessage7 msg = SubMessage7_init_zero;
+
+    if (pbjson_decode("{\"x\":{},\"y\":{\"unknown\":1}}", SubMessage7_fields, &msg) || msg.has_x || !msg.has_y)
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    /* Field masks and patches use the field table. */
+    msg.has_x = true;
+    msg.x.y = 5;
+
+    const char *patch = "{\"x\":{\"x\":1},\"y\":null}";
+
+    if (pbjson_decode_apply(patch, strlen(patch), SubMessage7_fields, &msg, NULL) || !msg.has_x || (msg.x.y != 5) ||
+        (msg.x.x != 1) || msg.has_y)
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    uint64_t mem[64];
+    pbjson_arena_t arena;
+    pbjson_arena_init(&arena, mem, sizeof(mem));
+    pbjson_fieldmask_t *mask = pbjson_fieldmask_compile(SubMessage7_fields, "y.opt", &arena);
+    const char *both = "{\"x\":{\"x\":1},\"y\":{\"x\":\"abc\",\"opt\":2}}";
+    msg = SubMessage7_init_zero;
+
+    if ((mask == NULL) || pbjson_decode_masked(both, strlen(both), mask, &msg, NULL) || msg.has_x || !msg.has_y ||
+        (msg.y.x[0] != '\0') || (msg.y.opt != TestEnum_Opt2))
+    {
+        std::cout << "decode error" << std::endl;
+    }
+}
+
+void test_encode1()
+{
+    char s[256];
+
+    SubMessage4 msg = SubMessage4_init_zero;
+
+    msg.a = 0.1f;
+    msg.b = 1e-7;
+    msg.c = INT32_MIN;
+    msg.d = UINT32_MAX;
+    msg.e = INT64_MIN;
+    msg.f = UINT64_MAX;
+    msg.g = -7;
+    msg.h = 1234567890123LL;
+    msg.j = true;
+
+    /* Shortest round-trip digits for floats, exact digits for integers. */
+    const char *expected = "{\"a\":0.1,\"b\":1e-7,\"c\":-2147483648,\"d\":4294967295,\"e\":-9223372036854775808,"
+                           "\"f\":18446744073709551615,\"g\":-7,\"h\":1234567890123,\"j\":true}";
+
+    int len = pbjson_encode(s, sizeof(s), SubMessage4_fields, &msg);
+
+    if (len != (int)strlen(expected) || strcmp(s, expected) != 0)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    /* A buffer that fits the output and its terminator exactly is enough. */
+    len = pbjson_encode(s, (uint32_t)strlen(expected) + 1, SubMessage4_fields, &msg);
+
+    if (len != (int)strlen(expected))
+    {
+        std::cout << "encode error" << std::endl;
+    }
+}
+
+static int test_string_callback(pbjson_ostream_t *stream, const char *buf, size_t count)
+{
+    /* Each flush must fit in the 8 byte chunk, apart from pass-through writes. */
+    if (count > 8 && stream->pos != 0)
+    {
+        return -1;
+    }
+
+    static_cast<std::string *>(stream->state)->append(buf, count);
+    return 0;
+}
+
+void test_encode2()
+{
+    char s[1024];
+
+    SubMessage7 msg = SubMessage7_init_zero;
+
+    /* The first field is absent, so no separator may precede the second one. */
+    msg.has_y = true;
+    msg.y.has_msg = true;
+    msg.y.msg.x = 1.27f;
+    msg.y.msg.y = -25;
+    snprintf(msg.y.x, sizeof(msg.y.x), "A string longer than the chunk");
+
+    int len = pbjson_encode(s, sizeof(s), SubMessage7_fields, &msg);
+
+    std::string out;
+    char chunk[8];
+    pbjson_ostream_t stream = pbjson_ostream_from_callback(test_string_callback, &out, chunk, sizeof(chunk));
+
+    int err = pbjson_encode_stream(&stream, SubMessage7_fields, &msg);
+
+    if (len < 0 || err || out != s || stream.bytes_written != (size_t)len || s[1] != '"')
+    {
+        std::cout << "encode error" << std::endl;
+    }
+}
+
+void test_encode3()
+{
+    char s[SubMessage4_json_max_size + 1];
+
+    /* The longest text of every field must stay within the generated bound. */
+    SubMessage4 msg = SubMessage4_init_zero;
+    msg.a = -1.17549435e-38f;
+    msg.b = -2.2250738585072014e-308;
+    msg.c = INT32_MIN;
+    msg.d = UINT32_MAX;
+    msg.e = INT64_MIN;
+    msg.f = UINT64_MAX;
+    msg.g = INT32_MIN;
+    msg.h = INT64_MIN;
+    msg.j = false;
+
+    int size = pbjson_encoded_size(SubMessage4_fields, &msg);
+    int len = pbjson_encode(s, sizeof(s), SubMessage4_fields, &msg);
+
+    if (len < 0 || size != len)
+    {
+        std::cout << "encode error" << std::endl;
+    }
+}
+
+void test_encode5()
+{
+    char s[256];
+
+    /* SubMessage7 is generated with --json-codegen, see CMakeLists.txt. */
+    if (SubMessage7_msg.encode == NULL)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    const char *expected[] = {
+        "{}",
+        "{\"x\":{\"x\":0.5,\"y\":-3}}",
+        "{\"y\":{\"x\":\"abc\",\"opt\":2}}",
+        "{\"x\":{\"x\":0.5,\"y\":-3},\"y\":{\"x\":\"abc\",\"opt\":2}}",
+    };
+
+    /* Every combination of absent fields gets its separators right. */
+    for (int i = 0; i < 4; i++)
+    {
+        SubMessage7 msg = SubMessage7_init_zero;
+        msg.has_x = (i & 1) != 0;
+        msg.x.x = 0.5f;
+        msg.x.y = -3;
+        msg.has_y = (i & 2) != 0;
+        strcpy(msg.y.x, "abc");
+        msg.y.opt = TestEnum_Opt2;
+
+        int len = pbjson_encode(s, sizeof(s), SubMessage7_fields, &msg);
+
+        if (len != (int)strlen(expected[i]) || strcmp(s, expected[i]) != 0 ||
+            pbjson_encoded_size(SubMessage7_fields, &msg) != len)
+        {
+            std::cout << "encode error" << std::endl;
+            return;
+        }
+
+        /* Running out of space fails the same way as the table encoder. */
+        if (pbjson_encode(s, (uint32_t)len, SubMessage7_fields, &msg) != -1)
+        {
+            std::cout << "encode error" << std::endl;
+            return;
+        }
+    }
+}
+
+void test_encode6()
+{
+    char s[256];
+    size_t offsets[4];
+
+    SubMessage2 msgs[3] = {{0.5f, 1}, {-2, 20}, {4, -300}};
+
+    const char *ndjson = "{\"x\":0.5,\"y\":1}\n{\"x\":-2,\"y\":20}\n{\"x\":4,\"y\":-300}\n";
+    const char *array = "[{\"x\":0.5,\"y\":1},{\"x\":-2,\"y\":20},{\"x\":4,\"y\":-300}]";
+
+    pbjson_ostream_t stream = pbjson_ostream_from_buffer(s, sizeof(s));
+    int err = pbjson_encode_batch(&stream, SubMessage2_fields, msgs, 3, sizeof(msgs[0]), PBJSON_BATCH_NDJSON, offsets);
+
+    if (err || stream.pos != strlen(ndjson) || memcmp(s, ndjson, stream.pos) != 0 || offsets[0] != 0 ||
+        offsets[1] != 16 || offsets[2] != 32 || offsets[3] != stream.pos)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    stream = pbjson_ostream_from_buffer(s, sizeof(s));
+    err = pbjson_encode_batch(&stream, SubMessage2_fields, msgs, 3, sizeof(msgs[0]), PBJSON_BATCH_ARRAY, offsets);
+
+    if (err || stream.pos != strlen(array) || memcmp(s, array, stream.pos) != 0 || offsets[0] != 1 ||
+        offsets[1] != 17 || offsets[2] != 33 || offsets[3] != stream.pos)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    /* An empty batch is an empty array, and the whole batch must fit. */
+    stream = pbjson_ostream_from_buffer(s, sizeof(s));
+    err = pbjson_encode_batch(&stream, SubMessage2_fields, msgs, 0, sizeof(msgs[0]), PBJSON_BATCH_ARRAY, NULL);
+
+    if (err || stream.pos != 2 || memcmp(s, "[]", 2) != 0)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    stream = pbjson_ostream_from_buffer(s, strlen(array) - 1);
+    err = pbjson_encode_batch(&stream, SubMessage2_fields, msgs, 3, sizeof(msgs[0]), PBJSON_BATCH_ARRAY, NULL);
+
+    if (err != -1)
+    {
+        std::cout << "encode error" << std::endl;
+    }
+}
+
+void test_encode7()
+{
+    char s[256];
+
+    SubMessage4 msg4 = SubMessage4_init_zero;
+    msg4.c = -1;
+    msg4.b = -0.0;
+    msg4.j = true;
+
+    /* Zero scalars and false are left out, -0.0 is not zero in protobuf either. */
+    pbjson_ostream_t stream = pbjson_ostream_from_buffer(s, sizeof(s) - 1);
+    stream.flags = PBJSON_ENCODE_OMIT_DEFAULTS;
+    int err = pbjson_encode_stream(&stream, SubMessage4_fields, &msg4);
+    s[stream.pos] = '\0';
+
+    if (err || strcmp(s, "{\"b\":-0,\"c\":-1,\"j\":true}") != 0)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    /* Set has_ flags keep a message even when it is all zero, the generated encoder is bypassed. */
+    SubMessage7 msg7 = SubMessage7_init_zero;
+    msg7.has_y = true;
+    msg7.y.has_msg = true;
+    strcpy(msg7.y.x, "");
+    memset(msg7.y.x + 1, 'x', sizeof(msg7.y.x) - 2);
+
+    const char *expected = "{\"y\":{\"msg\":{}}}";
+
+    stream = pbjson_ostream_from_buffer(s, sizeof(s) - 1);
+    stream.flags = PBJSON_ENCODE_OMIT_DEFAULTS;
+    err = pbjson_encode_stream(&stream, SubMessage7_fields, &msg7);
+    s[stream.pos] = '\0';
+
+    if (err || strcmp(s, expected) != 0)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    /* Empty arrays are left out, and the transcoder follows the same rules. */
+    SubMessage1 msg1 = SubMessage1_init_zero;
+    stream = pbjson_ostream_from_buffer(s, sizeof(s) - 1);
+    stream.flags = PBJSON_ENCODE_OMIT_DEFAULTS;
+    err = pbjson_encode_stream(&stream, SubMessage1_fields, &msg1);
+    s[stream.pos] = '\0';
+
+    if (err || strcmp(s, "{}") != 0)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    const char *json = "{\"x\":{\"x\":0,\"y\":0},\"y\":{\"x\":\"\",\"msg\":{\"y\":3},\"opt\":0}}";
+    uint8_t pb[128];
+    int len = pbjson_transcode_to_pb(json, strlen(json), SubMessage7_fields, pb, sizeof(pb));
+
+    stream = pbjson_ostream_from_buffer(s, sizeof(s) - 1);
+    stream.flags = PBJSON_ENCODE_OMIT_DEFAULTS;
+    err = (len < 0) ? -1 : pbjson_transcode_to_json(&stream, SubMessage7_fields, pb, (size_t)len);
+    s[stream.pos] = '\0';
+
+    if (err || strcmp(s, "{\"x\":{},\"y\":{\"msg\":{\"y\":3}}}") != 0)
+    {
+        std::cout << "encode error" << std::endl;
+    }
+}
+
+void test_encode8()
+{
+    char s[256];
+    char expected[256];
+
+    SubMessage4 prev4 = SubMessage4_init_zero;
+    prev4.c = 7;
+    prev4.j = true;
+    prev4.h = -3;
+
+    SubMessage4 cur4 = prev4;
+    cur4.c = 0;
+    cur4.j = false;
+
+    /* A field that changed to zero is written even with PBJSON_ENCODE_OMIT_DEFAULTS. */
+    pbjson_ostream_t stream = pbjson_ostream_from_buffer(s, sizeof(s) - 1);
+    stream.flags = PBJSON_ENCODE_OMIT_DEFAULTS;
+    int err = pbjson_encode_delta(&stream, SubMessage4_fields, &prev4, &cur4);
+    s[stream.pos] = '\0';
+
+    SubMessage4 applied4 = prev4;
+
+    if (err || strcmp(s, "{\"c\":0,\"j\":false}") != 0 ||
+        pbjson_decode_apply(s, strlen(s), SubMessage4_fields, &applied4, NULL) ||
+        memcmp(&applied4, &cur4, sizeof(cur4)) != 0)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    stream = pbjson_ostream_from_buffer(s, sizeof(s) - 1);
+    err = pbjson_encode_delta(&stream, SubMessage4_fields, &cur4, &cur4);
+    s[stream.pos] = '\0';
+
+    if (err || strcmp(s, "{}") != 0)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    /* Removed fields are null, submessages present on both sides are patched. */
+    SubMessage7 prev7 = SubMessage7_init_zero;
+    prev7.has_x = true;
+    prev7.x.x = 1.5f;
+    prev7.has_y = true;
+    strcpy(prev7.y.x, "abc");
+    prev7.y.has_msg = true;
+    prev7.y.msg.y = 2;
+
+    SubMessage7 cur7 = prev7;
+    cur7.has_x = false;
+    strcpy(cur7.y.x, "abd");
+    cur7.y.msg.y = 3;
+
+    stream = pbjson_ostream_from_buffer(s, sizeof(s) - 1);
+    err = pbjson_encode_delta(&stream, SubMessage7_fields, &prev7, &cur7);
+    s[stream.pos] = '\0';
+
+    SubMessage7 applied7 = prev7;
+
+    if (err || strcmp(s, "{\"x\":null,\"y\":{\"x\":\"abd\",\"msg\":{\"y\":3}}}") != 0 ||
+        pbjson_decode_apply(s, strlen(s), SubMessage7_fields, &applied7, NULL) || applied7.has_x ||
+        pbjson_encode(expected, sizeof(expected), SubMessage7_fields, &cur7) < 0 ||
+        pbjson_encode(s, sizeof(s), SubMessage7_fields, &applied7) < 0 || strcmp(s, expected) != 0)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    /* A submessage that becomes present is written whole and starts from zero on the receiver. */
+    SubMessage7 stale7 = SubMessage7_init_zero;
+    stale7.y.has_msg = true;
+    stale7.y.msg.x = 9.0f;
+
+    cur7 = SubMessage7_init_zero;
+    cur7.has_y = true;
+    cur7.y.opt = TestEnum_Opt2;
+
+    stream = pbjson_ostream_from_buffer(s, sizeof(s) - 1);
+    err = pbjson_encode_delta(&stream, SubMessage7_fields, &stale7, &cur7);
+    s[stream.pos] = '\0';
+
+    if (err || strcmp(s, "{\"y\":{\"x\":\"\",\"opt\":2}}") != 0 ||
+        pbjson_decode_apply(s, strlen(s), SubMessage7_fields, &stale7, NULL) || !stale7.has_y ||
+        stale7.y.has_msg || stale7.y.msg.x != 0 || stale7.y.opt != TestEnum_Opt2)
+    {
+        std::cout << "encode error" << std::endl;
+    }
+}
+
+void test_encode9()
+{
+    char s[256];
+
+    /* Control characters get the short escape where JSON has one, \u00XX otherwise. */
+    SubMessage3 msg3 = SubMessage3_init_zero;
+    strcpy(msg3.x, "tab\tcr\r\x01\x1f\x7f");
+
+    const char *expected = "{\"x\":\"tab\\tcr\\r\\u0001\\u001f\x7f\",\"opt\":0}";
+    int len = pbjson_encode(s, sizeof(s), SubMessage3_fields, &msg3);
+
+    if ((len != (int)strlen(expected)) || strcmp(s, expected) != 0 ||
+        pbjson_encoded_size(SubMessage3_fields, &msg3) != len)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    /* The generated encoder of SubMessage7 writes strings through pbjson_write_string(). */
+    SubMessage7 msg7 = SubMessage7_init_zero;
+    msg7.has_y = true;
+    strcpy(msg7.y.x, "say \"hi\"\n");
+
+    if (pbjson_encode(s, sizeof(s), SubMessage7_fields, &msg7) < 0 ||
+        strcmp(s, "{\"y\":{\"x\":\"say \\\"hi\\\"\\n\",\"opt\":0}}") != 0)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    /* Views keep the escapes of their input and are written back unchanged. */
+    const char *json = "{\"id\":\"a\\u0041\",\"token\":\"\\\"t\\\"\",\"n\":1}";
+    SubMessage10 msg10 = SubMessage10_init_zero;
+
+    if (pbjson_decode(json, SubMessage10_fields, &msg10) ||
+        pbjson_encode(s, sizeof(s), SubMessage10_fields, &msg10) < 0 || strcmp(s, json) != 0)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+#ifdef PBJSON_VALIDATE_UTF8
+    /* Truncated, overlong and surrogate sequences are rejected both ways. */
+    const char *bad[] = {"\xc3", "\xc0\xaf", "\xed\xa0\x80", "\xf4\x90\x80\x80", "\xff"};
+
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+    {
+        std::string input = std::string("{\"x\":\"") + bad[i] + "\"}";
+        SubMessage3 decoded = SubMessage3_init_zero;
+        msg3 = SubMessage3_init_zero;
+        strcpy(msg3.x, bad[i]);
+
+        if (pbjson_decode(input.c_str(), SubMessage3_fields, &decoded) == 0 ||
+            pbjson_encode(s, sizeof(s), SubMessage3_fields, &msg3) >= 0)
+        {
+            std::cout << "encode error" << std::endl;
+            return;
+        }
+    }
+
+    msg3 = SubMessage3_init_zero;
+
+    if (pbjson_decode("{\"x\":\"\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80\"}", SubMessage3_fields, &msg3) ||
+        pbjson_encode(s, sizeof(s), SubMessage3_fields, &msg3) < 0)
+    {
+        std::cout << "encode error" << std::endl;
+    }
+#endif
+}
+
+void test_encode10()
+{
+    char s[512];
+
+    SubMessage11 msg = SubMessage11_init_zero;
+    memcpy(msg.data.bytes, "hello", 5);
+    msg.data.size = 5;
+    msg.chunks_count = 2;
+    msg.chunks[1].bytes[0] = 0xFB;
+    msg.chunks[1].size = 1;
+
+    /* The generated encoder and the field table write the same text. */
+    pbjson_msgdesc_t table = SubMessage11_msg;
+    table.encode = NULL;
+
+    const char *expected = "{\"data\":\"aGVsbG8=\",\"chunks\":[\"\",\"+w==\"]}";
+    int len = pbjson_encode(s, sizeof(s), SubMessage11_fields, &msg);
+
+    if ((len != (int)strlen(expected)) || strcmp(s, expected) != 0 ||
+        pbjson_encode(s, sizeof(s), &table, &msg) != len || strcmp(s, expected) != 0 ||
+        pbjson_encoded_size(&table, &msg) != len)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    /* A size beyond the capacity of the array is refused by both. */
+    msg.chunks[0].size = 100;
+
+    if ((pbjson_encode(s, sizeof(s), SubMessage11_fields, &msg) >= 0) ||
+        (pbjson_encode(s, sizeof(s), &table, &msg) >= 0))
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    /* Filled to the capacity, padding included, the text stays within json_max_size. */
+    memset(&msg, 0xFF, sizeof(msg));
+    msg.data.size = sizeof(msg.data) - offsetof(pb_bytes_array_t, bytes);
+    msg.chunks_count = 3;
+
+    for (int i = 0; i < 3; i++)
+    {
+        msg.chunks[i].size = sizeof(msg.chunks[i]) - offsetof(pb_bytes_array_t, bytes);
+    }
+
+    len = pbjson_encode(s, sizeof(s), &table, &msg);
+
+    if ((len < 0) || (len > SubMessage11_json_max_size))
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    /* Empty bytes are a default value. */
+    msg = SubMessage11_init_zero;
+    pbjson_ostream_t stream = pbjson_ostream_from_buffer(s, sizeof(s));
+    stream.flags = PBJSON_ENCODE_OMIT_DEFAULTS;
+
+    if (pbjson_encode_stream(&stream, SubMessage11_fields, &msg) || (stream.pos != 2))
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    /* Only bytes up to the size take part in a delta. */
+    SubMessage11 prev = SubMessage11_init_zero;
+    msg.data.bytes[3] = 7;
+    stream = pbjson_ostream_from_buffer(s, sizeof(s));
+
+    if (pbjson_encode_delta(&stream, SubMessage11_fields, &prev, &msg) || (stream.pos != 2))
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    msg.data.size = 4;
+    stream = pbjson_ostream_from_buffer(s, sizeof(s) - 1);
+
+    if (pbjson_encode_delta(&stream, SubMessage11_fields, &prev, &msg))
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    s[stream.pos] = '\0';
+
+    if (strcmp(s, "{\"data\":\"AAAABw==\"}") != 0)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    /* Callback streams get the text in chunks of whole quanta. */
+    uint8_t data[1000];
+
+    for (size_t i = 0; i < sizeof(data); i++)
+    {
+        data[i] = (uint8_t)(i * 7);
+    }
+
+    std::string out;
+    char chunk[16];
+    stream = pbjson_ostream_from_callback(test_string_callback, &out, chunk, sizeof(chunk));
+
+    if (pbjson_write_bytes(&stream, data, sizeof(data)) || pbjson_ostream_flush(&stream) ||
+        (out != "\"" + test_base64(data, sizeof(data)) + "\""))
+    {
+        std::cout << "encode error" << std::endl;
+    }
+}
+
+void test_encode11()
+{
+    char s[256];
+
+    SubMessage13 msg = SubMessage13_init_zero;
+    msg.level = TestLevel_LEVEL_MAX;
+    msg.colors_count = 3;
+    msg.colors[0] = TestColor_BLUE;
+    msg.colors[1] = TestColor_RED;
+    msg.colors[2] = (TestColor)7;
+    msg.opt = TestEnum_Opt2;
+
+    pbjson_msgdesc_t table = SubMessage13_msg;
+    table.encode = NULL;
+
+    /* Numbers by default, names on request from the generated encoder and the field table alike. */
+    const char *numbers = "{\"level\":2,\"colors\":[2,0,7],\"opt\":2}";
+    const char *names = "{\"level\":\"LEVEL_HIGH\",\"colors\":[\"BLUE\",\"RED\",7],\"opt\":\"Opt2\"}";
+    const pbjson_msgdesc_t *descs[] = {SubMessage13_fields, &table};
+
+    for (int i = 0; i < 2; i++)
+    {
+        pbjson_ostream_t stream = pbjson_ostream_from_buffer(s, sizeof(s) - 1);
+
+        if (pbjson_encode_stream(&stream, descs[i], &msg) || (stream.pos != strlen(numbers)) ||
+            memcmp(s, numbers, stream.pos))
+        {
+            std::cout << "encode error" << std::endl;
+            return;
+        }
+
+        stream = pbjson_ostream_from_buffer(s, sizeof(s) - 1);
+        stream.flags = PBJSON_ENCODE_ENUM_NAMES;
+
+        if (pbjson_encode_stream(&stream, descs[i], &msg) || (stream.pos != strlen(names)) ||
+            memcmp(s, names, stream.pos))
+        {
+            std::cout << "encode error" << std::endl;
+            return;
+        }
+    }
+
+    /* The longest names stay within json_max_size. */
+    msg.level = TestLevel_LEVEL_DOWN;
+    msg.colors_count = 4;
+
+    for (int i = 0; i < 4; i++)
+    {
+        msg.colors[i] = TestColor_GREEN;
+    }
+
+    pbjson_ostream_t stream = pbjson_ostream_from_buffer(s, sizeof(s));
+    stream.flags = PBJSON_ENCODE_ENUM_NAMES;
+
+    if (pbjson_encode_stream(&stream, SubMessage13_fields, &msg) || (stream.pos > SubMessage13_json_max_size))
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    /* Every value of an enum with gaps is found, values in the gaps are not. */
+    const int32_t values[] = {-1, 0, 1, 2, 3, 1000, -2};
+    const char *expected[] = {"\"LEVEL_DOWN\"", "\"LEVEL_OFF\"", "\"LEVEL_LOW\"", "\"LEVEL_HIGH\"", "3", "1000", "-2"};
+
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+    {
+        stream = pbjson_ostream_from_buffer(s, sizeof(s));
+        stream.flags = PBJSON_ENCODE_ENUM_NAMES;
+
+        if (pbjson_write_enum(&stream, &TestLevel_enum, values[i]) || (stream.pos != strlen(expected[i])) ||
+            memcmp(s, expected[i], stream.pos))
+        {
+            std::cout << "encode error" << std::endl;
+            return;
+        }
+    }
+
+    /* An alias plus a gap spans as many numbers as there are names, 1 still has none. */
+    const pbjson_enum_value_t gap_values[] = {{"\"A\"", 1, 0}, {"\"A_ALIAS\"", 7, 0}, {"\"C\"", 1, 2}};
+    const pbjson_enumdesc_t gap_enum = {gap_values, 3, NULL, 0, 0};
+    const char *gap_expected[] = {"\"A\"", "1", "\"C\""};
+
+    for (int32_t i = 0; i < 3; i++)
+    {
+        stream = pbjson_ostream_from_buffer(s, sizeof(s));
+        stream.flags = PBJSON_ENCODE_ENUM_NAMES;
+
+        if (pbjson_write_enum(&stream, &gap_enum, i) || (stream.pos != strlen(gap_expected[i])) ||
+            memcmp(s, gap_expected[i], stream.pos))
+        {
+            std::cout << "encode error" << std::endl;
+            return;
+        }
+    }
+
+    /* With the alias after the gap the first name of 2 is found, not the alias at index 2. */
+    const pbjson_enum_value_t alias_values[] = {
+        {"\"A\"", 1, 0}, {"\"C\"", 1, 2}, {"\"C_ALIAS\"", 7, 2}, {"\"D\"", 1, 3}};
+    const pbjson_enumdesc_t alias_enum = {alias_values, 4, NULL, 0, 0};
+    const char *alias_expected[] = {"\"A\"", "1", "\"C\"", "\"D\""};
+
+    for (int32_t i = 0; i < 4; i++)
+    {
+        stream = pbjson_ostream_from_buffer(s, sizeof(s));
+        stream.flags = PBJSON_ENCODE_ENUM_NAMES;
+
+        if (pbjson_write_enum(&stream, &alias_enum, i) || (stream.pos != strlen(alias_expected[i])) ||
+            memcmp(s, alias_expected[i], stream.pos))
+        {
+            std::cout << "encode error" << std::endl;
+            return;
+        }
+    }
+
+    /* Default values are left out whether they are written by name or not. */
+    msg = SubMessage13_init_zero;
+    msg.level = TestLevel_LEVEL_OFF;
+    stream = pbjson_ostream_from_buffer(s, sizeof(s));
+    stream.flags = PBJSON_ENCODE_OMIT_DEFAULTS | PBJSON_ENCODE_ENUM_NAMES;
+
+    if (pbjson_encode_stream(&stream, SubMessage13_fields, &msg) || (stream.pos != 2))
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    SubMessage13 prev = msg;
+    msg.opt = TestEnum_Opt2;
+    stream = pbjson_ostream_from_buffer(s, sizeof(s) - 1);
+    stream.flags = PBJSON_ENCODE_ENUM_NAMES;
+
+    if (pbjson_encode_delta(&stream, SubMessage13_fields, &prev, &msg))
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    s[stream.pos] = '\0';
+
+    if (strcmp(s, "{\"opt\":\"Opt2\"}") != 0)
+    {
+        std::cout << "encode error" << std::endl;
+    }
+}
+
+void test_cpp1()
+{
+    SubMessage2 msg2 = SubMessage2_init_zero;
+    msg2.x = 1.5f;
+    msg2.y = -3;
+
+    /* SubMessage2 has a json_max_size and is written into the string in place. */
+    std::string out = "[";
+    int len = pbjson::encode(out, msg2);
+
+    if (len != 16 || out != "[{\"x\":1.5,\"y\":-3}" || pbjson::encoded_size(msg2) != len)
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    SubMessage2 back2 = SubMessage2_init_zero;
+
+    if (pbjson::decode(std::string_view(out).substr(1), back2) || back2.x != msg2.x || back2.y != msg2.y)
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    pbjson_ctx_t ctx;
+    pbjson_ctx_init(&ctx, NULL, 0, NULL);
+    back2 = SubMessage2_init_zero;
+
+    if (pbjson::decode(ctx, std::string_view(out).substr(1), back2) || back2.x != msg2.x || back2.y != msg2.y)
+    {
+        std::cout << "decode error" << std::endl;
+        return;
+    }
+
+    /* SubMessage1 is unbounded and goes through an appending stream. */
+    SubMessage1 msg1 = SubMessage1_init_zero;
+    msg1.array_count = 3;
+    msg1.array[0] = 1;
+    msg1.array[1] = -2;
+    msg1.array[2] = 300;
+
+    std::vector<char> vec;
+    len = pbjson::encode(vec, msg1);
+
+    if (len != (int)vec.size() || std::string(vec.begin(), vec.end()) != "{\"array\":[1,-2,300]}")
+    {
+        std::cout << "encode error" << std::endl;
+        return;
+    }
+
+    char s[8];
+
+    if (pbjson::encode(s, sizeof(s), msg1) != -1)
+    {
+        std::cout << "encode error" << std::endl;
+    }
+}
+
 int main()
 {
     test1();
@@ -376,6 +2622,44 @@ int main()
     test_decode5();
     test_decode6();
     test_decode7();
+    test_decode8();
+    test_decode9();
+    test_decode10();
+    test_decode11();
+    test_decode12();
+    test_decode13();
+    test_decode14();
+    test_decode15();
+    test_decode16();
+    test_decode17();
+#ifdef PBJSON_PARALLEL
+    test_decode18();
+#endif
+#ifdef PBJSON_STATS
+    test_decode19();
+#endif
+    test_decode20();
+    test_decode21();
+    test_decode22();
+    test_decode23();
+    test_decode24();
+    test_decode25();
+    test_decode26();
+    test_decode27();
+
+    test_encode1();
+    test_encode2();
+    test_encode3();
+    test_encode4();
+    test_encode5();
+    test_encode6();
+    test_encode7();
+    test_encode8();
+    test_encode9();
+    test_encode10();
+    test_encode11();
+
+    test_cpp1();
 
     return 0;
 }
\ No newline at end of file